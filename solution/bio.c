@@ -0,0 +1,538 @@
+#define _GNU_SOURCE // mremap, memfd_create, fallocate
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  Block I/O. The driver reaches every structure on the image through
+  MMAP_PTR, so what a backend provides is the image as one region of
+  memory, and a way to get what was changed in it back to the file.
+
+  io=mmap (the default) is a shared mapping of the image file, or of each
+  stripe unit of a volume (vol.c): the kernel reads pages in as they are
+  touched and writes them back when it likes. Reads and writes of io=pread
+  go through the volume, which splits them between its members.
+
+  io=pread keeps its own cache instead, in a memfd mapped twice: the
+  region the driver sees, whose pages start out inaccessible, and a
+  writable view only the cache uses. The first touch of a page faults,
+  and the fault handler reads the page in through the cache's view with
+  pread, then opens it read-only. The first store to it faults again and
+  marks it dirty. A page only becomes visible once it is whole, so pages
+  can also be read in on another thread. Setting protection page by page
+  splits the region into many mappings, which mremap cannot grow, so the
+  region sits at the start of address space reserved at open, and growing
+  maps the memfd's new pages into the reservation behind it. Dirty pages are written back with
+  pwrite, in runs of adjacent pages, by a writeback thread every
+  writeback_ms, on fsync and at unmount. At most cache_mb worth of pages
+  are resident: when a page has to come in and the cache is full, the
+  least recently used one is written back if dirty and dropped. Use is
+  seen through faults, so a page counts as used when it is read in or
+  first written to. With direct the image is opened O_DIRECT and neither
+  reads nor writes go through the kernel's page cache. Pages asked for
+  ahead of a reader (BIO_WILLNEED) are queued for the writeback thread to
+  read in, so the reader does not wait for them.
+
+  Ranges the driver knows will be hot (metadata, see bio_advise) can be
+  prefaulted, backed by transparent huge pages and locked in memory. With
+  io=mmap those are madvise and mlock on the mapping; with io=pread a
+  locked page is read in and kept out of the LRU list, so it is never
+  evicted.
+
+  The handler takes the cache lock. That is safe because nothing holding
+  the lock touches the region, so no fault can happen while it is held on
+  the faulting thread.
+*/
+
+#define PAGE_ABSENT (0)
+#define PAGE_CLEAN  (1)
+#define PAGE_DIRTY  (2)
+
+#define NO_PAGE     (UINT32_MAX)
+#define MIN_PAGES   (16) // more than one instruction can touch
+#define PREFETCH_QUEUE (64)
+#define RESERVE_GROW (64ULL << 30) // address space the region can grow into
+
+static struct bio_config cfg;
+static struct wfs_volume* vol;
+static char* region;
+static int mem = -1;    // io=pread: the memfd behind the region
+static char* shadow;    // and the cache's own, always writable view of it
+static size_t size;     // of the image
+static size_t pages;    // in the region, the last one maybe partly past the end
+static size_t page;
+static size_t reserved;  // io=pread: bytes of address space held for the region
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int writer_running;
+static int stopping;
+
+static uint8_t* state;
+static uint8_t* pinned; // io=pread: locked, so off the LRU list
+static uint32_t* prev;  // towards the most recently used
+static uint32_t* next;  // towards the least
+static uint32_t lru_head = NO_PAGE, lru_tail = NO_PAGE;
+static struct wfs_io_stats stats;
+
+// io=pread: page ranges waiting to be read in ahead of a reader
+static struct { size_t first, count; } queue[PREFETCH_QUEUE];
+static int queued;
+
+// what a fault handler may do when it cannot go on
+static void die(const char* msg) {
+    write(2, msg, strlen(msg));
+    _exit(2);
+}
+
+// =========================
+// LRU list
+// =========================
+
+static void lru_unlink(uint32_t p) {
+    if (prev[p] != NO_PAGE) { next[prev[p]] = next[p]; } else { lru_head = next[p]; }
+    if (next[p] != NO_PAGE) { prev[next[p]] = prev[p]; } else { lru_tail = prev[p]; }
+}
+
+static void lru_push(uint32_t p) {
+    prev[p] = NO_PAGE;
+    next[p] = lru_head;
+    if (lru_head != NO_PAGE) { prev[lru_head] = p; } else { lru_tail = p; }
+    lru_head = p;
+}
+
+// =========================
+// Page cache
+// =========================
+
+static size_t page_len(size_t p) {
+    size_t off = p * page;
+    return size - off < page ? size - off : page;
+}
+
+static int write_pages(size_t first, size_t count) {
+    size_t off = first * page;
+    size_t len = (count - 1) * page + page_len(first + count - 1);
+    if (vol_pwrite(vol, shadow + off, len, off) < 0) {
+        return -1;
+    }
+    stats.writebacks += count;
+    return 0;
+}
+
+// dirty pages become clean (read-only again) before they are written, so
+// a store made while one is on its way out dirties it anew
+static int writeback_locked() {
+    int ret = 0;
+    for (size_t p = 0; p < pages && stats.dirty > 0;) {
+        if (state[p] != PAGE_DIRTY) {
+            p++;
+            continue;
+        }
+        size_t run = 0;
+        while (p + run < pages && state[p + run] == PAGE_DIRTY) {
+            state[p + run] = PAGE_CLEAN;
+            run++;
+        }
+        mprotect(region + p * page, run * page, PROT_READ);
+        stats.dirty -= run;
+        if (write_pages(p, run) < 0) {
+            ret = -errno;
+        }
+        p += run;
+    }
+    return ret;
+}
+
+static void evict(uint32_t p) {
+    mprotect(region + p * page, page, PROT_NONE);
+    if (state[p] == PAGE_DIRTY) {
+        if (write_pages(p, 1) < 0) {
+            die("wfs: writing back a page failed\n");
+        }
+        stats.dirty--;
+    }
+    fallocate(mem, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)p * page, page);
+    lru_unlink(p);
+    state[p] = PAGE_ABSENT;
+    stats.resident--;
+    stats.evictions++;
+}
+
+static void load(uint32_t p) {
+    if (stats.resident >= stats.cache_pages) {
+        evict(lru_tail);
+    }
+    size_t len = page_len(p);
+    if (vol_pread(vol, shadow + (size_t)p * page, len, (off_t)p * page) != (ssize_t)len) {
+        die("wfs: reading a page in failed\n");
+    }
+    mprotect(region + (size_t)p * page, page, PROT_READ);
+    state[p] = PAGE_CLEAN;
+    lru_push(p);
+    stats.resident++;
+    stats.reads++;
+}
+
+// 1 if the fault is a store, 0 a load, -1 if the machine does not say
+static int fault_kind(void* ctx) {
+#if defined(__x86_64__)
+    return (((ucontext_t*)ctx)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+    (void)ctx;
+    return -1;
+#endif
+}
+
+static void on_fault(int sig, siginfo_t* si, void* ctx) {
+    char* addr = (char*)si->si_addr;
+    if (addr < region || addr >= region + pages * page) {
+        signal(sig, SIG_DFL); // a real crash, let it happen
+        return;
+    }
+    uint32_t p = (addr - region) / page;
+    int kind = fault_kind(ctx);
+    pthread_mutex_lock(&lock);
+    if (state[p] == PAGE_ABSENT) {
+        load(p);
+        if (kind != 1) {
+            // a load, or a store that faults again on the read-only page
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+    }
+    // a load finding the page clean raced with a prefetch bringing it in
+    if (state[p] == PAGE_CLEAN && kind != 0) {
+        // a store to a page only read so far
+        mprotect(region + (size_t)p * page, page, PROT_READ | PROT_WRITE);
+        state[p] = PAGE_DIRTY;
+        if (!pinned[p]) {
+            lru_unlink(p);
+            lru_push(p);
+        }
+        stats.dirty++;
+        stats.dirtied++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// reads in what is queued, a page at a time so faults get in between.
+// a prefetch never takes more than half the cache
+static void prefetch_locked() {
+    while (queued > 0 && !stopping) {
+        size_t first = queue[0].first, count = queue[0].count;
+        memmove(queue, queue + 1, --queued * sizeof(queue[0]));
+        for (size_t p = first; p < first + count && p < first + stats.cache_pages / 2; p++) {
+            if (p < pages && state[p] == PAGE_ABSENT) {
+                load(p);
+                stats.prefetched++;
+            }
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_lock(&lock);
+        }
+    }
+}
+
+static void* writeback_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    struct timespec due;
+    clock_gettime(CLOCK_REALTIME, &due);
+    while (!stopping) {
+        due.tv_sec += cfg.writeback_ms / 1000;
+        due.tv_nsec += (cfg.writeback_ms % 1000) * 1000000L;
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        // woken early for prefetches
+        while (!stopping && pthread_cond_timedwait(&wake, &lock, &due) == 0) {
+            prefetch_locked();
+        }
+        writeback_locked();
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// the tables for `count` pages, the ones past the current ones absent
+static int grow_tables(size_t count) {
+    uint8_t* s = realloc(state, count);
+    uint8_t* pn = realloc(pinned, count);
+    uint32_t* pv = realloc(prev, count * sizeof(uint32_t));
+    uint32_t* nx = realloc(next, count * sizeof(uint32_t));
+    state = s ? s : state;
+    pinned = pn ? pn : pinned;
+    prev = pv ? pv : prev;
+    next = nx ? nx : next;
+    if (!s || !pn || !pv || !nx) {
+        return -1;
+    }
+    memset(state + pages, PAGE_ABSENT, count - pages);
+    memset(pinned + pages, 0, count - pages);
+    return 0;
+}
+
+// =========================
+// Interface
+// =========================
+
+void* bio_open(struct wfs_volume* volume, const struct bio_config* config) {
+    cfg = *config;
+    vol = volume;
+    size = vol->size;
+    page = sysconf(_SC_PAGESIZE);
+    stats.backend = cfg.backend;
+    if (cfg.backend == WFS_IO_MMAP) {
+        region = vol_map(vol, MAP_SHARED);
+        return region == MAP_FAILED ? NULL : region;
+    }
+
+    stats.direct = cfg.direct;
+    stats.cache_pages = (cfg.cache_mb << 20) / page;
+    if (stats.cache_pages < MIN_PAGES) {
+        stats.cache_pages = MIN_PAGES;
+    }
+    if (grow_tables((size + page - 1) / page) < 0) {
+        return NULL;
+    }
+    pages = (size + page - 1) / page;
+    mem = memfd_create("wfs-cache", MFD_CLOEXEC);
+    if (mem < 0 || ftruncate(mem, pages * page) < 0) {
+        return NULL;
+    }
+    reserved = pages * page + RESERVE_GROW;
+    region = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED ||
+        mmap(region, pages * page, PROT_NONE, MAP_SHARED | MAP_FIXED, mem, 0) == MAP_FAILED) {
+        return NULL;
+    }
+    shadow = mmap(NULL, pages * page, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+    if (shadow == MAP_FAILED) {
+        return NULL;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    return region;
+}
+
+// the writeback thread is only started once fuse has put the process in
+// the background, so it is not left behind in the parent
+int bio_start() {
+    if (cfg.backend != WFS_IO_PREAD || cfg.writeback_ms == 0 || writer_running) {
+        return 0;
+    }
+    if (pthread_create(&writer, NULL, writeback_thread, NULL) != 0) {
+        return -1;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+// the volume has already been extended to `new_size`. A striped one is
+// mapped anew, since its units are separate mappings
+void* bio_resize(size_t new_size) {
+    if (cfg.backend == WFS_IO_MMAP && vol->members > 1) {
+        void* at = vol_map(vol, MAP_SHARED);
+        if (at == MAP_FAILED) {
+            return NULL;
+        }
+        munmap(region, size);
+        region = at;
+        size = new_size;
+        return region;
+    }
+    if (cfg.backend == WFS_IO_MMAP) {
+        void* at = mremap(region, size, new_size, MREMAP_MAYMOVE);
+        if (at == MAP_FAILED) {
+            return NULL;
+        }
+        region = at;
+        size = new_size;
+        return region;
+    }
+
+    pthread_mutex_lock(&lock);
+    size_t count = (new_size + page - 1) / page;
+    if (count * page > reserved) {
+        pthread_mutex_unlock(&lock);
+        errno = EFBIG;
+        return NULL;
+    }
+    // the region stays where it is: the new pages go into the reservation
+    // behind it, inaccessible like every page not yet read in
+    void* view = MAP_FAILED;
+    if (grow_tables(count) == 0 && ftruncate(mem, count * page) == 0 &&
+        (count == pages || mmap(region + pages * page, (count - pages) * page, PROT_NONE,
+                                MAP_SHARED | MAP_FIXED, mem, pages * page) != MAP_FAILED)) {
+        view = mremap(shadow, pages * page, count * page, MREMAP_MAYMOVE);
+    }
+    if (view == MAP_FAILED) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    shadow = view;
+    pages = count;
+    size = new_size;
+    pthread_mutex_unlock(&lock);
+    return region;
+}
+
+int bio_sync() {
+    if (region == NULL) {
+        return 0;
+    }
+    if (cfg.backend == WFS_IO_MMAP) {
+        return msync(region, size, MS_SYNC) < 0 ? -errno : 0;
+    }
+    pthread_mutex_lock(&lock);
+    int ret = writeback_locked();
+    pthread_mutex_unlock(&lock);
+    if (ret == 0 && vol_sync(vol) < 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+// reads every page of [first, first + count) in, one touch each
+static void touch_pages(size_t first, size_t count) {
+    for (size_t p = first; p < first + count; p++) {
+        (void)*(volatile char*)(region + p * page);
+    }
+}
+
+// io=pread: keeps the pages in the cache for good, as long as that leaves
+// room for the rest
+static int pin_pages(size_t first, size_t count) {
+    for (size_t p = first; p < first + count; p++) {
+        if (pinned[p]) {
+            continue;
+        }
+        if (stats.locked + MIN_PAGES >= stats.cache_pages) {
+            return -ENOMEM;
+        }
+        touch_pages(p, 1);
+        pthread_mutex_lock(&lock);
+        lru_unlink(p);
+        pinned[p] = 1;
+        stats.locked++;
+        pthread_mutex_unlock(&lock);
+    }
+    return 0;
+}
+
+// hints for [off, off + len) of the image, BIO_* flags. Returns the
+// first error, having tried each of them
+int bio_advise(off_t off, size_t len, int how) {
+    if (region == NULL || len == 0 || (size_t)off >= size) {
+        return 0;
+    }
+    len = (size_t)off + len > size ? size - off : len;
+    size_t first = off / page, count = (off + len + page - 1) / page - first;
+    char* at = region + first * page;
+    int ret = 0;
+
+    if (cfg.backend == WFS_IO_PREAD) {
+        // the cache maps and protects single pages, which would only
+        // split huge ones up again
+        if (how & BIO_HUGEPAGE) {
+            ret = -EOPNOTSUPP;
+        }
+        if (how & BIO_LOCK) {
+            int err = pin_pages(first, count);
+            ret = ret ? ret : err;
+        } else if (how & BIO_PREFAULT) {
+            touch_pages(first, count < stats.cache_pages / 2 ? count : stats.cache_pages / 2);
+        }
+        // without a writeback thread there is nobody to read ahead; a
+        // full queue drops the hint. the cache never reads around a
+        // fault, so there is nothing to turn off for random access
+        if ((how & BIO_WILLNEED) && writer_running) {
+            pthread_mutex_lock(&lock);
+            if (queued < PREFETCH_QUEUE) {
+                queue[queued].first = first;
+                queue[queued++].count = count;
+                pthread_cond_signal(&wake);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        return ret;
+    }
+
+    if ((how & BIO_HUGEPAGE) && madvise(at, count * page, MADV_HUGEPAGE) < 0) {
+        ret = -errno;
+    }
+    if (how & BIO_PREFAULT) {
+        // reads the range in ahead, then maps it so first touches do not
+        // fault
+        madvise(at, count * page, MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+        if (madvise(at, count * page, MADV_POPULATE_READ) < 0)
+#endif
+            touch_pages(first, count);
+    }
+    if (how & BIO_LOCK) {
+        if (mlock(at, count * page) < 0) {
+            ret = ret ? ret : -errno;
+        } else {
+            stats.locked += count;
+        }
+    }
+    if (how & BIO_WILLNEED) {
+        madvise(at, count * page, MADV_WILLNEED);
+        stats.prefetched += count;
+    }
+    if (how & (BIO_RANDOM | BIO_NORMAL)) {
+        madvise(at, count * page, how & BIO_RANDOM ? MADV_RANDOM : MADV_NORMAL);
+    }
+    return ret;
+}
+
+void bio_stats(struct wfs_io_stats* st) {
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+int bio_close() {
+    if (writer_running) {
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+        pthread_join(writer, NULL);
+        writer_running = 0;
+    }
+    int ret = bio_sync();
+    if (cfg.backend == WFS_IO_PREAD) {
+        signal(SIGSEGV, SIG_DFL);
+        printf("bio: %lu pages read, %lu written back, %lu evicted\n", (unsigned long)stats.reads,
+               (unsigned long)stats.writebacks, (unsigned long)stats.evictions);
+    }
+    munmap(region, cfg.backend == WFS_IO_MMAP ? size : reserved);
+    region = NULL;
+    if (mem >= 0) {
+        munmap(shadow, pages * page);
+        close(mem);
+        mem = -1;
+    }
+    free(state);
+    free(pinned);
+    free(prev);
+    free(next);
+    return ret;
+}
@@ -0,0 +1,365 @@
+#define FUSE_USE_VERSION 30
+#define _GNU_SOURCE // REG_EFL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include "wfs.h"
+
+/*
+  Crash-consistency harness. A workload of filesystem operations is run
+  directly against the wfs code (no FUSE) on an in-memory copy of an
+  image, and every store the code makes to the image is recorded. Then the
+  stores are replayed one at a time onto the original image, and every
+  prefix -- what the image would look like had the process died right
+  after that store -- is checked with fsck_image().
+
+  Stores are caught by keeping the image read-only: the write fault
+  handler saves the page, opens it up and single-steps the faulting
+  instruction (x86 trap flag); the trap handler diffs the page against the
+  saved copy, logs the change and write-protects the page again.
+
+  Prefixes are sorted into clean, leaking (an orphaned inode or block,
+  which fsck -r can reclaim), stale checksums (wfs brings checksums up to
+  date as an operation finishes, so blocks changed by an unfinished one
+  fail theirs until fsck -r rewrites them) and corrupt. Any corrupt
+  prefix fails the run, as does a finished workload that is not clean.
+
+  Workload files have one operation per line:
+      mkdir <path>
+      create <path>
+      write <path> <bytes>    (appends pseudo-random data)
+      unlink <path>
+      rmdir <path>
+      rename <path> <new path>
+      link <path> <new path>
+  Snapshots are taken and deleted with mkdir and rmdir in /.snapshots.
+  Lines starting with # are ignored. Without a workload file a built-in
+  one is used.
+*/
+
+#if !defined(__x86_64__)
+#error "store tracing single-steps with the x86-64 trap flag"
+#endif
+
+#define TRAP_FLAG (0x100)
+#define MAX_PENDING (4)           // pages a single instruction may touch
+#define MAX_EVENTS (1 << 22)
+#define MAX_LOG_BYTES (1UL << 28)
+
+// from wfs.c
+extern void* mregion;
+extern size_t msize;
+extern struct fuse_operations wfs_ops;
+
+// one recorded store: `len` bytes at image offset `off`, the new contents
+// of which are at `data` in the byte log
+struct store {
+    uint32_t off;
+    uint32_t len;
+    size_t data;
+    int op;
+};
+
+static struct store* stores;
+static size_t num_stores;
+static char* log_bytes;
+static size_t log_len;
+static int cur_op;
+
+static size_t page_size;
+static char* pending[MAX_PENDING];
+static char* shadow[MAX_PENDING];
+static int num_pending;
+
+static const char* default_workload[] = {
+    "mkdir /d",
+    "create /d/a",
+    "write /d/a 3000",
+    "create /b",
+    "write /b 512",
+    "mkdir /d/e",
+    "create /d/e/c",
+    "write /d/e/c 4000",
+    "create /d/f0", "create /d/f1", "create /d/f2", "create /d/f3",
+    "create /d/f4", "create /d/f5", "create /d/f6", "create /d/f7",
+    "create /d/f8", "create /d/f9", "create /d/f10", "create /d/f11",
+    "create /d/f12", "create /d/f13", "create /d/f14", "create /d/f15",
+    "link /d/a /d/a2",
+    "rename /d/f0 /d/g0",
+    "rename /d/f1 /d/e/g1",
+    "rename /d/e/g1 /g1",
+    "rename /d/f2 /d/f4",
+    "mkdir /.snapshots/s1",
+    "unlink /b",
+    "unlink /d/e/c",
+    "rmdir /d/e",
+    "unlink /d/f3",
+    "unlink /d/a2",
+    "write /d/a 2000",
+    "mkdir /.snapshots/s2",
+    "write /d/a 9000",
+    "rmdir /.snapshots/s1",
+    NULL
+};
+
+// =========================
+// Store tracing
+// =========================
+
+static void record(char* page, char* saved) {
+    size_t first = 0, last = page_size;
+    while (first < page_size && page[first] == saved[first]) {
+        first++;
+    }
+    if (first == page_size) {
+        return; // stored what was already there
+    }
+    while (page[last - 1] == saved[last - 1]) {
+        last--;
+    }
+    if (num_stores == MAX_EVENTS || log_len + (last - first) > MAX_LOG_BYTES) {
+        static const char msg[] = "crash: store log full\n";
+        write(2, msg, sizeof(msg) - 1);
+        _exit(2);
+    }
+    struct store* st = &stores[num_stores++];
+    st->off = page + first - (char*)mregion;
+    st->len = last - first;
+    st->data = log_len;
+    st->op = cur_op;
+    memcpy(log_bytes + log_len, page + first, last - first);
+    log_len += last - first;
+}
+
+static void on_fault(int sig, siginfo_t* si, void* ctx) {
+    char* addr = (char*)si->si_addr;
+    if (addr < (char*)mregion || addr >= (char*)mregion + msize || num_pending == MAX_PENDING) {
+        signal(sig, SIG_DFL); // a real crash, let it happen
+        return;
+    }
+    char* page = (char*)((uintptr_t)addr & ~(page_size - 1));
+    memcpy(shadow[num_pending], page, page_size);
+    pending[num_pending++] = page;
+    mprotect(page, page_size, PROT_READ | PROT_WRITE);
+    ((ucontext_t*)ctx)->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+static void on_trap(int sig, siginfo_t* si, void* ctx) {
+    (void)sig;
+    (void)si;
+    for (int i = 0; i < num_pending; i++) {
+        record(pending[i], shadow[i]);
+        mprotect(pending[i], page_size, PROT_READ);
+    }
+    num_pending = 0;
+    ((ucontext_t*)ctx)->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+}
+
+// =========================
+// Workload
+// =========================
+
+static int run_op(const char* line) {
+    char op[16], path[256], to[256];
+    long arg = 0;
+    if (sscanf(line, "%15s %255s %ld", op, path, &arg) < 2) {
+        return -EINVAL;
+    }
+    if (strcmp(op, "rename") == 0 || strcmp(op, "link") == 0) {
+        if (sscanf(line, "%*s %*s %255s", to) < 1) {
+            return -EINVAL;
+        }
+        return op[0] == 'r' ? wfs_ops.rename(path, to) : wfs_ops.link(path, to);
+    } else if (strcmp(op, "mkdir") == 0) {
+        return wfs_ops.mkdir(path, 0755);
+    } else if (strcmp(op, "create") == 0) {
+        return wfs_ops.mknod(path, S_IFREG | 0644, 0);
+    } else if (strcmp(op, "unlink") == 0) {
+        return wfs_ops.unlink(path);
+    } else if (strcmp(op, "rmdir") == 0) {
+        return wfs_ops.rmdir(path);
+    } else if (strcmp(op, "write") == 0) {
+        struct stat st;
+        int ret = wfs_ops.getattr(path, &st);
+        if (ret < 0) {
+            return ret;
+        }
+        char* buf = malloc(arg);
+        for (long i = 0; i < arg; i++) {
+            buf[i] = (char)(i * 131 + st.st_size);
+        }
+        ret = wfs_ops.write(path, buf, arg, st.st_size, NULL);
+        free(buf);
+        return ret < 0 ? ret : 0;
+    }
+    return -EINVAL;
+}
+
+// =========================
+// Driver
+// =========================
+
+#define CORRUPT (3)
+static const char* state_name[] = {"clean", "leaks", "stale checksums", "corrupt"};
+
+static int check(char* image, int print) {
+    struct fsck_result res;
+    int ret = fsck_image(image, msize, 0, print, &res);
+    if (ret == FSCK_OK) {
+        return 0;
+    }
+    if (ret == FSCK_ERROR || res.problems > res.leaks + res.bad_csums) {
+        return CORRUPT;
+    }
+    return res.bad_csums ? 2 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        printf("usage: ./wfs-crash <disk img> [workload]\n");
+        return 2;
+    }
+
+    // load the workload
+    const char** ops = default_workload;
+    int num_ops = 0;
+    if (argc == 3) {
+        FILE* f = fopen(argv[2], "r");
+        if (f == NULL) {
+            perror("open workload");
+            return 2;
+        }
+        char line[512];
+        ops = NULL;
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            ops = realloc(ops, (num_ops + 2) * sizeof(char*));
+            ops[num_ops++] = strdup(line);
+        }
+        fclose(f);
+        ops[num_ops] = NULL;
+    }
+    for (num_ops = 0; ops[num_ops]; num_ops++);
+
+    // the image lives in anonymous memory; the file is never written
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("open disk img");
+        return 2;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    msize = st.st_size;
+    char* base = malloc(msize);
+    char* image = mmap(NULL, msize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (read(fd, base, msize) != (ssize_t)msize) {
+        perror("read disk img");
+        return 2;
+    }
+    close(fd);
+    memcpy(image, base, msize);
+    mregion = image;
+
+    if (check(base, 0) != 0) {
+        printf("%s is not clean to begin with\n", argv[1]);
+        return 2;
+    }
+
+    stores = mmap(NULL, MAX_EVENTS * sizeof(struct store), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    log_bytes = mmap(NULL, MAX_LOG_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    for (int i = 0; i < MAX_PENDING; i++) {
+        shadow[i] = malloc(page_size);
+    }
+    int* op_result = calloc(num_ops, sizeof(int));
+
+    // run the workload with every store to the image trapped. wfs logs
+    // each call to stdout, which is muted meanwhile
+    load_alloc_summary();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = on_fault;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = on_trap;
+    sigaction(SIGTRAP, &sa, NULL);
+
+    fflush(stdout);
+    int saved_stdout = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    mprotect(image, msize, PROT_READ);
+    for (cur_op = 0; cur_op < num_ops; cur_op++) {
+        op_result[cur_op] = run_op(ops[cur_op]);
+    }
+    mprotect(image, msize, PROT_READ | PROT_WRITE);
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(devnull);
+
+    for (int i = 0; i < num_ops; i++) {
+        if (op_result[i] < 0) {
+            printf("warning: '%s' failed: %s\n", ops[i], strerror(-op_result[i]));
+        }
+    }
+
+    // replay every prefix of the stores onto the original image
+    int* worst = calloc(num_ops, sizeof(int));
+    size_t count[4] = {0, 0, 0, 0};
+    ssize_t first_corrupt = -1;
+    memcpy(image, base, msize);
+    for (size_t i = 0; i < num_stores; i++) {
+        memcpy(image + stores[i].off, log_bytes + stores[i].data, stores[i].len);
+        int state = check(image, 0);
+        count[state]++;
+        if (state > worst[stores[i].op]) {
+            worst[stores[i].op] = state;
+        }
+        if (state == CORRUPT && first_corrupt < 0) {
+            first_corrupt = i;
+        }
+    }
+
+    printf("%d operations, %zu stores, %zu bytes stored\n", num_ops, num_stores, log_len);
+    size_t first = 0;
+    for (int op = 0; op < num_ops; op++) {
+        size_t n = 0;
+        while (first + n < num_stores && stores[first + n].op == op) {
+            n++;
+        }
+        printf("  %-24s %6zu stores, worst prefix: %s\n", ops[op], n, state_name[worst[op]]);
+        first += n;
+    }
+    printf("prefixes: %zu clean, %zu leak space, %zu stale checksums, %zu corrupt\n",
+           count[0], count[1], count[2], count[3]);
+
+    if (check(image, 0) != 0) {
+        printf("the finished workload does not check clean:\n");
+        check(image, 1);
+        return 1;
+    }
+    if (first_corrupt >= 0) {
+        printf("first corrupt prefix: store %zd (%u bytes at %u) in '%s':\n", first_corrupt,
+               stores[first_corrupt].len, stores[first_corrupt].off, ops[stores[first_corrupt].op]);
+        memcpy(image, base, msize);
+        for (ssize_t i = 0; i <= first_corrupt; i++) {
+            memcpy(image + stores[i].off, log_bytes + stores[i].data, stores[i].len);
+        }
+        check(image, 1);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  CRC32C (Castagnoli), as used for block checksums. x86-64 CPUs with
+  SSE4.2 compute it with the crc32 instruction, 8 bytes at a time; other
+  machines use a table-driven software version. Both give the same
+  results, so an image can move between them.
+*/
+
+#define CRC32C_POLY (0x82F63B78) /* reversed */
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_impl)(uint32_t, const uint8_t*, size_t);
+
+// slicing-by-8: one table lookup per byte, eight bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc_table[7][v & 0xFF] ^ crc_table[6][(v >> 8) & 0xFF] ^
+              crc_table[5][(v >> 16) & 0xFF] ^ crc_table[4][(v >> 24) & 0xFF] ^
+              crc_table[3][(v >> 32) & 0xFF] ^ crc_table[2][(v >> 40) & 0xFF] ^
+              crc_table[1][(v >> 48) & 0xFF] ^ crc_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = c;
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_impl = crc32c_hw;
+    }
+#endif
+}
+
+const char* crc32c_impl_name() {
+    if (crc_impl == NULL) {
+        crc32c_init();
+    }
+    return crc_impl == crc32c_sw ? "software" : "sse4.2";
+}
+
+uint32_t crc32c(const void* buf, size_t len) {
+    if (crc_impl == NULL) {
+        crc32c_init();
+    }
+    return ~crc_impl(~0U, (const uint8_t*)buf, len);
+}
+
+// the superblock's checksum is taken with the sb_csum field itself zeroed
+uint32_t sb_checksum(const struct wfs_sb* sb) {
+    struct wfs_sb copy = *sb;
+    copy.sb_csum = 0;
+    return crc32c(&copy, sizeof(copy));
+}
+
+#ifdef CSUM_BENCH
+#include <time.h>
+
+// how verifying checksums compares with just copying the data out, which
+// is all wfs_read does without them
+static double seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+    size_t len = mb << 20;
+    char* src = malloc(len);
+    char* dst = malloc(BLOCK_SIZE);
+    for (size_t i = 0; i < len; i++) {
+        src[i] = (char)(i * 2654435761U >> 13);
+    }
+    // each block read from a different place in the copy, so none of it is dead
+    volatile uint32_t sink = 0;
+
+    // every run goes through the image a block at a time, like wfs_read
+    double t = seconds();
+    for (size_t off = 0; off < len; off += BLOCK_SIZE) {
+        memcpy(dst, src + off, BLOCK_SIZE);
+        sink += dst[(off / BLOCK_SIZE) % BLOCK_SIZE];
+    }
+    double copy = seconds() - t;
+
+    const char* names[2] = {"software", crc32c_impl_name()};
+    double took[2];
+    uint32_t sums[2] = {0, 0};
+    for (int k = 0; k < 2; k++) {
+        crc_impl = k == 0 ? crc32c_sw : crc_impl;
+        t = seconds();
+        for (size_t off = 0; off < len; off += BLOCK_SIZE) {
+            sums[k] += crc32c(src + off, BLOCK_SIZE);
+            memcpy(dst, src + off, BLOCK_SIZE);
+            sink += dst[(off / BLOCK_SIZE) % BLOCK_SIZE];
+        }
+        took[k] = seconds() - t;
+        crc_impl = NULL;
+        crc32c_impl_name(); // back to the best one
+    }
+    if (sums[0] != sums[1]) {
+        printf("software and %s checksums differ!\n", names[1]);
+        return 1;
+    }
+
+    printf("%zu MB in %d-byte blocks\n", mb, BLOCK_SIZE);
+    printf("  copy only:                %6.0f MB/s\n", mb / copy);
+    for (int k = 0; k < 2; k++) {
+        printf("  verify + copy (%-8s): %6.0f MB/s, %+.0f%% time\n", names[k], mb / took[k],
+               100 * (took[k] - copy) / copy);
+    }
+    free(src);
+    free(dst);
+    return 0;
+}
+#endif
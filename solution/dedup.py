@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+import fcntl
+import os
+import struct
+import sys
+import time
+
+# must match struct wfs_dedup_stats in wfs.h
+DEDUP_STATS = struct.Struct("QQII")
+
+def ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_DEDUPSTAT = ioc(2, 5, DEDUP_STATS.size)
+
+def used_blocks(mountpoint):
+    st = os.statvfs(mountpoint)
+    return st.f_blocks - st.f_bfree
+
+def dedup_stats(mountpoint):
+    fd = os.open(mountpoint, os.O_RDONLY)
+    buf = bytearray(DEDUP_STATS.size)
+    fcntl.ioctl(fd, WFS_IOC_DEDUPSTAT, buf)
+    os.close(fd)
+    return DEDUP_STATS.unpack(buf)
+
+def report(mountpoint):
+    written, deduped, indexed, enabled = dedup_stats(mountpoint)
+    if not enabled:
+        print("not mounted with -o dedup")
+        return
+    ratio = written / (written - deduped) if written > deduped else float("inf")
+    print(f"{written} whole blocks written, {deduped} deduplicated, "
+          f"ratio {ratio:.2f}:1, {indexed} blocks indexed")
+
+FILE_SIZE = 32 << 10 # files top out at 71 blocks
+
+# writes `mb` of fresh data, then the same data again, timing both. run it
+# on a mount with and without -o dedup to see what the lookups cost
+def bench(mountpoint, mb):
+    data = os.urandom(mb << 20)
+    for name in ("unique", "duplicate"):
+        before = used_blocks(mountpoint)
+        start = time.perf_counter()
+        for i in range(0, len(data), FILE_SIZE):
+            with open(os.path.join(mountpoint, f"dedup-{name}-{i // FILE_SIZE}"), "wb") as f:
+                f.write(data[i:i + FILE_SIZE])
+        elapsed = time.perf_counter() - start
+        print(f"{name:>9}: {mb / elapsed:7.1f} MB/s, {used_blocks(mountpoint) - before} new blocks")
+    for name in ("unique", "duplicate"):
+        for i in range(0, len(data), FILE_SIZE):
+            os.unlink(os.path.join(mountpoint, f"dedup-{name}-{i // FILE_SIZE}"))
+
+if len(sys.argv) not in (2, 4) or (len(sys.argv) == 4 and sys.argv[2] != "bench"):
+    print(f"Usage: {sys.argv[0]} <mountpoint> [bench <MB>]")
+    sys.exit(1)
+
+if len(sys.argv) == 4:
+    bench(sys.argv[1], int(sys.argv[3]))
+report(sys.argv[1])
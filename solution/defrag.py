@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+import fcntl
+import os
+import struct
+import sys
+import time
+
+# must match struct wfs_defrag_args / struct wfs_frag_stats in wfs.h
+DEFRAG_ARGS = struct.Struct("IIII")
+FRAG_STATS = struct.Struct("I" * 12)
+
+def ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_DEFRAG = ioc(3, 1, DEFRAG_ARGS.size)
+WFS_IOC_FRAGSTAT = ioc(2, 2, FRAG_STATS.size)
+
+def frag_stats(fd):
+    buf = bytearray(FRAG_STATS.size)
+    fcntl.ioctl(fd, WFS_IOC_FRAGSTAT, buf)
+    (files, fragmented, file_blocks, file_extents, dirs, dir_blocks, dir_extents,
+     dir_slots, dir_live, free_blocks, free_extents, largest_free) = FRAG_STATS.unpack(buf)
+    print(f"  files: {fragmented}/{files} fragmented, {file_blocks} blocks in {file_extents} extents")
+    print(f"  dirs:  {dir_live}/{dir_slots} dentry slots live, {dir_blocks} blocks in {dir_extents} extents")
+    print(f"  free:  {free_blocks} blocks in {free_extents} extents, largest {largest_free}")
+
+if len(sys.argv) < 2 or len(sys.argv) > 4:
+    print(f"Usage: {sys.argv[0]} <mountpoint> [blocks per step] [delay ms]")
+    sys.exit(1)
+
+mountpoint = sys.argv[1]
+step = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+delay = int(sys.argv[3]) if len(sys.argv) > 3 else 10
+if step < 1:
+    print("blocks per step must be at least 1")
+    sys.exit(1)
+
+fd = os.open(mountpoint, os.O_RDONLY)
+print("before:")
+frag_stats(fd)
+
+cursor, moved, done = 0, 0, 0
+while not done:
+    buf = bytearray(DEFRAG_ARGS.pack(cursor, step, 0, 0))
+    fcntl.ioctl(fd, WFS_IOC_DEFRAG, buf)
+    cursor, _, step_moved, done = DEFRAG_ARGS.unpack(buf)
+    moved += step_moved
+    time.sleep(delay / 1000)
+
+print(f"after ({moved} blocks moved):")
+frag_stats(fd)
+os.close(fd)
@@ -0,0 +1,978 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "wfs.h"
+
+/*
+  Offline consistency checker. The image is mapped whole and checked in
+  three parallel passes, after the block checksums have been verified:
+
+  1. directory walk: starting at the root, every reachable directory is
+     read and each entry's target gets one reference. The root's
+     subdirectories are handed out to the worker threads.
+  2. inode pass: the inode table is split into equal ranges, one per
+     thread. Inode bitmap bits are compared with reachability, link counts
+     with references, and every block pointer is checked and claimed, so
+     that blocks referenced more often than allowed stand out. Snapshot
+     records, their inode maps and the inode copies in them are claimed
+     after the threads are done.
+  3. block pass: the groups are split between threads and the data bitmaps
+     and reference counts are compared with the claims.
+
+  With -r the problems are repaired in place: dangling entries and bad
+  pointers are dropped, orphaned inodes and leaked blocks are freed, link
+  counts, bitmaps and reference counts are corrected, and blocks claimed
+  more often than their reference count allows are copied so each extra
+  owner has its own. Last, all checksums are rewritten to match what is
+  left; blocks that failed theirs are kept as they are.
+
+  Exit status follows fsck(8): 0 clean, 1 errors corrected, 4 errors left
+  uncorrected, 8 operational error.
+*/
+
+#define MMAP_PTR(offset) ((char*)mregion + offset)
+
+// at most this many problems are printed one by one
+#define MAX_REPORTS (100)
+
+// logical blocks a file can have: direct blocks and one indirect block
+#define IND_ENTRIES (BLOCK_SIZE / sizeof(off_t))
+#define MAX_FILE_BLOCKS (IND_BLOCK + IND_ENTRIES)
+
+static void* mregion;
+static size_t msize;
+static struct wfs_sb* sb;
+static int repair;
+static int nthreads;
+
+static size_t ipg; // inodes per group
+static size_t dpg; // data blocks per group
+
+static uint32_t* refs;         // dentries pointing at each inode
+static uint16_t* claims;       // references found to each data block
+static int verbose;
+static size_t problems;
+static size_t leaks;
+static size_t bad_csums;
+static size_t reports;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pointers to blocks claimed more often than they may be, cloned with -r
+struct dup_ref {
+    int num;        // inode holding the pointer
+    off_t ptr;      // image offset of the pointer itself
+};
+static struct dup_ref* dups;
+static size_t num_dups, cap_dups;
+
+static void vreport(int leak, const char* fmt, va_list ap) {
+    pthread_mutex_lock(&report_lock);
+    problems++;
+    leaks += leak;
+    if (verbose && reports++ < MAX_REPORTS) {
+        vprintf(fmt, ap);
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+// a problem that can lose data or break the filesystem
+__attribute__((format(printf, 1, 2)))
+static void report(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vreport(0, fmt, ap);
+    va_end(ap);
+}
+
+// a problem that only leaks space: things that are allocated but can no
+// longer be reached. a crash in the middle of an operation may leave these
+__attribute__((format(printf, 1, 2)))
+static void report_leak(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vreport(1, fmt, ap);
+    va_end(ap);
+}
+
+// a block whose contents do not match its checksum. wfs updates checksums
+// when an operation finishes, so a crash in the middle of one leaves these
+__attribute__((format(printf, 1, 2)))
+static void report_csum(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vreport(0, fmt, ap);
+    va_end(ap);
+    __atomic_fetch_add(&bad_csums, 1, __ATOMIC_RELAXED);
+}
+
+// =========================
+// Image helpers
+// =========================
+
+static int group_of_inode(size_t num) {
+    return num / ipg;
+}
+
+static uint32_t* inode_bitmap(uint32_t g) {
+    return (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr + group_offset(sb, g));
+}
+
+static uint32_t* data_bitmap(uint32_t g) {
+    return (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr + group_offset(sb, g));
+}
+
+static int bit_is_set(uint32_t* bitmap, size_t bit) {
+    return (bitmap[bit / 32] >> (bit % 32)) & 0x1;
+}
+
+static void set_bit(uint32_t* bitmap, size_t bit, int on) {
+    if (on) {
+        __atomic_fetch_or(&bitmap[bit / 32], 0x1U << (bit % 32), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&bitmap[bit / 32], ~(0x1U << (bit % 32)), __ATOMIC_RELAXED);
+    }
+}
+
+static int inode_allocated(size_t num) {
+    uint32_t g = group_of_inode(num);
+    return group_initialized(sb, g) && bit_is_set(inode_bitmap(g), num % ipg);
+}
+
+static struct wfs_inode* inode_at(size_t num) {
+    uint32_t g = group_of_inode(num);
+    return (struct wfs_inode*)(MMAP_PTR(sb->i_blocks_ptr + group_offset(sb, g)) + (num % ipg) * BLOCK_SIZE);
+}
+
+// an inode slot that looks like something wfs wrote
+static int inode_valid(size_t num) {
+    if (num >= sb->num_inodes || !group_initialized(sb, group_of_inode(num))) {
+        return 0;
+    }
+    struct wfs_inode* inode = inode_at(num);
+    return inode->num == (int)num && (S_ISDIR(inode->mode) || S_ISREG(inode->mode));
+}
+
+// global data block index of the block at `blk`, or -1 if `blk` is not
+// the start of a data block in an initialized group
+static ssize_t block_index(off_t blk) {
+    if (blk < sb->d_blocks_ptr) {
+        return -1;
+    }
+    uint32_t g = sb_groups(sb) > 1 ? (blk - sb->d_blocks_ptr) / sb->group_size : 0;
+    off_t rel = blk - sb->d_blocks_ptr - group_offset(sb, g);
+    if (g >= sb_groups(sb) || !group_initialized(sb, g) ||
+        rel % BLOCK_SIZE != 0 || (size_t)(rel / BLOCK_SIZE) >= dpg) {
+        return -1;
+    }
+    return g * dpg + rel / BLOCK_SIZE;
+}
+
+// references a block may have besides its owner
+static uint16_t extra_refs(ssize_t idx) {
+    if (!sb_has_refcounts(sb)) {
+        return 0;
+    }
+    uint32_t g = idx / dpg;
+    return ((uint16_t*)MMAP_PTR(sb->refcount_ptr + group_offset(sb, g)))[idx % dpg];
+}
+
+// pointer to the slot holding logical block i of an inode, or NULL if it
+// sits behind a missing or bad indirect block
+static off_t* block_slot(struct wfs_inode* inode, size_t i) {
+    if (i <= D_BLOCK) {
+        return &inode->blocks[i];
+    }
+    if (block_index(inode->blocks[IND_BLOCK]) < 0) {
+        return NULL;
+    }
+    return (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]) + (i - IND_BLOCK);
+}
+
+// =========================
+// Checksums
+// =========================
+
+// checks (or with `fix`, sets) the checksums of a group's metadata and of
+// the inodes and blocks its bitmaps say are in use
+static void csum_group(uint32_t g, int fix) {
+    off_t goff = group_offset(sb, g);
+    uint32_t* sums = (uint32_t*)MMAP_PTR(sb->csum_ptr + goff);
+
+    for (size_t e = 0; e < 1 + ipg + dpg; e++) {
+        char* p;
+        size_t len = BLOCK_SIZE;
+        if (e == 0) {
+            p = MMAP_PTR(sb->i_bitmap_ptr + goff);
+            len = sb->csum_ptr - sb->i_bitmap_ptr;
+        } else if (e <= ipg) {
+            if (!bit_is_set(inode_bitmap(g), e - 1)) {
+                continue;
+            }
+            p = (char*)inode_at(g * ipg + e - 1);
+        } else {
+            if (!bit_is_set(data_bitmap(g), e - 1 - ipg)) {
+                continue;
+            }
+            p = MMAP_PTR(sb->d_blocks_ptr + goff + (off_t)(e - 1 - ipg) * BLOCK_SIZE);
+        }
+        uint32_t sum = crc32c(p, len);
+        if (fix) {
+            sums[e] = sum;
+        } else if (sum != sums[e]) {
+            if (e == 0) {
+                report_csum("group %u: bitmap checksum mismatch\n", g);
+            } else if (e <= ipg) {
+                report_csum("inode %zu: checksum mismatch\n", g * ipg + e - 1);
+            } else {
+                report_csum("block %ld: checksum mismatch\n", (long)(p - (char*)mregion));
+            }
+        }
+    }
+}
+
+static int csum_fix;
+
+static void* csum_worker(void* arg) {
+    for (uint32_t g = (size_t)arg; g < sb_groups(sb); g += nthreads) {
+        if (group_initialized(sb, g)) {
+            csum_group(g, csum_fix);
+        }
+    }
+    return NULL;
+}
+
+// =========================
+// Pass 1: directory walk
+// =========================
+
+static const char no_bound[1];
+
+static size_t* top_dirs;
+static size_t num_top_dirs;
+static size_t next_top_dir;
+
+static void drop_entry(struct wfs_rec* r, int kind) {
+    if (kind == REC_FIXED) {
+        memset(r->at, 0, sizeof(struct wfs_dentry));
+    } else {
+        ((struct wfs_dirent*)r->at)->num = 0;
+    }
+}
+
+// counts the reference from one live entry of directory `num`, and puts
+// the subdirectory it leads to on `stack`
+static void scan_entry(size_t num, struct wfs_rec* r, int kind, size_t** stack, size_t* depth,
+                       size_t* cap) {
+    size_t child = r->id;
+    if (r->id < 0 || child == 0 || !inode_valid(child)) {
+        report("dir %zu: entry '%.*s' points at bad inode %ld%s\n", num,
+               r->len, r->name, r->id, repair ? ", removed" : "");
+        if (repair) {
+            drop_entry(r, kind);
+        }
+        return;
+    }
+    if (r->len == 0) {
+        report("dir %zu: entry for inode %zu has no name%s\n", num, child,
+               repair ? ", removed" : "");
+        if (repair) {
+            drop_entry(r, kind);
+        }
+        return;
+    }
+    if (kind == REC_DIRENT && r->type != (int)((inode_at(child)->mode & S_IFMT) >> 12)) {
+        report("dir %zu: entry '%.*s' has the wrong file type%s\n", num, r->len, r->name,
+               repair ? ", fixed" : "");
+        if (repair) {
+            ((struct wfs_dirent*)r->at)->file_type = (inode_at(child)->mode & S_IFMT) >> 12;
+        }
+    }
+    uint32_t seen = __atomic_fetch_add(&refs[child], 1, __ATOMIC_RELAXED);
+    if (!S_ISDIR(inode_at(child)->mode)) {
+        return;
+    }
+    if (seen > 0) {
+        // a directory may only have one parent
+        __atomic_fetch_sub(&refs[child], 1, __ATOMIC_RELAXED);
+        report("dir %zu: entry '%.*s' links directory %zu a second time%s\n", num,
+               r->len, r->name, child, repair ? ", removed" : "");
+        if (repair) {
+            drop_entry(r, kind);
+        }
+        return;
+    }
+    if (*depth == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        *stack = realloc(*stack, *cap * sizeof(size_t));
+    }
+    (*stack)[(*depth)++] = child;
+}
+
+// the live entries in a directory block or tree leaf at `blk`. records
+// that do not add up end the block: the last good one is made to run to
+// its end
+static void scan_area(size_t num, off_t blk, char* area, int alen, int kind, const char* hi,
+                      size_t** stack, size_t* depth, size_t* cap) {
+    struct wfs_rec r;
+    char* last = NULL;
+    int off = 0, ret;
+    for (; (ret = rec_at(area, alen, kind, off, &r)) > 0; off += r.size) {
+        last = r.at;
+        if (rec_live(&r, hi)) {
+            scan_entry(num, &r, kind, stack, depth, cap);
+        }
+    }
+    if (ret == 0) {
+        return;
+    }
+    report("dir %zu: damaged entries in block %ld%s\n", num, (long)blk, repair ? ", cut off" : "");
+    if (!repair) {
+        return;
+    } else if (last == NULL) {
+        memset(area, 0, alen);
+        ((struct wfs_dirent*)area)->rec_len = alen;
+    } else {
+        ((struct wfs_dirent*)last)->rec_len = area + alen - last;
+    }
+}
+
+// the live entries of a B+-tree directory. bad nodes are left to the
+// inode pass
+static void scan_dtree(size_t num, off_t blk, const char* hi, int level, size_t** stack,
+                       size_t* depth, size_t* cap) {
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    if (block_index(blk) < 0 || node->magic != DTREE_MAGIC || level >= DTREE_MAX_HEIGHT) {
+        return;
+    }
+    if (node->level == 0) {
+        scan_area(num, blk, node->recs, DTREE_AREA, REC_DIRENT, hi, stack, depth, cap);
+        return;
+    }
+    char kid_hi[WFS_NAME_MAX + 1];
+    struct wfs_rec r;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi)) {
+            dtree_kid_bound(node, hi, &r, kid_hi);
+            scan_dtree(num, r.id, kid_hi, level + 1, stack, depth, cap);
+        }
+    }
+}
+
+// counts the references from one directory, returns its subdirectories
+// through `stack` so the caller can walk them
+static void scan_dir(size_t num, size_t** stack, size_t* depth, size_t* cap) {
+    struct wfs_inode* dir = inode_at(num);
+    if (dir->flags & WFS_INODE_DTREE) {
+        if (dir->dtree != 0) {
+            scan_dtree(num, dir->dtree, no_bound, 0, stack, depth, cap);
+        }
+        return;
+    }
+    int kind = sb_long_names(sb) ? REC_DIRENT : REC_FIXED;
+    for (size_t i = 0; i < (size_t)dir->size / BLOCK_SIZE && i < MAX_FILE_BLOCKS; i++) {
+        off_t* slot = block_slot(dir, i);
+        if (slot == NULL || block_index(*slot) < 0) {
+            continue; // reported by the inode pass
+        }
+        scan_area(num, *slot, MMAP_PTR(*slot), BLOCK_SIZE, kind, no_bound, stack, depth, cap);
+    }
+}
+
+static void* walk_worker(void* arg) {
+    (void)arg;
+    size_t* stack = NULL;
+    size_t depth = 0, cap = 0;
+
+    for (;;) {
+        size_t t = __atomic_fetch_add(&next_top_dir, 1, __ATOMIC_RELAXED);
+        if (t >= num_top_dirs) {
+            break;
+        }
+        scan_dir(top_dirs[t], &stack, &depth, &cap);
+        while (depth > 0) {
+            scan_dir(stack[--depth], &stack, &depth, &cap);
+        }
+    }
+    free(stack);
+    return NULL;
+}
+
+// =========================
+// Pass 2: inodes
+// =========================
+
+// returns whether this was the first reference to the block
+static int claim_block(size_t num, off_t* slot) {
+    ssize_t idx = block_index(*slot);
+    uint16_t seen = __atomic_fetch_add(&claims[idx], 1, __ATOMIC_RELAXED);
+    if (seen > extra_refs(idx)) {
+        report("inode %zu: block %ld is also used by another inode%s\n", num,
+               (long)*slot, repair ? ", copied" : "");
+        pthread_mutex_lock(&report_lock);
+        if (num_dups == cap_dups) {
+            cap_dups = cap_dups ? 2 * cap_dups : 64;
+            dups = realloc(dups, cap_dups * sizeof(struct dup_ref));
+        }
+        dups[num_dups].num = num;
+        dups[num_dups].ptr = (char*)slot - (char*)mregion;
+        num_dups++;
+        pthread_mutex_unlock(&report_lock);
+    }
+    return seen == 0;
+}
+
+// the nodes of a B+-tree directory below `slot`, which should be at
+// `level` (-1 for the root, which can be at any). a node shared with a
+// snapshot is only followed by whoever claims it first, like an indirect
+// block
+static void check_dtree(size_t num, off_t* slot, int level, const char* hi) {
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(*slot);
+    struct wfs_rec r;
+    int off = 0, ret = 1; // the entries of leaves are checked by the walk
+    if (block_index(*slot) >= 0 && node->magic == DTREE_MAGIC && node->level > 0 &&
+        node->level < DTREE_MAX_HEIGHT) {
+        while ((ret = rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r)) > 0) {
+            off += r.size;
+        }
+    }
+    if (block_index(*slot) < 0 || node->magic != DTREE_MAGIC || node->level >= DTREE_MAX_HEIGHT ||
+        (level >= 0 && node->level != level) || ret < 0) {
+        report("dir %zu: bad tree node %ld%s\n", num, (long)*slot, repair ? ", dropped" : "");
+        if (repair) {
+            *slot = 0;
+        }
+        return;
+    }
+    if (!claim_block(num, slot) || node->level == 0) {
+        return;
+    }
+    char kid_hi[WFS_NAME_MAX + 1];
+    for (off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi)) {
+            dtree_kid_bound(node, hi, &r, kid_hi);
+            check_dtree(num, &((struct wfs_dtree_key*)r.at)->child, node->level - 1, kid_hi);
+        }
+    }
+}
+
+// whether an xattr area holds well-formed entries, see wfs.h
+static int xattrs_ok(const char* area, size_t len) {
+    uint32_t magic = *(uint32_t*)area;
+    if (magic != WFS_XATTR_MAGIC) {
+        return magic == 0;
+    }
+    size_t off = sizeof(uint32_t);
+    while (off + sizeof(struct wfs_xattr_entry) <= len) {
+        struct wfs_xattr_entry* e = (struct wfs_xattr_entry*)(area + off);
+        if (e->name_len == 0) {
+            break;
+        }
+        if (e->ns < WFS_XATTR_USER || e->ns > WFS_XATTR_SECURITY) {
+            return 0;
+        }
+        off += XATTR_ENTRY_SIZE(e->name_len, e->value_len);
+    }
+    return off <= len;
+}
+
+// the attributes kept in the inode's slot and its xattr block. damaged
+// ones are dropped all together
+static void check_xattrs(size_t num, struct wfs_inode* inode) {
+    char* ibody = (char*)inode + WFS_XATTR_IBODY_OFF;
+    if (!xattrs_ok(ibody, WFS_XATTR_IBODY)) {
+        report("inode %zu: damaged extended attributes%s\n", num, repair ? ", dropped" : "");
+        if (repair) {
+            memset(ibody, 0, WFS_XATTR_IBODY);
+        }
+    }
+    if (inode->xattr == 0) {
+        return;
+    }
+    if (block_index(inode->xattr) < 0 || *(uint32_t*)MMAP_PTR(inode->xattr) != WFS_XATTR_MAGIC ||
+        !xattrs_ok(MMAP_PTR(inode->xattr), BLOCK_SIZE)) {
+        report("inode %zu: bad xattr block %ld%s\n", num, (long)inode->xattr,
+               repair ? ", dropped" : "");
+        if (repair) {
+            inode->xattr = 0;
+        }
+        return;
+    }
+    claim_block(num, &inode->xattr);
+}
+
+static void check_blocks(size_t num, struct wfs_inode* inode) {
+    check_xattrs(num, inode);
+    if (S_ISDIR(inode->mode) && (inode->flags & WFS_INODE_DTREE)) {
+        // the list blocks are let go of right after the switch to a tree
+        for (int i = 0; i < N_BLOCKS; i++) {
+            if (inode->blocks[i] != 0) {
+                report_leak("dir %zu: block %ld left behind by conversion%s\n", num,
+                            (long)inode->blocks[i], repair ? ", dropped" : "");
+                if (repair) {
+                    inode->blocks[i] = 0;
+                }
+            }
+        }
+        if (inode->dtree != 0) {
+            check_dtree(num, &inode->dtree, -1, no_bound);
+        }
+        return;
+    }
+    size_t nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // the blocks behind an indirect block shared with a snapshot are
+    // referenced once, by whoever gets to the indirect block first
+    int own_ind = 1;
+
+    if (inode->blocks[IND_BLOCK] != 0) {
+        if (block_index(inode->blocks[IND_BLOCK]) < 0) {
+            report("inode %zu: bad indirect block %ld%s\n", num,
+                   (long)inode->blocks[IND_BLOCK], repair ? ", dropped" : "");
+            if (repair) {
+                inode->blocks[IND_BLOCK] = 0;
+            }
+        } else {
+            own_ind = claim_block(num, &inode->blocks[IND_BLOCK]);
+        }
+    }
+
+    for (size_t i = 0; i < (own_ind ? MAX_FILE_BLOCKS : IND_BLOCK); i++) {
+        off_t* slot = block_slot(inode, i);
+        if (slot == NULL || *slot == 0) {
+            if (S_ISDIR(inode->mode) && i < nblocks) {
+                report("dir %zu: block %zu missing inside size %ld\n", num, i, (long)inode->size);
+            }
+            continue;
+        }
+        if (block_index(*slot) < 0) {
+            report("inode %zu: bad block pointer %ld at %zu%s\n", num, (long)*slot, i,
+                   repair ? ", dropped" : "");
+            if (repair) {
+                *slot = 0;
+            }
+            continue;
+        }
+        if (i >= nblocks) {
+            report_leak("inode %zu: block %zu is past the end (size %ld)%s\n", num, i,
+                   (long)inode->size, repair ? ", dropped" : "");
+            if (repair) {
+                *slot = 0;
+            }
+            continue;
+        }
+        claim_block(num, slot);
+    }
+}
+
+static void check_inode(size_t num) {
+    int allocated = inode_allocated(num);
+    int reachable = num == 0 || refs[num] > 0;
+    uint32_t g = group_of_inode(num);
+
+    if (allocated && !reachable) {
+        report_leak("inode %zu: allocated but not reachable%s\n", num, repair ? ", freed" : "");
+        if (repair) {
+            memset(inode_at(num), 0, BLOCK_SIZE);
+            set_bit(inode_bitmap(g), num % ipg, 0);
+        }
+        return;
+    }
+    if (!reachable) {
+        return;
+    }
+    if (!allocated) {
+        report("inode %zu: in use but free in the bitmap%s\n", num, repair ? ", marked" : "");
+        if (repair) {
+            set_bit(inode_bitmap(g), num % ipg, 1);
+        }
+    }
+
+    struct wfs_inode* inode = inode_at(num);
+    if (S_ISDIR(inode->mode)) {
+        if (inode->size % BLOCK_SIZE != 0) {
+            report("dir %zu: size %ld is not whole blocks%s\n", num, (long)inode->size,
+                   repair ? ", rounded" : "");
+            if (repair) {
+                inode->size -= inode->size % BLOCK_SIZE;
+            }
+        }
+        // wfs counts every entry ever added, so only a lower bound holds
+        if (inode->nlinks < 1) {
+            report("dir %zu: link count %d%s\n", num, inode->nlinks, repair ? ", set to 1" : "");
+            if (repair) {
+                inode->nlinks = 1;
+            }
+        }
+    } else if ((uint32_t)inode->nlinks != refs[num]) {
+        // too high only keeps the inode around for longer than needed
+        void (*rep)(const char*, ...) = (uint32_t)inode->nlinks > refs[num] ? report_leak : report;
+        rep("inode %zu: link count %d, found %u entries%s\n", num, inode->nlinks, refs[num],
+            repair ? ", fixed" : "");
+        if (repair) {
+            inode->nlinks = refs[num];
+        }
+    }
+    // a tree directory is not limited to the blocks an inode can point to
+    int tree = S_ISDIR(inode->mode) && (inode->flags & WFS_INODE_DTREE);
+    if (inode->size < 0 || (!tree && inode->size > (off_t)(MAX_FILE_BLOCKS * BLOCK_SIZE))) {
+        report("inode %zu: bad size %ld%s\n", num, (long)inode->size, repair ? ", truncated" : "");
+        if (repair) {
+            inode->size = inode->size < 0 ? 0 : MAX_FILE_BLOCKS * BLOCK_SIZE;
+        }
+    }
+    check_blocks(num, inode);
+}
+
+static void* inode_worker(void* arg) {
+    size_t t = (size_t)arg;
+    // ranges are whole bitmap words so no two threads share one
+    size_t words = sb->num_inodes / 32;
+    size_t first = words * t / nthreads * 32;
+    size_t last = words * (t + 1) / nthreads * 32;
+
+    for (size_t num = first; num < last; num++) {
+        if (!group_initialized(sb, group_of_inode(num))) {
+            num += ipg - num % ipg - 1; // nothing in use there
+            continue;
+        }
+        check_inode(num);
+    }
+    return NULL;
+}
+
+// the snapshot table, and for each snapshot its inode map and the copies
+// of inodes in it. a copy shared by several snapshots is only checked once
+static void check_map(struct wfs_snapshot* snap, off_t* slot, uint32_t level) {
+    if (block_index(*slot) < 0) {
+        report("snapshot '%.*s': bad map block %ld%s\n", MAX_NAME, snap->name, (long)*slot,
+               repair ? ", dropped" : "");
+        if (repair) {
+            *slot = 0;
+        }
+        return;
+    }
+    if (level == 0) {
+        struct wfs_inode* copy = (struct wfs_inode*)MMAP_PTR(*slot);
+        if (claim_block(copy->num, slot)) {
+            check_blocks(copy->num, copy);
+        }
+        return;
+    }
+    claim_block(0, slot);
+    off_t* slots = (off_t*)MMAP_PTR(*slot);
+    for (size_t i = 0; i < MAP_FANOUT; i++) {
+        if (slots[i] != 0) {
+            check_map(snap, &slots[i], level - 1);
+        }
+    }
+}
+
+static void check_snapshots() {
+    if (sb->snap_table == 0) {
+        return;
+    }
+    if (!sb_has_refcounts(sb) || block_index(sb->snap_table) < 0) {
+        report("bad snapshot table %ld%s\n", (long)sb->snap_table, repair ? ", dropped" : "");
+        if (repair) {
+            sb->snap_table = 0;
+        }
+        return;
+    }
+    claim_block(0, &sb->snap_table);
+    struct wfs_snapshot* snaps = (struct wfs_snapshot*)MMAP_PTR(sb->snap_table);
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snaps[i].name[0] == '\0' || snaps[i].map == 0) {
+            continue;
+        }
+        if (snaps[i].epoch >= sb->snap_epoch || snaps[i].height > 8) {
+            report("snapshot '%.*s': bad epoch %u or height %u\n", MAX_NAME, snaps[i].name,
+                   snaps[i].epoch, snaps[i].height);
+            continue;
+        }
+        check_map(&snaps[i], &snaps[i].map, snaps[i].height);
+    }
+}
+
+// =========================
+// Pass 3: data bitmaps
+// =========================
+
+static size_t leaked_blocks, unmarked_blocks;
+static size_t overcounted_blocks;
+
+static void* block_worker(void* arg) {
+    size_t t = (size_t)arg;
+    size_t leaked = 0, unmarked = 0, over = 0;
+
+    for (uint32_t g = t; g < sb_groups(sb); g += nthreads) {
+        if (!group_initialized(sb, g)) {
+            continue;
+        }
+        uint32_t* bitmap = data_bitmap(g);
+        uint16_t* counts = sb_has_refcounts(sb) ?
+            (uint16_t*)MMAP_PTR(sb->refcount_ptr + group_offset(sb, g)) : NULL;
+        for (size_t i = 0; i < dpg; i++) {
+            int used = bit_is_set(bitmap, i);
+            uint16_t found = claims[g * dpg + i];
+            int wanted = found > 0;
+            // claims past the count were reported as shared blocks already,
+            // so only a count that is too high is left to find. such a
+            // block outlives its last owner
+            uint16_t extra = wanted ? found - 1 : 0;
+            if (counts && counts[i] > extra) {
+                over++;
+                if (repair) {
+                    counts[i] = extra;
+                }
+            }
+            if (used == wanted) {
+                continue;
+            }
+            if (used) {
+                leaked++;
+            } else {
+                unmarked++;
+            }
+            if (repair) {
+                off_t blk = sb->d_blocks_ptr + group_offset(sb, g) + i * BLOCK_SIZE;
+                if (used) {
+                    memset(MMAP_PTR(blk), 0, BLOCK_SIZE); // free blocks are kept zeroed
+                }
+                set_bit(bitmap, i, wanted);
+            }
+        }
+    }
+    __atomic_fetch_add(&leaked_blocks, leaked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&unmarked_blocks, unmarked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&overcounted_blocks, over, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// gives every extra owner of a shared block its own copy. runs after the
+// bitmaps have been rebuilt, so free blocks can be taken from them
+static size_t clone_dups() {
+    size_t cloned = 0;
+    uint32_t g = 0;
+    size_t i = 0;
+
+    for (size_t d = 0; d < num_dups; d++) {
+        for (; g < sb_groups(sb); g++, i = 0) {
+            if (!group_initialized(sb, g)) {
+                continue;
+            }
+            while (i < dpg && bit_is_set(data_bitmap(g), i)) {
+                i++;
+            }
+            if (i < dpg) {
+                break;
+            }
+        }
+        if (g == sb_groups(sb)) {
+            printf("no free blocks left to copy %zu shared blocks\n", num_dups - d);
+            break;
+        }
+        off_t* slot = (off_t*)MMAP_PTR(dups[d].ptr);
+        off_t blk = sb->d_blocks_ptr + group_offset(sb, g) + i * BLOCK_SIZE;
+        memcpy(MMAP_PTR(blk), MMAP_PTR(*slot), BLOCK_SIZE);
+        set_bit(data_bitmap(g), i, 1);
+        *slot = blk;
+        cloned++;
+    }
+    return cloned;
+}
+
+// =========================
+// Driver
+// =========================
+
+static int check_sb() {
+    if (msize < sizeof(struct wfs_sb)) {
+        return -1;
+    }
+    uint32_t groups = sb_groups(sb);
+    if (groups == 0 || sb->num_inodes == 0 || sb->num_inodes % groups != 0 ||
+        sb->num_data_blocks % groups != 0) {
+        return -1;
+    }
+    ipg = sb->num_inodes / groups;
+    dpg = sb->num_data_blocks / groups;
+    if (ipg % 32 != 0 || dpg % 32 != 0 ||
+        sb->d_bitmap_ptr < sb->i_bitmap_ptr + (off_t)(ipg / 8) ||
+        sb->i_blocks_ptr < sb->d_bitmap_ptr + (off_t)(dpg / 8) ||
+        (sb_has_refcounts(sb) &&
+         (sb->refcount_ptr < sb->d_bitmap_ptr + (off_t)(dpg / 8) || sb->refcount_ptr % 2 != 0 ||
+          sb->i_blocks_ptr < sb->refcount_ptr + (off_t)(dpg * sizeof(uint16_t)))) ||
+        (sb_has_csums(sb) &&
+         (sb->csum_ptr < sb->d_bitmap_ptr + (off_t)(dpg / 8) || sb->csum_ptr % 4 != 0 ||
+          sb->i_blocks_ptr < sb->csum_ptr + (off_t)(csum_entries(sb) * sizeof(uint32_t)))) ||
+        sb->d_blocks_ptr < sb->i_blocks_ptr + (off_t)(ipg * BLOCK_SIZE)) {
+        return -1;
+    }
+    off_t end = sb->d_blocks_ptr + group_offset(sb, groups - 1) + (off_t)(dpg * BLOCK_SIZE);
+    return (size_t)end <= msize ? 0 : -1;
+}
+
+static void run_threads(void* (*fn)(void*)) {
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    for (long t = 0; t < nthreads; t++) {
+        pthread_create(&threads[t], NULL, fn, (void*)t);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+// checks (and with `fix`, repairs) the image mapped at `region`. usable
+// from other tools: all state is reset on every call
+int fsck_image(void* region, size_t size, int fix, int print, struct fsck_result* res) {
+    mregion = region;
+    msize = size;
+    sb = (struct wfs_sb*)mregion;
+    repair = fix;
+    verbose = print;
+    problems = leaks = bad_csums = reports = 0;
+    leaked_blocks = unmarked_blocks = 0;
+    overcounted_blocks = 0;
+    num_top_dirs = next_top_dir = 0;
+    num_dups = 0;
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    if (check_sb() < 0) {
+        if (verbose) { printf("bad superblock, giving up\n"); }
+        return FSCK_ERROR;
+    }
+    if (!inode_valid(0) || !S_ISDIR(inode_at(0)->mode)) {
+        if (verbose) { printf("root directory is missing, giving up\n"); }
+        return FSCK_ERROR;
+    }
+
+    // checksums are verified before anything is repaired
+    if (sb_has_csums(sb)) {
+        crc32c_impl_name(); // picks the implementation before the threads race to
+        if (sb_checksum(sb) != sb->sb_csum) {
+            report_csum("superblock checksum mismatch\n");
+        }
+        csum_fix = 0;
+        run_threads(csum_worker);
+    }
+
+    refs = calloc(sb->num_inodes, sizeof(uint32_t));
+    claims = calloc(sb->num_data_blocks, sizeof(uint16_t));
+
+    // the root is scanned first to hand its subdirectories to the threads
+    size_t cap = 0;
+    scan_dir(0, &top_dirs, &num_top_dirs, &cap);
+    run_threads(walk_worker);
+    run_threads(inode_worker);
+    check_snapshots();
+    run_threads(block_worker);
+
+    if (leaked_blocks) {
+        report_leak("%zu data blocks marked used but not referenced%s\n", leaked_blocks,
+                    repair ? ", freed" : "");
+    }
+    if (unmarked_blocks) {
+        report("%zu data blocks referenced but free in the bitmap%s\n", unmarked_blocks,
+               repair ? ", marked" : "");
+    }
+    if (overcounted_blocks) {
+        report_leak("%zu data blocks with more references counted than found%s\n",
+                    overcounted_blocks, repair ? ", fixed" : "");
+    }
+
+    if (repair && num_dups) {
+        size_t cloned = clone_dups();
+        if (verbose) { printf("copied %zu shared blocks\n", cloned); }
+    }
+    // whatever was repaired, or failed its checksum, gets a new one
+    if (repair && problems && sb_has_csums(sb)) {
+        csum_fix = 1;
+        run_threads(csum_worker);
+        sb->sb_csum = sb_checksum(sb);
+    }
+    if (verbose && reports > MAX_REPORTS) {
+        printf("... %zu more problems not shown\n", reports - MAX_REPORTS);
+    }
+
+    free(refs);
+    free(claims);
+    free(top_dirs);
+    top_dirs = NULL;
+    if (res) {
+        res->problems = problems;
+        res->leaks = leaks;
+        res->bad_csums = bad_csums;
+    }
+    if (problems == 0) {
+        return FSCK_OK;
+    }
+    return repair ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
+
+#ifndef FSCK_NO_MAIN
+int main(int argc, char* argv[]) {
+    int opt;
+    int fix = 0;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch (opt) {
+        case 'r':
+            fix = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            printf("usage: ./wfs-fsck [-r] [-j <threads>] <disk img>[,<disk img> ...]\n");
+            exit(FSCK_ERROR);
+        }
+    }
+    if (optind != argc - 1) {
+        printf("usage: ./wfs-fsck [-r] [-j <threads>] <disk img>[,<disk img> ...]\n");
+        exit(FSCK_ERROR);
+    }
+
+    // a volume's members are given as one comma-separated list. a mirror
+    // is mapped from one member, so fixes are written to all of them
+    // afterwards
+    struct wfs_volume vol;
+    if (vol_open(argv[optind], fix ? O_RDWR : O_RDONLY, &vol) < 0) {
+        return FSCK_ERROR;
+    }
+    int mirror = vol.members > 1 && vol.hdr.layout == WFS_VOL_MIRROR;
+    void* region = vol_map(&vol, fix && !mirror ? MAP_SHARED : MAP_PRIVATE);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return FSCK_ERROR;
+    }
+
+    struct fsck_result res;
+    int ret = fsck_image(region, vol.size, fix, 1, &res);
+    if (ret == FSCK_OK) {
+        printf("%s: clean, %zu inodes, %zu data blocks, %u groups\n", argv[optind],
+               sb->num_inodes, sb->num_data_blocks, sb_groups(sb));
+    } else if (ret != FSCK_ERROR) {
+        printf("%s: %zu problems%s\n", argv[optind], res.problems, fix ? " fixed" : "");
+    }
+
+    if (fix && mirror && res.problems > 0 && vol_pwrite(&vol, region, vol.size, 0) < 0) {
+        perror("writing fixes");
+        ret = FSCK_ERROR;
+    } else if (fix) {
+        msync(region, vol.size, MS_SYNC);
+    }
+    munmap(region, vol.size);
+    vol_close(&vol);
+    return ret;
+}
+#endif
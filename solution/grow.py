@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+import fcntl
+import os
+import struct
+import sys
+
+# must match struct wfs_grow_args in wfs.h
+GROW_ARGS = struct.Struct("II")
+
+def ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_GROW = ioc(3, 3, GROW_ARGS.size)
+
+def show(mountpoint):
+    st = os.statvfs(mountpoint)
+    print(f"  {st.f_files} inodes ({st.f_ffree} free), {st.f_blocks} data blocks ({st.f_bfree} free)")
+
+if len(sys.argv) != 3:
+    print(f"Usage: {sys.argv[0]} <mountpoint> <groups to add>")
+    sys.exit(1)
+
+mountpoint = sys.argv[1]
+fd = os.open(mountpoint, os.O_RDONLY)
+print("before:")
+show(mountpoint)
+
+buf = bytearray(GROW_ARGS.pack(int(sys.argv[2]), 0))
+fcntl.ioctl(fd, WFS_IOC_GROW, buf)
+_, groups = GROW_ARGS.unpack(buf)
+
+print(f"after ({groups} groups):")
+show(mountpoint)
+os.close(fd)
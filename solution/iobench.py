@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+import fcntl
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# must match struct wfs_io_stats in wfs.h
+IO_STATS = struct.Struct("IIQQQQQQQQQ")
+
+def ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_IOSTAT = ioc(2, 8, IO_STATS.size)
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FILE_SIZE = 30000  # about the most a file can hold
+DIRS = 64
+STRIPE = os.environ.get("STRIPE", "64K")
+MIRROR = os.environ.get("MIRROR") == "1"
+
+# the mount options each workload is run with, unless others are given
+DEFAULTS = {
+    "data": ["", "io=pread,cache=4", "io=pread,cache=4,direct"],
+    "getattr": ["", "prefault", "prefault,mlock", "prefault,hugepages", "io=pread,cache=16",
+                "io=pread,cache=16,prefault"],
+}
+
+def io_stats(mountpoint):
+    buf = bytearray(IO_STATS.size)
+    fd = os.open(mountpoint, os.O_RDONLY)
+    fcntl.ioctl(fd, WFS_IOC_IOSTAT, buf)
+    os.close(fd)
+    return IO_STATS.unpack(buf)
+
+# a volume's members are made by mkfs, striped in STRIPE units or, with
+# MIRROR=1, mirrored
+def mkfs(image, inodes, blocks):
+    args = [os.path.join(HERE, "mkfs"), "-i", str(inodes), "-b", str(blocks)]
+    for member in image.split(","):
+        args += ["-d", member]
+    if "," in image:
+        args += ["-s", f"{mb}M"] + (["-M"] if MIRROR else ["-S", STRIPE])
+    subprocess.run(args, check=True, stdout=subprocess.DEVNULL)
+
+# the image is dropped from the page cache first, so the mount starts cold
+def mount(image, mountpoint, opts):
+    for member in image.split(","):
+        fd = os.open(member, os.O_RDONLY)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        os.close(fd)
+    args = [os.path.join(HERE, "wfs"), image, mountpoint, "-s"]
+    if opts:
+        args += ["-o", opts]
+    subprocess.run(args, check=True)
+
+def unmount(mountpoint):
+    subprocess.run([os.path.join(HERE, "umount.sh"), mountpoint], check=True)
+    time.sleep(0.3)
+
+def timed(what, nbytes, fn):
+    t = time.monotonic()
+    fn()
+    took = time.monotonic() - t
+    print(f"  {what:<22} {nbytes / took / (1 << 20):8.1f} MB/s")
+
+def cache_line(mountpoint):
+    (backend, direct, cache, resident, dirty, reads, dirtied, evictions, writebacks,
+     locked, prefetched) = io_stats(mountpoint)
+    if backend == 1:
+        print(f"  cache: {resident}/{cache} pages, {locked} locked, {reads} read in "
+              f"({prefetched} ahead), {evictions} evicted, {writebacks} written back")
+    elif locked or prefetched:
+        print(f"  {locked} pages locked, {prefetched} advised ahead")
+
+def run_data(image, mountpoint, opts, files, data):
+    mkfs(image, files + 64, files * (FILE_SIZE // 512 + 8))
+    print(f"-o {opts or 'io=mmap'}:")
+    total = files * FILE_SIZE
+    names = [os.path.join(mountpoint, f"f{i:05d}") for i in range(files)]
+
+    def write_all():
+        for name in names:
+            with open(name, "wb") as f:
+                f.write(data)
+        fd = os.open(names[0], os.O_RDONLY)
+        os.fsync(fd)
+        os.close(fd)
+
+    def read_all():
+        for name in names:
+            with open(name, "rb") as f:
+                f.read()
+
+    def read_random():
+        rng = random.Random(1)
+        for _ in range(files):
+            with open(names[rng.randrange(files)], "rb") as f:
+                f.seek(rng.randrange(FILE_SIZE // 512) * 512)
+                f.read(512)
+
+    mount(image, mountpoint, opts)
+    time.sleep(0.3)
+    timed("write + fsync", total, write_all)
+    unmount(mountpoint)
+    mount(image, mountpoint, opts)
+    time.sleep(0.3)
+    timed("sequential read", total, read_all)
+    timed("random 512B reads", files * 512, read_random)
+    cache_line(mountpoint)
+    unmount(mountpoint)
+
+# stats every file once, in random order, right after a cold mount. The
+# first one also waits for the mount to finish, prefaulting included
+def run_getattr(image, mountpoint, opts, names):
+    print(f"-o {opts or 'io=mmap'}:")
+    t = time.monotonic()
+    mount(image, mountpoint, opts)
+    while True:
+        try:
+            os.stat(names[0])
+            break
+        except FileNotFoundError:
+            time.sleep(0.001)
+    first = time.monotonic() - t
+    t = time.monotonic()
+    for name in names[1:]:
+        os.stat(name)
+    each = (time.monotonic() - t) / (len(names) - 1)
+    print(f"  mount to first getattr {first * 1e3:8.1f} ms")
+    print(f"  cold getattr           {each * 1e6:8.1f} us")
+    cache_line(mountpoint)
+    unmount(mountpoint)
+
+if len(sys.argv) < 2 or (len(sys.argv) > 2 and sys.argv[2] not in DEFAULTS):
+    print(f"Usage: {sys.argv[0]} <image>[,<image> ...] [data|getattr] [files] [mount options ...]")
+    print("Formats the image, or a volume striped over the images (unit $STRIPE, default 64K)")
+    print("or with MIRROR=1 mirrored on them,")
+    print("and compares mount options on one workload:")
+    print("  data     write, then cold sequential and random reads of 30000-byte files")
+    print("  getattr  cold getattr of empty files spread over directories")
+    sys.exit(1)
+
+image = sys.argv[1]
+workload = sys.argv[2] if len(sys.argv) > 2 else "data"
+files = int(sys.argv[3]) if len(sys.argv) > 3 else (1000 if workload == "data" else 20000)
+option_sets = sys.argv[4:] or DEFAULTS[workload]
+
+# whole megabytes, which O_DIRECT needs
+per_file = FILE_SIZE + 4096 if workload == "data" else 1024
+mb = (files * per_file >> 20) + 2
+if "," not in image:
+    if not os.path.exists(image):
+        open(image, "wb").close()
+    with open(image, "r+b") as f:
+        f.truncate(max(os.path.getsize(image) >> 20, mb) << 20)
+
+with tempfile.TemporaryDirectory() as mountpoint:
+    if workload == "data":
+        data = os.urandom(FILE_SIZE)
+        for opts in option_sets:
+            run_data(image, mountpoint, opts, files, data)
+    else:
+        mkfs(image, files + DIRS + 64, DIRS * 8 + files // 16)
+        mount(image, mountpoint, "")
+        time.sleep(0.3)
+        names = []
+        for d in range(DIRS):
+            os.mkdir(os.path.join(mountpoint, f"d{d:02d}"))
+        for i in range(files):
+            names.append(os.path.join(mountpoint, f"d{i % DIRS:02d}", f"f{i:06d}"))
+            open(names[-1], "wb").close()
+        unmount(mountpoint)
+        random.Random(1).shuffle(names)
+        for opts in option_sets:
+            run_getattr(image, mountpoint, opts, names)
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  A small LZ77 codec in the style of LZ4, used for compressed files.
+
+  The stream is a run of sequences. Each starts with a token byte: the
+  high nibble is the number of literal bytes that follow, the low nibble
+  the length of the match after them, minus LZ_MIN_MATCH. A nibble of 15
+  means more length bytes follow the token (literals) or the offset
+  (match), each added on, until one is not 255. The literals come next,
+  then the match as a 2-byte little-endian distance back into the output.
+  The last sequence has literals only and ends at the end of the input.
+*/
+
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_BITS (12)
+#define LZ_MAX_DISTANCE (0xFFFF)
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static int put_length(uint8_t* out, size_t* op, size_t cap, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (*op == cap) { return -1; }
+        out[(*op)++] = 255;
+    }
+    if (*op == cap) { return -1; }
+    out[(*op)++] = n;
+    return 0;
+}
+
+// one sequence: `lit` literals, then a match of `mlen` bytes `dist` back
+// (no match for the last sequence, mlen == 0)
+static int put_sequence(uint8_t* out, size_t* op, size_t cap, const uint8_t* lits, size_t lit,
+                        size_t dist, size_t mlen) {
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    if (*op == cap) { return -1; }
+    out[(*op)++] = (lit < 15 ? lit : 15) << 4 | (mcode < 15 ? mcode : 15);
+    if (lit >= 15 && put_length(out, op, cap, lit - 15) < 0) {
+        return -1;
+    }
+    if (cap - *op < lit) {
+        return -1;
+    }
+    memcpy(out + *op, lits, lit);
+    *op += lit;
+    if (mlen == 0) {
+        return 0;
+    }
+    if (cap - *op < 2) {
+        return -1;
+    }
+    out[(*op)++] = dist & 0xFF;
+    out[(*op)++] = dist >> 8;
+    if (mcode >= 15 && put_length(out, op, cap, mcode - 15) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// returns the compressed length, or -1 if it would not fit in `cap` bytes
+ssize_t lz_compress(const char* src, size_t len, char* dst, size_t cap) {
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    uint32_t table[1 << LZ_HASH_BITS]; // last position + 1 with each hash
+    size_t ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t h = hash4(in + ip);
+        size_t cand = table[h];
+        table[h] = ip + 1;
+        if (cand == 0 || ip - (cand - 1) > LZ_MAX_DISTANCE ||
+            memcmp(in + cand - 1, in + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        cand--;
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && in[cand + mlen] == in[ip + mlen]) {
+            mlen++;
+        }
+        if (put_sequence(out, &op, cap, in + anchor, ip - anchor, ip - cand, mlen) < 0) {
+            return -1;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if (put_sequence(out, &op, cap, in + anchor, len - anchor, 0, 0) < 0) {
+        return -1;
+    }
+    return op;
+}
+
+static int get_length(const uint8_t* in, size_t* ip, size_t len, size_t* n) {
+    uint8_t b;
+    do {
+        if (*ip == len) { return -1; }
+        b = in[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// returns the decompressed length, or -1 if the input is corrupt or the
+// output would not fit in `cap` bytes
+ssize_t lz_decompress(const char* src, size_t len, char* dst, size_t cap) {
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    size_t ip = 0, op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(in, &ip, len, &lit) < 0) {
+            return -1;
+        }
+        if (lit > len - ip || lit > cap - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) {
+            break; // the last sequence
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        size_t dist = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = token & 0xF;
+        if (mlen == 15 && get_length(in, &ip, len, &mlen) < 0) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (dist == 0 || dist > op || mlen > cap - op) {
+            return -1;
+        }
+        // byte by byte: the match may overlap what it produces
+        for (size_t i = 0; i < mlen; i++, op++) {
+            out[op] = out[op - dist];
+        }
+    }
+    return op;
+}
@@ -6,51 +6,110 @@
 #include <string.h>
 #include "wfs.h"
 
-int roundup(int num, int factor) {
+off_t roundup(off_t num, off_t factor) {
     return num % factor == 0 ? num : num + (factor - (num % factor));
 }
 
-int setup_sb(struct wfs_sb* sb, int inodes, int blocks, size_t sz) {
-    inodes = roundup(inodes, 32);
-    blocks = roundup(blocks, 32);
-    
-    sb->num_inodes = inodes;
-    sb->num_data_blocks = blocks;
-    sb->i_bitmap_ptr = sizeof(struct wfs_sb);
+// inodes and blocks are split evenly across the groups; each group's
+// counts are rounded up to whole bitmap words
+int setup_sb(struct wfs_sb* sb, int inodes, int blocks, int groups, size_t sz) {
+    inodes = roundup((inodes + groups - 1) / groups, 32);
+    blocks = roundup((blocks + groups - 1) / groups, 32);
+
+    memset(sb, 0, sizeof(struct wfs_sb));
+    sb->magic = WFS_MAGIC;
+    sb->num_groups = groups;
+    // only group 0 is written here, the rest is set up by wfs on first use
+    sb->features = WFS_FEATURE_LAZY_INIT | WFS_FEATURE_LONG_NAMES;
+    sb->init_groups = 1;
+    sb->num_inodes = (size_t)inodes * groups;
+    sb->num_data_blocks = (size_t)blocks * groups;
+    // group 0 starts after the space reserved for the superblock
+    sb->i_bitmap_ptr = SB_SIZE;
     // 8 bits in a byte...
     sb->d_bitmap_ptr = sb->i_bitmap_ptr + (inodes / 8);
-    sb->i_blocks_ptr = sb->d_bitmap_ptr + (blocks / 8);
-    sb->d_blocks_ptr = sb->i_blocks_ptr + (inodes * BLOCK_SIZE);
+    // followed by a reference count for every data block
+    sb->refcount_ptr = sb->d_bitmap_ptr + (blocks / 8);
+    // and a checksum for the group's metadata, every inode and every block
+    sb->csum_ptr = roundup(sb->refcount_ptr + (off_t)blocks * sizeof(uint16_t), sizeof(uint32_t));
+    sb->i_blocks_ptr = roundup(sb->csum_ptr + (off_t)(1 + inodes + blocks) * sizeof(uint32_t), BLOCK_SIZE);
+    sb->d_blocks_ptr = sb->i_blocks_ptr + ((off_t)inodes * BLOCK_SIZE);
+    sb->group_size = sb->d_blocks_ptr + ((off_t)blocks * BLOCK_SIZE) - sb->i_bitmap_ptr;
 
-    printf("trying to create with %d inodes, %d blocks, size is %ld, block start at %ld\n", inodes, blocks, sz, sb->i_blocks_ptr);
-    return (inodes * BLOCK_SIZE) + (blocks * BLOCK_SIZE) + sb->i_blocks_ptr < sz;
+    printf("trying to create with %ld inodes, %ld blocks in %d groups, size is %ld, block start at %ld\n",
+           sb->num_inodes, sb->num_data_blocks, groups, sz, sb->i_blocks_ptr);
+    return sb->i_bitmap_ptr + groups * sb->group_size <= sz;
+}
+
+// parses a size like 4096, 64K, 10M or 100G
+off_t parse_size(char* str) {
+    char* end;
+    off_t size = strtoll(str, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;
+    // fall through
+    case 'M': case 'm': size *= 1024;
+    // fall through
+    case 'K': case 'k': size *= 1024;
+    }
+    return size;
 }
 
 // Setup superblock for disk img. 
-int wfs_mkfs(char* path, int inodes, int blocks) {
+// With `size` > 0 the image is created (or emptied) and sized by mkfs as a
+// sparse file, so nothing has to be zeroed first. Several paths make a
+// volume, which needs `size`: striped across them in `stripe`-byte units,
+// with `meta` set that member holding the first group's metadata, or with
+// `layout` WFS_VOL_MIRROR a copy of the image on each.
+int wfs_mkfs(char** paths, int members, int inodes, int blocks, int groups, off_t size,
+             uint32_t layout, uint32_t stripe, uint32_t meta) {
     int fd;
     struct stat statb;
     struct wfs_sb sb;
+    struct wfs_volume vol;
+    char sb_block[SB_SIZE];
 
-    if ((fd = open(path, O_RDWR, S_IRWXU)) < 0) {
-        perror("open failed create metadata\n");
-        return -1;
-    }
+    if (members > 1) {
+        if (size <= 0) {
+            printf("a volume needs its size (-s)\n");
+            return -1;
+        }
+        if (setup_sb(&sb, inodes, blocks, groups, size) == 0) {
+            printf("too many blocks requested, failed to write superblock\n");
+            return -1;
+        }
+        if (vol_create(paths, members, layout, stripe, meta, roundup(sb.d_blocks_ptr, stripe), size, &vol) < 0) {
+            perror("creating volume");
+            return -1;
+        }
+        if (layout == WFS_VOL_MIRROR) {
+            printf("volume of %d mirrored members\n", members);
+        } else {
+            printf("volume of %d members, %u-byte stripe units, metadata %s\n", members, stripe,
+                   meta == WFS_VOL_STRIPED ? "striped" : paths[meta]);
+        }
+    } else {
+        if ((fd = open(paths[0], O_RDWR | (size > 0 ? O_CREAT : 0), 0666)) < 0) {
+            perror("open failed create metadata\n");
+            return -1;
+        }
 
-    if (fstat(fd, &statb) < 0) {
-        perror("stat-ing diskimg\n");
-        return -1;
-    }
+        if (size > 0 && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+            perror("sizing diskimg\n");
+            return -1;
+        }
 
-    if (setup_sb(&sb, inodes, blocks, statb.st_size) == 0) {
-        printf("too many blocks requested, failed to write superblock\n");
-        close(fd);
-        return -1;
-    }
+        if (fstat(fd, &statb) < 0) {
+            perror("stat-ing diskimg\n");
+            return -1;
+        }
 
-    if (write(fd, &sb, sizeof(struct wfs_sb)) < 0) {
-        perror("writing superblock\n");
-        return -1;
+        if (setup_sb(&sb, inodes, blocks, groups, statb.st_size) == 0) {
+            printf("too many blocks requested, failed to write superblock\n");
+            close(fd);
+            return -1;
+        }
+        vol_plain(&vol, fd, statb.st_size);
     }
 
     struct timespec t;
@@ -66,33 +125,65 @@ int wfs_mkfs(char* path, int inodes, int blocks) {
     inode.atim = t.tv_sec;
     inode.mtim = t.tv_sec;
     inode.ctim = t.tv_sec;
+    inode.atim_ns = inode.mtim_ns = inode.ctim_ns = t.tv_nsec;
     inode.color = WFS_COLOR_NONE; // default: no color
+    char inode_block[BLOCK_SIZE];
+    memset(inode_block, 0, BLOCK_SIZE);
+    memcpy(inode_block, &inode, sizeof(struct wfs_inode));
+
+    // clear group 0's bitmaps, reference counts and checksums, the image
+    // is not assumed to be zeroed
+    size_t bitmaps_len = sb.i_blocks_ptr - sb.i_bitmap_ptr;
+    char* bitmaps = calloc(1, bitmaps_len);
+    *(uint32_t*)bitmaps = 0x1; // root inode
+    uint32_t* csums = (uint32_t*)(bitmaps + (sb.csum_ptr - sb.i_bitmap_ptr));
+    csums[0] = crc32c(bitmaps, sb.csum_ptr - sb.i_bitmap_ptr);
+    csums[1] = crc32c(inode_block, BLOCK_SIZE);
+
+    // pad the superblock out to its reserved space
+    sb.sb_csum = sb_checksum(&sb);
+    memset(sb_block, 0, SB_SIZE);
+    memcpy(sb_block, &sb, sizeof(struct wfs_sb));
+    if (vol_pwrite(&vol, sb_block, SB_SIZE, 0) < 0) {
+        perror("writing superblock\n");
+        return -1;
+    }
 
-    // set bitmap
-    uint32_t bit = 0x1;
-    lseek(fd, sb.i_bitmap_ptr, SEEK_SET);
-    write(fd, &bit, sizeof(uint32_t));
+    if (vol_pwrite(&vol, bitmaps, bitmaps_len, sb.i_bitmap_ptr) < 0) {
+        perror("writing bitmaps\n");
+        return -1;
+    }
+    free(bitmaps);
 
-    // write inode
-    lseek(fd, sb.i_blocks_ptr, SEEK_SET);
-    if (write(fd, &inode, sizeof(struct wfs_inode)) < 0) {
+    // write inode, padded to its slot
+    if (vol_pwrite(&vol, inode_block, BLOCK_SIZE, sb.i_blocks_ptr) < 0) {
         perror("writing root inode\n");
         return -1;
     }
     
-    close(fd);
+    vol_close(&vol);
     return 0;
 }
 
 int main(int argc, char* argv[]) {
-    char* diskimg;
+    char* diskimgs[WFS_VOL_MAX];
+    int members = 0;
     int inodes, blocks;
+    int groups = 1;
+    off_t size = 0;
+    off_t stripe = 64 * 1024;
+    uint32_t meta = WFS_VOL_STRIPED;
+    uint32_t layout = WFS_VOL_STRIPE;
     int opt;
     
-    while ((opt = getopt(argc, argv, "d:i:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:i:b:g:s:S:m:M")) != -1) {
         switch (opt) {
         case 'd':
-            diskimg = optarg;
+            if (members == WFS_VOL_MAX) {
+                printf("at most %d volume members\n", WFS_VOL_MAX);
+                exit(1);
+            }
+            diskimgs[members++] = optarg;
             break;
         case 'i':
             inodes = atoi(optarg);
@@ -100,11 +191,46 @@ int main(int argc, char* argv[]) {
         case 'b':
             blocks = atoi(optarg);
             break;
+        case 'g':
+            groups = atoi(optarg);
+            break;
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'S':
+            stripe = parse_size(optarg);
+            break;
+        case 'm':
+            meta = atoi(optarg);
+            break;
+        case 'M':
+            layout = WFS_VOL_MIRROR;
+            break;
         default:
-            printf("usage: ./mkfs -d <disk img> -i <num inodes> -b <num data blocks>\n");
+            printf("usage: ./mkfs -d <disk img> [-d <disk img> ...] -i <num inodes> -b <num data blocks> [-g <num block groups>] [-s <image size>] [-S <stripe unit>] [-m <metadata member>] [-M]\n");
             exit(1);
         }
     }
+    if (groups < 1) {
+        printf("need at least one block group\n");
+        exit(1);
+    }
+    if (members == 0) {
+        printf("need a disk img\n");
+        exit(1);
+    }
+    if (members > 1 && (stripe <= 0 || stripe % sysconf(_SC_PAGESIZE) != 0)) {
+        printf("the stripe unit must be a multiple of %ld\n", sysconf(_SC_PAGESIZE));
+        exit(1);
+    }
+    if (layout == WFS_VOL_MIRROR && (members < 2 || meta != WFS_VOL_STRIPED)) {
+        printf("a mirror needs several -d, and keeps all of the image on each\n");
+        exit(1);
+    }
+    if (meta != WFS_VOL_STRIPED && (members < 2 || meta >= (uint32_t)members)) {
+        printf("the metadata member is one of the %d -d given, counting from 0\n", members);
+        exit(1);
+    }
     
-    return wfs_mkfs(diskimg, inodes, blocks);
+    return wfs_mkfs(diskimgs, members, inodes, blocks, groups, size, layout, stripe, meta);
 }
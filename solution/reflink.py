@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+import fcntl
+import os
+import struct
+import sys
+import time
+
+# must match struct wfs_clone_args in wfs.h
+CLONE_ARGS = struct.Struct("256sQQQQII")
+
+def ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_CLONE = ioc(3, 4, CLONE_ARGS.size)
+
+def mount_root(path):
+    path = os.path.realpath(path)
+    while not os.path.ismount(path):
+        path = os.path.dirname(path)
+    return path
+
+def used_blocks(mountpoint):
+    st = os.statvfs(mountpoint)
+    return st.f_blocks - st.f_bfree
+
+if len(sys.argv) != 3:
+    print(f"Usage: {sys.argv[0]} <source file> <new file>")
+    print("Both files must be on the same wfs mount.")
+    sys.exit(1)
+
+src, dst = sys.argv[1], sys.argv[2]
+root = mount_root(src)
+if mount_root(os.path.dirname(os.path.abspath(dst))) != root:
+    print(f"{src} and {dst} are not on the same mount")
+    sys.exit(1)
+
+before = used_blocks(root)
+fd = os.open(dst, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o644)
+src_path = "/" + os.path.relpath(os.path.realpath(src), root)
+buf = bytearray(CLONE_ARGS.pack(src_path.encode(), 0, 0, 0, 0, 0, 0))
+start = time.perf_counter()
+fcntl.ioctl(fd, WFS_IOC_CLONE, buf)
+elapsed = time.perf_counter() - start
+os.close(fd)
+
+_, _, _, _, cloned, shared, _ = CLONE_ARGS.unpack(buf)
+print(f"cloned {cloned} bytes in {elapsed * 1000:.2f} ms, {shared} blocks shared, "
+      f"{used_blocks(root) - before} new data blocks")
@@ -0,0 +1,679 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  Volumes: where the bytes of an image are stored (see wfs.h for the
+  layouts). vol_locate is the one place that knows where a byte lives;
+  reads, writes and mappings are split into the contiguous pieces it
+  returns.
+
+  A striped volume is mapped by reserving address space for the whole
+  image and mapping every unit over it from its member, so the driver
+  still sees one region. Each unit is a mapping of its own, which bounds
+  how many units a mapped volume can have (VOL_MAX_MAPS); io=pread has no
+  limit.
+
+  A mirror can only be mapped for reading, since stores to a mapping
+  would reach a single member: wfs mounts mirrors with io=pread, whose
+  writebacks go through vol_pwrite to every member. Reads go to the
+  member with the fewest reads in flight, and among those to the one whose
+  last read ended nearest, so a sequential reader stays on one member and
+  readers elsewhere in the image use the others. A member a read or write
+  fails on is dropped for the rest of the mount.
+
+  The lock keeps a sync from clearing bitmap bits between a write setting
+  them and its data reaching the members.
+*/
+
+#define VOL_MAX_MAPS (32768) /* well under the usual vm.max_map_count */
+
+// headers are read and written through this, which suits O_DIRECT
+static char hdr_buf[WFS_VOL_HDR] __attribute__((aligned(WFS_VOL_HDR)));
+
+static int vol_striped(const struct wfs_volume* vol) {
+    return vol->members > 1 && vol->hdr.layout == WFS_VOL_STRIPE;
+}
+
+static int vol_mirrored(const struct wfs_volume* vol) {
+    return vol->members > 1 && vol->hdr.layout == WFS_VOL_MIRROR;
+}
+
+static int has_meta(const struct wfs_volume* vol) {
+    return vol->hdr.meta != WFS_VOL_STRIPED;
+}
+
+// bytes member m holds of an image of `size` bytes, header included
+static size_t member_size(const struct wfs_volume* vol, int m, size_t size) {
+    const struct wfs_vol_header* h = &vol->hdr;
+    if (vol_mirrored(vol)) {
+        return WFS_VOL_HDR + size;
+    }
+    if (has_meta(vol) && (uint32_t)m == h->meta) {
+        return WFS_VOL_HDR + h->meta_size;
+    }
+    size_t data = size - (has_meta(vol) ? h->meta_size : 0);
+    size_t units = (data + h->stripe - 1) / h->stripe;
+    int n = vol->members - has_meta(vol);
+    int k = has_meta(vol) && (uint32_t)m > h->meta ? m - 1 : m;
+    return WFS_VOL_HDR + (units / n + ((size_t)k < units % n)) * h->stripe;
+}
+
+static int pread_all(int fd, void* buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char*)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            errno = n == 0 ? EIO : errno;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char*)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// =========================
+// Member headers
+// =========================
+
+static uint32_t header_checksum() {
+    struct wfs_vol_header* hdr = (struct wfs_vol_header*)hdr_buf;
+    uint32_t saved = hdr->csum;
+    hdr->csum = 0;
+    uint32_t csum = crc32c(hdr_buf, WFS_VOL_HDR);
+    hdr->csum = saved;
+    return csum;
+}
+
+static int write_header(struct wfs_volume* vol, int m) {
+    struct wfs_vol_header hdr = vol->hdr;
+    hdr.index = m;
+    memset(hdr_buf, 0, WFS_VOL_HDR);
+    memcpy(hdr_buf, &hdr, sizeof(hdr));
+    if (vol_mirrored(vol)) {
+        memcpy(hdr_buf + WFS_VOL_BITMAP_OFF, vol->bitmap, WFS_VOL_BITMAP);
+    }
+    ((struct wfs_vol_header*)hdr_buf)->csum = header_checksum();
+    return pwrite(vol->fd[m], hdr_buf, WFS_VOL_HDR, 0) == WFS_VOL_HDR ? 0 : -1;
+}
+
+// 1 if the file starts with a member header, 0 if it has none, -1 if the
+// header is damaged
+static int read_header(int fd, struct wfs_vol_header* hdr, uint8_t* bitmap) {
+    if (pread(fd, hdr_buf, WFS_VOL_HDR, 0) != WFS_VOL_HDR ||
+        memcmp(hdr_buf, WFS_VOL_MAGIC, sizeof(hdr->magic)) != 0) {
+        return 0;
+    }
+    memcpy(hdr, hdr_buf, sizeof(*hdr));
+    if (hdr->csum != header_checksum()) {
+        return -1;
+    }
+    memcpy(bitmap, hdr_buf + WFS_VOL_BITMAP_OFF, WFS_VOL_BITMAP);
+    return 1;
+}
+
+// =========================
+// Mirrors
+// =========================
+
+static int bitmap_test(const struct wfs_volume* vol, size_t r) {
+    return vol->bitmap[r / 8] & (1 << (r % 8));
+}
+
+static int bitmap_empty(const struct wfs_volume* vol) {
+    for (int i = 0; i < WFS_VOL_BITMAP; i++) {
+        if (vol->bitmap[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// stops using member m for the rest of the mount; its event count stays
+// behind, so it is brought up to date when it is next opened
+static void drop_member(struct wfs_volume* vol, int m) {
+    printf("vol: member %d failed (%s), going on without it\n", m, strerror(errno));
+    close(vol->fd[m]);
+    vol->fd[m] = -1;
+    vol->degraded = 1;
+    vol->stats.present--;
+}
+
+static int live_members(struct wfs_volume* vol) {
+    int live = 0;
+    for (int m = 0; m < vol->members; m++) {
+        live += vol->fd[m] >= 0;
+    }
+    if (live == 0) {
+        errno = EIO;
+    }
+    return live;
+}
+
+// puts the headers, and so the bitmap, on every member for good
+static int write_headers(struct wfs_volume* vol, int sync) {
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0 && (write_header(vol, m) < 0 || (sync && fdatasync(vol->fd[m]) < 0))) {
+            drop_member(vol, m);
+        }
+    }
+    return live_members(vol) ? 0 : -1;
+}
+
+// halves the bitmap's resolution until an image of `size` bytes fits
+static void fit_bitmap(struct wfs_volume* vol, size_t size) {
+    while ((size + vol->hdr.region - 1) / vol->hdr.region > WFS_VOL_BITMAP * 8) {
+        for (size_t r = 0; r < WFS_VOL_BITMAP * 8; r += 2) {
+            int set = bitmap_test(vol, r) || bitmap_test(vol, r + 1);
+            vol->bitmap[r / 8] &= ~(3 << (r % 8));
+            if (set) {
+                vol->bitmap[r / 16] |= 1 << (r / 2 % 8);
+            }
+        }
+        vol->hdr.region *= 2;
+    }
+}
+
+// copies what the bitmap covers from the source to the other members,
+// then has every member start a new mount with an empty bitmap, unless
+// one is missing
+static int resync(struct wfs_volume* vol, const uint64_t* events) {
+    uint64_t newest = events[vol->source];
+    char* buf = malloc(vol->hdr.region);
+    size_t regions = (vol->size + vol->hdr.region - 1) / vol->hdr.region;
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0 && events[m] < newest) {
+            printf("vol: member %d is behind, bringing it up to date\n", m);
+            vol->stats.stale++;
+            ftruncate(vol->fd[m], member_size(vol, m, vol->size));
+        }
+    }
+    for (size_t r = 0; r < regions; r++) {
+        if (!bitmap_test(vol, r)) {
+            continue;
+        }
+        off_t off = (off_t)r * vol->hdr.region;
+        size_t len = vol->size - off < vol->hdr.region ? vol->size - off : vol->hdr.region;
+        if (pread_all(vol->fd[vol->source], buf, len, WFS_VOL_HDR + off) < 0) {
+            free(buf);
+            return -1;
+        }
+        for (int m = 0; m < vol->members; m++) {
+            if (m != vol->source && vol->fd[m] >= 0) {
+                if (pwrite_all(vol->fd[m], buf, len, WFS_VOL_HDR + off) < 0) {
+                    drop_member(vol, m);
+                } else {
+                    vol->stats.resynced += len;
+                }
+            }
+        }
+    }
+    free(buf);
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0 && fdatasync(vol->fd[m]) < 0) {
+            drop_member(vol, m);
+        }
+    }
+    if (vol->stats.resynced > 0) {
+        printf("vol: %lu bytes resynced\n", (unsigned long)vol->stats.resynced);
+    }
+    if (!vol->degraded) {
+        memset(vol->bitmap, 0, WFS_VOL_BITMAP);
+    }
+    vol->hdr.events = newest + 1;
+    return write_headers(vol, 1);
+}
+
+// the member a read of `len` bytes at `off` goes to
+static int pick_member(struct wfs_volume* vol, off_t off) {
+    int best = -1;
+    off_t best_dist = 0;
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] < 0) {
+            continue;
+        }
+        off_t dist = off > vol->last[m] ? off - vol->last[m] : vol->last[m] - off;
+        if (best < 0 || vol->busy[m] < vol->busy[best] ||
+            (vol->busy[m] == vol->busy[best] && dist < best_dist)) {
+            best = m;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+static ssize_t mirror_pread(struct wfs_volume* vol, void* buf, size_t len, off_t off) {
+    for (;;) {
+        pthread_mutex_lock(&vol->lock);
+        int m = pick_member(vol, off);
+        if (m < 0) {
+            pthread_mutex_unlock(&vol->lock);
+            errno = EIO;
+            return -1;
+        }
+        int fd = vol->fd[m];
+        vol->busy[m]++;
+        vol->last[m] = off + len;
+        vol->stats.reads[m]++;
+        pthread_mutex_unlock(&vol->lock);
+
+        int ret = pread_all(fd, buf, len, WFS_VOL_HDR + off);
+
+        pthread_mutex_lock(&vol->lock);
+        vol->busy[m]--;
+        if (ret < 0 && vol->fd[m] == fd) {
+            drop_member(vol, m);
+        }
+        pthread_mutex_unlock(&vol->lock);
+        if (ret == 0) {
+            return len;
+        }
+    }
+}
+
+static ssize_t mirror_pwrite(struct wfs_volume* vol, const void* buf, size_t len, off_t off) {
+    pthread_mutex_lock(&vol->lock);
+    // the bits go on every member before the data does
+    int marked = 0;
+    for (size_t r = off / vol->hdr.region; len > 0 && r <= (off + len - 1) / vol->hdr.region; r++) {
+        if (!bitmap_test(vol, r)) {
+            vol->bitmap[r / 8] |= 1 << (r % 8);
+            marked = 1;
+        }
+    }
+    if (marked && write_headers(vol, 1) < 0) {
+        pthread_mutex_unlock(&vol->lock);
+        return -1;
+    }
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] < 0) {
+            continue;
+        }
+        if (pwrite_all(vol->fd[m], buf, len, WFS_VOL_HDR + off) < 0) {
+            drop_member(vol, m);
+        } else {
+            vol->stats.writes[m]++;
+        }
+    }
+    int live = live_members(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return live ? (ssize_t)len : -1;
+}
+
+// =========================
+// Interface
+// =========================
+
+static void vol_init(struct wfs_volume* vol) {
+    memset(vol, 0, sizeof(*vol));
+    for (int m = 0; m < WFS_VOL_MAX; m++) {
+        vol->fd[m] = -1;
+    }
+    pthread_mutex_init(&vol->lock, NULL);
+}
+
+void vol_plain(struct wfs_volume* vol, int fd, size_t size) {
+    vol_init(vol);
+    vol->members = 1;
+    vol->fd[0] = fd;
+    vol->size = size;
+    vol->stats.members = vol->stats.present = 1;
+}
+
+// opens a plain image or the comma-separated members of a volume, in any
+// order. A mirror can do with some of its members, and is brought up to
+// date when opened for writing. Returns 0, or -1 having said what is wrong
+int vol_open(const char* paths, int flags, struct wfs_volume* vol) {
+    char* list = strdup(paths);
+    char* names[WFS_VOL_MAX + 1];
+    uint64_t events[WFS_VOL_MAX];
+    static uint8_t bitmaps[WFS_VOL_MAX][WFS_VOL_BITMAP];
+    int count = 0;
+    for (char* p = strtok(list, ","); p != NULL && count <= WFS_VOL_MAX; p = strtok(NULL, ",")) {
+        names[count++] = p;
+    }
+    vol_init(vol);
+    if (count == 0 || count > WFS_VOL_MAX) {
+        printf("vol: give one image or 2-%d volume members\n", WFS_VOL_MAX);
+        free(list);
+        return -1;
+    }
+    vol->members = WFS_VOL_MAX;
+
+    for (int i = 0; i < count; i++) {
+        struct wfs_vol_header hdr;
+        uint8_t map[WFS_VOL_BITMAP];
+        int fd = open(names[i], flags);
+        if (fd < 0) {
+            printf("vol: %s: %s\n", names[i], strerror(errno));
+            goto fail;
+        }
+        int valid = read_header(fd, &hdr, map);
+        if (valid == 0) {
+            struct stat st;
+            if (count == 1 && fstat(fd, &st) == 0) {
+                vol_plain(vol, fd, st.st_size);
+                free(list);
+                return 0;
+            }
+            printf("vol: %s is not a volume member\n", names[i]);
+            close(fd);
+            goto fail;
+        }
+        if (valid < 0) {
+            printf("vol: %s has a damaged member header\n", names[i]);
+            close(fd);
+            goto fail;
+        }
+        if (i > 0 && hdr.id != vol->hdr.id) {
+            printf("vol: %s belongs to another volume\n", names[i]);
+            close(fd);
+            goto fail;
+        }
+        int enough = hdr.layout == WFS_VOL_MIRROR ? (uint32_t)count <= hdr.members : (uint32_t)count == hdr.members;
+        if (!enough || hdr.index >= hdr.members || vol->fd[hdr.index] >= 0) {
+            printf("vol: %s is member %u of %u, %d given\n", names[i], hdr.index + 1, hdr.members, count);
+            close(fd);
+            goto fail;
+        }
+        vol->fd[hdr.index] = fd;
+        events[hdr.index] = hdr.events;
+        memcpy(bitmaps[hdr.index], map, WFS_VOL_BITMAP);
+        // a resize that was cut short may have updated some headers only;
+        // the members are extended before any of them
+        if (i == 0 || hdr.size > vol->size) {
+            vol->size = hdr.size;
+        }
+        if (i == 0 || hdr.events > vol->hdr.events) {
+            vol->hdr = hdr;
+        }
+    }
+    free(list);
+    vol->members = vol->hdr.members;
+    vol->hdr.size = vol->size;
+    vol->writable = (flags & O_ACCMODE) == O_RDWR;
+    vol->stats.layout = vol->hdr.layout;
+    vol->stats.members = vol->members;
+    vol->stats.present = count;
+    vol->degraded = count < vol->members;
+    if (!vol_mirrored(vol)) {
+        return 0;
+    }
+
+    // copies are taken from the lowest-numbered member that is up to date.
+    // the ones that are all had every bit set, the others may lack some
+    vol->source = -1;
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] < 0 || events[m] != vol->hdr.events) {
+            continue;
+        }
+        if (vol->source < 0) {
+            vol->source = m;
+        }
+        for (int i = 0; i < WFS_VOL_BITMAP; i++) {
+            vol->bitmap[i] |= bitmaps[m][i];
+        }
+    }
+    if (vol->degraded) {
+        printf("vol: %d of %d mirror members given\n", count, vol->members);
+    }
+    if (vol->writable && resync(vol, events) < 0) {
+        printf("vol: bringing the mirror up to date failed: %s\n", strerror(errno));
+        vol->writable = 0;
+        vol_close(vol);
+        return -1;
+    }
+    return 0;
+
+fail:
+    vol_close(vol);
+    free(list);
+    return -1;
+}
+
+// makes a new volume of `size` bytes out of the files at `paths`, which
+// are created or emptied. Returns 0, or -1 with errno set
+int vol_create(char** paths, int members, uint32_t layout, uint32_t stripe, uint32_t meta,
+               size_t meta_size, size_t size, struct wfs_volume* vol) {
+    vol_init(vol);
+    int mirror = layout == WFS_VOL_MIRROR;
+    if (members < 2 || members > WFS_VOL_MAX ||
+        (!mirror && (stripe == 0 || stripe % sysconf(_SC_PAGESIZE))) ||
+        (!mirror && meta != WFS_VOL_STRIPED && (meta >= (uint32_t)members || meta_size % stripe))) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    memcpy(vol->hdr.magic, WFS_VOL_MAGIC, sizeof(vol->hdr.magic));
+    vol->hdr.id = ((uint64_t)t.tv_sec << 32) ^ t.tv_nsec ^ ((uint64_t)getpid() << 16);
+    vol->hdr.members = members;
+    vol->hdr.layout = layout;
+    vol->hdr.stripe = mirror ? 0 : stripe;
+    vol->hdr.meta = mirror ? WFS_VOL_STRIPED : meta;
+    vol->hdr.meta_size = vol->hdr.meta == WFS_VOL_STRIPED ? 0 : meta_size;
+    vol->hdr.region = mirror ? WFS_VOL_REGION : 0;
+    vol->hdr.events = 1;
+    vol->members = members;
+    vol->writable = 1;
+    vol->stats.layout = layout;
+    vol->stats.members = vol->stats.present = members;
+    for (int m = 0; m < members; m++) {
+        if ((vol->fd[m] = open(paths[m], O_RDWR | O_CREAT, 0666)) < 0 || ftruncate(vol->fd[m], 0) < 0) {
+            int err = errno;
+            vol_close(vol);
+            errno = err;
+            return -1;
+        }
+    }
+    if (vol_truncate(vol, size) < 0) {
+        int err = errno;
+        vol_close(vol);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// where the byte at `off` of the image is stored, and how many bytes from
+// there on are stored next to it. For a mirror, that is on the source
+size_t vol_locate(const struct wfs_volume* vol, off_t off, int* member, off_t* moff) {
+    const struct wfs_vol_header* h = &vol->hdr;
+    if (vol_mirrored(vol)) {
+        *member = vol->source;
+        *moff = WFS_VOL_HDR + off;
+        return SIZE_MAX;
+    }
+    if (!vol_striped(vol)) {
+        *member = 0;
+        *moff = off;
+        return SIZE_MAX;
+    }
+    if (has_meta(vol) && (uint64_t)off < h->meta_size) {
+        *member = h->meta;
+        *moff = WFS_VOL_HDR + off;
+        return h->meta_size - off;
+    }
+    uint64_t data = off - (has_meta(vol) ? h->meta_size : 0);
+    uint64_t unit = data / h->stripe;
+    int n = vol->members - has_meta(vol);
+    int m = unit % n;
+    *member = has_meta(vol) && (uint32_t)m >= h->meta ? m + 1 : m;
+    *moff = WFS_VOL_HDR + (unit / n) * h->stripe + data % h->stripe;
+    return h->stripe - data % h->stripe;
+}
+
+// maps the whole image read-write, MAP_SHARED or MAP_PRIVATE. Returns
+// MAP_FAILED on failure
+void* vol_map(struct wfs_volume* vol, int flags) {
+    if (!vol_striped(vol)) {
+        int m;
+        off_t moff;
+        vol_locate(vol, 0, &m, &moff);
+        return mmap(NULL, vol->size, PROT_READ | PROT_WRITE, flags, vol->fd[m], moff);
+    }
+    if (vol->size / vol->hdr.stripe > VOL_MAX_MAPS) {
+        printf("vol: too many stripe units to map, use a larger unit or -o io=pread\n");
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    char* region = mmap(NULL, vol->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    for (size_t off = 0; off < vol->size;) {
+        int m;
+        off_t moff;
+        size_t len = vol_locate(vol, off, &m, &moff);
+        len = len < vol->size - off ? len : vol->size - off;
+        if (mmap(region + off, len, PROT_READ | PROT_WRITE, flags | MAP_FIXED, vol->fd[m], moff) == MAP_FAILED) {
+            int err = errno;
+            munmap(region, vol->size);
+            errno = err;
+            return MAP_FAILED;
+        }
+        off += len;
+    }
+    return region;
+}
+
+// reads and writes all of `len`, or fail
+ssize_t vol_pread(struct wfs_volume* vol, void* buf, size_t len, off_t off) {
+    if (vol_mirrored(vol)) {
+        return mirror_pread(vol, buf, len, off);
+    }
+    size_t done = 0;
+    while (done < len) {
+        int m;
+        off_t moff;
+        size_t run = vol_locate(vol, off + done, &m, &moff);
+        run = run < len - done ? run : len - done;
+        if (pread_all(vol->fd[m], (char*)buf + done, run, moff) < 0) {
+            return -1;
+        }
+        vol->stats.reads[m]++;
+        done += run;
+    }
+    return done;
+}
+
+ssize_t vol_pwrite(struct wfs_volume* vol, const void* buf, size_t len, off_t off) {
+    if (vol_mirrored(vol)) {
+        return mirror_pwrite(vol, buf, len, off);
+    }
+    size_t done = 0;
+    while (done < len) {
+        int m;
+        off_t moff;
+        size_t run = vol_locate(vol, off + done, &m, &moff);
+        run = run < len - done ? run : len - done;
+        if (pwrite_all(vol->fd[m], (const char*)buf + done, run, moff) < 0) {
+            return -1;
+        }
+        vol->stats.writes[m]++;
+        done += run;
+    }
+    return done;
+}
+
+// sizes every member for an image of `size` bytes. The headers are only
+// updated once all members have their new size
+int vol_truncate(struct wfs_volume* vol, size_t size) {
+    if (vol->members == 1) {
+        if (ftruncate(vol->fd[0], size) < 0) {
+            return -1;
+        }
+        vol->size = size;
+        return 0;
+    }
+    if (has_meta(vol) && size < vol->hdr.meta_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&vol->lock);
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0 && ftruncate(vol->fd[m], member_size(vol, m, size)) < 0) {
+            pthread_mutex_unlock(&vol->lock);
+            return -1;
+        }
+    }
+    if (vol_mirrored(vol)) {
+        fit_bitmap(vol, size);
+    }
+    vol->hdr.size = size;
+    vol->size = size;
+    int ret = write_headers(vol, 0);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+// makes what was written durable. Once every member of a mirror has it,
+// the members are in sync and the bitmap is cleared
+int vol_sync(struct wfs_volume* vol) {
+    pthread_mutex_lock(&vol->lock);
+    int ret = 0;
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0 && fdatasync(vol->fd[m]) < 0) {
+            if (!vol_mirrored(vol)) {
+                ret = -1;
+                break;
+            }
+            drop_member(vol, m);
+        }
+    }
+    if (vol_mirrored(vol) && vol->writable) {
+        if (live_members(vol) == 0) {
+            ret = -1;
+        } else if (!vol->degraded && !bitmap_empty(vol)) {
+            memset(vol->bitmap, 0, WFS_VOL_BITMAP);
+            ret = write_headers(vol, 0);
+        }
+    }
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+void vol_stats(struct wfs_volume* vol, struct wfs_vol_stats* st) {
+    pthread_mutex_lock(&vol->lock);
+    *st = vol->stats;
+    pthread_mutex_unlock(&vol->lock);
+}
+
+// a mirror is synced first, so a clean close leaves no bits set
+void vol_close(struct wfs_volume* vol) {
+    if (vol_mirrored(vol) && vol->writable) {
+        vol_sync(vol);
+    }
+    for (int m = 0; m < vol->members; m++) {
+        if (vol->fd[m] >= 0) {
+            close(vol->fd[m]);
+            vol->fd[m] = -1;
+        }
+    }
+}
@@ -1,4 +1,6 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE // mremap
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
@@ -6,20 +8,242 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <fuse.h>
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
 #include "wfs.h"
 
 #define MMAP_PTR(offset) ((char*)mregion + offset)
+#define MMAP_OFF(ptr) ((char*)(ptr) - (char*)mregion)
 
 void* mregion;
+size_t msize; // bytes mapped at mregion
+struct wfs_volume volume; // the image's files, kept open so they can be extended
 int wfs_error;
 
+static int list_snapshots(void* buf, fuse_fill_dir_t filler);
+static void shrink_dir(struct wfs_inode* dir);
+
+// called on directory entries in turn; a non-zero return stops the walk
+typedef int (*dentry_fn)(const struct wfs_rec* ent, void* arg);
+
+// the way down a directory B+-tree to a leaf
+struct dtree_path {
+    int depth;                                   // nodes from the root down
+    off_t* slot[DTREE_MAX_HEIGHT];               // where each one is linked from
+    char hi[DTREE_MAX_HEIGHT][WFS_NAME_MAX + 1]; // and the bound of each
+};
+
+// where a directory entry was found: its record, and the block or tree
+// leaf that holds it
+struct dir_slot {
+    struct wfs_rec rec;
+    char* area;
+    int alen;
+    int kind;
+    struct dtree_path path; // for a tree
+};
+
+static int name_max();
+static int list_kind();
+static int dirent_type(struct wfs_inode* inode);
+static int area_room(char* area, int alen, int kind, int need);
+static void area_init(char* area, int alen, int kind);
+static void area_put(char* host, int kind, const char* name, int len, long id, int type);
+static void area_del(char* area, int alen, int kind, char* at);
+static int dtree_insert(struct wfs_inode* dir, const char* name, int len, int num, int type);
+static void dtree_prune(struct wfs_inode* dir, struct dtree_path* path);
+static void dtree_collapse(struct wfs_inode* dir);
+static int dtree_convert(struct wfs_inode* dir);
+static int dir_iterate(struct wfs_inode* dir, const char* from, dentry_fn fn, void* arg);
+static int dir_find(struct wfs_inode* dir, const char* name, int alloc, struct dir_slot* at);
+static void advise_group(uint32_t g);
+
+// =========================
+// Mount options (-o name,...)
+// =========================
+
+// how reads update atime
+#define ATIME_RELATIVE (0) // relatime: only when older than mtime or ctime, or a day
+#define ATIME_STRICT   (1) // strictatime: on every read
+#define ATIME_NEVER    (2) // noatime
+
+// io=pread cache defaults
+#define IO_CACHE_MB     (64)
+#define IO_WRITEBACK_MS (1000)
+
+struct wfs_options {
+    int dedup;
+    int atime;
+    int lazytime;
+    int io;                 // WFS_IO_*
+    int direct;
+    unsigned long cache_mb;
+    unsigned writeback_ms;
+    int prefault;           // metadata hints, see advise_group()
+    int hugepages;
+    int mlock;
+};
+
+static struct wfs_options options;
+
+#ifndef WFS_NO_MAIN
+#define WFS_OPT(t, p, v) { t, offsetof(struct wfs_options, p), v }
+
+static const struct fuse_opt wfs_opts[] = {
+    WFS_OPT("dedup", dedup, 1),
+    WFS_OPT("relatime", atime, ATIME_RELATIVE),
+    WFS_OPT("strictatime", atime, ATIME_STRICT),
+    WFS_OPT("noatime", atime, ATIME_NEVER),
+    WFS_OPT("lazytime", lazytime, 1),
+    WFS_OPT("io=mmap", io, WFS_IO_MMAP),
+    WFS_OPT("io=pread", io, WFS_IO_PREAD),
+    WFS_OPT("direct", direct, 1),
+    WFS_OPT("cache=%lu", cache_mb, 0),
+    WFS_OPT("writeback=%u", writeback_ms, 0),
+    WFS_OPT("prefault", prefault, 1),
+    WFS_OPT("hugepages", hugepages, 1),
+    WFS_OPT("mlock", mlock, 1),
+    FUSE_OPT_END
+};
+#endif
+
+// =========================
+// Timestamps
+// =========================
+
+// With -o lazytime timestamp updates stay in memory, up to LAZY_BATCH
+// inodes' worth, and are written out together when the batch fills, when
+// the oldest is LAZY_MAX_AGE seconds old, on fsync and at unmount. A
+// crash loses at most those timestamps, never anything else.
+
+#define LAZY_BATCH   (64)
+#define LAZY_MAX_AGE (60)
+
+struct lazy_times {
+    int num;
+    int which; // WFS_*TIME
+    struct timespec atim, mtim, ctim;
+};
+
+static struct lazy_times lazy[LAZY_BATCH];
+static int num_lazy;
+static time_t lazy_since; // when the oldest pending update was made
+
+static void store_times(struct wfs_inode* inode, int which, const struct timespec* atim,
+                        const struct timespec* mtim, const struct timespec* ctim) {
+    if (which & WFS_ATIME) { inode->atim = atim->tv_sec; inode->atim_ns = atim->tv_nsec; }
+    if (which & WFS_MTIME) { inode->mtim = mtim->tv_sec; inode->mtim_ns = mtim->tv_nsec; }
+    if (which & WFS_CTIME) { inode->ctim = ctim->tv_sec; inode->ctim_ns = ctim->tv_nsec; }
+}
+
+static struct lazy_times* find_lazy(int num) {
+    for (int i = 0; i < num_lazy; i++) {
+        if (lazy[i].num == num) {
+            return &lazy[i];
+        }
+    }
+    return NULL;
+}
+
+// writes out every pending timestamp
+void lazy_flush() {
+    for (int i = 0; i < num_lazy; i++) {
+        struct wfs_inode* inode = retrieve_inode(lazy[i].num);
+        // snapshots keep the times they saw
+        if (inode != NULL && cow_inode(inode) == 0) {
+            store_times(inode, lazy[i].which, &lazy[i].atim, &lazy[i].mtim, &lazy[i].ctim);
+        }
+    }
+    num_lazy = 0;
+    wfs_error = 0;
+}
+
+// the inode is being freed, its pending times with it
+void lazy_forget(int num) {
+    struct lazy_times* lt = find_lazy(num);
+    if (lt != NULL) {
+        *lt = lazy[--num_lazy];
+    }
+}
+
+// sets the `which` timestamps of `inode` to now. the caller has already
+// preserved the inode for snapshots, unless -o lazytime defers the update
+void touch_inode(struct wfs_inode* inode, int which) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!options.lazytime) {
+        store_times(inode, which, &now, &now, &now);
+        return;
+    }
+    if (num_lazy > 0 && now.tv_sec - lazy_since >= LAZY_MAX_AGE) {
+        lazy_flush();
+    }
+    struct lazy_times* lt = find_lazy(inode->num);
+    if (lt == NULL) {
+        if (num_lazy == LAZY_BATCH) {
+            lazy_flush();
+        }
+        if (num_lazy == 0) {
+            lazy_since = now.tv_sec;
+        }
+        lt = &lazy[num_lazy++];
+        lt->num = inode->num;
+        lt->which = 0;
+    }
+    lt->which |= which;
+    if (which & WFS_ATIME) { lt->atim = now; }
+    if (which & WFS_MTIME) { lt->mtim = now; }
+    if (which & WFS_CTIME) { lt->ctim = now; }
+}
+
+// the inode's timestamps, including any not written out yet
+void inode_times(struct wfs_inode* inode, struct timespec* atim, struct timespec* mtim,
+                 struct timespec* ctim) {
+    atim->tv_sec = inode->atim; atim->tv_nsec = inode->atim_ns;
+    mtim->tv_sec = inode->mtim; mtim->tv_nsec = inode->mtim_ns;
+    ctim->tv_sec = inode->ctim; ctim->tv_nsec = inode->ctim_ns;
+    // only the live inode, not a snapshot's copy of it
+    struct lazy_times* lt = num_lazy ? find_lazy(inode->num) : NULL;
+    if (lt != NULL && inode == inode_slot(inode->num)) {
+        if (lt->which & WFS_ATIME) { *atim = lt->atim; }
+        if (lt->which & WFS_MTIME) { *mtim = lt->mtim; }
+        if (lt->which & WFS_CTIME) { *ctim = lt->ctim; }
+    }
+}
+
+static int time_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// `inode` was read. with relatime, atime only moves when it would
+// otherwise look older than the last change, or is a day old: enough for
+// tools that compare atime with mtime, without a write per read
+void touch_atime(struct wfs_inode* inode) {
+    if (options.atime == ATIME_NEVER) {
+        return;
+    }
+    if (options.atime == ATIME_RELATIVE) {
+        struct timespec atim, mtim, ctim;
+        inode_times(inode, &atim, &mtim, &ctim);
+        if (time_before(&mtim, &atim) && time_before(&ctim, &atim) &&
+            time(NULL) - atim.tv_sec < 24 * 60 * 60) {
+            return;
+        }
+    }
+    if (!options.lazytime && cow_inode(inode) < 0) {
+        wfs_error = 0;
+        return; // the read still succeeds
+    }
+    touch_inode(inode, WFS_ATIME);
+}
+
 // =========================
 // Color tag helpers (enum-based palette)
 // =========================
@@ -99,20 +323,16 @@ static void strip_ansi_codes(const char* path, char* clean_path_out, size_t out_
 // presume inode is a directory
 // return inode number corresponding to dentry name
 int dentry_to_num(char* name, struct wfs_inode* inode) {
-    size_t sz = inode->size;
-    struct wfs_dentry* dent;
-    
-    for (off_t off = 0; off < sz; off += sizeof(struct wfs_dentry)) {
-        dent = (struct wfs_dentry*)data_offset(inode, off, 0);
-
-        if (dent->num != 0 && !strcmp(dent->name, name)) { // match
-            return dent->num;
-        }
+    struct dir_slot at;
+    if (dir_find(inode, name, 0, &at) < 0) {
+        return -1;
     }
-    return -1;
+    return at.rec.id;
 }
 
-int get_inode_rec(struct wfs_inode* enclosing, char* path, struct wfs_inode** inode) {
+// `view` is the snapshot being looked at, NULL for the live tree
+int get_inode_rec(struct wfs_snapshot* view, struct wfs_inode* enclosing, char* path,
+                  struct wfs_inode** inode) {
     if (!strcmp(path, "")) {
         *inode = enclosing;
         return 0;
@@ -126,27 +346,86 @@ int get_inode_rec(struct wfs_inode* enclosing, char* path, struct wfs_inode** in
         *path++ = '\0';
     }
 
+    // a block or inode that fails its checksum turns this into EIO
+    wfs_error = -ENOENT;
     int inum = dentry_to_num(next, enclosing);
-    if (inum < 0) {
-        wfs_error = -ENOENT;
+    struct wfs_inode* found = NULL;
+    if (inum >= 0) {
+        found = view ? snapshot_inode(view, inum) : retrieve_inode(inum);
+    }
+    if (found == NULL) {
         return -1;
     }
-    return get_inode_rec(retrieve_inode(inum), path, inode);
+    return get_inode_rec(view, found, path, inode);
 }
 
-int get_inode_from_path(char* path, struct wfs_inode** inode) {
+// whether path is SNAP_DIR or somewhere below it: all of that is read-only
+int in_snapshots(const char* path) {
+    size_t n = strlen(SNAP_DIR);
+    return strncmp(path, SNAP_DIR, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+// the name of the snapshot if path is SNAP_DIR/<name>, otherwise NULL
+static const char* snapshot_name(const char* path) {
+    if (!in_snapshots(path) || path[strlen(SNAP_DIR)] == '\0') {
+        return NULL;
+    }
+    const char* name = path + strlen(SNAP_DIR) + 1;
+    return strchr(name, '/') ? NULL : name;
+}
+
+// like get_inode_from_path(), and also tells which snapshot the inode was
+// found in (NULL for the live tree and for SNAP_DIR itself)
+int resolve_path(const char* path, struct wfs_inode** inode, struct wfs_snapshot** view) {
     // all paths must start at root, thus path+1 is safe
     char clean[1024]; // Use a local, stack-allocated buffer
     strip_ansi_codes(path, clean, sizeof(clean));
-    char* clean_copy = strdup(clean);
-    int result = get_inode_rec(retrieve_inode(0), clean_copy + 1, inode);
-    free(clean_copy);
+    struct wfs_snapshot* snap = NULL;
+    struct wfs_inode* root = retrieve_inode(0);
+    char* rest = clean + 1;
+    if (root == NULL) {
+        return -1;
+    }
+
+    if (in_snapshots(clean)) {
+        rest = clean + strlen(SNAP_DIR);
+        if (*rest == '\0') {
+            *inode = snapshot_dir();
+            if (view) { *view = NULL; }
+            return 0;
+        }
+        char* name = ++rest;
+        rest += strcspn(rest, "/");
+        if (*rest != '\0') {
+            *rest++ = '\0';
+        }
+        if ((snap = find_snapshot(name)) == NULL) {
+            wfs_error = -ENOENT;
+            return -1;
+        }
+        if ((root = snapshot_inode(snap, 0)) == NULL) {
+            return -1;
+        }
+    }
+    if (view) {
+        *view = snap;
+    }
+    char* rest_copy = strdup(rest);
+    int result = get_inode_rec(snap, root, rest_copy, inode);
+    free(rest_copy);
     return result;
 }
 
+int get_inode_from_path(char* path, struct wfs_inode** inode) {
+    return resolve_path(path, inode, NULL);
+}
+
 int wfs_mknod(const char* path, mode_t mode, dev_t dev) {
     (void)dev;
     printf("wfs_mknod: %s\n", path);
+    if (in_snapshots(path)) {
+        return -EROFS;
+    }
 
     struct wfs_inode* parent_inode = NULL;
     char *base = strdup(path);
@@ -155,13 +434,20 @@ int wfs_mknod(const char* path, mode_t mode, dev_t dev) {
     if (get_inode_from_path(dirname(base), &parent_inode) < 0) {
         return wfs_error;
     }
+    if (strlen(basename(name)) > name_max()) {
+        return -ENAMETOOLONG;
+    }
 
-    struct wfs_inode *inode = allocate_inode();
+    struct wfs_inode *inode = allocate_inode(parent_inode, S_IFREG);
     if (inode == NULL) { return wfs_error; }
     fillin_inode(inode, S_IFREG | mode);
+    inode->flags = parent_inode->flags & WFS_INODE_COMPRESS;
 
-    // add dentry to parent
-    if (add_dentry(parent_inode, inode->num, basename(name)) < 0) {
+    // add dentry to parent; without one nothing can reach the inode
+    if (add_dentry(parent_inode, inode, basename(name)) < 0) {
+        free_inode(inode);
+        free(base);
+        free(name);
         return wfs_error;
     }
 
@@ -170,41 +456,67 @@ int wfs_mknod(const char* path, mode_t mode, dev_t dev) {
     return 0;
 }
 
-int add_dentry(struct wfs_inode* parent, int num, char* name) {
+int add_dentry(struct wfs_inode* parent, struct wfs_inode* inode, const char* name) {
+    int len = strlen(name);
+    if (len > name_max()) {
+        wfs_error = -ENAMETOOLONG;
+        return -1;
+    }
+    if (cow_inode(parent) < 0) {
+        return -1;
+    }
+    if (parent->flags & WFS_INODE_DTREE) {
+        if (dtree_insert(parent, name, len, inode->num, dirent_type(inode)) < 0) {
+            return -1;
+        }
+        parent->nlinks += 1;
+        touch_inode(parent, WFS_MTIME | WFS_CTIME);
+        return 0;
+    }
 
-    // insert dentry if there is an empty slot
+    // insert the entry into the first block with room for it
+    int kind = list_kind();
     int numblks = parent->size / BLOCK_SIZE;
-    struct wfs_dentry* dent;
-    off_t offset = 0;
-    
-    while (offset < parent->size) {
-        dent = (struct wfs_dentry*)data_offset(parent, offset, 0);
-
-        if (dent->num == 0) {
-            dent->num = num;
-            strncpy(dent->name, name, MAX_NAME);
-            parent->nlinks += 1;
-            // update directory mtime/ctime because its entries changed
-            struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-            parent->mtim = now.tv_sec; parent->ctim = now.tv_sec;
-            return 0;
+    char* area;
+    for (int b = 0; b < numblks; b++) {
+        if ((area = data_offset(parent, (off_t)b * BLOCK_SIZE, 0)) == NULL) {
+            return -1;
         }
-        offset += sizeof(struct wfs_dentry);
+        int room = area_room(area, BLOCK_SIZE, kind, rec_need(kind, len));
+        if (room == -2) {
+            return -1;
+        } else if (room < 0) {
+            continue;
+        }
+        // the block may be shared with a snapshot
+        if ((area = data_offset(parent, (off_t)b * BLOCK_SIZE, 1)) == NULL) {
+            return -1;
+        }
+        area_put(area + room, kind, name, len, inode->num, dirent_type(inode));
+        parent->nlinks += 1;
+        // update directory mtime/ctime because its entries changed
+        touch_inode(parent, WFS_MTIME | WFS_CTIME);
+        return 0;
     }
 
-    // careful this will not work with indirect blocks for now
-    // We will not do indirect blocks with directories
-    dent = (struct wfs_dentry*)data_offset(parent, numblks*BLOCK_SIZE, 1);
-    if (!dent) {
+    // the direct blocks are full: past them the directory becomes a
+    // B+-tree. one that already spilled into its indirect block (made by
+    // an older version) just keeps growing as a list
+    if (numblks > D_BLOCK && parent->blocks[IND_BLOCK] == 0) {
+        if (dtree_convert(parent) < 0) {
+            return -1;
+        }
+        return add_dentry(parent, inode, name);
+    }
+    if ((area = data_offset(parent, (off_t)numblks * BLOCK_SIZE, 1)) == NULL) {
         return -1;
     }
-    dent->num = num;
-    strncpy(dent->name, name, MAX_NAME);
+    area_init(area, BLOCK_SIZE, kind);
+    area_put(area, kind, name, len, inode->num, dirent_type(inode));
     parent->nlinks += 1;
     parent->size += BLOCK_SIZE;
     // directory grew: update mtime/ctime
-    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-    parent->mtim = now.tv_sec; parent->ctim = now.tv_sec;
+    touch_inode(parent, WFS_MTIME | WFS_CTIME);
 
     return 0;
 }
@@ -218,14 +530,20 @@ void fillin_inode(struct wfs_inode* inode, mode_t mode) {
     inode->gid = getgid();
     inode->size = 0;
     inode->nlinks = 1;
-    inode->atim = t.tv_sec;
-    inode->mtim = t.tv_sec;
-    inode->ctim = t.tv_sec;
+    store_times(inode, WFS_ATIME | WFS_MTIME | WFS_CTIME, &t, &t, &t);
     inode->color = WFS_COLOR_NONE; // default: no color
+    // no snapshot taken so far can see a new inode
+    inode->epoch = ((struct wfs_sb*)mregion)->snap_epoch;
 }
 
 int wfs_mkdir(const char* path, mode_t mode) {
     printf("wfs_mkdir: %s\n", path);
+    if (snapshot_name(path)) {
+        return snapshot_create(snapshot_name(path));
+    }
+    if (in_snapshots(path)) {
+        return strcmp(path, SNAP_DIR) == 0 ? -EEXIST : -EROFS;
+    }
 
     struct wfs_inode* parent_inode = NULL;
     
@@ -235,12 +553,19 @@ int wfs_mkdir(const char* path, mode_t mode) {
     if (get_inode_from_path(dirname(base), &parent_inode) < 0) {
         return wfs_error;
     }
-    struct wfs_inode* inode = allocate_inode();
+    if (strlen(basename(name)) > name_max()) {
+        return -ENAMETOOLONG;
+    }
+    struct wfs_inode* inode = allocate_inode(parent_inode, S_IFDIR);
     if (inode == NULL) { return wfs_error; }
     fillin_inode(inode, S_IFDIR | mode);
+    inode->flags = parent_inode->flags & WFS_INODE_COMPRESS;
 
-    // add dentry to parent
-    if (add_dentry(parent_inode, inode->num, basename(name)) < 0) {
+    // add dentry to parent; without one nothing can reach the inode
+    if (add_dentry(parent_inode, inode, basename(name)) < 0) {
+        free_inode(inode);
+        free(name);
+        free(base);
         return wfs_error;
     }
 
@@ -262,362 +587,4203 @@ int wfs_getattr(const char* path, struct stat *statbuf) {
     statbuf->st_uid  = inode->uid;
     statbuf->st_gid  = inode->gid;
     statbuf->st_size = inode->size;
-    statbuf->st_atime = inode->atim;
-    statbuf->st_mtime = inode->mtim;
-    statbuf->st_ctime = inode->ctim;
+    inode_times(inode, &statbuf->st_atim, &statbuf->st_mtim, &statbuf->st_ctim);
     statbuf->st_nlink = inode->nlinks;
+    // what is on disk, which compression can make less than st_size
+    statbuf->st_blocks = inode_blocks(inode) * (BLOCK_SIZE / 512);
+    if (in_snapshots(path)) {
+        statbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    }
 
     free(searchpath);
     return 0;
 }
 
 // =========================
-// xattr: expose color tag as "user.color"
+// xattr: expose color tag as "user.color" and the compression flag as
+// "user.compress" ("lz" or "none"). Other user., trusted. and security.
+// attributes are stored with the inode (see wfs.h)
 // =========================
+#define COMPRESS_XATTR "user.compress"
+
+static int is_wfs_xattr(const char *name) {
+    return strcmp(name, "user.color") == 0 || strcmp(name, COMPRESS_XATTR) == 0;
+}
+
+static const char* xattr_prefixes[] = {
+    [WFS_XATTR_USER] = "user.", [WFS_XATTR_TRUSTED] = "trusted.", [WFS_XATTR_SECURITY] = "security.",
+};
+
+// the namespace of a full attribute name, with `*suffix` pointed past its
+// prefix. 0 for namespaces that are not stored
+static int xattr_ns(const char* name, const char** suffix) {
+    for (int ns = WFS_XATTR_USER; ns <= WFS_XATTR_SECURITY; ns++) {
+        size_t len = strlen(xattr_prefixes[ns]);
+        if (strncmp(name, xattr_prefixes[ns], len) == 0) {
+            *suffix = name + len;
+            return ns;
+        }
+    }
+    return 0;
+}
+
+// trusted. attributes are for root only, everyone else does not see them
+static int xattr_visible(int ns) {
+    return ns != WFS_XATTR_TRUSTED || fuse_get_context()->uid == 0;
+}
+
+// an attribute as read from either area, or about to be written to one
+struct xattr {
+    uint8_t ns;
+    uint8_t name_len;
+    uint16_t value_len;
+    const char* name;
+    const char* value;
+};
+
+#define MAX_XATTRS ((WFS_XATTR_IBODY + BLOCK_SIZE) / XATTR_ENTRY_SIZE(1, 0))
+
+// appends the entries of an area to `list`, which holds `n`. returns the
+// new count, -1 if the area is damaged
+static int xattr_parse(const char* area, size_t len, struct xattr* list, int n) {
+    uint32_t magic = *(uint32_t*)area;
+    if (magic != WFS_XATTR_MAGIC) {
+        return magic == 0 ? n : -1;
+    }
+    size_t off = sizeof(uint32_t);
+    while (off + sizeof(struct wfs_xattr_entry) <= len) {
+        struct wfs_xattr_entry* e = (struct wfs_xattr_entry*)(area + off);
+        if (e->name_len == 0) {
+            break;
+        }
+        size_t size = XATTR_ENTRY_SIZE(e->name_len, e->value_len);
+        if (off + size > len || e->ns < WFS_XATTR_USER || e->ns > WFS_XATTR_SECURITY ||
+            n == MAX_XATTRS) {
+            return -1;
+        }
+        list[n++] = (struct xattr){e->ns, e->name_len, e->value_len, e->name,
+                                   e->name + e->name_len};
+        off += size;
+    }
+    return n;
+}
+
+// writes `list` into an area, zeroing the rest of it
+static void xattr_pack(char* area, size_t len, struct xattr* list, int n) {
+    memset(area, 0, len);
+    if (n == 0) {
+        return;
+    }
+    *(uint32_t*)area = WFS_XATTR_MAGIC;
+    size_t off = sizeof(uint32_t);
+    for (int i = 0; i < n; i++) {
+        struct wfs_xattr_entry* e = (struct wfs_xattr_entry*)(area + off);
+        e->ns = list[i].ns;
+        e->name_len = list[i].name_len;
+        e->value_len = list[i].value_len;
+        memcpy(e->name, list[i].name, list[i].name_len);
+        memcpy(e->name + list[i].name_len, list[i].value, list[i].value_len);
+        off += XATTR_ENTRY_SIZE(list[i].name_len, list[i].value_len);
+    }
+}
+
+static int xattr_find(struct xattr* list, int n, int ns, const char* name, size_t name_len) {
+    for (int i = 0; i < n; i++) {
+        if (list[i].ns == ns && list[i].name_len == name_len &&
+            memcmp(list[i].name, name, name_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the attributes in an inode's slot. the snapshot directory is not on
+// disk and has none
+static int xattr_load_ibody(struct wfs_inode* inode, struct xattr* list) {
+    if (inode->num < 0) {
+        return 0;
+    }
+    int n = xattr_parse((char*)inode + WFS_XATTR_IBODY_OFF, WFS_XATTR_IBODY, list, 0);
+    if (n < 0) {
+        printf("xattr: inode %d has damaged attributes\n", inode->num);
+        wfs_error = -EIO;
+    }
+    return n;
+}
+
+// appends the attributes in an inode's block to the `n` in `list`
+static int xattr_load_block(struct wfs_inode* inode, struct xattr* list, int n) {
+    if (inode->num < 0 || inode->xattr == 0) {
+        return n;
+    }
+    if (csum_verify(inode->xattr) < 0) {
+        return -1;
+    }
+    n = xattr_parse(MMAP_PTR(inode->xattr), BLOCK_SIZE, list, n);
+    if (n < 0) {
+        printf("xattr: inode %d has a damaged attribute block\n", inode->num);
+        wfs_error = -EIO;
+    }
+    return n;
+}
+
+// In-core index of xattr blocks by the CRC32C of their contents, so that
+// inodes given the same attributes share a block, as in ext4's mbcache.
+// It starts out empty at mount; blocks are added as they are written or
+// read for a change, and leave before they are rewritten or freed.
+
+#define XATTR_BUCKETS (64)
+
+struct xattr_cached {
+    off_t blk;
+    uint32_t hash;
+    struct xattr_cached* next;
+};
+
+static struct xattr_cached* xattr_cache[XATTR_BUCKETS];
+
+static void xattr_remember(off_t blk, uint32_t hash) {
+    struct xattr_cached** head = &xattr_cache[hash % XATTR_BUCKETS];
+    for (struct xattr_cached* c = *head; c; c = c->next) {
+        if (c->blk == blk) {
+            return;
+        }
+    }
+    struct xattr_cached* c = malloc(sizeof(*c));
+    *c = (struct xattr_cached){blk, hash, *head};
+    *head = c;
+}
+
+static void xattr_forget(off_t blk) {
+    uint32_t hash = crc32c(MMAP_PTR(blk), BLOCK_SIZE);
+    for (struct xattr_cached** link = &xattr_cache[hash % XATTR_BUCKETS]; *link; link = &(*link)->next) {
+        if ((*link)->blk == blk) {
+            struct xattr_cached* c = *link;
+            *link = c->next;
+            free(c);
+            return;
+        }
+    }
+}
+
+// a block holding exactly `data` that can take one more reference, 0 if
+// there is none
+static off_t xattr_lookup(const char* data, uint32_t hash) {
+    for (struct xattr_cached* c = xattr_cache[hash % XATTR_BUCKETS]; c; c = c->next) {
+        uint16_t* refs = block_refs(c->blk);
+        if (c->hash == hash && refs && *refs < UINT16_MAX &&
+            memcmp(MMAP_PTR(c->blk), data, BLOCK_SIZE) == 0 && csum_verify(c->blk) == 0) {
+            return c->blk;
+        }
+    }
+    wfs_error = 0; // a block failing its checksum is just not a match
+    return 0;
+}
+
+// drops one reference to an xattr block
+static void xattr_put(off_t blk) {
+    if (!block_shared(blk)) {
+        xattr_forget(blk);
+    }
+    put_block(blk);
+}
+
+// a block holding `data` for `inode`: one that already does if there is
+// one to share, otherwise its own, written in place unless it is shared
+static off_t xattr_block(struct wfs_inode* inode, const char* data) {
+    off_t old = inode->xattr;
+    if (old != 0 && memcmp(MMAP_PTR(old), data, BLOCK_SIZE) == 0) {
+        return old;
+    }
+    uint32_t hash = crc32c(data, BLOCK_SIZE);
+    off_t blk = xattr_lookup(data, hash);
+    if (blk != 0) {
+        (*block_refs(blk))++;
+        return blk;
+    }
+    if (old != 0 && !block_shared(old)) {
+        xattr_forget(old);
+        blk = old;
+    } else if ((blk = allocate_data_block(inode_group(inode))) == 0) {
+        wfs_error = -ENOSPC;
+        return 0;
+    }
+    memcpy(MMAP_PTR(blk), data, BLOCK_SIZE);
+    csum_dirty(blk);
+    xattr_remember(blk, hash);
+    return blk;
+}
+
+// sets (or with a NULL value removes) a stored attribute. the attributes
+// are repacked, as many as fit into the inode and the rest into its block
+static int xattr_set(struct wfs_inode* inode, int ns, const char* name, const char* value,
+                     size_t size, int flags) {
+    size_t name_len = strlen(name);
+    if (name_len == 0) {
+        return -EINVAL;
+    }
+    if (name_len > UINT8_MAX) {
+        return -ERANGE;
+    }
+    if (value != NULL && XATTR_ENTRY_SIZE(name_len, size) + sizeof(uint32_t) > BLOCK_SIZE) {
+        return -ENOSPC;
+    }
+
+    // the list points into the areas, which are rewritten from copies
+    char ibody[WFS_XATTR_IBODY], block[BLOCK_SIZE];
+    struct xattr list[MAX_XATTRS + 1];
+    int n = xattr_load_ibody(inode, list);
+    if (n < 0 || (n = xattr_load_block(inode, list, n)) < 0) {
+        return wfs_error;
+    }
+    if (inode->xattr != 0) {
+        xattr_remember(inode->xattr, crc32c(MMAP_PTR(inode->xattr), BLOCK_SIZE));
+    }
+    int i = xattr_find(list, n, ns, name, name_len);
+    if (i >= 0 && (flags & XATTR_CREATE)) {
+        return -EEXIST;
+    }
+    if (i < 0 && (value == NULL || (flags & XATTR_REPLACE))) {
+        return -ENODATA;
+    }
+    if (value == NULL) {
+        memmove(&list[i], &list[i + 1], (n - i - 1) * sizeof(struct xattr));
+        n--;
+    } else {
+        if (i < 0) {
+            i = n++;
+        }
+        list[i] = (struct xattr){ns, name_len, size, name, value};
+    }
+
+    struct xattr in[MAX_XATTRS + 1], out[MAX_XATTRS + 1];
+    int n_in = 0, n_out = 0;
+    size_t in_used = sizeof(uint32_t), out_used = sizeof(uint32_t);
+    for (i = 0; i < n; i++) {
+        size_t len = XATTR_ENTRY_SIZE(list[i].name_len, list[i].value_len);
+        if (in_used + len <= WFS_XATTR_IBODY) {
+            in[n_in++] = list[i];
+            in_used += len;
+        } else if (out_used + len <= BLOCK_SIZE) {
+            out[n_out++] = list[i];
+            out_used += len;
+        } else {
+            return -ENOSPC;
+        }
+    }
+    xattr_pack(ibody, WFS_XATTR_IBODY, in, n_in);
+    xattr_pack(block, BLOCK_SIZE, out, n_out);
+
+    if (cow_inode(inode) < 0) {
+        return wfs_error;
+    }
+    off_t old = inode->xattr, blk = 0;
+    if (n_out > 0 && (blk = xattr_block(inode, block)) == 0) {
+        return wfs_error;
+    }
+    memcpy((char*)inode + WFS_XATTR_IBODY_OFF, ibody, WFS_XATTR_IBODY);
+    inode->xattr = blk;
+    // pointed away first, like copy_block()
+    if (old != 0 && old != blk) {
+        xattr_put(old);
+    }
+    return 0;
+}
+
 static int wfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
-    (void)flags;
     if (!path || !name) return -EINVAL;
-    if (strcmp(name, "user.color") != 0) return -EOPNOTSUPP;
+    const char* suffix;
+    int ns = is_wfs_xattr(name) ? 0 : xattr_ns(name, &suffix);
+    if (!is_wfs_xattr(name) && ns == 0) return -EOPNOTSUPP;
+    if (ns == WFS_XATTR_TRUSTED && !xattr_visible(ns)) return -EPERM;
+    if (in_snapshots(path)) return -EROFS;
     struct wfs_inode *inode; char *p = strdup(path);
     if (get_inode_from_path(p, &inode) < 0) { free(p); return wfs_error; }
+    if (ns != 0) {
+        int ret = xattr_set(inode, ns, suffix, value ? value : "", size, flags);
+        if (ret == 0) {
+            touch_inode(inode, WFS_CTIME);
+        }
+        free(p);
+        return ret;
+    }
     // value may not be NUL-terminated; ensure it is
     char valbuf[64];
     size_t n = size < sizeof(valbuf)-1 ? size : sizeof(valbuf)-1;
     if (value && n > 0) memcpy(valbuf, value, n);
     valbuf[n] = '\0';
 
+    if (strcmp(name, COMPRESS_XATTR) == 0) {
+        int on = strcmp(valbuf, "lz") == 0;
+        if (!on && strcmp(valbuf, "none") != 0) { free(p); return -EINVAL; }
+        // directories only pass the flag on to what is created in them
+        if (S_ISDIR(inode->mode)) {
+            if (cow_inode(inode) < 0) { free(p); return wfs_error; }
+            inode->flags = on ? inode->flags | WFS_INODE_COMPRESS : inode->flags & ~WFS_INODE_COMPRESS;
+        } else if (set_compression(inode, on) < 0) {
+            free(p);
+            return wfs_error;
+        }
+        touch_inode(inode, WFS_CTIME);
+        free(p);
+        return 0;
+    }
+
     uint8_t code;
     if (!parse_color_name(valbuf, &code)) { free(p); return -EINVAL; }
+    if (cow_inode(inode) < 0) { free(p); return wfs_error; }
     inode->color = code;
-    inode->ctim = time(NULL);
+    touch_inode(inode, WFS_CTIME);
     free(p);
     return 0;
 }
 
+// copies out a value the way getxattr() and listxattr() do: with no
+// buffer only its size is returned
+static int xattr_copy_out(char *value, size_t size, const char* out, size_t need) {
+    if (size == 0 || value == NULL) return (int)need;
+    if (size < need) return -ERANGE;
+    memcpy(value, out, need);
+    return (int)need;
+}
+
 static int wfs_getxattr(const char *path, const char *name, char *value, size_t size) {
     if (!path || !name) return -EINVAL;
-    if (strcmp(name, "user.color") != 0) return -EOPNOTSUPP;
+    const char* suffix;
+    int ns = is_wfs_xattr(name) ? 0 : xattr_ns(name, &suffix);
+    if (!is_wfs_xattr(name) && ns == 0) return -EOPNOTSUPP;
     struct wfs_inode *inode; char *p = strdup(path);
     if (get_inode_from_path(p, &inode) < 0) { free(p); return wfs_error; }
+    free(p);
+
+    if (ns != 0) {
+        // the inode's own area first, which needs no other block read
+        struct xattr list[MAX_XATTRS];
+        int n = xattr_load_ibody(inode, list);
+        if (n < 0) return wfs_error;
+        int i = xattr_find(list, n, ns, suffix, strlen(suffix));
+        if (i < 0) {
+            int had = n;
+            if ((n = xattr_load_block(inode, list, n)) < 0) return wfs_error;
+            i = xattr_find(list + had, n - had, ns, suffix, strlen(suffix));
+            i = i < 0 ? i : i + had;
+        }
+        if (i < 0 || !xattr_visible(ns)) return -ENODATA;
+        return xattr_copy_out(value, size, list[i].value, list[i].value_len);
+    }
 
-    const wfs_color_info *ci = wfs_color_from_code(inode->color);
-    const char *name_out = ci->name;
-    size_t need = strlen(name_out) + 1;
-    if (size == 0 || value == NULL) { free(p); return (int)need; }
-    if (size < need) { free(p); return -ERANGE; }
-    memcpy(value, name_out, need);
+    const char *name_out;
+    if (strcmp(name, COMPRESS_XATTR) == 0) {
+        name_out = inode->flags & WFS_INODE_COMPRESS ? "lz" : "none";
+    } else {
+        name_out = wfs_color_from_code(inode->color)->name;
+    }
+    return xattr_copy_out(value, size, name_out, strlen(name_out) + 1);
+}
 
+// the stored attributes, then "user.color" and "user.compress" when they
+// are set to something
+static int wfs_listxattr(const char *path, char *value, size_t size) {
+    printf("wfs_listxattr: %s\n", path);
+    struct wfs_inode *inode; char *p = strdup(path);
+    if (get_inode_from_path(p, &inode) < 0) { free(p); return wfs_error; }
     free(p);
-    return (int)need;
+
+    struct xattr list[MAX_XATTRS];
+    int n = xattr_load_ibody(inode, list);
+    if (n < 0 || (n = xattr_load_block(inode, list, n)) < 0) return wfs_error;
+    char names[(MAX_XATTRS + 2) * (sizeof("security.") + UINT8_MAX)];
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        if (xattr_visible(list[i].ns)) {
+            len += sprintf(names + len, "%s%.*s", xattr_prefixes[list[i].ns], list[i].name_len,
+                           list[i].name) + 1;
+        }
+    }
+    if (inode->color != 0) {
+        len += sprintf(names + len, "user.color") + 1;
+    }
+    if (inode->flags & WFS_INODE_COMPRESS) {
+        len += sprintf(names + len, COMPRESS_XATTR) + 1;
+    }
+    return xattr_copy_out(value, size, names, len);
 }
 
 static int wfs_removexattr(const char *path, const char *name) {
     printf("wfs_removexattr: %s %s\n", path, name);
     if (!path || !name) return -EINVAL;
-    if (strcmp(name, "user.color") != 0) return -EOPNOTSUPP;
+    const char* suffix;
+    int ns = is_wfs_xattr(name) ? 0 : xattr_ns(name, &suffix);
+    if (!is_wfs_xattr(name) && ns == 0) return -EOPNOTSUPP;
+    if (ns == WFS_XATTR_TRUSTED && !xattr_visible(ns)) return -EPERM;
+    if (in_snapshots(path)) return -EROFS;
     struct wfs_inode *inode; char *p = strdup(path);
     if (get_inode_from_path(p, &inode) < 0) { free(p); return wfs_error; }
+    if (ns != 0) {
+        int ret = xattr_set(inode, ns, suffix, NULL, 0, 0);
+        if (ret == 0) {
+            touch_inode(inode, WFS_CTIME);
+        }
+        free(p);
+        return ret;
+    }
+    if (strcmp(name, COMPRESS_XATTR) == 0) {
+        if (S_ISDIR(inode->mode)) {
+            if (cow_inode(inode) < 0) { free(p); return wfs_error; }
+            inode->flags &= ~WFS_INODE_COMPRESS;
+        } else if (set_compression(inode, 0) < 0) {
+            free(p);
+            return wfs_error;
+        }
+        touch_inode(inode, WFS_CTIME);
+        free(p);
+        return 0;
+    }
+    if (cow_inode(inode) < 0) { free(p); return wfs_error; }
     inode->color = 0; // none
-    inode->ctim = time(NULL);
+    touch_inode(inode, WFS_CTIME);
     free(p);
     return 0;
 }
 
 // removes a dentry from the directory inode
-// if this results in an empty data block, we will not deallocate it.
-// removed dentries can result in "holes" in the dentry list, thus it
-// is important to use the first available slot in add_dentry()
-int remove_dentry(struct wfs_inode* inode, int inum) {
-    size_t sz = inode->size;
-    struct wfs_dentry* dent;
-
-    for (off_t off = 0; off < sz; off += sizeof(struct wfs_dentry)) {
-        dent = (struct wfs_dentry*)data_offset(inode, off, 0);
-        
-        if (dent->num == inum) { // match
-            dent->num = 0;
-            // directory entries changed: update mtime/ctime
-            struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-            inode->mtim = now.tv_sec; inode->ctim = now.tv_sec;
-            return 0;
-        }
+// removed dentries leave free space in their block, thus it is important
+// to use the first block with room in add_dentry(), and shrink_dir()
+// gives back the blocks that end up unused.
+// removes the entry `name`, which must be for inode `inum`: hard links
+// put several entries for one inode in a directory
+int remove_dentry(struct wfs_inode* inode, int inum, const char* name) {
+    struct dir_slot at;
+    if (cow_inode(inode) < 0) {
+        return -1;
     }
-    return -1; // not found
+    // the block may be shared with a snapshot
+    if (dir_find(inode, name, 1, &at) < 0) {
+        return -1;
+    }
+    if (at.rec.id != inum) {
+        wfs_error = -ENOENT;
+        return -1; // not found
+    }
+    area_del(at.area, at.alen, at.kind, at.rec.at);
+    // directory entries changed: update mtime/ctime
+    touch_inode(inode, WFS_MTIME | WFS_CTIME);
+    if (inode->flags & WFS_INODE_DTREE) {
+        dtree_prune(inode, &at.path);
+        dtree_collapse(inode);
+    } else {
+        shrink_dir(inode);
+    }
+    return 0;
 }
 
-// returns a pointer to offset for this inode
-// be careful, won't work well if reading across block boundaries
-// dirents are guaranteed to not cross block boundaries
-char* data_offset(struct wfs_inode* inode, off_t offset, int alloc) {
-    int blocknum = offset / BLOCK_SIZE;
-    off_t* blks_arr;
+#define MAX_FILE_BLOCKS (IND_BLOCK + BLOCK_SIZE / sizeof(off_t))
+#define MAX_FILE_SIZE   ((off_t)MAX_FILE_BLOCKS * BLOCK_SIZE)
 
+// returns the inode's pointer to logical block `blocknum`, NULL if it is
+// out of range or behind a missing indirect block. with `alloc` the
+// indirect block is allocated, or copied if it is shared, so the pointer
+// can be written
+static off_t* block_slot(struct wfs_inode* inode, int blocknum, int alloc) {
     // out of range
     if (blocknum > D_BLOCK + (BLOCK_SIZE / sizeof(off_t))) {
-        printf("data_offset() bad blocknum, too big!\n");
+        printf("block_slot() bad blocknum, too big!\n");
+        wfs_error = -EFBIG;
         return NULL;
-    } else if (blocknum > D_BLOCK) { // indirect block
-        blocknum -= IND_BLOCK;
-        if (inode->blocks[IND_BLOCK] == 0) {
-            inode->blocks[IND_BLOCK] = allocate_data_block();
-        }
-        blks_arr = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
-    } else { // direct block
-        blks_arr = inode->blocks;
+    } else if (blocknum <= D_BLOCK) { // direct block
+        return &inode->blocks[blocknum];
     }
 
-    if (alloc && *(blks_arr + blocknum) == 0) {
-        *(blks_arr + blocknum) = allocate_data_block();
+    // indirect block
+    if (alloc && block_shared(inode->blocks[IND_BLOCK])) {
+        // the private copy holds its own reference to every block in it
+        off_t old = inode->blocks[IND_BLOCK];
+        off_t copy = copy_block(inode, old);
+        if (copy == 0) {
+            return NULL;
+        }
+        off_t* ind = (off_t*)MMAP_PTR(copy);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            if (ind[i] != 0) { (*block_refs(ind[i]))++; }
+        }
+        inode->blocks[IND_BLOCK] = copy;
+        (*block_refs(old))--;
     }
-    if (*(blks_arr + blocknum) == 0) {
-        if (alloc) { wfs_error = -ENOSPC; }
+    if (alloc && inode->blocks[IND_BLOCK] == 0) {
+        inode->blocks[IND_BLOCK] = allocate_data_block(inode_group(inode));
+    }
+    if (inode->blocks[IND_BLOCK] == 0) {
+        wfs_error = alloc ? -ENOSPC : 0;
         return NULL;
     }
-    
-    return MMAP_PTR(blks_arr[blocknum]) + (offset % BLOCK_SIZE);
+    if (csum_verify(inode->blocks[IND_BLOCK]) < 0) {
+        return NULL;
+    }
+    if (alloc) {
+        csum_dirty(inode->blocks[IND_BLOCK]);
+    }
+    return (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]) + (blocknum - IND_BLOCK);
 }
 
-int wfs_read(const char* path, char *buf, size_t length, off_t offset, struct fuse_file_info *fi) {
-    (void)fi;
-    printf("wfs_read: %s\n", path);
-    struct wfs_inode* inode;
-    char* searchpath = strdup(path);
+// returns a pointer to offset for this inode
+// be careful, won't work well if reading across block boundaries
+// dirents are guaranteed to not cross block boundaries
+// with `alloc` the caller is going to write: missing blocks are allocated
+// and blocks shared with a snapshot or a clone are copied first. without
+// it, NULL with wfs_error 0 means a hole; a block failing its checksum
+// gives NULL and EIO
+char* data_offset(struct wfs_inode* inode, off_t offset, int alloc) {
+    off_t* slot = block_slot(inode, offset / BLOCK_SIZE, alloc);
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    if (alloc && *slot == 0) {
+        *slot = allocate_data_block(inode_group(inode));
+    } else if (alloc && block_shared(*slot)) {
+        off_t old = *slot;
+        off_t copy = copy_block(inode, old);
+        if (copy == 0) {
+            return NULL;
+        }
+        *slot = copy;
+        (*block_refs(old))--;
+    }
+    if (*slot == 0) {
+        wfs_error = alloc ? -ENOSPC : 0;
+        return NULL;
+    }
+    if (csum_verify(*slot) < 0) {
+        return NULL;
+    }
+    if (alloc) {
+        csum_dirty(*slot);
+        dedup_forget(*slot);
+    }
+    return MMAP_PTR(*slot) + (offset % BLOCK_SIZE);
+}
+
+// =========================
+// Block ranges
+// =========================
+
+// Reads and writes map their whole range before copying anything. The
+// holes a write fills are allocated together, as one run where a group
+// has room for it, and blocks that sit next to each other on disk are
+// copied with one memcpy.
+
+// the blocks a write is handing out, from the last run allocated
+struct block_run {
+    off_t next;
+    int left;
+};
+
+// the next block of `run`, for which another run is allocated when it is
+// used up: as many of the `missing` blocks still to come as one can hold.
+// 0 if the disk is full
+static off_t run_take(struct wfs_inode* inode, struct block_run* run, int missing) {
+    for (int want = missing; run->left == 0 && want > 0; want /= 2) {
+        run->next = allocate_data_run(inode_group(inode), want);
+        run->left = run->next ? want : 0;
+    }
+    if (run->left == 0) {
+        wfs_error = -ENOSPC;
+        return 0;
+    }
+    run->left--;
+    run->next += BLOCK_SIZE;
+    return run->next - BLOCK_SIZE;
+}
+
+// gives back what is left of `run` when a write stops early, and returns
+// `mapped` for map_range() to pass on
+static int run_drop(struct block_run* run, int mapped) {
+    for (; run->left > 0; run->left--, run->next += BLOCK_SIZE) {
+        free_block(run->next);
+    }
+    return mapped;
+}
+
+// the slot of logical block b, like block_slot(). *ind caches the
+// indirect block's slots, so it is only checked and copied once
+static off_t* range_slot(struct wfs_inode* inode, int b, int alloc, off_t** ind) {
+    if (b < IND_BLOCK || b >= MAX_FILE_BLOCKS || *ind == NULL) {
+        off_t* slot = block_slot(inode, b, alloc);
+        if (slot && b >= IND_BLOCK) {
+            *ind = slot - (b - IND_BLOCK);
+        }
+        return slot;
+    }
+    return *ind + (b - IND_BLOCK);
+}
+
+// maps the blocks under `length` bytes of inode at `offset` into blks, 0
+// for a hole. with `alloc` the holes are filled and shared blocks copied,
+// like data_offset() does one at a time, and a missing indirect block
+// comes from the same runs, in front of the blocks it points to. blocks
+// are checked against their checksums, except ones a write replaces
+// whole. returns how many blocks were mapped; fewer than asked for with
+// wfs_error set when a block is bad, past the end of a file, or the disk
+// is full
+static int map_range(struct wfs_inode* inode, off_t offset, size_t length, int alloc, off_t* blks) {
+    int first = offset / BLOCK_SIZE;
+    int count = (offset + length - 1) / BLOCK_SIZE - first + 1;
+    int n = 0, missing = 0;
+    off_t* ind = NULL;
+    for (; n < count; n++) {
+        off_t* slot = range_slot(inode, first + n, 0, &ind);
+        if (slot == NULL && wfs_error != 0) {
+            return n;
+        }
+        blks[n] = slot ? *slot : 0;
+        int kept = !alloc || (n == 0 && offset % BLOCK_SIZE) ||
+                   (n == count - 1 && (offset + length) % BLOCK_SIZE);
+        if (blks[n] != 0 && kept && csum_verify(blks[n]) < 0) {
+            return n;
+        }
+        missing += blks[n] == 0;
+    }
+    if (!alloc) {
+        return n;
+    }
+    missing += first + n > IND_BLOCK && inode->blocks[IND_BLOCK] == 0;
+
+    struct block_run run = {0, 0};
+    ind = NULL; // a shared indirect block is copied now
+    for (int i = 0; i < n; i++) {
+        if (first + i >= IND_BLOCK && inode->blocks[IND_BLOCK] == 0) {
+            if ((inode->blocks[IND_BLOCK] = run_take(inode, &run, missing--)) == 0) {
+                return run_drop(&run, i);
+            }
+        }
+        off_t* slot = range_slot(inode, first + i, 1, &ind);
+        if (slot == NULL) {
+            return run_drop(&run, i);
+        }
+        if (*slot == 0) {
+            if ((*slot = run_take(inode, &run, missing--)) == 0) {
+                return run_drop(&run, i);
+            }
+            blks[i] = *slot;
+            continue;
+        }
+        if (block_shared(*slot)) {
+            off_t old = *slot;
+            off_t copy = copy_block(inode, old);
+            if (copy == 0) {
+                return run_drop(&run, i);
+            }
+            *slot = copy;
+            (*block_refs(old))--;
+        }
+        blks[i] = *slot;
+        csum_dirty(blks[i]);
+        dedup_forget(blks[i]);
+    }
+    return n;
+}
+
+// copies `length` bytes between buf and the blocks, from `skip` bytes into
+// the first one on, a physically contiguous run at a time. holes read as
+// zeros
+static void copy_runs(const off_t* blks, size_t skip, char* buf, size_t length, int write) {
+    int n = (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t done = 0;
+    for (int i = 0, k; i < n; i = k) {
+        for (k = i + 1; k < n; k++) {
+            off_t want = blks[i] == 0 ? 0 : blks[i] + (off_t)(k - i) * BLOCK_SIZE;
+            if (blks[k] != want) {
+                break;
+            }
+        }
+        size_t at = i == 0 ? skip : 0;
+        size_t len = (size_t)(k - i) * BLOCK_SIZE - at;
+        if (len > length - done) { len = length - done; }
+
+        if (blks[i] == 0) {
+            memset(buf + done, 0, len);
+        } else if (write) {
+            memcpy(MMAP_PTR(blks[i]) + at, buf + done, len);
+        } else {
+            memcpy(buf + done, MMAP_PTR(blks[i]) + at, len);
+        }
+        done += len;
+    }
+}
+
+// =========================
+// Directory records
+// =========================
+
+// see wfs.h for the formats. the longest name an entry can have
+static int name_max() {
+    return sb_long_names((struct wfs_sb*)mregion) ? WFS_NAME_MAX : MAX_NAME - 1;
+}
+
+// the records in the blocks of a list directory
+static int list_kind() {
+    return sb_long_names((struct wfs_sb*)mregion) ? REC_DIRENT : REC_FIXED;
+}
+
+// the DT_* type readdir reports for an inode, as kept in its entries
+static int dirent_type(struct wfs_inode* inode) {
+    return (inode->mode & S_IFMT) >> 12;
+}
+
+static void rec_set_size(char* at, int kind, int size) {
+    if (kind == REC_DIRENT) {
+        ((struct wfs_dirent*)at)->rec_len = size;
+    } else if (kind == REC_KEY) {
+        ((struct wfs_dtree_key*)at)->rec_len = size;
+    }
+}
+
+static void rec_clear(char* at, int kind) {
+    if (kind == REC_KEY) {
+        ((struct wfs_dtree_key*)at)->child = 0;
+    } else if (kind == REC_DIRENT) {
+        ((struct wfs_dirent*)at)->num = 0;
+    } else {
+        ((struct wfs_dentry*)at)->num = 0;
+    }
+}
+
+// an area with nothing in it: one unused record over all of it
+static void area_init(char* area, int alen, int kind) {
+    memset(area, 0, alen);
+    rec_set_size(area, kind, alen);
+}
+
+// where a record of `need` bytes would go: the offset of an unused
+// record with room, or of a used one with that much free at its end. -1
+// if there is none, and -2 with EIO if the records are damaged
+static int area_room(char* area, int alen, int kind, int need) {
+    struct wfs_rec r;
+    int off = 0, ret;
+    for (; (ret = rec_at(area, alen, kind, off, &r)) > 0; off += r.size) {
+        int used = r.id != 0 ? rec_need(kind, r.len) : 0;
+        if (r.size - used >= need) {
+            return off;
+        }
+    }
+    if (ret < 0) {
+        printf("area_room: damaged records at %ld\n", (long)MMAP_OFF(area + off));
+        wfs_error = -EIO;
+        return -2;
+    }
+    return -1;
+}
+
+// puts an entry into the record `host` found by area_room(), or into the
+// free end of it, which is then split off. it is filled in before the id
+// or the host's new size make it visible
+static void area_put(char* host, int kind, const char* name, int len, long id, int type) {
+    struct wfs_rec r;
+    rec_at(host, BLOCK_SIZE, kind, 0, &r);
+    char* at = host;
+    int size = r.size;
+    if (r.id != 0) {
+        at = host + rec_need(kind, r.len);
+        size = r.size - rec_need(kind, r.len);
+    }
+    if (kind == REC_FIXED) {
+        struct wfs_dentry* d = (struct wfs_dentry*)at;
+        memset(d->name, 0, MAX_NAME);
+        memcpy(d->name, name, len);
+        d->num = id;
+    } else if (kind == REC_DIRENT) {
+        struct wfs_dirent* d = (struct wfs_dirent*)at;
+        d->rec_len = size;
+        d->name_len = len;
+        d->file_type = type;
+        memcpy(d->name, name, len);
+        d->num = id;
+    } else {
+        struct wfs_dtree_key* k = (struct wfs_dtree_key*)at;
+        k->rec_len = size;
+        k->key_len = len;
+        k->pad = 0;
+        memcpy(k->key, name, len);
+        k->child = id;
+    }
+    if (at != host) {
+        rec_set_size(host, kind, at - host);
+    }
+}
+
+// takes the record at `at` out: the record before it grows over it, or it
+// is marked unused if it is the first
+static void area_del(char* area, int alen, int kind, char* at) {
+    struct wfs_rec r;
+    char* prev = NULL;
+    int prev_size = 0;
+    for (int off = 0; rec_at(area, alen, kind, off, &r) > 0 && r.at != at; off += r.size) {
+        prev = r.at;
+        prev_size = r.size;
+    }
+    if (kind == REC_FIXED || prev == NULL) {
+        rec_clear(at, kind);
+        return;
+    }
+    rec_at(at, BLOCK_SIZE, kind, 0, &r);
+    rec_set_size(prev, kind, prev_size + r.size);
+}
+
+// bytes taken up by the live records of an area
+static int area_used(char* area, int alen, int kind, const char* hi) {
+    struct wfs_rec r;
+    int used = 0;
+    for (int off = 0; rec_at(area, alen, kind, off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi)) {
+            used += rec_need(kind, r.len);
+        }
+    }
+    return used;
+}
+
+// an entry copied out of a directory, for sorting
+struct dir_ent {
+    int num;
+    uint8_t type;
+    uint8_t len;
+    char name[WFS_NAME_MAX + 1];
+};
+
+struct dir_ents {
+    struct dir_ent* ents;
+    int n, cap;
+};
+
+static int collect_entry(const struct wfs_rec* ent, void* arg) {
+    struct dir_ents* list = arg;
+    if (list->n == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 64;
+        list->ents = realloc(list->ents, list->cap * sizeof(struct dir_ent));
+    }
+    struct dir_ent* e = &list->ents[list->n++];
+    e->num = ent->id;
+    e->type = ent->type;
+    e->len = ent->len;
+    memcpy(e->name, ent->name, ent->len);
+    e->name[ent->len] = '\0';
+    return 0;
+}
+
+static int cmp_dir_ent(const void* a, const void* b) {
+    const struct dir_ent* x = a;
+    const struct dir_ent* y = b;
+    return name_cmp(x->name, x->len, y->name, y->len);
+}
+
+static int cmp_rec(const void* a, const void* b) {
+    const struct wfs_rec* x = a;
+    const struct wfs_rec* y = b;
+    return name_cmp(x->name, x->len, y->name, y->len);
+}
+
+// =========================
+// Directory B+-trees
+// =========================
+
+// see wfs.h for the format
+static const char no_bound[1];
+
+static int node_kind(struct wfs_dtree_node* node) {
+    return node->level == 0 ? REC_DIRENT : REC_KEY;
+}
+
+// a node as read: NULL and EIO if it fails its checksum, is not a node or
+// its records do not add up
+static struct wfs_dtree_node* dtree_node(off_t blk) {
+    if (csum_verify(blk) < 0) {
+        return NULL;
+    }
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    struct wfs_rec r;
+    int off = 0, ret = -1;
+    if (node->magic == DTREE_MAGIC && node->level < DTREE_MAX_HEIGHT) {
+        while ((ret = rec_at(node->recs, DTREE_AREA, node_kind(node), off, &r)) > 0) {
+            off += r.size;
+        }
+    }
+    if (ret < 0) {
+        printf("dtree_node: no tree node at %ld\n", (long)blk);
+        wfs_error = -EIO;
+        return NULL;
+    }
+    return node;
+}
+
+static off_t dtree_new_node(struct wfs_inode* dir, int level) {
+    off_t blk = allocate_data_block(inode_group(dir));
+    if (blk == 0) {
+        wfs_error = -ENOSPC;
+        return 0;
+    }
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    node->magic = DTREE_MAGIC;
+    node->level = level;
+    node->pad = 0;
+    area_init(node->recs, DTREE_AREA, node_kind(node));
+    return blk;
+}
+
+// the lowest live child of an inner node into `low`. -1 if there is none
+static int dtree_lowest(struct wfs_dtree_node* node, const char* hi, struct wfs_rec* low) {
+    struct wfs_rec r;
+    low->at = NULL;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi) && (low->at == NULL || name_cmp(r.name, r.len, low->name, low->len) < 0)) {
+            *low = r;
+        }
+    }
+    return low->at ? 0 : -1;
+}
+
+static int dtree_count(struct wfs_dtree_node* node, const char* hi) {
+    struct wfs_rec r;
+    int n = 0;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, node_kind(node), off, &r) > 0; off += r.size) {
+        n += rec_live(&r, hi);
+    }
+    return n;
+}
+
+// clears the dead records out of a private node, and empties the lowest
+// key of an inner one: a crash while unlinking its lowest child can leave
+// it set
+static void dtree_purge(struct wfs_dtree_node* node, const char* hi) {
+    int kind = node_kind(node);
+    struct wfs_rec r, prev = {0};
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, kind, off, &r) > 0; off += r.size) {
+        if (r.id == 0 || rec_live(&r, hi)) {
+            prev = r;
+        } else if (prev.at == NULL) {
+            rec_clear(r.at, kind);
+            prev = r;
+        } else {
+            prev.size += r.size;
+            rec_set_size(prev.at, kind, prev.size);
+        }
+    }
+    struct wfs_rec low;
+    if (kind == REC_KEY && dtree_lowest(node, hi, &low) == 0 && low.len != 0) {
+        ((struct wfs_dtree_key*)low.at)->key_len = 0;
+    }
+}
+
+// a new node with the live records of `node`, packed together. with
+// `share` the children gain the copy's references
+static off_t dtree_copy(struct wfs_inode* dir, struct wfs_dtree_node* node, const char* hi, int share) {
+    off_t blk = dtree_new_node(dir, node->level);
+    if (blk == 0) {
+        return 0;
+    }
+    struct wfs_dtree_node* copy = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    int kind = node_kind(node);
+    struct wfs_rec r;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, kind, off, &r) > 0; off += r.size) {
+        if (!rec_live(&r, hi)) {
+            continue;
+        }
+        int room = area_room(copy->recs, DTREE_AREA, kind, rec_need(kind, r.len));
+        area_put(copy->recs + room, kind, r.name, r.len, r.id, r.type);
+        if (share && kind == REC_KEY) {
+            (*block_refs(r.id))++;
+        }
+    }
+    dtree_purge(copy, hi);
+    return blk;
+}
+
+// the node linked from `slot`, made private to `dir` so it can be written:
+// one shared with a snapshot is copied, without its dead records, and its
+// children gain the copy's references. `slot` has to be writable already
+static struct wfs_dtree_node* dtree_write(struct wfs_inode* dir, off_t* slot, const char* hi) {
+    struct wfs_dtree_node* node = dtree_node(*slot);
+    if (node == NULL) {
+        return NULL;
+    }
+    if (block_shared(*slot)) {
+        off_t old = *slot;
+        off_t copy = dtree_copy(dir, node, hi, 1);
+        if (copy == 0) {
+            return NULL;
+        }
+        *slot = copy;
+        csum_dirty(MMAP_OFF(slot));
+        (*block_refs(old))--;
+        return (struct wfs_dtree_node*)MMAP_PTR(copy);
+    }
+    csum_dirty(*slot);
+    dtree_purge(node, hi);
+    return node;
+}
+
+// replaces the private node at `slot` by a copy with its records packed
+// together, so its free space is all in one piece
+static int dtree_pack(struct wfs_inode* dir, off_t* slot, const char* hi) {
+    off_t old = *slot;
+    off_t copy = dtree_copy(dir, (struct wfs_dtree_node*)MMAP_PTR(old), hi, 0);
+    if (copy == 0) {
+        return -1;
+    }
+    *slot = copy;
+    csum_dirty(MMAP_OFF(slot));
+    free_block(old);
+    return 0;
+}
+
+// the live child of an inner node `name` belongs to: the one with the
+// greatest key not above it, or else the lowest. its bound goes to
+// `kid_hi`. -1 if the node has no live children
+static int dtree_route(struct wfs_dtree_node* node, const char* hi, const char* name, int len,
+                       struct wfs_rec* kid, char* kid_hi) {
+    struct wfs_rec r, best = {0}, low = {0};
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+        if (!rec_live(&r, hi)) {
+            continue;
+        }
+        if (low.at == NULL || name_cmp(r.name, r.len, low.name, low.len) < 0) {
+            low = r;
+        }
+        if (name_cmp(r.name, r.len, name, len) <= 0 &&
+            (best.at == NULL || name_cmp(r.name, r.len, best.name, best.len) > 0)) {
+            best = r;
+        }
+    }
+    *kid = best.at ? best : low;
+    if (kid->at == NULL) {
+        return -1;
+    }
+    dtree_kid_bound(node, hi, kid, kid_hi);
+    return 0;
+}
+
+// the leaf `name` belongs in, with the nodes on the way there in `path`.
+// with `alloc` each of them is made private to the directory first
+static struct wfs_dtree_node* dtree_leaf(struct wfs_inode* dir, const char* name, int len, int alloc,
+                                         struct dtree_path* path) {
+    off_t* slot = &dir->dtree;
+    path->hi[0][0] = '\0';
+    for (int d = 0; d < DTREE_MAX_HEIGHT; d++) {
+        if (*slot == 0) {
+            wfs_error = -ENOENT; // an empty tree
+            return NULL;
+        }
+        path->slot[d] = slot;
+        path->depth = d + 1;
+        struct wfs_dtree_node* node = alloc ? dtree_write(dir, slot, path->hi[d]) : dtree_node(*slot);
+        if (node == NULL) {
+            return NULL;
+        }
+        if (node->level == 0) {
+            return node;
+        }
+        struct wfs_rec kid;
+        if (d + 1 == DTREE_MAX_HEIGHT || dtree_route(node, path->hi[d], name, len, &kid, path->hi[d + 1]) < 0) {
+            break;
+        }
+        slot = &((struct wfs_dtree_key*)kid.at)->child;
+    }
+    printf("dtree_leaf: directory %d is damaged\n", dir->num);
+    wfs_error = -EIO;
+    return NULL;
+}
+
+// the live entry called `name` into `ent`, -1 with ENOENT if there is
+// none. with `alloc` its leaf is made private so the entry can be written
+static int dtree_find(struct wfs_inode* dir, const char* name, int len, int alloc,
+                      struct dtree_path* path, struct wfs_rec* ent) {
+    struct wfs_dtree_node* leaf = dtree_leaf(dir, name, len, alloc, path);
+    if (leaf == NULL) {
+        return -1;
+    }
+    // whatever has the name is inside the leaf's range, so live
+    for (int off = 0; rec_at(leaf->recs, DTREE_AREA, REC_DIRENT, off, ent) > 0; off += ent->size) {
+        if (ent->id != 0 && name_cmp(ent->name, ent->len, name, len) == 0) {
+            return 0;
+        }
+    }
+    wfs_error = -ENOENT;
+    return -1;
+}
+
+// where to split a node: the middle one of its live keys, counting `extra`
+// (the name being inserted into a leaf) among them. NUL-terminated into `sep`.
+// a leaf only needs a key between its two halves, so it gets the shortest
+// prefix of the middle name that still sorts after the one before it; with
+// long names that is what keeps more than a couple of keys to a node
+static void dtree_median(struct wfs_dtree_node* node, const char* hi, const char* extra, int extra_len,
+                         char* sep) {
+    struct wfs_rec keys[DTREE_AREA / 8 + 1], r;
+    int n = 0;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, node_kind(node), off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi)) {
+            keys[n++] = r;
+        }
+    }
+    if (extra != NULL) {
+        keys[n].name = extra;
+        keys[n++].len = extra_len;
+    }
+    qsort(keys, n, sizeof(struct wfs_rec), cmp_rec);
+    int len = keys[n / 2].len;
+    if (node->level == 0 && n > 1) {
+        const struct wfs_rec* prev = &keys[n / 2 - 1];
+        int same = 0;
+        while (same < prev->len && keys[n / 2].name[same] == prev->name[same]) {
+            same++;
+        }
+        len = same + 1;
+    }
+    memcpy(sep, keys[n / 2].name, len);
+    sep[len] = '\0';
+}
+
+// splits the node linked from `slot` at `sep`, with its parent at `pslot`
+// having room for the key: what is at or past `sep` is copied to a new
+// node, which is then linked in next to it. that is what moves them; the
+// originals are dead from then on and only cleared up after
+static int dtree_split(struct wfs_inode* dir, off_t* pslot, off_t* slot, const char* sep) {
+    struct wfs_dtree_node* parent = (struct wfs_dtree_node*)MMAP_PTR(*pslot);
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(*slot);
+    int kind = node_kind(node), sep_len = strlen(sep);
+    off_t blk = dtree_new_node(dir, node->level);
+    if (blk == 0) {
+        return -1;
+    }
+    struct wfs_dtree_node* sib = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    struct wfs_rec r;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, kind, off, &r) > 0; off += r.size) {
+        if (r.id == 0 || name_cmp(r.name, r.len, sep, sep_len) < 0) {
+            continue;
+        }
+        // the separator's child is the new node's lowest
+        int len = kind == REC_KEY && name_cmp(r.name, r.len, sep, sep_len) == 0 ? 0 : r.len;
+        int room = area_room(sib->recs, DTREE_AREA, kind, rec_need(kind, len));
+        area_put(sib->recs + room, kind, r.name, len, r.id, r.type);
+    }
+
+    int room = area_room(parent->recs, DTREE_AREA, REC_KEY, DTREE_KEY_SIZE(sep_len));
+    area_put(parent->recs + room, REC_KEY, sep, sep_len, blk, 0);
+    dir->size += BLOCK_SIZE;
+    dtree_purge(node, sep);
+    printf("dtree_split: %d, level %d at '%s'\n", dir->num, node->level, sep);
+    return 0;
+}
+
+// adds an entry. a leaf without room is split, once its parent has room
+// for the key that goes up; a parent without is split first, up to a new
+// root. each of those steps starts over from the root, so the path is
+// always as it is on disk
+static int dtree_insert(struct wfs_inode* dir, const char* name, int len, int num, int type) {
+    if (dir->dtree == 0) {
+        if ((dir->dtree = dtree_new_node(dir, 0)) == 0) {
+            return -1;
+        }
+        dir->size += BLOCK_SIZE;
+    }
+    int need = DIRENT_SIZE(len);
+    for (int step = 0; step < 4 * DTREE_MAX_HEIGHT; step++) {
+        struct dtree_path path;
+        struct wfs_dtree_node* leaf = dtree_leaf(dir, name, len, 1, &path);
+        if (leaf == NULL) {
+            return -1;
+        }
+        int d = path.depth - 1;
+        int room = area_room(leaf->recs, DTREE_AREA, REC_DIRENT, need);
+        if (room >= 0) {
+            area_put(leaf->recs + room, REC_DIRENT, name, len, num, type);
+            return 0;
+        } else if (room == -2) {
+            return -1;
+        }
+
+        // a node with enough room, just not in one piece, is packed
+        // instead of split
+        struct wfs_dtree_node* node = leaf;
+        int up = need; // what has to fit into `node`
+        char sep[WFS_NAME_MAX + 1];
+        dtree_median(leaf, path.hi[d], name, len, sep);
+        int ret;
+        for (;;) {
+            if (DTREE_AREA - area_used(node->recs, DTREE_AREA, node_kind(node), path.hi[d]) >= up) {
+                ret = dtree_pack(dir, path.slot[d], path.hi[d]);
+                break;
+            }
+            if (d == 0) {
+                // a full root gets a new one above it to split into
+                off_t root = dtree_new_node(dir, node->level + 1);
+                ret = root != 0 ? 0 : -1;
+                if (root != 0) {
+                    struct wfs_dtree_node* top = (struct wfs_dtree_node*)MMAP_PTR(root);
+                    area_put(top->recs, REC_KEY, "", 0, dir->dtree, 0);
+                    dir->dtree = root;
+                    dir->size += BLOCK_SIZE;
+                }
+                break;
+            }
+            struct wfs_dtree_node* parent = (struct wfs_dtree_node*)MMAP_PTR(*path.slot[d - 1]);
+            int key = DTREE_KEY_SIZE(strlen(sep));
+            if (area_room(parent->recs, DTREE_AREA, REC_KEY, key) >= 0) {
+                ret = dtree_split(dir, path.slot[d - 1], path.slot[d], sep);
+                break;
+            }
+            node = parent;
+            up = key;
+            d--;
+            dtree_median(node, path.hi[d], NULL, 0, sep);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    printf("dtree_insert: directory %d is damaged\n", dir->num);
+    wfs_error = -EIO;
+    return -1;
+}
+
+// drops a reference to the subtree at `blk`. a node is freed with its last
+// reference, and only then lets go of its children
+static void dtree_release(off_t blk, const char* hi) {
+    uint16_t* refs = block_refs(blk);
+    if (refs && *refs > 0) {
+        (*refs)--;
+        return;
+    }
+    struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(blk);
+    if (node->magic == DTREE_MAGIC && node->level > 0) {
+        char kid_hi[WFS_NAME_MAX + 1];
+        struct wfs_rec r;
+        for (int off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+            if (rec_live(&r, hi)) {
+                dtree_kid_bound(node, hi, &r, kid_hi);
+                dtree_release(r.id, kid_hi);
+            }
+        }
+    }
+    free_block(blk);
+}
+
+// clears everything at or past `bound` from the node at `slot` and the
+// last nodes below it: dead records left by an interrupted split, which
+// would come back once the range grows past `bound`
+static int dtree_trim(struct wfs_inode* dir, off_t* slot, const char* bound) {
+    for (int depth = 0; depth < DTREE_MAX_HEIGHT; depth++) {
+        struct wfs_dtree_node* node = dtree_write(dir, slot, bound);
+        if (node == NULL) {
+            return -1;
+        }
+        struct wfs_rec r, last = {0};
+        for (int off = 0; node->level > 0 && rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0;
+             off += r.size) {
+            if (r.id != 0 && (last.at == NULL || name_cmp(r.name, r.len, last.name, last.len) > 0)) {
+                last = r;
+            }
+        }
+        if (last.at == NULL) {
+            return 0;
+        }
+        slot = &((struct wfs_dtree_key*)last.at)->child;
+    }
+    return 0;
+}
+
+// after an entry is removed from the leaf at the end of `path`: the leaf
+// leaves the tree once it is empty, along with the parents it was the
+// last child of
+static void dtree_prune(struct wfs_inode* dir, struct dtree_path* path) {
+    int d = path->depth - 1;
+    if (dtree_count((struct wfs_dtree_node*)MMAP_PTR(*path->slot[d]), path->hi[d]) > 0) {
+        return;
+    }
+    // the highest node that only leads to the empty leaf goes, and all of
+    // it with it
+    int top = d;
+    while (top > 0 &&
+           dtree_count((struct wfs_dtree_node*)MMAP_PTR(*path->slot[top - 1]), path->hi[top - 1]) <= 1) {
+        top--;
+    }
+
+    off_t gone = *path->slot[top];
+    if (top == 0) {
+        dir->dtree = 0;
+    } else {
+        struct wfs_dtree_node* parent = (struct wfs_dtree_node*)MMAP_PTR(*path->slot[top - 1]);
+        const char* hi = path->hi[top - 1];
+        char* link = (char*)path->slot[top];
+        struct wfs_rec low, r, prev = {0};
+        dtree_lowest(parent, hi, &low);
+        if (low.at == link) {
+            // the next child up takes over the range below, where it
+            // cannot have anything left over
+            area_del(parent->recs, DTREE_AREA, REC_KEY, link);
+            dtree_lowest(parent, hi, &low);
+            ((struct wfs_dtree_key*)low.at)->key_len = 0;
+        } else {
+            // the child below takes over the range, after dead records
+            // in it are gone
+            struct wfs_dtree_key* key = (struct wfs_dtree_key*)link;
+            char bound[WFS_NAME_MAX + 1];
+            memcpy(bound, key->key, key->key_len);
+            bound[key->key_len] = '\0';
+            for (int off = 0; rec_at(parent->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+                if (rec_live(&r, hi) && name_cmp(r.name, r.len, key->key, key->key_len) < 0 &&
+                    (prev.at == NULL || name_cmp(r.name, r.len, prev.name, prev.len) > 0)) {
+                    prev = r;
+                }
+            }
+            if (dtree_trim(dir, &((struct wfs_dtree_key*)prev.at)->child, bound) < 0) {
+                wfs_error = 0;
+                return; // left as it is: an empty leaf does no harm
+            }
+            area_del(parent->recs, DTREE_AREA, REC_KEY, link);
+        }
+    }
+    dtree_release(gone, path->hi[top]);
+    dir->size -= (off_t)(d - top + 1) * BLOCK_SIZE;
+}
+
+// a root with a single child is not needed. only a private root can go,
+// its child then has the same owners as before
+static void dtree_collapse(struct wfs_inode* dir) {
+    while (dir->dtree != 0 && !block_shared(dir->dtree)) {
+        struct wfs_dtree_node* root = (struct wfs_dtree_node*)MMAP_PTR(dir->dtree);
+        struct wfs_rec only;
+        if (root->level == 0 || dtree_count(root, no_bound) != 1 || dtree_lowest(root, no_bound, &only) < 0) {
+            break;
+        }
+        off_t old = dir->dtree;
+        dir->dtree = only.id;
+        free_block(old);
+        dir->size -= BLOCK_SIZE;
+    }
+}
+
+// calls `fn` on the entries of the subtree at `blk` from `from` on, in name
+// order, until it returns non-zero. returns that, or -1 with wfs_error set
+static int dtree_scan(off_t blk, const char* hi, const char* from, dentry_fn fn, void* arg, int depth) {
+    struct wfs_dtree_node* node = dtree_node(blk);
+    if (node == NULL) {
+        return -1;
+    }
+    struct wfs_rec recs[DTREE_AREA / 8], r;
+    int n = 0, from_len = strlen(from);
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, node_kind(node), off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi) && (node->level > 0 || name_cmp(r.name, r.len, from, from_len) >= 0)) {
+            recs[n++] = r;
+        }
+    }
+    qsort(recs, n, sizeof(struct wfs_rec), cmp_rec);
+    if (node->level == 0) {
+        for (int k = 0; k < n; k++) {
+            int ret = fn(&recs[k], arg);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+    if (depth + 1 == DTREE_MAX_HEIGHT) {
+        wfs_error = -EIO;
+        return -1;
+    }
+
+    char next[WFS_NAME_MAX + 1];
+    for (int k = 0; k < n; k++) {
+        if (k + 1 < n) {
+            memcpy(next, recs[k + 1].name, recs[k + 1].len);
+            next[recs[k + 1].len] = '\0';
+            if (name_cmp(next, recs[k + 1].len, from, from_len) <= 0) {
+                continue; // all of it comes before `from`
+            }
+        } else {
+            strcpy(next, hi);
+        }
+        int ret = dtree_scan(recs[k].id, next, from, fn, arg, depth + 1);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// loads sorted entries into a new tree, filling nodes to about 3/4 so the
+// next inserts do not split them right away. returns the root, 0 if the
+// blocks run out
+static off_t dtree_build(struct wfs_inode* dir, struct dir_ent* ents, int n, int* nodes) {
+    int fill = DTREE_AREA * 3 / 4;
+    // the nodes of the level being built, with the key each goes under: for
+    // a leaf the shortest prefix of its first name that sorts after the
+    // last name of the one before
+    struct { off_t blk; const char* key; int len; } *level = calloc(n + 1, sizeof(*level));
+    off_t* made = calloc(2 * (n + 1) + DTREE_MAX_HEIGHT, sizeof(off_t));
+    int count = 0;
+    *nodes = 0;
+
+    for (int i = 0; i < n || count == 0; count++) {
+        off_t blk = made[(*nodes)++] = dtree_new_node(dir, 0);
+        if (blk == 0) {
+            goto fail;
+        }
+        struct wfs_dtree_node* leaf = (struct wfs_dtree_node*)MMAP_PTR(blk);
+        level[count].blk = blk;
+        level[count].key = i < n ? ents[i].name : "";
+        if (i > 0) {
+            int same = 0;
+            while (same < ents[i - 1].len && ents[i].name[same] == ents[i - 1].name[same]) {
+                same++;
+            }
+            level[count].len = same + 1;
+        }
+        for (int used = 0; i < n && (used == 0 || used + (int)DIRENT_SIZE(ents[i].len) <= fill); i++) {
+            int room = area_room(leaf->recs, DTREE_AREA, REC_DIRENT, DIRENT_SIZE(ents[i].len));
+            area_put(leaf->recs + room, REC_DIRENT, ents[i].name, ents[i].len, ents[i].num, ents[i].type);
+            used += DIRENT_SIZE(ents[i].len);
+        }
+    }
+    for (int height = 1; count > 1; height++) {
+        int parents = 0;
+        for (int i = 0; i < count; parents++) {
+            off_t blk = made[(*nodes)++] = dtree_new_node(dir, height);
+            if (blk == 0) {
+                goto fail;
+            }
+            struct wfs_dtree_node* node = (struct wfs_dtree_node*)MMAP_PTR(blk);
+            const char* key = level[i].key;
+            int key_len = level[i].len;
+            for (int used = 0; i < count; i++) {
+                // the lowest key is empty
+                int len = used == 0 ? 0 : level[i].len;
+                if (used > 0 && used + (int)DTREE_KEY_SIZE(len) > fill) {
+                    break;
+                }
+                int room = area_room(node->recs, DTREE_AREA, REC_KEY, DTREE_KEY_SIZE(len));
+                area_put(node->recs + room, REC_KEY, len ? level[i].key : "", len, level[i].blk, 0);
+                used += DTREE_KEY_SIZE(len);
+            }
+            level[parents].blk = blk;
+            level[parents].key = key;
+            level[parents].len = key_len;
+        }
+        count = parents;
+    }
+    off_t root = level[0].blk;
+    free(level);
+    free(made);
+    return root;
+
+fail:
+    for (int i = 0; i < *nodes; i++) {
+        if (made[i] != 0) { free_block(made[i]); }
+    }
+    free(level);
+    free(made);
+    return 0;
+}
+
+// turns a list directory whose direct blocks are full into a tree. the
+// tree is built on the side and the flag switches over to it, so a crash
+// before that only leaks the tree, and one after only the list's blocks
+static int dtree_convert(struct wfs_inode* dir) {
+    struct dir_ents list = {NULL, 0, 0};
+    if (dir_iterate(dir, "", collect_entry, &list) < 0) {
+        free(list.ents);
+        return -1;
+    }
+    // entries without a type come from an image without long names
+    for (int i = 0; i < list.n; i++) {
+        struct wfs_inode* inode = list.ents[i].type ? NULL : retrieve_inode(list.ents[i].num);
+        if (inode != NULL) {
+            list.ents[i].type = dirent_type(inode);
+        }
+    }
+    qsort(list.ents, list.n, sizeof(struct dir_ent), cmp_dir_ent);
+    int nodes;
+    off_t root = dtree_build(dir, list.ents, list.n, &nodes);
+    free(list.ents);
+    if (root == 0) {
+        return -1;
+    }
+
+    dir->dtree = root;
+    dir->flags |= WFS_INODE_DTREE;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        off_t blk = dir->blocks[i];
+        if (blk != 0) {
+            dir->blocks[i] = 0;
+            put_block(blk);
+        }
+    }
+    dir->size = (off_t)nodes * BLOCK_SIZE;
+    printf("dtree_convert: %d, %d entries in %d nodes\n", dir->num, list.n, nodes);
+    return 0;
+}
+
+// calls `fn` on the live entries of a directory, until it returns non-zero.
+// a B+-tree goes in name order from `from` on, a list in block order
+static int dir_iterate(struct wfs_inode* dir, const char* from, dentry_fn fn, void* arg) {
+    if (dir->flags & WFS_INODE_DTREE) {
+        return dir->dtree ? dtree_scan(dir->dtree, no_bound, from, fn, arg, 0) : 0;
+    }
+    int kind = list_kind();
+    for (off_t blk = 0; blk < dir->size; blk += BLOCK_SIZE) {
+        char* area = data_offset(dir, blk, 0);
+        if (area == NULL && wfs_error != 0) {
+            return -1;
+        }
+        struct wfs_rec r;
+        int off = 0, ret = 0;
+        for (; area && (ret = rec_at(area, BLOCK_SIZE, kind, off, &r)) > 0; off += r.size) {
+            if (r.id != 0 && (ret = fn(&r, arg)) != 0) {
+                return ret;
+            }
+        }
+        if (ret < 0) {
+            printf("dir_iterate: %d has damaged entries\n", dir->num);
+            wfs_error = -EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the entry called `name` in `dir`, -1 with ENOENT if there is none. with
+// `alloc` its block is made private to the directory so the entry can be
+// written
+static int dir_find(struct wfs_inode* dir, const char* name, int alloc, struct dir_slot* at) {
+    int len = strlen(name);
+    if (dir->flags & WFS_INODE_DTREE) {
+        if (dtree_find(dir, name, len, alloc, &at->path, &at->rec) < 0) {
+            return -1;
+        }
+        at->area = ((struct wfs_dtree_node*)MMAP_PTR(*at->path.slot[at->path.depth - 1]))->recs;
+        at->alen = DTREE_AREA;
+        at->kind = REC_DIRENT;
+        return 0;
+    }
+    at->kind = list_kind();
+    at->alen = BLOCK_SIZE;
+    for (off_t blk = 0; blk < dir->size; blk += BLOCK_SIZE) {
+        if ((at->area = data_offset(dir, blk, 0)) == NULL) {
+            if (wfs_error != 0) {
+                return -1;
+            }
+            continue;
+        }
+        for (int off = 0; rec_at(at->area, BLOCK_SIZE, at->kind, off, &at->rec) > 0; off += at->rec.size) {
+            if (at->rec.id == 0 || name_cmp(at->rec.name, at->rec.len, name, len) != 0) {
+                continue;
+            }
+            if (alloc && (at->area = data_offset(dir, blk, 1)) == NULL) {
+                return -1;
+            }
+            rec_at(at->area, BLOCK_SIZE, at->kind, off, &at->rec);
+            return 0;
+        }
+    }
+    wfs_error = -ENOENT;
+    return -1;
+}
+
+// points the entry at `inode` instead, its type first
+static void dir_slot_set(struct dir_slot* at, struct wfs_inode* inode) {
+    if (at->kind == REC_DIRENT) {
+        ((struct wfs_dirent*)at->rec.at)->file_type = dirent_type(inode);
+        ((struct wfs_dirent*)at->rec.at)->num = inode->num;
+    } else {
+        ((struct wfs_dentry*)at->rec.at)->num = inode->num;
+    }
+}
+
+// =========================
+// Readahead
+// =========================
+
+// Each open file keeps a readahead window, in blocks, like the kernel's
+// per-file readahead. Reads that carry on where the last one ended grow
+// it, up to RA_MAX; the blocks in it are handed to bio_advise() as
+// BIO_WILLNEED, so the backend reads them in before they are asked for.
+// After RANDOM_MISSES reads somewhere else the file is taken to be read
+// at random: readahead stops and its blocks are advised BIO_RANDOM until
+// it is closed.
+#define RA_MIN        (8)
+#define RA_MAX        (256)
+#define RANDOM_MISSES (2)
+
+struct open_file {
+    off_t next;   // where a sequential read would start
+    int window;   // blocks, 0 before the first sequential read
+    int ahead;    // the block readahead has got to
+    int misses;   // non-sequential reads in a row
+    int random;
+};
+
+// advises the blocks [first, last) of inode with `how`, a run of
+// contiguous blocks at a time
+static void advise_blocks(struct wfs_inode* inode, int first, int last, int how) {
+    off_t run = 0;
+    size_t len = 0;
+    for (int b = first; b <= last; b++) {
+        off_t* slot = b < last ? block_slot(inode, b, 0) : NULL;
+        off_t at = slot ? *slot : 0;
+        if (len > 0 && at == run + (off_t)len) {
+            len += BLOCK_SIZE;
+            continue;
+        }
+        if (len > 0) {
+            bio_advise(run, len, how);
+        }
+        run = at;
+        len = at ? BLOCK_SIZE : 0;
+    }
+    wfs_error = 0; // missing indirect blocks are just holes here
+}
+
+static void read_ahead(struct open_file* of, struct wfs_inode* inode, off_t offset, size_t length) {
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + length - 1) / BLOCK_SIZE;
+    if (offset != of->next) {
+        of->window = 0;
+        if (!of->random && ++of->misses >= RANDOM_MISSES) {
+            of->random = 1;
+            advise_blocks(inode, 0, end, BIO_RANDOM);
+        }
+    } else {
+        if (of->random) {
+            advise_blocks(inode, 0, end, BIO_NORMAL);
+        }
+        of->misses = 0;
+        of->random = 0;
+        if (of->window == 0) {
+            of->window = RA_MIN;
+            of->ahead = first;
+        } else if (last >= of->ahead - of->window / 2 && of->window < RA_MAX) {
+            of->window *= 2;
+        }
+        // past this read, which faults its own blocks in anyway, and only
+        // what has not been asked for yet
+        int from = of->ahead > last + 1 ? of->ahead : last + 1;
+        int to = last + 1 + of->window < end ? last + 1 + of->window : end;
+        if (to > from && last >= of->ahead - of->window / 2) {
+            advise_blocks(inode, from, to, BIO_WILLNEED);
+            of->ahead = to;
+        }
+    }
+    of->next = offset + length;
+}
+
+int wfs_open(const char* path, struct fuse_file_info* fi) {
+    printf("wfs_open: %s\n", path);
+    struct open_file* of = calloc(1, sizeof(struct open_file));
+    if (of == NULL) {
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)of;
+    return 0;
+}
+
+int wfs_release(const char* path, struct fuse_file_info* fi) {
+    printf("wfs_release: %s\n", path);
+    struct open_file* of = (struct open_file*)(uintptr_t)fi->fh;
+    struct wfs_inode* inode;
+    if (of && of->random && resolve_path(path, &inode, NULL) == 0) {
+        advise_blocks(inode, 0, (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE, BIO_NORMAL);
+    }
+    wfs_error = 0;
+    free(of);
+    return 0;
+}
+
+int wfs_read(const char* path, char *buf, size_t length, off_t offset, struct fuse_file_info *fi) {
+    printf("wfs_read: %s\n", path);
+    struct wfs_inode* inode;
+    char* searchpath = strdup(path);
+    if (get_inode_from_path(searchpath, &inode) < 0) {
+        return wfs_error;
+    }
+    size_t have_read = 0;
+    size_t pos = offset;
+
+    if (fi && fi->fh && length > 0 && offset < inode->size && !file_compressed(inode)) {
+        read_ahead((struct open_file*)(uintptr_t)fi->fh, inode, offset, length);
+    }
+    if (file_compressed(inode)) {
+        ssize_t n = read_compressed(inode, buf, length, offset);
+        if (n < 0) {
+            return wfs_error;
+        }
+        have_read = n;
+    }
+    if (!file_compressed(inode) && length > 0 && pos < inode->size) {
+        // length might be larger than the file
+        size_t want = inode->size - pos < length ? inode->size - pos : length;
+        int count = (pos + want - 1) / BLOCK_SIZE - pos / BLOCK_SIZE + 1;
+        off_t blks[MAX_FILE_BLOCKS];
+        if (map_range(inode, pos, want, 0, blks) < count) {
+            free(searchpath);
+            return wfs_error;
+        }
+        copy_runs(blks, pos % BLOCK_SIZE, buf, want, 0);
+        have_read = want;
+    }
+
+    free(searchpath);
+    // Update atime only if we actually read some bytes (POSIX allows updating on any access; this avoids pure EOF bumps)
+    // Snapshots are never written, not even their atimes
+    if (have_read > 0 && !in_snapshots(path)) {
+        touch_atime(inode);
+    }
+
+    return have_read;
+}
+
+int wfs_write(const char *path, const char *buf, size_t length, off_t offset, struct fuse_file_info *fi) {
+    (void)fi;
+    printf("wfs_write: %s\n", path);
+    if (in_snapshots(path)) {
+        return -EROFS;
+    }
+    struct wfs_inode* inode;
+    char* searchpath = strdup(path);
     if (get_inode_from_path(searchpath, &inode) < 0) {
         return wfs_error;
     }
-    size_t have_read = 0;
-    size_t pos = offset;
-
-    while (have_read < length && pos < inode->size) {
-        size_t to_read = BLOCK_SIZE - (pos % BLOCK_SIZE);
-        // length might be larger than file or block size
-        size_t eof = inode->size - pos; 
-        if (to_read > eof) { to_read = eof; }
+    if (cow_inode(inode) < 0) {
+        return wfs_error;
+    }
+    if (file_compressed(inode)) {
+        ssize_t written = write_compressed(inode, buf, length, offset);
+        if (written < 0) {
+            return wfs_error;
+        }
+        touch_inode(inode, WFS_MTIME | WFS_CTIME);
+        free(searchpath);
+        return written;
+    }
+
+    // a write running past the largest file there can be stops short
+    // there, so it never leaves blocks behind past the end
+    if (length > 0 && offset >= MAX_FILE_SIZE) {
+        free(searchpath);
+        return -EFBIG;
+    }
+    if (offset + (off_t)length > MAX_FILE_SIZE) {
+        length = MAX_FILE_SIZE - offset;
+    }
+
+    size_t have_written = 0;
+    size_t pos = offset;
+
+    // with dedup a whole block may turn out to be there already, so
+    // blocks are written one at a time
+    while (options.dedup && have_written < length) {
+        size_t to_write = BLOCK_SIZE - (pos % BLOCK_SIZE);
+        if (to_write + have_written > length) {
+            to_write = length - have_written;
+        }
+
+        uint32_t hash;
+        int whole = to_write == BLOCK_SIZE;
+        int shared = whole ? dedup_write(inode, pos / BLOCK_SIZE, buf + have_written, &hash) : 0;
+        if (shared < 0) {
+            break;
+        }
+        if (!shared) {
+            char* addr = data_offset(inode, pos, 1);
+            if (addr == NULL) {
+                break;
+            }
+            memcpy(addr, buf + have_written, to_write);
+            if (whole) {
+                dedup_insert(MMAP_OFF(addr), hash);
+            }
+        }
+        pos += to_write;
+        have_written += to_write;
+    }
+    if (!options.dedup && length > 0) {
+        int count = (pos + length - 1) / BLOCK_SIZE - pos / BLOCK_SIZE + 1;
+        off_t blks[MAX_FILE_BLOCKS];
+        int n = map_range(inode, pos, length, 1, blks);
+        // as much as there was room for
+        have_written = n == count ? length : n > 0 ? (size_t)n * BLOCK_SIZE - pos % BLOCK_SIZE : 0;
+        copy_runs(blks, pos % BLOCK_SIZE, (char*)buf, have_written, 1);
+    }
+    if (have_written == 0 && length > 0) {
+        free(searchpath);
+        return wfs_error;
+    }
+
+    if (offset + (off_t)have_written > inode->size) {
+        inode->size = offset + have_written;
+    }
+    // Writing updates mtime and ctime
+    touch_inode(inode, WFS_MTIME | WFS_CTIME);
+    free(searchpath);
+    return have_written;
+}
+
+struct readdir_ctx {
+    void* buf;
+    fuse_fill_dir_t filler;
+    struct wfs_snapshot* view;
+    int is_ls;
+};
+
+static int readdir_entry(const struct wfs_rec* ent, void* arg) {
+    struct readdir_ctx* ctx = arg;
+    struct wfs_inode *file_inode = ctx->view ? snapshot_inode(ctx->view, ent->id)
+                                             : retrieve_inode(ent->id);
+    char name[WFS_NAME_MAX + 1];
+    memcpy(name, ent->name, ent->len);
+    name[ent->len] = '\0';
+    // the type kept in the entry saves a lookup of the inode for d_type
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = ent->type << 12;
+    const struct stat* stp = ent->type ? &st : NULL;
+    printf("DEBUG: file %s, color = %d\n", name, file_inode ? file_inode->color : -1);
+    if (ctx->is_ls && file_inode && file_inode->color != WFS_COLOR_NONE) {
+        const wfs_color_info *ci = wfs_color_from_code(file_inode->color);
+        char colored_name[WFS_NAME_MAX + 64];
+        snprintf(colored_name, sizeof(colored_name), "%s%s\033[0m",
+                 ci->ansi, name);
+        printf("DEBUG: returning colored name: %s\n", colored_name);
+        ctx->filler(ctx->buf, colored_name, stp, 0);
+    } else {
+        ctx->filler(ctx->buf, name, stp, 0);
+    }
+    return 0;
+}
+
+int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    (void)fi;
+    (void)offset;
+
+    printf("wfs_readdir: %s\n", path);
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    
+    if (strcmp(path, SNAP_DIR) == 0) {
+        return list_snapshots(buf, filler);
+    }
+    struct wfs_inode* inode;
+    struct wfs_snapshot* view;
+    char* searchpath = strdup(path);
+    if (resolve_path(searchpath, &inode, &view) < 0) {
+        return wfs_error;
+    }
+
+    // Detect if caller is 'ls' by checking process name
+    struct fuse_context *ctx = fuse_get_context();
+    int is_ls = 0;
+    if (ctx) {
+        char comm_path[64], comm_name[256];
+        snprintf(comm_path, sizeof(comm_path), "/proc/%d/comm", ctx->pid);
+        FILE *fp = fopen(comm_path, "r");
+        if (fp) {
+            if (fgets(comm_name, sizeof(comm_name), fp)) {
+                // Remove trailing newline
+                comm_name[strcspn(comm_name, "\n")] = '\0';
+                printf("DEBUG: comm_name = %s\n", comm_name);
+                is_ls = (strcmp(comm_name, "ls") == 0);
+            }
+            fclose(fp);
+        }
+    }
+    printf("DEBUG: is_ls = %d\n", is_ls); 
+    // a B+-tree directory lists in name order, a list one in block order
+    struct readdir_ctx rctx = {buf, filler, view, is_ls};
+    if (dir_iterate(inode, "", readdir_entry, &rctx) < 0) {
+        free(searchpath);
+        return wfs_error;
+    }
+
+    free(searchpath);
+    // Reading a directory updates its atime
+    if (!view) {
+        touch_atime(inode);
+    }
+    return 0;
+}
+
+// finds the directory `path` goes in and copies out its last component,
+// without color codes
+static int lookup_parent(const char* path, struct wfs_inode** parent, char* name) {
+    char clean[1024];
+    strip_ansi_codes(path, clean, sizeof(clean));
+    char* slash = strrchr(clean, '/');
+    if (strlen(slash + 1) > name_max()) {
+        wfs_error = -ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(name, slash + 1);
+    slash[slash == clean] = '\0'; // the root keeps its slash
+    return resolve_path(clean, parent, NULL);
+}
+
+static int any_entry(const struct wfs_rec* ent, void* arg) {
+    (void)ent;
+    (void)arg;
+    return 1;
+}
+
+static int dir_empty(struct wfs_inode* dir) {
+    return dir_iterate(dir, "", any_entry, NULL) == 0;
+}
+
+// an entry for `inode` is gone: the inode goes with its last link.
+// directories only ever have the one
+static void drop_link(struct wfs_inode* inode) {
+    touch_inode(inode, WFS_CTIME);
+    if (!S_ISDIR(inode->mode) && --inode->nlinks > 0) {
+        return;
+    }
+
+    // free all the data blocks not shared with a snapshot
+    release_blocks(inode);
+    free_inode(inode);
+}
+
+int wfs_unlink(const char* path)
+{
+    printf("wfs_unlink: %s\n", path);
+    if (in_snapshots(path)) {
+        return -EROFS;
+    }
+    struct wfs_inode* parent_inode;
+    struct wfs_inode* inode;
+    char name[WFS_NAME_MAX + 1];
+
+    // parent inode
+    if (lookup_parent(path, &parent_inode, name) < 0) {
+        return wfs_error;
+    }
+
+    // inode
+    if (resolve_path(path, &inode, NULL) < 0) {
+        return wfs_error;
+    }
+
+    // snapshots that can see the inode keep a copy of it
+    if (cow_inode(inode) < 0) {
+        return wfs_error;
+    }
+
+    // remove dentry from parent first: once the inode can't be reached, a
+    // crash part way through freeing it only leaks space
+    if (remove_dentry(parent_inode, inode->num, name) < 0) {
+        return wfs_error;
+    }
+    drop_link(inode);
+    return 0;
+}
+
+// a new entry `to` for the file at `from`
+int wfs_link(const char* from, const char* to) {
+    printf("wfs_link: %s -> %s\n", to, from);
+    if (in_snapshots(from) || in_snapshots(to)) {
+        return -EROFS;
+    }
+    struct wfs_inode* inode;
+    struct wfs_inode* parent;
+    struct dir_slot at;
+    char name[WFS_NAME_MAX + 1];
+
+    if (resolve_path(from, &inode, NULL) < 0 || lookup_parent(to, &parent, name) < 0) {
+        return wfs_error;
+    }
+    if (S_ISDIR(inode->mode)) {
+        return -EPERM;
+    }
+    if (dir_find(parent, name, 0, &at) == 0) {
+        return -EEXIST;
+    } else if (wfs_error != -ENOENT) {
+        return wfs_error;
+    }
+    if (inode->nlinks == INT_MAX) {
+        return -EMLINK;
+    }
+    if (cow_inode(inode) < 0) {
+        return wfs_error;
+    }
+
+    // count the link before adding it: a crash in between only keeps the
+    // inode around for too long
+    inode->nlinks++;
+    if (add_dentry(parent, inode, name) < 0) {
+        inode->nlinks--;
+        return wfs_error;
+    }
+    touch_inode(inode, WFS_CTIME);
+    return 0;
+}
+
+// whether `path` is `dir` or below it
+static int path_within(const char* path, const char* dir) {
+    size_t n = strlen(dir);
+    return strncmp(path, dir, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+// moves the entry `from` to `to`. with no flags an entry already at `to`
+// is replaced, with RENAME_NOREPLACE that is an error and RENAME_EXCHANGE
+// swaps the two. only directory entries change, never file data
+int wfs_rename2(const char* from, const char* to, unsigned int flags) {
+    printf("wfs_rename: %s -> %s (%x)\n", from, to, flags);
+    if (in_snapshots(from) || in_snapshots(to)) {
+        return -EROFS;
+    }
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+        (flags & RENAME_NOREPLACE && flags & RENAME_EXCHANGE)) {
+        return -EINVAL;
+    }
+    struct wfs_inode* fparent;
+    struct wfs_inode* tparent;
+    char fname[WFS_NAME_MAX + 1], tname[WFS_NAME_MAX + 1];
+    if (lookup_parent(from, &fparent, fname) < 0 || lookup_parent(to, &tparent, tname) < 0) {
+        return wfs_error;
+    }
+    struct dir_slot fdent, tdent;
+    if (dir_find(fparent, fname, 0, &fdent) < 0) {
+        return wfs_error;
+    }
+    struct wfs_inode* inode = retrieve_inode(fdent.rec.id);
+    int found = dir_find(tparent, tname, 0, &tdent) == 0;
+    if (inode == NULL || (!found && wfs_error != -ENOENT)) {
+        return wfs_error;
+    }
+    struct wfs_inode* target = found ? retrieve_inode(tdent.rec.id) : NULL;
+    if (found && target == NULL) {
+        return wfs_error;
+    }
+
+    if (target != NULL && flags & RENAME_NOREPLACE) {
+        return -EEXIST;
+    } else if (target == NULL && flags & RENAME_EXCHANGE) {
+        return -ENOENT;
+    }
+    if (target == inode) {
+        return 0; // two links to one file, or the same name
+    }
+    // a directory cannot end up inside itself
+    char cfrom[1024], cto[1024];
+    strip_ansi_codes(from, cfrom, sizeof(cfrom));
+    strip_ansi_codes(to, cto, sizeof(cto));
+    if ((S_ISDIR(inode->mode) && path_within(cto, cfrom)) ||
+        (flags & RENAME_EXCHANGE && S_ISDIR(target->mode) && path_within(cfrom, cto))) {
+        return -EINVAL;
+    }
+    if (target != NULL && !(flags & RENAME_EXCHANGE)) {
+        if (S_ISDIR(inode->mode) && !S_ISDIR(target->mode)) {
+            return -ENOTDIR;
+        } else if (!S_ISDIR(inode->mode) && S_ISDIR(target->mode)) {
+            return -EISDIR;
+        } else if (S_ISDIR(target->mode) && !dir_empty(target)) {
+            return -ENOTEMPTY;
+        }
+    }
+
+    // snapshots keep the inodes and directories as they were
+    if (cow_inode(inode) < 0 || cow_inode(fparent) < 0 || cow_inode(tparent) < 0 ||
+        (target && cow_inode(target) < 0)) {
+        return wfs_error;
+    }
+    touch_inode(inode, WFS_CTIME);
+    touch_inode(fparent, WFS_MTIME | WFS_CTIME);
+    touch_inode(tparent, WFS_MTIME | WFS_CTIME);
+
+    if (flags & RENAME_EXCHANGE) {
+        // each entry is rewritten in place, swapping the inode numbers
+        if (dir_find(fparent, fname, 1, &fdent) < 0 || dir_find(tparent, tname, 1, &tdent) < 0) {
+            return wfs_error;
+        }
+        dir_slot_set(&fdent, target);
+        dir_slot_set(&tdent, inode);
+        touch_inode(target, WFS_CTIME);
+        return 0;
+    }
+
+    // files are linked twice for a moment, and counted that way first so a
+    // crash part way only leaves the count too high
+    int file = !S_ISDIR(inode->mode);
+    inode->nlinks += file;
+    if (target != NULL) {
+        // pointing the existing entry at the inode replaces it at once
+        if (dir_find(tparent, tname, 1, &tdent) < 0) {
+            inode->nlinks -= file;
+            return wfs_error;
+        }
+        dir_slot_set(&tdent, inode);
+    } else if (add_dentry(tparent, inode, tname) < 0) {
+        inode->nlinks -= file;
+        return wfs_error;
+    }
+    if (remove_dentry(fparent, inode->num, fname) < 0) {
+        return wfs_error;
+    }
+    inode->nlinks -= file;
+    if (target != NULL) {
+        drop_link(target);
+    }
+    return 0;
+}
+
+int wfs_rename(const char* from, const char* to) {
+    return wfs_rename2(from, to, 0);
+}
+
+int wfs_rmdir(const char *path)
+{
+    printf("wfs_rmdir: %s\n", path);
+    if (snapshot_name(path)) {
+        return snapshot_delete(snapshot_name(path));
+    }
+    if (in_snapshots(path)) {
+        return -EROFS;
+    }
+    struct wfs_inode* inode;
+    if (resolve_path(path, &inode, NULL) < 0) {
+        return wfs_error;
+    }
+    if (!S_ISDIR(inode->mode)) {
+        return -ENOTDIR;
+    }
+    if (!dir_empty(inode)) {
+        return -ENOTEMPTY;
+    }
+    // wfs_unlink updates parent directory times; rmdir should also adjust parent atime (access) minimally handled by getattr/read elsewhere
+    return wfs_unlink(path);
+}
+
+static int wfs_statfs(const char *path, struct statvfs *st) {
+    (void)path;
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    memset(st, 0, sizeof(*st));
+
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = sb->num_data_blocks;
+    st->f_files  = sb->num_inodes;
+
+    uint32_t groups = sb_groups(sb);
+    int used_inodes = 0;
+    for (uint32_t g = 0; g < groups; g++) {
+        if (!group_initialized(sb, g)) {
+            continue; // nothing allocated there yet
+        }
+        uint32_t* i_bm = (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr + group_offset(sb, g));
+        for (size_t i = 0; i < sb->num_inodes / groups / 32; i++)
+            used_inodes += __builtin_popcount(i_bm[i]);
+    }
+
+    struct wfs_free_stats space_now;
+    free_stats(&space_now);
+    st->f_bfree = space_now.free_blocks;
+    st->f_bavail = st->f_bfree;
+    st->f_ffree = sb->num_inodes - used_inodes;
+    st->f_namemax = name_max();
+
+    return 0;
+}
+
+// =========================
+// Checksums
+// =========================
+
+// checksum entries touched by the current operation, whose checksums are
+// out of date until csum_flush(): as a bitmap, and in the order touched
+static uint32_t* dirty_map;
+static size_t dirty_bits;
+static size_t* dirty_list;
+static size_t num_dirty, cap_dirty;
+
+// the checksum entry covering image offset `off`, numbered across groups
+// (group * csum_entries + entry), or -1 if nothing covers it
+static ssize_t csum_entry(off_t off) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!sb_has_csums(sb) || off < sb->i_bitmap_ptr) {
+        return -1;
+    }
+    uint32_t g = (off - sb->i_bitmap_ptr) / sb->group_size;
+    if (g >= sb_groups(sb) || !group_initialized(sb, g)) {
+        return -1;
+    }
+    size_t ipg = sb->num_inodes / sb_groups(sb);
+    size_t dpg = sb->num_data_blocks / sb_groups(sb);
+    off_t rel = off - group_offset(sb, g);
+    size_t e;
+    if (rel < sb->csum_ptr) {
+        e = 0;
+    } else if (rel < sb->i_blocks_ptr) {
+        return -1; // the checksum table itself
+    } else if (rel < sb->d_blocks_ptr) {
+        e = 1 + (rel - sb->i_blocks_ptr) / BLOCK_SIZE;
+    } else if (rel < sb->d_blocks_ptr + (off_t)(dpg * BLOCK_SIZE)) {
+        e = 1 + ipg + (rel - sb->d_blocks_ptr) / BLOCK_SIZE;
+    } else {
+        return -1;
+    }
+    return g * csum_entries(sb) + e;
+}
+
+// the bytes entry `e` covers, and where its checksum is kept
+static char* csum_range(size_t e, size_t* len, uint32_t** sum) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    size_t ipg = sb->num_inodes / sb_groups(sb);
+    off_t goff = group_offset(sb, e / csum_entries(sb));
+    e %= csum_entries(sb);
+
+    *sum = (uint32_t*)MMAP_PTR(sb->csum_ptr + goff) + e;
+    *len = BLOCK_SIZE;
+    if (e == 0) {
+        *len = sb->csum_ptr - sb->i_bitmap_ptr;
+        return MMAP_PTR(sb->i_bitmap_ptr + goff);
+    } else if (e <= ipg) {
+        return MMAP_PTR(sb->i_blocks_ptr + goff + (off_t)(e - 1) * BLOCK_SIZE);
+    }
+    return MMAP_PTR(sb->d_blocks_ptr + goff + (off_t)(e - 1 - ipg) * BLOCK_SIZE);
+}
+
+static int entry_dirty(size_t e) {
+    return e < dirty_bits && (dirty_map[e / 32] >> (e % 32)) & 0x1;
+}
+
+// the block (or group metadata) at `off` is going to change
+void csum_dirty(off_t off) {
+    ssize_t e = csum_entry(off);
+    if (e < 0 || entry_dirty(e)) {
+        return;
+    }
+    if ((size_t)e >= dirty_bits) {
+        size_t bits = 2 * ((size_t)e / 32 + 1) * 32;
+        dirty_map = realloc(dirty_map, bits / 8);
+        memset((char*)dirty_map + dirty_bits / 8, 0, (bits - dirty_bits) / 8);
+        dirty_bits = bits;
+    }
+    dirty_map[e / 32] |= 0x1U << (e % 32);
+    if (num_dirty == cap_dirty) {
+        cap_dirty = cap_dirty ? 2 * cap_dirty : 64;
+        dirty_list = realloc(dirty_list, cap_dirty * sizeof(size_t));
+    }
+    dirty_list[num_dirty++] = e;
+}
+
+// checks the block (or group metadata) at `off` against its checksum.
+// what the current operation has changed already is taken as it is
+int csum_verify(off_t off) {
+    ssize_t e = csum_entry(off);
+    if (e < 0 || entry_dirty(e)) {
+        return 0;
+    }
+    size_t len;
+    uint32_t* sum;
+    char* p = csum_range(e, &len, &sum);
+    if (crc32c(p, len) != *sum) {
+        printf("csum_verify: checksum mismatch at %ld\n", (long)off);
+        wfs_error = -EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// brings the checksums of everything touched up to date. called at the
+// end of every operation
+void csum_flush() {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!sb_has_csums(sb)) {
+        return;
+    }
+    for (size_t i = 0; i < num_dirty; i++) {
+        size_t e = dirty_list[i];
+        size_t len;
+        uint32_t* sum;
+        char* p = csum_range(e, &len, &sum);
+        // lookups mark what they may change: storing an unchanged sum
+        // would still dirty the page
+        uint32_t c = crc32c(p, len);
+        if (*sum != c) {
+            *sum = c;
+        }
+        dirty_map[e / 32] &= ~(0x1U << (e % 32));
+    }
+    num_dirty = 0;
+    uint32_t c = sb_checksum(sb);
+    if (sb->sb_csum != c) {
+        sb->sb_csum = c;
+    }
+}
+
+// the superblock and the bitmaps are checked once, at mount. inodes and
+// blocks are checked as they are read
+int csum_check_mount() {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!sb_has_csums(sb)) {
+        return 0;
+    }
+    if (sb_checksum(sb) != sb->sb_csum) {
+        printf("superblock checksum mismatch\n");
+        return -1;
+    }
+    for (uint32_t g = 0; g < sb_groups(sb); g++) {
+        if (csum_verify(sb->i_bitmap_ptr + group_offset(sb, g)) < 0) {
+            printf("group %u: bitmap checksum mismatch\n", g);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// =========================
+// Compression
+// =========================
+
+// whether reads and writes have to go through compression units
+int file_compressed(struct wfs_inode* inode) {
+    return (inode->flags & WFS_INODE_COMPRESS) || inode->zunits != 0;
+}
+
+// data blocks the inode holds on disk, indirect block included
+blkcnt_t inode_blocks(struct wfs_inode* inode) {
+    if (inode->flags & WFS_INODE_DTREE) {
+        return inode->size / BLOCK_SIZE; // one block per tree node
+    }
+    blkcnt_t n = 0;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        n += inode->blocks[i] != 0;
+    }
+    if (inode->blocks[IND_BLOCK] != 0) {
+        off_t* ind = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            n += ind[i] != 0;
+        }
+    }
+    return n;
+}
+
+// logical blocks unit u covers in a file of `size` bytes
+static int unit_blocks(off_t size, int u) {
+    int n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE - u * ZUNIT_BLOCKS;
+    return n < 0 ? 0 : n > ZUNIT_BLOCKS ? ZUNIT_BLOCKS : n;
+}
+
+// reads unit u into buf (ZUNIT_SIZE bytes), zero past the end of the file
+static int read_unit(struct wfs_inode* inode, int u, char* buf) {
+    int n = unit_blocks(inode->size, u);
+    char packed[ZUNIT_SIZE];
+    char* to = inode->zunits & (1U << u) ? packed : buf;
+    int have = 0;
+
+    memset(buf, 0, ZUNIT_SIZE);
+    for (; have < n; have++) {
+        char* addr = data_offset(inode, (off_t)(u * ZUNIT_BLOCKS + have) * BLOCK_SIZE, 0);
+        if (addr == NULL) {
+            if (wfs_error != 0) { return -1; }
+            if (to == packed) { break; } // the rest of a compressed unit is empty
+            continue;                    // a hole
+        }
+        memcpy(to + have * BLOCK_SIZE, addr, BLOCK_SIZE);
+    }
+    if (to == buf) {
+        return 0;
+    }
+
+    uint32_t clen;
+    memcpy(&clen, packed, sizeof(clen));
+    if (have == 0 || clen > have * BLOCK_SIZE - sizeof(clen) ||
+        lz_decompress(packed + sizeof(clen), clen, buf, ZUNIT_SIZE) < 0) {
+        printf("read_unit: inode %d unit %d is corrupt\n", inode->num, u);
+        wfs_error = -EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// stores unit u from buf for a file of `size` bytes: compressed if the
+// file wants that and it saves at least a block, as is otherwise. blocks
+// the unit no longer needs are let go of. every block is mapped before
+// any is written, so running out of space leaves the unit as it was
+static int store_unit(struct wfs_inode* inode, int u, const char* buf, off_t size) {
+    int n = unit_blocks(size, u);
+    char packed[ZUNIT_SIZE];
+    const char* from = buf;
+    int k = n;
+
+    if ((inode->flags & WFS_INODE_COMPRESS) && n > 1) {
+        uint32_t clen;
+        ssize_t len = lz_compress(buf, n * BLOCK_SIZE, packed + sizeof(clen),
+                                  (n - 1) * BLOCK_SIZE - sizeof(clen));
+        if (len >= 0) {
+            clen = len;
+            memcpy(packed, &clen, sizeof(clen));
+            k = (len + sizeof(clen) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            from = packed;
+        }
+    }
+
+    char* addrs[ZUNIT_BLOCKS];
+    off_t* unused[ZUNIT_BLOCKS];
+    int filled = 0; // holes given a block so far, one bit each
+    int i, b;
+    for (i = 0; i < k; i++) {
+        off_t pos = (off_t)(u * ZUNIT_BLOCKS + i) * BLOCK_SIZE;
+        if (data_offset(inode, pos, 0) == NULL) {
+            if (wfs_error != 0) { goto undo; }
+            filled |= 1 << i;
+        }
+        if ((addrs[i] = data_offset(inode, pos, 1)) == NULL) {
+            filled &= ~(1 << i);
+            goto undo;
+        }
+    }
+    for (b = k; b < ZUNIT_BLOCKS && u * ZUNIT_BLOCKS + b < MAX_FILE_BLOCKS; b++) {
+        off_t* slot = block_slot(inode, u * ZUNIT_BLOCKS + b, 0);
+        unused[b] = NULL;
+        if (slot != NULL && *slot != 0 &&
+            (unused[b] = block_slot(inode, u * ZUNIT_BLOCKS + b, 1)) == NULL) {
+            goto undo;
+        }
+    }
+
+    for (i = 0; i < k; i++) {
+        memcpy(addrs[i], from + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    for (int j = k; j < b; j++) {
+        if (unused[j] != NULL) {
+            off_t old = *unused[j];
+            *unused[j] = 0;
+            put_block(old);
+        }
+    }
+    if (from == packed) {
+        inode->zunits |= 1U << u;
+    } else {
+        inode->zunits &= ~(1U << u);
+    }
+    return 0;
+
+undo:
+    // the blocks given to holes go back; copies of shared blocks stay,
+    // they hold what the shared ones did
+    for (i = 0; i < ZUNIT_BLOCKS; i++) {
+        if (filled & (1 << i)) {
+            off_t* slot = block_slot(inode, u * ZUNIT_BLOCKS + i, 0);
+            off_t blk = *slot;
+            *slot = 0;
+            put_block(blk);
+        }
+    }
+    return -1;
+}
+
+ssize_t read_compressed(struct wfs_inode* inode, char* buf, size_t length, off_t offset) {
+    char unit[ZUNIT_SIZE];
+    size_t done = 0;
+
+    while (done < length && offset + (off_t)done < inode->size) {
+        off_t pos = offset + done;
+        if (read_unit(inode, pos / ZUNIT_SIZE, unit) < 0) {
+            return -1;
+        }
+        size_t n = ZUNIT_SIZE - pos % ZUNIT_SIZE;
+        if (n > length - done) { n = length - done; }
+        if (n > inode->size - pos) { n = inode->size - pos; }
+        memcpy(buf + done, unit + pos % ZUNIT_SIZE, n);
+        done += n;
+    }
+    return done;
+}
+
+// every unit the write touches is read, patched and stored again
+ssize_t write_compressed(struct wfs_inode* inode, const char* buf, size_t length, off_t offset) {
+    char unit[ZUNIT_SIZE];
+    off_t end = offset + length;
+
+    if (end > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        wfs_error = -EFBIG;
+        return -1;
+    }
+    for (int u = offset / ZUNIT_SIZE; (off_t)u * ZUNIT_SIZE < end; u++) {
+        off_t first = (off_t)u * ZUNIT_SIZE;
+        off_t from = offset > first ? offset : first;
+        off_t to = end < first + ZUNIT_SIZE ? end : first + ZUNIT_SIZE;
+        if (read_unit(inode, u, unit) < 0) {
+            return -1;
+        }
+        memcpy(unit + (from - first), buf + (from - offset), to - from);
+        off_t size = to > inode->size ? to : inode->size;
+        if (store_unit(inode, u, unit, size) < 0) {
+            // what the units before this one took is written
+            return from > offset ? from - offset : -1;
+        }
+        inode->size = size;
+    }
+    return length;
+}
+
+// turns compression on or off. a file's data is stored again the new way
+int set_compression(struct wfs_inode* inode, int on) {
+    if (on == !!(inode->flags & WFS_INODE_COMPRESS)) {
+        return 0;
+    }
+    if (cow_inode(inode) < 0) {
+        return -1;
+    }
+    int units = (inode->size + ZUNIT_SIZE - 1) / ZUNIT_SIZE;
+    char* data = malloc((size_t)units * ZUNIT_SIZE + 1);
+    for (int u = 0; u < units; u++) {
+        if (read_unit(inode, u, data + (size_t)u * ZUNIT_SIZE) < 0) {
+            free(data);
+            return -1;
+        }
+    }
+    inode->flags ^= WFS_INODE_COMPRESS;
+    for (int u = 0; u < units; u++) {
+        if (store_unit(inode, u, data + (size_t)u * ZUNIT_SIZE, inode->size) < 0) {
+            free(data);
+            return -1;
+        }
+    }
+    free(data);
+    return 0;
+}
+
+// =========================
+// Snapshots
+// =========================
+
+// group holding the data block at `blk`. data regions are group_size
+// apart, and each is shorter than a group
+static uint32_t block_group(off_t blk) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    return sb_groups(sb) > 1 ? (blk - sb->d_blocks_ptr) / sb->group_size : 0;
+}
+
+// extra references to a data block, NULL if the image has no counts
+uint16_t* block_refs(off_t blk) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!sb_has_refcounts(sb)) {
+        return NULL;
+    }
+    uint32_t g = block_group(blk);
+    off_t base = sb->d_blocks_ptr + group_offset(sb, g);
+    csum_dirty(sb->i_bitmap_ptr + group_offset(sb, g)); // the count is likely to change
+    return (uint16_t*)MMAP_PTR(sb->refcount_ptr + group_offset(sb, g)) + (blk - base) / BLOCK_SIZE;
+}
+
+int block_shared(off_t blk) {
+    uint16_t* refs = block_refs(blk);
+    return blk != 0 && refs && *refs > 0;
+}
+
+// a private copy of a shared block for `inode` to write to. the caller
+// points the inode at it, then drops its reference to the original, so a
+// crash in between only leaves a reference count too high. the copy gets
+// a fresh checksum, so a damaged original fails with EIO instead
+off_t copy_block(struct wfs_inode* inode, off_t blk) {
+    if (csum_verify(blk) < 0) {
+        return 0;
+    }
+    off_t copy = allocate_data_block(inode_group(inode));
+    if (copy == 0) {
+        wfs_error = -ENOSPC;
+        return 0;
+    }
+    memcpy(MMAP_PTR(copy), MMAP_PTR(blk), BLOCK_SIZE);
+    return copy;
+}
+
+// drops one reference to a block, freeing it with the last one
+void put_block(off_t blk) {
+    uint16_t* refs = block_refs(blk);
+    if (refs && *refs > 0) {
+        (*refs)--;
+        return;
+    }
+    free_block(blk);
+}
+
+// drops an inode's references to its blocks. the blocks an indirect block
+// points to are only let go of along with the indirect block itself
+void release_blocks(struct wfs_inode* inode) {
+    off_t ind = inode->blocks[IND_BLOCK];
+    if (ind != 0 && !block_shared(ind)) {
+        off_t* blks_arr = (off_t*)MMAP_PTR(ind);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            if (blks_arr[i] != 0) { put_block(blks_arr[i]); }
+        }
+    }
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (inode->blocks[i] != 0) { put_block(inode->blocks[i]); }
+    }
+    if (inode->dtree != 0) {
+        dtree_release(inode->dtree, no_bound);
+    }
+    if (inode->xattr != 0) {
+        xattr_put(inode->xattr);
+    }
+}
+
+static struct wfs_snapshot* snapshot_table() {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    return sb->snap_table ? (struct wfs_snapshot*)MMAP_PTR(sb->snap_table) : NULL;
+}
+
+// slot for inode `num` in a snapshot's inode map. with `alloc` missing
+// levels are added, otherwise NULL is returned where the map ends
+static off_t* map_slot(struct wfs_snapshot* snap, int num, int alloc) {
+    size_t cap = 1;
+    for (uint32_t h = 0; h < snap->height; h++) {
+        cap *= MAP_FANOUT;
+    }
+    // a taller tree keeps the old one as its first subtree
+    while (snap->height == 0 || (size_t)num >= cap) {
+        off_t root = alloc ? allocate_data_block(0) : 0;
+        if (root == 0) {
+            if (alloc) { wfs_error = -ENOSPC; }
+            return NULL;
+        }
+        *(off_t*)MMAP_PTR(root) = snap->map;
+        snap->map = root;
+        snap->height++;
+        csum_dirty(MMAP_OFF(snap));
+        cap *= MAP_FANOUT;
+    }
+
+    off_t* slot = &snap->map;
+    for (uint32_t h = snap->height; h > 0; h--) {
+        if (*slot == 0) {
+            if (!alloc) {
+                return NULL;
+            }
+            if ((*slot = allocate_data_block(0)) == 0) {
+                wfs_error = -ENOSPC;
+                return NULL;
+            }
+            csum_dirty(MMAP_OFF(slot));
+        }
+        cap /= MAP_FANOUT;
+        slot = (off_t*)MMAP_PTR(*slot) + num / cap;
+        num %= cap;
+    }
+    return slot;
+}
+
+// whether some snapshot sees the live inode rather than a copy of it
+int snapshot_sees(struct wfs_inode* inode) {
+    struct wfs_snapshot* snaps = snapshot_table();
+    for (size_t i = 0; snaps && i < MAX_SNAPSHOTS; i++) {
+        if (snaps[i].name[0] != '\0' && snaps[i].epoch >= inode->epoch) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// must be called before an inode or anything it points to is modified.
+// gives every snapshot that still sees the live inode a copy of it; the
+// copy shares all of the inode's blocks until they are written to
+int cow_inode(struct wfs_inode* inode) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    struct wfs_snapshot* snaps = snapshot_table();
+    off_t copy = 0;
+
+    for (size_t i = 0; snaps && i < MAX_SNAPSHOTS; i++) {
+        struct wfs_snapshot* snap = &snaps[i];
+        if (snap->name[0] == '\0' || snap->epoch < inode->epoch) {
+            continue;
+        }
+        off_t* slot = map_slot(snap, inode->num, 1);
+        if (slot == NULL) {
+            return -1;
+        }
+        if (*slot != 0) {
+            continue; // copied by an earlier, interrupted call
+        }
+        if (copy == 0) {
+            if ((copy = allocate_data_block(inode_group(inode))) == 0) {
+                wfs_error = -ENOSPC;
+                return -1;
+            }
+            // the whole slot, the attributes kept in it included
+            memcpy(MMAP_PTR(copy), inode, BLOCK_SIZE);
+            for (int b = 0; b < N_BLOCKS; b++) {
+                if (inode->blocks[b] != 0) { (*block_refs(inode->blocks[b]))++; }
+            }
+            if (inode->dtree != 0) { (*block_refs(inode->dtree))++; }
+            if (inode->xattr != 0) { (*block_refs(inode->xattr))++; }
+        } else {
+            (*block_refs(copy))++;
+        }
+        *slot = copy;
+        csum_dirty(MMAP_OFF(slot));
+    }
+    inode->epoch = sb->snap_epoch;
+    return 0;
+}
+
+// inode `num` as a snapshot sees it: its copy if it has been modified
+// since the snapshot was taken, the live inode otherwise
+struct wfs_inode* snapshot_inode(struct wfs_snapshot* snap, int num) {
+    off_t* slot = map_slot(snap, num, 0);
+    if (slot && *slot != 0) {
+        return csum_verify(*slot) < 0 ? NULL : (struct wfs_inode*)MMAP_PTR(*slot);
+    }
+    struct wfs_inode* inode = retrieve_inode(num);
+    return inode && inode->epoch <= snap->epoch ? inode : NULL;
+}
+
+struct wfs_snapshot* find_snapshot(const char* name) {
+    struct wfs_snapshot* snaps = snapshot_table();
+    for (size_t i = 0; snaps && i < MAX_SNAPSHOTS; i++) {
+        if (snaps[i].name[0] != '\0' && strncmp(snaps[i].name, name, MAX_NAME) == 0) {
+            return &snaps[i];
+        }
+    }
+    return NULL;
+}
+
+// SNAP_DIR is not on disk. it looks like an empty, read-only directory
+// to everything but readdir, which lists the snapshots in it
+struct wfs_inode* snapshot_dir() {
+    static struct wfs_inode dir;
+    struct wfs_inode* root = retrieve_inode(0);
+    memset(&dir, 0, sizeof(dir));
+    dir.num = -1;
+    dir.mode = S_IFDIR | 0555;
+    dir.uid = root->uid;
+    dir.gid = root->gid;
+    dir.nlinks = 2;
+    dir.atim = dir.mtim = dir.ctim = root->ctim;
+    dir.atim_ns = dir.mtim_ns = dir.ctim_ns = root->ctim_ns;
+    return &dir;
+}
+
+static int list_snapshots(void* buf, fuse_fill_dir_t filler) {
+    struct wfs_snapshot* snaps = snapshot_table();
+    for (size_t i = 0; snaps && i < MAX_SNAPSHOTS; i++) {
+        if (snaps[i].name[0] != '\0') {
+            char name[MAX_NAME + 1] = {0};
+            memcpy(name, snaps[i].name, MAX_NAME);
+            filler(buf, name, NULL, 0);
+        }
+    }
+    return 0;
+}
+
+// taking a snapshot only writes its record: nothing is copied until the
+// live tree changes
+int snapshot_create(const char* name) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    printf("snapshot_create: %s at epoch %u\n", name, sb->snap_epoch);
+    if (!sb_has_refcounts(sb)) {
+        return -EOPNOTSUPP;
+    }
+    if (strlen(name) >= MAX_NAME) {
+        return -ENAMETOOLONG;
+    }
+    lazy_flush(); // the snapshot gets the times of everything before it
+    if (find_snapshot(name)) {
+        return -EEXIST;
+    }
+    if (sb->snap_table == 0 && (sb->snap_table = allocate_data_block(0)) == 0) {
+        return -ENOSPC;
+    }
+    struct wfs_snapshot* snaps = snapshot_table();
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snaps[i].name[0] != '\0') {
+            continue;
+        }
+        snaps[i].epoch = sb->snap_epoch;
+        snaps[i].height = 0;
+        snaps[i].map = 0;
+        // the name makes the record live; only then can the epoch move on
+        strncpy(snaps[i].name, name, MAX_NAME);
+        sb->snap_epoch++;
+        csum_dirty(sb->snap_table);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+// drops a snapshot's reference to a copied inode
+static void put_copy(off_t copy) {
+    uint16_t* refs = block_refs(copy);
+    if (*refs > 0) {
+        (*refs)--;
+        return;
+    }
+    release_blocks((struct wfs_inode*)MMAP_PTR(copy));
+    free_block(copy);
+}
+
+static void free_map(off_t blk, uint32_t level) {
+    off_t* slots = (off_t*)MMAP_PTR(blk);
+    for (size_t i = 0; i < MAP_FANOUT; i++) {
+        if (slots[i] == 0) {
+            continue;
+        }
+        if (level == 1) {
+            put_copy(slots[i]);
+        } else {
+            free_map(slots[i], level - 1);
+        }
+    }
+    free_block(blk);
+}
+
+// the record goes first, so a crash part way through only leaks space.
+// blocks shared with the live tree or other snapshots are kept
+int snapshot_delete(const char* name) {
+    printf("snapshot_delete: %s\n", name);
+    struct wfs_snapshot* snap = find_snapshot(name);
+    if (snap == NULL) {
+        return -ENOENT;
+    }
+    off_t map = snap->map;
+    uint32_t height = snap->height;
+    memset(snap, 0, sizeof(struct wfs_snapshot));
+    csum_dirty(MMAP_OFF(snap));
+    if (map != 0) {
+        free_map(map, height);
+    }
+    return 0;
+}
+
+// =========================
+// Reflinks
+// =========================
+
+// points dst's logical block `blocknum` at `blk`. returns 1 if it did, 0
+// if `blk` has run out of references and has to be copied instead
+static int share_block(struct wfs_inode* dst, int blocknum, off_t blk) {
+    uint16_t* refs = block_refs(blk);
+    if (*refs == UINT16_MAX) {
+        return 0;
+    }
+    off_t* slot = block_slot(dst, blocknum, 1);
+    if (slot == NULL) {
+        return -1;
+    }
+    // reference first: a crash before the old block is dropped only
+    // leaves counts too high
+    off_t old = *slot;
+    (*refs)++;
+    *slot = blk;
+    if (old != 0) {
+        put_block(old);
+    }
+    return 1;
+}
+
+// a whole file cloned into an empty one takes over the source's block
+// pointers as they are, indirect block included, like a snapshot copy
+static int clone_file(struct wfs_inode* dst, struct wfs_inode* src, struct wfs_clone_args* args) {
+    for (int b = 0; b < N_BLOCKS; b++) {
+        if (src->blocks[b] != 0 && *block_refs(src->blocks[b]) == UINT16_MAX) {
+            return 0;
+        }
+    }
+    for (int b = 0; b < N_BLOCKS; b++) {
+        if (src->blocks[b] != 0) {
+            (*block_refs(src->blocks[b]))++;
+            args->shared_blocks++;
+        }
+        dst->blocks[b] = src->blocks[b];
+    }
+    dst->zunits = src->zunits;
+    if (src->blocks[IND_BLOCK] != 0) {
+        off_t* ind = (off_t*)MMAP_PTR(src->blocks[IND_BLOCK]);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            args->shared_blocks += ind[i] != 0;
+        }
+    }
+    dst->size = src->size;
+    return 1;
+}
+
+// copy_file_range() without the copying: every source block that lines up
+// with a whole destination block is shared, and only the unaligned parts
+// at either end are copied. the shared blocks are copied on write
+static int clone_range(const char* path, struct wfs_clone_args* args) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    struct wfs_inode *src, *dst;
+    if (!sb_has_refcounts(sb)) {
+        return -EOPNOTSUPP;
+    }
+    if (in_snapshots(path)) {
+        return -EROFS;
+    }
+    // the source may be in a snapshot, which brings a file back from it
+    args->src[sizeof(args->src) - 1] = '\0';
+    if (resolve_path(args->src, &src, NULL) < 0 || get_inode_from_path((char*)path, &dst) < 0) {
+        return wfs_error;
+    }
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) {
+        return -EISDIR;
+    }
+
+    off_t src_off = args->src_offset, dst_off = args->dst_offset;
+    off_t len = src_off < src->size ? src->size - src_off : 0;
+    if (args->length != 0 && (off_t)args->length < len) {
+        len = args->length;
+    }
+    if (dst_off + len > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (src == dst && src_off < dst_off + len && dst_off < src_off + len) {
+        return -EINVAL;
+    }
+    if (cow_inode(dst) < 0) {
+        return wfs_error;
+    }
+    args->cloned = 0;
+    args->shared_blocks = 0;
+
+    if (src_off == 0 && dst_off == 0 && len == src->size && dst->size == 0 &&
+        dst->blocks[0] == 0 && dst->blocks[IND_BLOCK] == 0 && clone_file(dst, src, args)) {
+        args->cloned = len;
+    } else if (src->zunits || dst->zunits) {
+        return -EOPNOTSUPP; // compressed blocks only make sense as a whole file
+    }
+
+    while ((off_t)args->cloned < len) {
+        off_t s = src_off + args->cloned, d = dst_off + args->cloned;
+        off_t chunk = BLOCK_SIZE - s % BLOCK_SIZE;
+        if (chunk > BLOCK_SIZE - d % BLOCK_SIZE) {
+            chunk = BLOCK_SIZE - d % BLOCK_SIZE;
+        }
+        if (chunk > len - (off_t)args->cloned) {
+            chunk = len - args->cloned;
+        }
+        off_t* src_slot = block_slot(src, s / BLOCK_SIZE, 0);
+        off_t blk = src_slot ? *src_slot : 0;
+
+        // whole blocks, or the source's last block landing at or past the
+        // end of the destination, where the rest of the block is unused
+        int shared = 0;
+        if (blk != 0 && s % BLOCK_SIZE == 0 && d % BLOCK_SIZE == 0 &&
+            (chunk == BLOCK_SIZE || (s + chunk == src->size && d + chunk >= dst->size))) {
+            if ((shared = share_block(dst, d / BLOCK_SIZE, blk)) < 0) {
+                return wfs_error;
+            }
+            args->shared_blocks += shared;
+        }
+        if (!shared) {
+            char* to = data_offset(dst, d, 1);
+            if (to == NULL) {
+                return wfs_error;
+            }
+            if (blk != 0) {
+                memcpy(to, MMAP_PTR(blk) + s % BLOCK_SIZE, chunk);
+            } else {
+                memset(to, 0, chunk); // a hole
+            }
+        }
+        args->cloned += chunk;
+        if (d + chunk > dst->size) {
+            dst->size = d + chunk;
+        }
+    }
+
+    touch_inode(dst, WFS_MTIME | WFS_CTIME);
+    printf("clone_range: %s -> %s, %lu bytes, %u blocks shared\n", args->src, path,
+           (unsigned long)args->cloned, args->shared_blocks);
+    return 0;
+}
+
+// =========================
+// Deduplication (-o dedup)
+// =========================
+
+// An in-core index from the CRC32C of a file data block to the blocks
+// with that content. A whole-block write whose bytes some block already
+// holds shares that block, the way a clone does, instead of taking a new
+// one. Hashes only pick candidates, the bytes are compared before sharing.
+// The index is rebuilt from the files at mount, and blocks leave it as
+// they are freed or about to be written in place. Arrays are indexed by
+// data block number across groups.
+
+#define DEDUP_BUCKETS_SHIFT (3) // one bucket per 8 data blocks
+#define DEDUP_NONE (UINT32_MAX)
+
+static uint32_t* dedup_head;  // bucket -> first block in its chain
+static uint32_t* dedup_next;  // block -> next block in its chain
+static uint32_t* dedup_hash;  // block -> hash it was indexed under
+static uint8_t* dedup_in;     // block -> in the index
+static size_t dedup_buckets;
+static size_t dedup_blocks;
+static struct wfs_dedup_stats dedup_stats;
+
+static uint32_t data_block_num(off_t blk) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    uint32_t g = block_group(blk);
+    size_t dpg = sb->num_data_blocks / sb_groups(sb);
+    return g * dpg + (blk - sb->d_blocks_ptr - group_offset(sb, g)) / BLOCK_SIZE;
+}
+
+static off_t data_block_at(uint32_t n) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    size_t dpg = sb->num_data_blocks / sb_groups(sb);
+    return sb->d_blocks_ptr + group_offset(sb, n / dpg) + (off_t)(n % dpg) * BLOCK_SIZE;
+}
+
+void dedup_insert(off_t blk, uint32_t hash) {
+    uint32_t n = data_block_num(blk);
+    if (dedup_in[n]) {
+        return;
+    }
+    size_t b = hash % dedup_buckets;
+    dedup_hash[n] = hash;
+    dedup_next[n] = dedup_head[b];
+    dedup_head[b] = n;
+    dedup_in[n] = 1;
+    dedup_stats.indexed_blocks++;
+}
+
+// `blk` is being freed or written in place, it can no longer be matched
+void dedup_forget(off_t blk) {
+    if (dedup_in == NULL || !dedup_in[data_block_num(blk)]) {
+        return;
+    }
+    uint32_t n = data_block_num(blk);
+    uint32_t* link = &dedup_head[dedup_hash[n] % dedup_buckets];
+    while (*link != n) {
+        link = &dedup_next[*link];
+    }
+    *link = dedup_next[n];
+    dedup_in[n] = 0;
+    dedup_stats.indexed_blocks--;
+}
+
+// a block holding exactly `data`, 0 if there is none
+static off_t dedup_find(const char* data, uint32_t hash) {
+    for (uint32_t n = dedup_head[hash % dedup_buckets]; n != DEDUP_NONE; n = dedup_next[n]) {
+        off_t blk = data_block_at(n);
+        if (dedup_hash[n] == hash && memcmp(MMAP_PTR(blk), data, BLOCK_SIZE) == 0 &&
+            csum_verify(blk) == 0) {
+            return blk;
+        }
+    }
+    wfs_error = 0; // a block failing its checksum is just not a match
+    return 0;
+}
+
+// sizes the index for the data blocks the image has now. new blocks
+// start out unindexed
+static void dedup_grow() {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    size_t n = sb->num_data_blocks;
+    dedup_next = realloc(dedup_next, n * sizeof(uint32_t));
+    dedup_hash = realloc(dedup_hash, n * sizeof(uint32_t));
+    dedup_in = realloc(dedup_in, n);
+    memset(dedup_in + dedup_blocks, 0, n - dedup_blocks);
+    dedup_blocks = n;
+}
+
+// indexes the data blocks of every regular file. indirect blocks and
+// directories are left out, nothing but file data is ever shared this way
+void dedup_load() {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!options.dedup) {
+        return;
+    }
+    if (!sb_has_refcounts(sb)) {
+        printf("dedup: the image has no reference counts, not deduplicating\n");
+        options.dedup = 0;
+        return;
+    }
+    dedup_buckets = (sb->num_data_blocks >> DEDUP_BUCKETS_SHIFT) + 1;
+    dedup_head = malloc(dedup_buckets * sizeof(uint32_t));
+    memset(dedup_head, 0xFF, dedup_buckets * sizeof(uint32_t)); // DEDUP_NONE
+    dedup_grow();
+
+    for (size_t num = 0; num < sb->num_inodes; num++) {
+        struct wfs_inode* inode = inode_slot(num);
+        if (inode == NULL || !S_ISREG(inode->mode)) {
+            continue;
+        }
+        for (int b = 0; b < MAX_FILE_BLOCKS; b++) {
+            off_t* slot = block_slot(inode, b, 0);
+            if (slot != NULL && *slot != 0 && csum_verify(*slot) == 0) {
+                dedup_insert(*slot, crc32c(MMAP_PTR(*slot), BLOCK_SIZE));
+            }
+        }
+    }
+    wfs_error = 0;
+    printf("dedup: %u blocks indexed\n", dedup_stats.indexed_blocks);
+}
+
+// logical block `blocknum` of `inode` is about to be overwritten whole
+// with `data`. returns 1 if it now shares a block already holding those
+// bytes, 0 if the caller has to write them, after which it indexes the
+// block under `hash`
+int dedup_write(struct wfs_inode* inode, int blocknum, const char* data, uint32_t* hash) {
+    *hash = crc32c(data, BLOCK_SIZE);
+    dedup_stats.blocks_written++;
+    off_t blk = dedup_find(data, *hash);
+    if (blk == 0) {
+        return 0;
+    }
+    off_t* slot = block_slot(inode, blocknum, 0);
+    if (slot == NULL && wfs_error != 0) {
+        return -1;
+    }
+    if (slot == NULL || *slot != blk) { // already sharing it otherwise
+        int shared = share_block(inode, blocknum, blk);
+        if (shared <= 0) {
+            return shared;
+        }
+    }
+    dedup_stats.blocks_deduped++;
+    return 1;
+}
+
+// =========================
+// Online resize
+// =========================
+
+static int grow_fs(struct wfs_grow_args* args) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (!sb_is_extended(sb)) {
+        return -EOPNOTSUPP;
+    }
+    uint32_t groups = sb->num_groups;
+    size_t ipg = sb->num_inodes / groups;
+    size_t dpg = sb->num_data_blocks / groups;
+    size_t add = args->add_groups;
+
+    // inode numbers are ints
+    if ((groups + add) * ipg > INT_MAX) {
+        return -EFBIG;
+    }
+    off_t old_end = sb->i_bitmap_ptr + (off_t)groups * sb->group_size;
+    off_t new_end = sb->i_bitmap_ptr + (off_t)(groups + add) * sb->group_size;
+    size_t old_size = msize;
+
+    if ((size_t)new_end > msize) {
+        if (vol_truncate(&volume, new_end) < 0) {
+            return -errno;
+        }
+        void* region = bio_resize(new_end);
+        if (region == NULL) {
+            int err = errno;
+            vol_truncate(&volume, msize);
+            return -err;
+        }
+        mregion = region;
+        msize = new_end;
+        sb = (struct wfs_sb*)mregion;
+    }
+
+    // the new groups must start out empty. whatever ftruncate added is
+    // already zero, only space the image file had before needs clearing.
+    // lazily initialized images clear groups when they are first used
+    if (!sb_lazy_init(sb) && (size_t)old_end < old_size) {
+        size_t end = (size_t)new_end < old_size ? (size_t)new_end : old_size;
+        memset(MMAP_PTR(old_end), 0, end - old_end);
+    }
+
+    // the new groups only become visible once the superblock says so
+    sb->num_inodes += add * ipg;
+    sb->num_data_blocks += add * dpg;
+    sb->num_groups += add;
+    load_alloc_summary();
+    if (options.dedup) {
+        dedup_grow();
+    }
+    for (uint32_t g = groups; g < sb->num_groups && group_initialized(sb, g); g++) {
+        advise_group(g);
+    }
+
+    printf("grow_fs: %u -> %u groups, %zu inodes, %zu data blocks\n",
+           groups, sb->num_groups, sb->num_inodes, sb->num_data_blocks);
+    args->num_groups = sb->num_groups;
+    return 0;
+}
+
+// =========================
+// Online defragmentation
+// =========================
+
+// most blocks a single inode can hold: direct, indirect, and the entries
+// of the indirect block
+#define MAX_INODE_BLOCKS (N_BLOCKS + BLOCK_SIZE / sizeof(off_t))
+
+// collect an inode's blocks in the order we want them on disk: the direct
+// blocks, then the indirect block itself, then the blocks it points to.
+// returns the number of blocks
+static int collect_blocks(struct wfs_inode* inode, off_t* blks) {
+    int n = 0;
+    for (int i = 0; i <= D_BLOCK; i++) {
+        if (inode->blocks[i] != 0) { blks[n++] = inode->blocks[i]; }
+    }
+    if (inode->blocks[IND_BLOCK] != 0) {
+        off_t* ind = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
+        blks[n++] = inode->blocks[IND_BLOCK];
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            if (ind[i] != 0) { blks[n++] = ind[i]; }
+        }
+    }
+    return n;
+}
+
+// number of physically contiguous runs in a block list
+static int count_extents(off_t* blks, int n) {
+    int extents = n > 0;
+    for (int i = 1; i < n; i++) {
+        if (blks[i] != blks[i-1] + BLOCK_SIZE) { extents++; }
+    }
+    return extents;
+}
+
+// frees every block at or past logical block `keep` of a file or directory
+static void truncate_blocks(struct wfs_inode* inode, int keep) {
+    for (int i = keep; i <= D_BLOCK; i++) {
+        if (inode->blocks[i] != 0) {
+            free_block(inode->blocks[i]);
+            inode->blocks[i] = 0;
+        }
+    }
+    if (inode->blocks[IND_BLOCK] == 0) {
+        return;
+    }
+    off_t* ind = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
+    int first = keep > IND_BLOCK ? keep - IND_BLOCK : 0;
+    for (int i = first; i < BLOCK_SIZE / sizeof(off_t); i++) {
+        if (ind[i] != 0) {
+            free_block(ind[i]);
+            ind[i] = 0;
+        }
+    }
+    csum_dirty(inode->blocks[IND_BLOCK]);
+    if (first == 0) {
+        free_block(inode->blocks[IND_BLOCK]);
+        inode->blocks[IND_BLOCK] = 0;
+    }
+}
+
+// an inode whose blocks a snapshot relies on stays as it is: moving the
+// blocks would pull them out from under the snapshot, and compacting a
+// directory would rewrite them in place
+static int snapshot_pinned(struct wfs_inode* inode) {
+    off_t blks[MAX_INODE_BLOCKS];
+    if (snapshot_sees(inode)) {
+        return 1;
+    }
+    int n = collect_blocks(inode, blks);
+    for (int i = 0; i < n; i++) {
+        if (block_shared(blks[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// moves the live dentries of a directory into the room left in earlier
+// blocks by remove_dentry(), and frees the blocks at the end that end up
+// empty. returns the number of blocks freed. a file is linked from both
+// blocks for a moment and counted that way, so a crash only leaves its
+// link count too high. directories stay where they are: fsck could not
+// tell which of two entries for one is the real one
+static int compact_dir(struct wfs_inode* dir) {
+    if (dir->flags & WFS_INODE_DTREE) {
+        return 0; // a tree frees its nodes as they empty
+    }
+    int kind = list_kind();
+    int had = dir->size / BLOCK_SIZE, keep = 0;
+    for (int b = 0; b < had; b++) {
+        char* area = data_offset(dir, (off_t)b * BLOCK_SIZE, 0);
+        if (area == NULL && wfs_error != 0) {
+            return 0; // unreadable, leave it be
+        }
+        struct wfs_rec r;
+        for (int off = 0; area && rec_at(area, BLOCK_SIZE, kind, off, &r) > 0; off += r.size) {
+            if (r.id == 0) {
+                continue;
+            }
+            struct wfs_inode* inode = b > 0 ? retrieve_inode(r.id) : NULL;
+            int to = 0, room = -1;
+            char* dst = NULL;
+            for (; inode && !S_ISDIR(inode->mode) && to < b && room < 0; to++) {
+                dst = data_offset(dir, (off_t)to * BLOCK_SIZE, 0);
+                room = dst ? area_room(dst, BLOCK_SIZE, kind, rec_need(kind, r.len)) : -1;
+            }
+            if (room < 0 || cow_inode(inode) < 0 ||
+                (dst = data_offset(dir, (off_t)(to - 1) * BLOCK_SIZE, 1)) == NULL ||
+                (area = data_offset(dir, (off_t)b * BLOCK_SIZE, 1)) == NULL) {
+                keep = b + 1;
+                area = data_offset(dir, (off_t)b * BLOCK_SIZE, 0);
+                continue;
+            }
+            rec_at(area, BLOCK_SIZE, kind, off, &r);
+            inode->nlinks++;
+            area_put(dst + room, kind, r.name, r.len, r.id, r.type);
+            area_del(area, BLOCK_SIZE, kind, r.at);
+            inode->nlinks--;
+            keep = keep > to ? keep : to;
+        }
+    }
+    wfs_error = 0;
+
+    if (keep == had) {
+        return 0;
+    }
+    // size first: blocks past it are only a leak to fsck, a hole inside
+    // it is damage
+    dir->size = keep * BLOCK_SIZE;
+    truncate_blocks(dir, keep);
+    return had - keep;
+}
+
+// after a delete: gives back the blocks a directory no longer needs, so
+// lookups and listings scan about as many blocks as the entries need. a
+// directory is compacted once it is less than half full or its last
+// block is empty. directories sharing blocks with a snapshot are left to
+// the snapshot's deletion
+static void shrink_dir(struct wfs_inode* dir) {
+    size_t live = 0, used = 0;
+    int kind = list_kind(), end = 0;
+    if (dir->flags & WFS_INODE_DTREE) {
+        return;
+    }
+    for (int b = 0; b < dir->size / BLOCK_SIZE; b++) {
+        char* area = data_offset(dir, (off_t)b * BLOCK_SIZE, 0);
+        if (area == NULL && wfs_error != 0) {
+            wfs_error = 0;
+            return;
+        }
+        struct wfs_rec r;
+        for (int off = 0; area && rec_at(area, BLOCK_SIZE, kind, off, &r) > 0; off += r.size) {
+            if (r.id != 0) {
+                live++;
+                used += rec_need(kind, r.len);
+                end = b + 1;
+            }
+        }
+    }
+    if (end == dir->size / BLOCK_SIZE && (2 * used >= dir->size || dir->size == BLOCK_SIZE)) {
+        return; // nothing to give back
+    }
+    if (snapshot_pinned(dir)) {
+        return;
+    }
+    int freed = compact_dir(dir);
+    printf("shrink_dir: %d, %zu entries, %d blocks freed\n", dir->num, live, freed);
+}
+
+// copies an inode's blocks into one contiguous run and frees the old ones.
+// returns the number of blocks moved; 0 if the inode was already contiguous
+// or no free run is large enough
+static int relocate_blocks(struct wfs_inode* inode) {
+    off_t old[MAX_INODE_BLOCKS];
+    int n = collect_blocks(inode, old);
+    if (count_extents(old, n) <= 1) {
+        return 0;
+    }
+    // the copies get fresh checksums: a file with a damaged block is left
+    // where it is, for wfs-fsck to report
+    for (int i = 0; i < n; i++) {
+        if (csum_verify(old[i]) < 0) {
+            wfs_error = 0;
+            return 0;
+        }
+    }
+    off_t run = allocate_data_run(inode_group(inode), n);
+    if (run == 0) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        memcpy(MMAP_PTR(run + i*BLOCK_SIZE), MMAP_PTR(old[i]), BLOCK_SIZE);
+    }
+
+    // rewrite the pointers in the same order collect_blocks() produced them.
+    // the indirect entries are updated in the new copy of the indirect block
+    int k = 0;
+    for (int i = 0; i <= D_BLOCK; i++) {
+        if (inode->blocks[i] != 0) { inode->blocks[i] = run + BLOCK_SIZE * k++; }
+    }
+    if (inode->blocks[IND_BLOCK] != 0) {
+        inode->blocks[IND_BLOCK] = run + BLOCK_SIZE * k++;
+        off_t* ind = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            if (ind[i] != 0) { ind[i] = run + BLOCK_SIZE * k++; }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        free_block(old[i]);
+    }
+    return n;
+}
+
+// adds up the nodes of a directory B+-tree, in key order. `prev` is the
+// node counted last, for telling where a new extent starts
+static void dtree_stats(off_t blk, const char* hi, struct wfs_frag_stats* st, off_t* prev) {
+    struct wfs_dtree_node* node = dtree_node(blk);
+    if (node == NULL) {
+        wfs_error = 0;
+        return;
+    }
+    st->dir_blocks++;
+    st->dir_extents += blk != *prev + BLOCK_SIZE;
+    *prev = blk;
+    struct wfs_rec recs[DTREE_AREA / 8], r;
+    int n = 0;
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, node_kind(node), off, &r) > 0; off += r.size) {
+        if (node->level == 0) {
+            st->dir_slots++;
+            st->dir_live += rec_live(&r, hi);
+        } else if (rec_live(&r, hi)) {
+            recs[n++] = r;
+        }
+    }
+    qsort(recs, n, sizeof(struct wfs_rec), cmp_rec);
+    char next[WFS_NAME_MAX + 1];
+    for (int k = 0; k < n; k++) {
+        dtree_kid_bound(node, hi, &recs[k], next);
+        dtree_stats(recs[k].id, next, st, prev);
+    }
+}
+
+static void frag_stats(struct wfs_frag_stats* st) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    off_t blks[MAX_INODE_BLOCKS];
+    memset(st, 0, sizeof(*st));
+
+    for (int num = 0; num < sb->num_inodes; num++) {
+        struct wfs_inode* inode = retrieve_inode(num);
+        if (inode == NULL) {
+            continue;
+        }
+        int n = collect_blocks(inode, blks);
+        int extents = count_extents(blks, n);
+        if (S_ISDIR(inode->mode) && (inode->flags & WFS_INODE_DTREE)) {
+            st->dirs++;
+            off_t prev = 0;
+            if (inode->dtree != 0) {
+                dtree_stats(inode->dtree, no_bound, st, &prev);
+            }
+        } else if (S_ISDIR(inode->mode)) {
+            st->dirs++;
+            st->dir_blocks += n;
+            st->dir_extents += extents;
+            for (off_t blk = 0; blk < inode->size; blk += BLOCK_SIZE) {
+                char* area = data_offset(inode, blk, 0);
+                struct wfs_rec r;
+                for (int off = 0; area && rec_at(area, BLOCK_SIZE, list_kind(), off, &r) > 0; off += r.size) {
+                    st->dir_slots++;
+                    st->dir_live += r.id != 0;
+                }
+            }
+            wfs_error = 0;
+        } else if (n > 0) {
+            st->files++;
+            st->fragmented_files += extents > 1;
+            st->file_blocks += n;
+            st->file_extents += extents;
+        }
+    }
+
+    // free runs never span groups: the next group's metadata is in between
+    uint32_t groups = sb_groups(sb);
+    for (uint32_t g = 0; g < groups; g++) {
+        size_t per_group = sb->num_data_blocks / groups;
+        if (!group_initialized(sb, g)) {
+            // one free run, all of it
+            st->free_blocks += per_group;
+            st->free_extents++;
+            if (per_group > st->largest_free) { st->largest_free = per_group; }
+            continue;
+        }
+        uint32_t* bitmap = (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr + group_offset(sb, g));
+        uint32_t run = 0;
+        for (size_t i = 0; i < per_group; i++) {
+            if ((bitmap[i / 32] >> (i % 32)) & 0x1) {
+                run = 0;
+                continue;
+            }
+            st->free_blocks++;
+            st->free_extents += run == 0;
+            if (++run > st->largest_free) { st->largest_free = run; }
+        }
+    }
+}
+
+// one throttled defragmentation step: compacts directories and moves each
+// inode's blocks into a contiguous run until the block budget is spent.
+// an inode is always processed whole, so the budget can be overshot by one
+// inode's worth of blocks. a budget of 0 would never get past the cursor
+static int defrag_step(struct wfs_defrag_args* args) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    uint32_t num = args->cursor;
+    if (args->max_blocks == 0) {
+        return -EINVAL;
+    }
+    args->moved = 0;
+
+    for (; num < sb->num_inodes && args->moved < args->max_blocks; num++) {
+        struct wfs_inode* inode = retrieve_inode(num);
+        if (inode == NULL || snapshot_pinned(inode)) {
+            continue;
+        }
+        if (S_ISDIR(inode->mode)) {
+            args->moved += compact_dir(inode);
+        }
+        args->moved += relocate_blocks(inode);
+    }
+    args->cursor = num;
+    args->done = num >= sb->num_inodes;
+    return 0;
+}
+
+struct dirscan_ctx {
+    struct wfs_dirscan_args* args;
+    int prefix_len;
+};
+
+static int dirscan_entry(const struct wfs_rec* ent, void* arg) {
+    struct dirscan_ctx* ctx = arg;
+    struct wfs_dirscan_args* args = ctx->args;
+    if (args->after[0] != '\0' && name_cmp(ent->name, ent->len, args->after, strlen(args->after)) <= 0) {
+        return 0;
+    }
+    int n = ent->len < ctx->prefix_len ? ent->len : ctx->prefix_len;
+    int cmp = memcmp(ent->name, args->prefix, n);
+    if (cmp < 0 || (cmp == 0 && n < ctx->prefix_len)) {
+        return 0;
+    } else if (cmp > 0) {
+        return 1; // past the names with the prefix
+    }
+    if (args->count == DIRSCAN_BATCH) {
+        args->more = 1;
+        return 1;
+    }
+    struct wfs_dirscan_ent* out = &args->ents[args->count++];
+    memset(out, 0, sizeof(*out));
+    out->num = ent->id;
+    out->file_type = ent->type;
+    memcpy(out->name, ent->name, ent->len);
+    return 0;
+}
+
+// a list directory is sorted here first, a tree is read from the
+// first name in range on
+static int dir_scan(const char* path, struct wfs_dirscan_args* args) {
+    struct wfs_inode* dir;
+    args->after[WFS_NAME_MAX] = '\0';
+    args->prefix[WFS_NAME_MAX] = '\0';
+    args->count = 0;
+    args->more = 0;
+    if (resolve_path(path, &dir, NULL) < 0) {
+        return wfs_error;
+    }
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    struct dirscan_ctx ctx = {args, strlen(args->prefix)};
+    const char* from = strcmp(args->after, args->prefix) > 0 ? args->after : args->prefix;
+
+    if (dir->flags & WFS_INODE_DTREE) {
+        return dir_iterate(dir, from, dirscan_entry, &ctx) < 0 ? wfs_error : 0;
+    }
+    struct dir_ents list = {NULL, 0, 0};
+    if (dir_iterate(dir, "", collect_entry, &list) < 0) {
+        free(list.ents);
+        return wfs_error ? wfs_error : -EIO;
+    }
+    qsort(list.ents, list.n, sizeof(struct dir_ent), cmp_dir_ent);
+    for (int i = 0; i < list.n; i++) {
+        struct wfs_rec r = {NULL, 0, list.ents[i].num, list.ents[i].name, list.ents[i].len, list.ents[i].type};
+        if (dirscan_entry(&r, &ctx) != 0) {
+            break;
+        }
+    }
+    free(list.ents);
+    return 0;
+}
+
+static int wfs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+                     unsigned int flags, void* data) {
+    (void)arg;
+    (void)fi;
+    printf("wfs_ioctl: %s %x\n", path, cmd);
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+
+    switch ((unsigned int)cmd) {
+    case WFS_IOC_DEFRAG:
+        return defrag_step((struct wfs_defrag_args*)data);
+    case WFS_IOC_FRAGSTAT:
+        frag_stats((struct wfs_frag_stats*)data);
+        return 0;
+    case WFS_IOC_GROW:
+        return grow_fs((struct wfs_grow_args*)data);
+    case WFS_IOC_CLONE:
+        return clone_range(path, (struct wfs_clone_args*)data);
+    case WFS_IOC_DEDUPSTAT:
+        *(struct wfs_dedup_stats*)data = dedup_stats;
+        ((struct wfs_dedup_stats*)data)->enabled = options.dedup;
+        return 0;
+    case WFS_IOC_RENAME: {
+        struct wfs_rename_args* args = (struct wfs_rename_args*)data;
+        args->from[sizeof(args->from) - 1] = '\0';
+        args->to[sizeof(args->to) - 1] = '\0';
+        if (args->from[0] != '/' || args->to[0] != '/') {
+            return -EINVAL;
+        }
+        return wfs_rename2(args->from, args->to, args->flags);
+    }
+    case WFS_IOC_DIRSCAN:
+        return dir_scan(path, (struct wfs_dirscan_args*)data);
+    case WFS_IOC_IOSTAT:
+        bio_stats((struct wfs_io_stats*)data);
+        return 0;
+    case WFS_IOC_VOLSTAT:
+        vol_stats(&volume, (struct wfs_vol_stats*)data);
+        return 0;
+    case WFS_IOC_FREESTAT:
+        free_stats((struct wfs_free_stats*)data);
+        return 0;
+    }
+    return -ENOTTY;
+}
 
-        char* addr = data_offset(inode, pos, 0);
-        memcpy(buf + have_read, addr, to_read);
-        pos += to_read;
-        have_read += to_read;
+// pushes out timestamps held back by lazytime, then has the block I/O
+// backend write back the image
+static int wfs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    (void)fi;
+    printf("wfs_fsync: %s\n", path);
+    if (!datasync) {
+        lazy_flush();
+        csum_flush();
     }
+    return bio_sync();
+}
 
-    free(searchpath);
-    // Update atime only if we actually read some bytes (POSIX allows updating on any access; this avoids pure EOF bumps)
-    if (have_read > 0) {
-        struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-        inode->atim = now.tv_sec;
+// With -o prefault, hugepages or mlock, a group's metadata -- bitmaps,
+// reference counts, checksums and inodes, plus the superblock in front of
+// group 0 -- is read in at mount, backed by huge pages or kept in memory,
+// so getattr and lookups do not wait on it. Groups are advised as they
+// come into use.
+static void advise_group(uint32_t g) {
+    int how = (options.prefault ? BIO_PREFAULT : 0) | (options.hugepages ? BIO_HUGEPAGE : 0) |
+              (options.mlock ? BIO_LOCK : 0);
+    if (how == 0) {
+        return;
+    }
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    off_t start = g == 0 ? 0 : sb->i_bitmap_ptr + group_offset(sb, g);
+    int ret = bio_advise(start, sb->d_blocks_ptr + group_offset(sb, g) - start, how);
+    if (ret < 0) {
+        printf("advise_group: group %u: %s\n", g, strerror(-ret));
     }
-// inode->ctim = now.tv_sec; // optional
-
-    return have_read;
 }
 
-int wfs_write(const char *path, const char *buf, size_t length, off_t offset, struct fuse_file_info *fi) {
-    (void)fi;
-    printf("wfs_write: %s\n", path);
-    struct wfs_inode* inode;
-    char* searchpath = strdup(path);
-    if (get_inode_from_path(searchpath, &inode) < 0) {
-        return wfs_error;
+// runs once fuse has started serving, in the background process, which
+// is also the one memory locks have to be taken in
+static void* wfs_init(struct fuse_conn_info* conn) {
+    (void)conn;
+    if (bio_start() < 0) {
+        printf("wfs_init: no writeback thread, pages are written back on fsync and eviction\n");
+    }
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    for (uint32_t g = 0; g < sb_groups(sb) && group_initialized(sb, g); g++) {
+        advise_group(g);
     }
+    return NULL;
+}
 
-    // size will be increased by the amount of data we add to the file
-    ssize_t newdatalen = length - (inode->size - offset);
+// every operation ends by bringing the checksums of what it touched up
+// to date, however it returns
+#define SEALED(call) { int ret = call; csum_flush(); return ret; }
 
-    size_t have_written = 0;
-    size_t pos = offset;
+static int sealed_getattr(const char* path, struct stat* st)
+    SEALED(wfs_getattr(path, st))
+static int sealed_mknod(const char* path, mode_t mode, dev_t dev)
+    SEALED(wfs_mknod(path, mode, dev))
+static int sealed_mkdir(const char* path, mode_t mode)
+    SEALED(wfs_mkdir(path, mode))
+static int sealed_unlink(const char* path)
+    SEALED(wfs_unlink(path))
+static int sealed_rmdir(const char* path)
+    SEALED(wfs_rmdir(path))
+static int sealed_rename(const char* from, const char* to)
+    SEALED(wfs_rename(from, to))
+static int sealed_link(const char* from, const char* to)
+    SEALED(wfs_link(from, to))
+static int sealed_read(const char* path, char* buf, size_t len, off_t off, struct fuse_file_info* fi)
+    SEALED(wfs_read(path, buf, len, off, fi))
+static int sealed_write(const char* path, const char* buf, size_t len, off_t off, struct fuse_file_info* fi)
+    SEALED(wfs_write(path, buf, len, off, fi))
+static int sealed_open(const char* path, struct fuse_file_info* fi)
+    SEALED(wfs_open(path, fi))
+static int sealed_release(const char* path, struct fuse_file_info* fi)
+    SEALED(wfs_release(path, fi))
+static int sealed_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off,
+                          struct fuse_file_info* fi)
+    SEALED(wfs_readdir(path, buf, filler, off, fi))
+static int sealed_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
+    SEALED(wfs_setxattr(path, name, value, size, flags))
+static int sealed_getxattr(const char* path, const char* name, char* value, size_t size)
+    SEALED(wfs_getxattr(path, name, value, size))
+static int sealed_listxattr(const char* path, char* list, size_t size)
+    SEALED(wfs_listxattr(path, list, size))
+static int sealed_removexattr(const char* path, const char* name)
+    SEALED(wfs_removexattr(path, name))
+static int sealed_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+    SEALED(wfs_fsync(path, datasync, fi))
+static int sealed_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+                        unsigned int flags, void* data)
+    SEALED(wfs_ioctl(path, cmd, arg, fi, flags, data))
 
-    while (have_written < length) {
-        size_t to_write = BLOCK_SIZE - (pos % BLOCK_SIZE);
-        if (to_write + have_written > length) {
-            to_write = length - have_written;
-        }
+struct fuse_operations wfs_ops = {
+  .getattr = sealed_getattr,
+  .mknod = sealed_mknod,
+  .mkdir = sealed_mkdir,
+  .unlink = sealed_unlink,
+  .rmdir = sealed_rmdir,
+  .rename = sealed_rename,
+  .link = sealed_link,
+  .read = sealed_read,
+  .write = sealed_write,
+  .open = sealed_open,
+  .release = sealed_release,
+  .readdir = sealed_readdir,
+  .statfs = wfs_statfs,
+  .setxattr = sealed_setxattr,
+  .getxattr = sealed_getxattr,
+  .listxattr = sealed_listxattr,
+  .removexattr = sealed_removexattr,
+  .fsync = sealed_fsync,
+  .ioctl = sealed_ioctl,
+  .init = wfs_init,
+};
 
-        char* addr = data_offset(inode, pos, 1);
-        if (addr == NULL) {
-            return wfs_error;
-        }
-        memcpy(addr, buf + have_written, to_write);
-        pos += to_write;
-        have_written += to_write;
+// =========================
+// Free space index
+// =========================
+
+// The free data blocks of each group as extents, in two balanced trees
+// like XFS's free space B-trees: one ordered by offset, to find the
+// neighbours a freed block joins, and one by length then offset, for best
+// fit runs. The trees are treaps sharing their nodes. Like the other
+// allocation summaries the index is in-core only: it is rebuilt from the
+// bitmaps at mount and after a resize, and changes with them, so the
+// bitmaps stay the only record on disk. Offsets are data block numbers
+// within the group.
+
+enum { BY_OFF, BY_SIZE };
+
+struct free_ext {
+    uint32_t start;
+    uint32_t len;
+    uint32_t prio;
+    uint32_t kid[2][2]; // [BY_OFF or BY_SIZE][left, right], 0 for none
+};
+
+struct free_space {
+    uint32_t root[2];
+    uint32_t free;    // blocks
+    uint32_t extents;
+};
+
+static struct free_ext* exts; // node 0 is unused, it stands for none
+static uint32_t num_exts, cap_exts, spare_exts;
+static struct free_space* space;
+static struct wfs_free_stats space_stats;
+static uint32_t ext_seed = 2463534242U;
+
+#define KID(n, by, side) (exts[n].kid[by][side])
+
+static int ext_before(int by, uint32_t a, uint32_t b) {
+    if (by == BY_SIZE && exts[a].len != exts[b].len) {
+        return exts[a].len < exts[b].len;
     }
+    return exts[a].start < exts[b].start;
+}
 
-    inode->size += newdatalen > 0 ? newdatalen : 0;
-    // Writing updates mtime and ctime
-    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-    inode->mtim = now.tv_sec; inode->ctim = now.tv_sec;
-    free(searchpath);
-    return have_written;
+static uint32_t ext_insert(int by, uint32_t t, uint32_t n) {
+    if (t == 0) {
+        return n;
+    }
+    int side = !ext_before(by, n, t);
+    uint32_t k = KID(t, by, side) = ext_insert(by, KID(t, by, side), n);
+    if (exts[k].prio > exts[t].prio) {
+        // rotate the kid up
+        KID(t, by, side) = KID(k, by, !side);
+        KID(k, by, !side) = t;
+        return k;
+    }
+    return t;
 }
 
-int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    (void)fi;
-    (void)offset;
+// joins two trees, everything in `a` ordered before `b`
+static uint32_t ext_join(int by, uint32_t a, uint32_t b) {
+    if (a == 0 || b == 0) {
+        return a ? a : b;
+    }
+    if (exts[a].prio > exts[b].prio) {
+        KID(a, by, 1) = ext_join(by, KID(a, by, 1), b);
+        return a;
+    }
+    KID(b, by, 0) = ext_join(by, a, KID(b, by, 0));
+    return b;
+}
 
-    printf("wfs_readdir: %s\n", path);
+static uint32_t ext_erase(int by, uint32_t t, uint32_t n) {
+    if (t == n) {
+        return ext_join(by, KID(t, by, 0), KID(t, by, 1));
+    }
+    int side = !ext_before(by, n, t);
+    KID(t, by, side) = ext_erase(by, KID(t, by, side), n);
+    return t;
+}
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    
-    struct wfs_inode* inode;
-    char* searchpath = strdup(path);
-    if (get_inode_from_path(searchpath, &inode) < 0) {
-        return wfs_error;
+static void ext_add(uint32_t g, uint32_t start, uint32_t len) {
+    uint32_t n = spare_exts;
+    if (n != 0) {
+        spare_exts = KID(n, BY_OFF, 0);
+    } else {
+        if (num_exts >= cap_exts) {
+            cap_exts = cap_exts ? 2 * cap_exts : 64;
+            exts = realloc(exts, cap_exts * sizeof(struct free_ext));
+        }
+        n = num_exts++;
     }
+    ext_seed ^= ext_seed << 13;
+    ext_seed ^= ext_seed >> 17;
+    ext_seed ^= ext_seed << 5;
+    exts[n] = (struct free_ext){start, len, ext_seed, {{0, 0}, {0, 0}}};
+    space[g].root[BY_OFF] = ext_insert(BY_OFF, space[g].root[BY_OFF], n);
+    space[g].root[BY_SIZE] = ext_insert(BY_SIZE, space[g].root[BY_SIZE], n);
+    space[g].extents++;
+}
 
-    // Detect if caller is 'ls' by checking process name
-    struct fuse_context *ctx = fuse_get_context();
-    int is_ls = 0;
-    if (ctx) {
-        char comm_path[64], comm_name[256];
-        snprintf(comm_path, sizeof(comm_path), "/proc/%d/comm", ctx->pid);
-        FILE *fp = fopen(comm_path, "r");
-        if (fp) {
-            if (fgets(comm_name, sizeof(comm_name), fp)) {
-                // Remove trailing newline
-                comm_name[strcspn(comm_name, "\n")] = '\0';
-                printf("DEBUG: comm_name = %s\n", comm_name);
-                is_ls = (strcmp(comm_name, "ls") == 0);
-            }
-            fclose(fp);
+static void ext_del(uint32_t g, uint32_t n) {
+    space[g].root[BY_OFF] = ext_erase(BY_OFF, space[g].root[BY_OFF], n);
+    space[g].root[BY_SIZE] = ext_erase(BY_SIZE, space[g].root[BY_SIZE], n);
+    space[g].extents--;
+    KID(n, BY_OFF, 0) = spare_exts;
+    spare_exts = n;
+}
+
+// the extent starting at or closest before block `b`, 0 if there is none
+static uint32_t ext_at(uint32_t g, uint32_t b) {
+    uint32_t found = 0;
+    for (uint32_t t = space[g].root[BY_OFF]; t != 0;) {
+        if (exts[t].start <= b) {
+            found = t;
+            t = KID(t, BY_OFF, 1);
+        } else {
+            t = KID(t, BY_OFF, 0);
         }
     }
-    printf("DEBUG: is_ls = %d\n", is_ls); 
-    size_t sz = inode->size;
-    struct wfs_dentry* dent;
-        
-    for (off_t off = 0; off < sz; off += sizeof(struct wfs_dentry)) {
-        dent = (struct wfs_dentry*)data_offset(inode, off, 0);
-
-        if (dent->num != 0) {
-            struct wfs_inode *file_inode = retrieve_inode(dent->num);
-            printf("DEBUG: file %s, color = %d\n", dent->name, file_inode ? file_inode->color : -1);
-            if (is_ls && file_inode && file_inode->color != WFS_COLOR_NONE) {
-                const wfs_color_info *ci = wfs_color_from_code(file_inode->color);
-                char colored_name[MAX_NAME + 64];
-                snprintf(colored_name, sizeof(colored_name), "%s%s\033[0m",
-                         ci->ansi, dent->name);
-                printf("DEBUG: returning colored name: %s\n", colored_name);
-                filler(buf, colored_name, NULL, 0);
-            } else {
-                filler(buf, dent->name, NULL, 0);
-            }
+    return found;
+}
+
+// the shortest extent of at least `count` blocks, the first of those
+static uint32_t ext_fit(uint32_t g, uint32_t count) {
+    uint32_t found = 0;
+    for (uint32_t t = space[g].root[BY_SIZE]; t != 0;) {
+        if (exts[t].len >= count) {
+            found = t;
+            t = KID(t, BY_SIZE, 0);
+        } else {
+            t = KID(t, BY_SIZE, 1);
         }
     }
+    return found;
+}
 
-    free(searchpath);
-    // Reading a directory updates its atime
-    struct wfs_inode* dir_inode;
-    char* p2 = strdup(path);
-    if (get_inode_from_path(p2, &dir_inode) == 0) {
-        struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-        dir_inode->atim = now.tv_sec;
+static uint32_t ext_edge(uint32_t g, int by, int side) {
+    uint32_t t = space[g].root[by];
+    while (t != 0 && KID(t, by, side) != 0) {
+        t = KID(t, by, side);
     }
-    free(p2);
-    return 0;
+    return t;
 }
 
-int wfs_unlink(const char* path)
-{
-    printf("wfs_unlink: %s\n", path);
-    struct wfs_inode* parent_inode;
-    struct wfs_inode* inode;
-    char* base = strdup(path);
-    char* searchpath = strdup(path);
-    
-    // parent inode
-    if (get_inode_from_path(dirname(base), &parent_inode) < 0) {
-        return wfs_error;
+// blocks [start, start + count) of one free extent were allocated
+static void space_take(uint32_t g, uint32_t start, uint32_t count) {
+    uint32_t n = ext_at(g, start);
+    uint32_t first = exts[n].start, end = exts[n].start + exts[n].len;
+    ext_del(g, n);
+    if (first < start) {
+        ext_add(g, first, start - first);
     }
-    
-    // inode
-    if (get_inode_from_path(searchpath, &inode) < 0) {
-        return wfs_error;
+    if (start + count < end) {
+        ext_add(g, start + count, end - start - count);
     }
+    space[g].free -= count;
+}
 
-    // free all the data blocks
-    off_t* blks_arr;
-    if (inode->blocks[IND_BLOCK] != 0) { // free indirect blocks
-        blks_arr = (off_t*)MMAP_PTR(inode->blocks[IND_BLOCK]);
-        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
-            if (blks_arr[i] != 0) { free_block(blks_arr[i]); }
+// block `b` was freed, and joins the extents next to it
+static void space_give(uint32_t g, uint32_t b) {
+    uint32_t start = b, end = b + 1;
+    uint32_t left = b > 0 ? ext_at(g, b - 1) : 0;
+    if (left != 0 && exts[left].start + exts[left].len == b) {
+        start = exts[left].start;
+        ext_del(g, left);
+    }
+    uint32_t right = ext_at(g, b + 1);
+    if (right != 0 && exts[right].start == b + 1) {
+        end += exts[right].len;
+        ext_del(g, right);
+    }
+    ext_add(g, start, end - start);
+    space[g].free++;
+}
+
+// the index of a group from its bitmap. a group not in use yet is free
+static void space_load(uint32_t g) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    size_t dpg = sb->num_data_blocks / sb_groups(sb);
+    uint32_t* bitmap = (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr + group_offset(sb, g));
+    ssize_t run = group_initialized(sb, g) ? -1 : 0; // start of the free run being scanned
+    for (size_t i = 0; group_initialized(sb, g) && i < dpg; i++) {
+        uint32_t word = bitmap[i / 32];
+        if (i % 32 == 0 && word == (run < 0 ? 0xFFFFFFFF : 0)) {
+            i += 31; // a whole word that neither ends a run nor starts one
+            continue;
+        }
+        int used = (word >> (i % 32)) & 0x1;
+        if (used && run >= 0) {
+            ext_add(g, run, i - run);
+            space[g].free += i - run;
+            run = -1;
+        } else if (!used && run < 0) {
+            run = i;
         }
     }
-    blks_arr = inode->blocks;
-    for (int i = 0; i < N_BLOCKS; i++) { // free all the direct blocks
-        if (blks_arr[i] != 0) { free_block(blks_arr[i]); }
+    if (run >= 0) {
+        ext_add(g, run, dpg - run);
+        space[g].free += dpg - run;
     }
-        
-    // remove dentry from parent
-    remove_dentry(parent_inode, inode->num);
+}
 
-    // free inode
-    // Update parent's ctime/mtime already handled in remove_dentry; set inode's ctime to now before freeing (for completeness if observed)
-    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
-    inode->ctim = now.tv_sec;
-    free_inode(inode);
+// =========================
+// Orlov inode placement
+// =========================
 
-    free(base);
-    free(searchpath);
-    return 0;
+// Directories are spread out and files are kept next to their parent, so
+// walking one subtree touches a compact stretch of the inode table. The
+// allocator works on slices of the inode table: one per block group, or,
+// on a single-group image, up to ORLOV_SLICES runs of whole bitmap words.
+// The per-slice counts are in-core only and rebuilt from the bitmaps at
+// mount, like the group summaries in FFS/ext2.
+#define ORLOV_SLICES 8
+
+struct slice_summary {
+    uint32_t free_inodes;
+    uint32_t dirs;
+};
+
+static struct slice_summary* slices;
+static uint32_t num_slices;
+static size_t inodes_per_slice;
+static uint32_t next_top_slice; // where the next top-level directory search starts
+
+static uint32_t slice_of(int num) {
+    return num / inodes_per_slice;
 }
 
-int wfs_rmdir(const char *path)
-{
-    printf("wfs_rmdir: %s\n", path);
-    // wfs_unlink updates parent directory times; rmdir should also adjust parent atime (access) minimally handled by getattr/read elsewhere
-    wfs_unlink(path);
-    return 0;
+static uint32_t slice_group(uint32_t s) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    return (s * inodes_per_slice) / (sb->num_inodes / sb_groups(sb));
 }
 
-static int wfs_statfs(const char *path, struct statvfs *st) {
-    (void)path;
+static int is_set(uint32_t* bitmap, size_t bit) {
+    return (bitmap[bit / 32] >> (bit % 32)) & 0x1;
+}
+
+void load_alloc_summary() {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
-    memset(st, 0, sizeof(*st));
+    uint32_t groups = sb_groups(sb);
+    size_t ipg = sb->num_inodes / groups;
 
-    st->f_bsize = BLOCK_SIZE;
-    st->f_frsize = BLOCK_SIZE;
-    st->f_blocks = sb->num_data_blocks;
-    st->f_files  = sb->num_inodes;
+    free(slices);
+    free(space);
+    inodes_per_slice = ipg;
+    if (groups == 1) {
+        inodes_per_slice = (ipg / ORLOV_SLICES) / 32 * 32;
+        if (inodes_per_slice < 32) {
+            inodes_per_slice = 32;
+        }
+    }
+    num_slices = (sb->num_inodes + inodes_per_slice - 1) / inodes_per_slice;
+    slices = calloc(num_slices, sizeof(struct slice_summary));
+    space = calloc(groups, sizeof(struct free_space));
+    num_exts = 1;
+    spare_exts = 0;
+
+    for (size_t num = 0; num < sb->num_inodes; num++) {
+        if (!group_initialized(sb, num / ipg)) {
+            // untouched groups are empty, and are whole slices
+            slices[slice_of(num)].free_inodes += ipg;
+            num += ipg - 1;
+            continue;
+        }
+        struct wfs_inode* inode = inode_slot(num);
+        if (inode == NULL) {
+            slices[slice_of(num)].free_inodes++;
+        } else if (S_ISDIR(inode->mode)) {
+            slices[slice_of(num)].dirs++;
+        }
+    }
+    for (uint32_t g = 0; g < groups; g++) {
+        space_load(g);
+    }
+}
 
-    uint32_t* i_bm = (uint32_t*)((char*)mregion + sb->i_bitmap_ptr);
-    uint32_t* d_bm = (uint32_t*)((char*)mregion + sb->d_bitmap_ptr);
+// picks the slice a new directory should go in (Orlov, as in ext2)
+static uint32_t find_dir_slice(struct wfs_inode* parent) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    uint32_t groups = sb_groups(sb);
+    size_t free_inodes = 0, dirs = 0, free_blocks = 0;
 
-    int used_inodes = 0, used_blocks = 0;
-    for (size_t i = 0; i < sb->num_inodes / 32; i++)
-        used_inodes += __builtin_popcount(i_bm[i]);
-    for (size_t i = 0; i < sb->num_data_blocks / 32; i++)
-        used_blocks += __builtin_popcount(d_bm[i]);
+    for (uint32_t s = 0; s < num_slices; s++) {
+        free_inodes += slices[s].free_inodes;
+        dirs += slices[s].dirs;
+    }
+    for (uint32_t g = 0; g < groups; g++) {
+        free_blocks += space[g].free;
+    }
+    size_t avg_free_inodes = free_inodes / num_slices;
+    size_t avg_free_blocks = free_blocks / groups;
+    size_t avg_dirs = dirs / num_slices;
 
-    st->f_bfree = sb->num_data_blocks - used_blocks;
-    st->f_bavail = st->f_bfree;
-    st->f_ffree = sb->num_inodes - used_inodes;
-    st->f_namemax = MAX_NAME;
+    // top-level directories go to the emptiest slice, scanning from a
+    // rotating start so ties are spread out instead of piling up in slice 0
+    if (parent->num == 0) {
+        int best = -1;
+        for (uint32_t i = 0; i < num_slices; i++) {
+            uint32_t s = (next_top_slice + i) % num_slices;
+            if (slices[s].free_inodes == 0 ||
+                slices[s].free_inodes < avg_free_inodes ||
+                space[slice_group(s)].free < avg_free_blocks) {
+                continue;
+            }
+            if (best < 0 || slices[s].dirs < slices[best].dirs ||
+                (slices[s].dirs == slices[best].dirs &&
+                 slices[s].free_inodes > slices[best].free_inodes)) {
+                best = s;
+            }
+        }
+        if (best >= 0) {
+            next_top_slice = (best + 1) % num_slices;
+            return best;
+        }
+    } else {
+        // nested directories stay near their parent unless its slice is
+        // already crowded with directories or running out of room
+        size_t max_dirs = avg_dirs + inodes_per_slice / 16;
+        size_t min_inodes = avg_free_inodes - avg_free_inodes / 4;
+        size_t min_blocks = avg_free_blocks - avg_free_blocks / 4;
+        uint32_t start = slice_of(parent->num);
+        for (uint32_t i = 0; i < num_slices; i++) {
+            uint32_t s = (start + i) % num_slices;
+            if (slices[s].free_inodes > 0 && slices[s].dirs < max_dirs &&
+                slices[s].free_inodes >= min_inodes &&
+                space[slice_group(s)].free >= min_blocks) {
+                return s;
+            }
+        }
+    }
 
-    return 0;
+    // fall back to any slice with an average share of free inodes
+    uint32_t start = slice_of(parent->num);
+    for (uint32_t i = 0; i < num_slices; i++) {
+        uint32_t s = (start + i) % num_slices;
+        if (slices[s].free_inodes > 0 && slices[s].free_inodes >= avg_free_inodes) {
+            return s;
+        }
+    }
+    return start;
 }
 
-static struct fuse_operations wfs_ops = {
-  .getattr = wfs_getattr,
-  .mknod = wfs_mknod,
-  .mkdir = wfs_mkdir,
-  .unlink = wfs_unlink,
-  .rmdir = wfs_rmdir,
-  .read = wfs_read,
-  .write = wfs_write,
-  .readdir = wfs_readdir,
-  .statfs = wfs_statfs,
-  .setxattr = wfs_setxattr,
-  .getxattr = wfs_getxattr,
-  .removexattr = wfs_removexattr,
-};
+// allocates the first free bit in [lo, hi) at or after `goal`, wrapping
+// around to lo. returns the bit index or -1 if the range is full
+static ssize_t allocate_bit_near(uint32_t* bitmap, size_t lo, size_t hi, size_t goal) {
+    for (size_t n = 0; n < hi - lo; n++) {
+        size_t bit = lo + (goal - lo + n) % (hi - lo);
+        if (bitmap[bit / 32] == 0xFFFFFFFF) {
+            // skip the rest of a full word
+            n += 31 - bit % 32;
+            continue;
+        }
+        if (!is_set(bitmap, bit)) {
+            bitmap[bit / 32] |= (0x1U << (bit % 32));
+            return bit;
+        }
+    }
+    return -1;
+}
+
+// directories go where find_dir_slice() says, files go in their parent's
+// slice at the first free slot after the parent
+struct wfs_inode* allocate_inode(struct wfs_inode* parent, mode_t mode) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    size_t per_group = sb->num_inodes / sb_groups(sb);
+    uint32_t start = S_ISDIR(mode) ? find_dir_slice(parent) : slice_of(parent->num);
+
+    for (uint32_t i = 0; i < num_slices; i++) {
+        uint32_t s = (start + i) % num_slices;
+        if (slices[s].free_inodes == 0) {
+            continue;
+        }
+        uint32_t g = slice_group(s);
+        init_group(g);
+        size_t first = s * inodes_per_slice;
+        size_t last = first + inodes_per_slice;
+        if (last > sb->num_inodes) {
+            last = sb->num_inodes;
+        }
+        size_t goal = first;
+        if (!S_ISDIR(mode) && slice_of(parent->num) == s) {
+            goal = parent->num;
+        }
+
+        // bit positions are relative to the group's bitmap
+        size_t base = g * per_group;
+        off_t goff = group_offset(sb, g);
+        ssize_t bit = allocate_bit_near((uint32_t*)MMAP_PTR(sb->i_bitmap_ptr + goff),
+                                        first - base, last - base, goal - base);
+        if (bit < 0) {
+            continue;
+        }
+        slices[s].free_inodes--;
+        if (S_ISDIR(mode)) {
+            slices[s].dirs++;
+        }
+        struct wfs_inode* inode = (struct wfs_inode*)(MMAP_PTR(sb->i_blocks_ptr + goff) + BLOCK_SIZE * bit);
+        if (sb_lazy_init(sb)) {
+            memset((char*)inode, 0, BLOCK_SIZE);
+        }
+        csum_dirty(sb->i_bitmap_ptr + goff);
+        csum_dirty(MMAP_OFF(inode));
+        inode->num = base + bit;
+        return inode;
+    }
+    wfs_error = -ENOSPC;
+    return NULL;
+}
 
-void free_bitmap(uint32_t position, uint32_t* bitmap) {
+// returns -1 if the bit was already clear: toggling it would have marked
+// a doubly freed block or inode as allocated again
+int free_bitmap(uint32_t position, uint32_t* bitmap) {
     int b = position / 32;
     int p = position % 32;
-    bitmap[b] = bitmap[b] ^ (0x1 << p);
-
-    //TODO: error checking?
-    //bitmap[b] &= ~(1U << p);  // clear instead of toggle
+    if (!(bitmap[b] & (0x1U << p))) {
+        printf("free_bitmap: %u is already free\n", position);
+        return -1;
+    }
+    bitmap[b] &= ~(0x1U << p);
+    return 0;
 }
 
 // we choose to zero blocks and inodes as they are freed because some
@@ -627,82 +4793,168 @@ void free_bitmap(uint32_t position, uint32_t* bitmap) {
 
 void free_block(off_t blk) {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    uint32_t g = block_group(blk);
+    off_t base = sb->d_blocks_ptr + group_offset(sb, g);
+    if (free_bitmap(/*position*/ (blk - base) / BLOCK_SIZE,
+                    /*bitmap*/ (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr + group_offset(sb, g))) < 0) {
+        return; // the block may belong to someone else by now, leave it be
+    }
+    space_give(g, (blk - base) / BLOCK_SIZE);
+    csum_dirty(sb->i_bitmap_ptr + group_offset(sb, g));
+    dedup_forget(blk);
     memset(MMAP_PTR(blk), 0, BLOCK_SIZE); // zero
-
-    free_bitmap(/*position*/ (blk - sb->d_blocks_ptr) / BLOCK_SIZE,
-                /*bitmap*/ (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr));
 }
 
 void free_inode(struct wfs_inode* inode) {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    int g = inode_group(inode);
+    int position = inode->num % (sb->num_inodes / sb_groups(sb));
+    if (free_bitmap(position, (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr + group_offset(sb, g))) < 0) {
+        return;
+    }
+    csum_dirty(sb->i_bitmap_ptr + group_offset(sb, g));
+    csum_dirty(MMAP_OFF(inode));
+    lazy_forget(inode->num);
+    struct slice_summary* slice = &slices[slice_of(inode->num)];
+    slice->free_inodes++;
+    if (S_ISDIR(inode->mode)) {
+        slice->dirs--;
+    }
     memset((char*)inode, 0, BLOCK_SIZE); // zero
-
-    free_bitmap(/*position*/ ((char*)inode - MMAP_PTR(sb->i_blocks_ptr)) / BLOCK_SIZE,
-                /*bitmap*/ (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr));
 }
 
-struct wfs_inode* retrieve_inode(int num) {
+// the slot of inode `num` if it is allocated, as it is on disk
+struct wfs_inode* inode_slot(int num) {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
-    uint32_t* bitmap = (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr);
+    if (num < 0 || num >= sb->num_inodes) {
+        return NULL;
+    }
+    size_t per_group = sb->num_inodes / sb_groups(sb);
+    if (!group_initialized(sb, num / per_group)) {
+        return NULL;
+    }
+    off_t goff = group_offset(sb, num / per_group);
+    uint32_t* bitmap = (uint32_t*)MMAP_PTR(sb->i_bitmap_ptr + goff);
 
-    int b = num / 32;
-    int p = num % 32;
+    int b = (num % per_group) / 32;
+    int p = (num % per_group) % 32;
     // check if it is allocated first
-    if (bitmap[b] & (0x1 << p)) {
-        return (struct wfs_inode*)(MMAP_PTR(sb->i_blocks_ptr) + num*BLOCK_SIZE);
+    if (bitmap[b] & (0x1U << p)) {
+        return (struct wfs_inode*)(MMAP_PTR(sb->i_blocks_ptr + goff) + (num % per_group)*BLOCK_SIZE);
     }
     return NULL;
 }
 
-// careful - block allocations are always stored by their offsets 
-// to use a block, we add the block address (i.e. offset) to mregion
-// we don't store pointers in the inode as they are not persistent across fs reboot.
-ssize_t allocate_block(uint32_t* bitmap, size_t len) {
-    for (uint32_t i = 0; i < len; i++) {
-        uint32_t bm_region = bitmap[i];
-        if (bm_region == 0xFFFFFFFF) {
-            continue;
-        }
-        for (uint32_t k = 0; k < 32; k++) {
-            if (!((bm_region >> k) & 0x1)) { // it is free
-                // allocate
-                bitmap[i] = bitmap[i] | (0x1 << k);
-                return 32*i + k;
-//                return block_region + (BLOCK_SIZE * (32*i + k));
-            }
-        }
+// like inode_slot(), for use: the inode is checked against its checksum,
+// and the caller is free to change it
+struct wfs_inode* retrieve_inode(int num) {
+    struct wfs_inode* inode = inode_slot(num);
+    if (inode == NULL) {
+        return NULL;
     }
-    return -1; // no free blocks found
+    if (csum_verify(MMAP_OFF(inode)) < 0) {
+        return NULL;
+    }
+    csum_dirty(MMAP_OFF(inode));
+    return inode;
 }
 
-off_t allocate_data_block(void) {
+int inode_group(struct wfs_inode* inode) {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
-    off_t blknum = allocate_block((uint32_t*)MMAP_PTR(sb->d_bitmap_ptr),
-                                  sb->num_data_blocks / 32);
-    if (blknum < 0) {
-        return 0;
+    return inode->num / (sb->num_inodes / sb_groups(sb));
+}
+
+// takes groups up to and including g into use on a lazily initialized
+// image. only the bitmaps need clearing, which is cheap next to the inode
+// table and data blocks behind them
+void init_group(uint32_t g) {
+    struct wfs_sb* sb = (struct wfs_sb*)mregion;
+    if (group_initialized(sb, g)) {
+        return;
+    }
+    for (uint32_t k = sb->init_groups; k <= g; k++) {
+        off_t goff = group_offset(sb, k);
+        memset(MMAP_PTR(sb->i_bitmap_ptr + goff), 0, sb->i_blocks_ptr - sb->i_bitmap_ptr);
+    }
+    printf("init_group: groups %u-%u now in use\n", sb->init_groups, g);
+    uint32_t first = sb->init_groups;
+    sb->init_groups = g + 1;
+    for (uint32_t k = first; k <= g; k++) {
+        csum_dirty(sb->i_bitmap_ptr + group_offset(sb, k));
+        advise_group(k);
     }
-       
-    return sb->d_blocks_ptr + BLOCK_SIZE * blknum;
 }
 
-struct wfs_inode* allocate_inode(void) {
+// marks data blocks [start, start + count) of group `g` allocated, in the
+// bitmap and the free space index. returns the first one's offset
+static off_t take_blocks(uint32_t g, uint32_t start, uint32_t count) {
     struct wfs_sb* sb = (struct wfs_sb*)mregion;
-    off_t blknum = allocate_block((uint32_t*)MMAP_PTR(sb->i_bitmap_ptr),
-                                  sb->num_inodes / 32);
-    if (blknum < 0) { 
-        wfs_error = -ENOSPC;
-        return NULL;
+    init_group(g);
+    off_t goff = group_offset(sb, g);
+    uint32_t* bitmap = (uint32_t*)MMAP_PTR(sb->d_bitmap_ptr + goff);
+    for (uint32_t k = start; k < start + count; k++) {
+        bitmap[k / 32] |= (0x1U << (k % 32));
+    }
+    space_take(g, start, count);
+    off_t blk = sb->d_blocks_ptr + goff + BLOCK_SIZE * (off_t)start;
+    if (sb_lazy_init(sb)) {
+        memset(MMAP_PTR(blk), 0, (size_t)count * BLOCK_SIZE);
+    }
+    csum_dirty(sb->i_bitmap_ptr + goff);
+    for (uint32_t i = 0; i < count; i++) {
+        csum_dirty(blk + (off_t)i * BLOCK_SIZE);
+    }
+    return blk;
+}
+
+// data blocks are taken from `group` if it has room, otherwise from the
+// groups after it, so a file's blocks stay close to its inode. a run comes
+// from the shortest free extent it fits in, leaving the long ones whole
+off_t allocate_data_run(int group, int count) {
+    uint32_t groups = sb_groups((struct wfs_sb*)mregion);
+    for (uint32_t i = 0; i < groups; i++) {
+        uint32_t g = (group + i) % groups;
+        uint32_t n = space[g].free >= (uint32_t)count ? ext_fit(g, count) : 0;
+        if (n != 0) {
+            space_stats.runs_allocated++;
+            space_stats.exact_fits += exts[n].len == (uint32_t)count;
+            return take_blocks(g, exts[n].start, count);
+        }
+    }
+    return 0;
+}
+
+// careful - block allocations are always stored by their offsets
+// to use a block, we add the block address (i.e. offset) to mregion
+// we don't store pointers in the inode as they are not persistent across fs reboot.
+// single blocks are the first free one in the group
+off_t allocate_data_block(int group) {
+    uint32_t groups = sb_groups((struct wfs_sb*)mregion);
+    for (uint32_t i = 0; i < groups; i++) {
+        uint32_t g = (group + i) % groups;
+        if (space[g].free > 0) {
+            return take_blocks(g, exts[ext_edge(g, BY_OFF, 0)].start, 1);
+        }
+    }
+    return 0;
+}
+
+// what the free space index has, without a look at the bitmaps
+void free_stats(struct wfs_free_stats* st) {
+    *st = space_stats;
+    for (uint32_t g = 0; g < sb_groups((struct wfs_sb*)mregion); g++) {
+        st->free_blocks += space[g].free;
+        st->free_extents += space[g].extents;
+        uint32_t n = ext_edge(g, BY_SIZE, 1);
+        if (n != 0 && exts[n].len > st->largest_free) {
+            st->largest_free = exts[n].len;
+        }
     }
-    struct wfs_inode* inode = (struct wfs_inode*)(MMAP_PTR(sb->i_blocks_ptr) + BLOCK_SIZE * blknum);
-    inode->num = blknum;
-    return inode;
 }
 
+#ifndef WFS_NO_MAIN
 int main(int argc, char* argv[]) {
     int fuse_stat;
-    struct stat sb;
-    int fd;
     char* diskimage = strdup(argv[1]);
 
     // shift args down by one for fuse
@@ -711,29 +4963,54 @@ int main(int argc, char* argv[]) {
     }
     argc -= 1;
 
-    // open the file
-    if ((fd = open(diskimage, O_RDWR, 0666)) < 0) {
-        perror("open failed main\n");
+    // our own -o options are taken out, the rest are fuse's
+    options.cache_mb = IO_CACHE_MB;
+    options.writeback_ms = IO_WRITEBACK_MS;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, wfs_opts, NULL) < 0) {
         return 1;
     }
 
-    // stat so we know how large the mmap needs to be
-    if (fstat(fd, &sb) < 0) {
-        perror("stat");
+    // open the image, or the members of a volume given as a comma-separated
+    // list. O_DIRECT only makes sense with our own cache
+    int direct = options.io == WFS_IO_PREAD && options.direct ? O_DIRECT : 0;
+    if (vol_open(diskimage, O_RDWR | direct, &volume) < 0) {
+        return 1;
+    }
+    // a store to a mapping would only reach one mirror
+    if (volume.members > 1 && volume.hdr.layout == WFS_VOL_MIRROR && options.io != WFS_IO_PREAD) {
+        printf("mirrored volume, using io=pread\n");
+        options.io = WFS_IO_PREAD;
+    }
+    if (direct && volume.size % BLOCK_SIZE != 0) {
+        printf("image size is not a multiple of %d, cannot use O_DIRECT\n", BLOCK_SIZE);
         return 1;
     }
 
-    // setup mmap
-    mregion = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    struct bio_config io = {options.io, direct != 0, options.cache_mb, options.writeback_ms};
+    mregion = bio_open(&volume, &io);
     if (mregion == NULL) {
-        printf("error mmaping file\n");
+        printf("error mapping the image\n");
         return 1;
     }
 
+    msize = volume.size;
+
+    if (csum_check_mount() < 0) {
+        printf("image is damaged, run wfs-fsck -r on it\n");
+        return 1;
+    }
     assert(retrieve_inode(0) != NULL);
-    fuse_stat = fuse_main(argc, argv, &wfs_ops, NULL);
+    load_alloc_summary();
+    dedup_load();
+    csum_flush();
+    fuse_stat = fuse_main(args.argc, args.argv, &wfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    lazy_flush();
+    csum_flush();
 
-    munmap(mregion, sb.st_size);
-    close(fd);
+    bio_close();
+    vol_close(&volume);
     return fuse_stat;
 }
+#endif
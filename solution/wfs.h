@@ -1,6 +1,10 @@
+#include <stddef.h>
+#include <string.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
 
 #define BLOCK_SIZE (512)
 #define MAX_NAME   (28)
@@ -22,8 +26,30 @@
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  Images that support snapshots keep a reference count table right after
+  the data bitmap (refcount_ptr), inside the space in front of i_blocks_ptr.
+  Images with checksums keep a checksum table after that (csum_ptr).
+
+  With block groups (mkfs -g), the inodes and data blocks are split into
+  num_groups equal groups, each with its own bitmaps, laid out like the
+  single group above. The pointers in the superblock locate group 0; every
+  following group starts group_size bytes after the previous one:
+
++----+---------+---------+--------+------+---------+---------+--------+------+--
+| SB | IBITMAP | DBITMAP | INODES | DATA | IBITMAP | DBITMAP | INODES | DATA | ...
++----+---------+---------+--------+------+---------+---------+--------+------+--
+     |<------------- group 0 ----------->|<------------- group 1 ----------->|
+
+  Inode numbers are global: inode n lives in group n / (num_inodes / num_groups).
+  Data blocks are still referred to by their offset in the image.
+
+  The filesystem grows online by appending groups (WFS_IOC_GROW), so
+  existing inode numbers and block offsets never move.
 */
 
+#define WFS_MAGIC  (0x21534657) /* "WFS!" */
+#define SB_SIZE    (BLOCK_SIZE) /* space mkfs reserves for the superblock */
+
 // Superblock
 struct wfs_sb {
     size_t num_inodes;
@@ -32,6 +58,175 @@ struct wfs_sb {
     off_t d_bitmap_ptr;
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
+
+    /* Images made by the original mkfs end the superblock here, with the
+     * inode bitmap right behind it. The fields below are only valid when
+     * sb_is_extended() says so; such images are a single group. */
+    uint32_t magic;
+    uint32_t num_groups;  /* number of block groups */
+    off_t group_size;     /* bytes from the start of one group to the next */
+    uint32_t features;    /* WFS_FEATURE_* flags */
+    uint32_t init_groups; /* with WFS_FEATURE_LAZY_INIT: groups in use so far */
+
+    /* Snapshots. refcount_ptr is 0 on images made without a reference
+     * count table, which cannot take snapshots. */
+    off_t refcount_ptr;   /* group 0's table, one uint16_t per data block */
+    off_t snap_table;     /* data block of struct wfs_snapshot, 0 until used */
+    uint32_t snap_epoch;  /* bumped by every snapshot taken */
+
+    /* Block checksums. csum_ptr is 0 on images made without them. */
+    off_t csum_ptr;       /* group 0's checksum table, see below */
+    uint32_t sb_csum;     /* CRC32C of this struct, taken with sb_csum = 0 */
+};
+
+/* Lazily initialized image: mkfs only writes group 0. Groups from
+ * init_groups on have never been written and may hold garbage; they are
+ * taken into use in order by clearing their bitmaps. Inode slots and data
+ * blocks are cleared when they are allocated rather than up front. */
+#define WFS_FEATURE_LAZY_INIT (0x1)
+
+/* Long names: directory blocks hold variable-length records (struct
+ * wfs_dirent) rather than struct wfs_dentry, and names go up to
+ * WFS_NAME_MAX bytes instead of MAX_NAME - 1. */
+#define WFS_FEATURE_LONG_NAMES (0x2)
+
+static inline int sb_is_extended(const struct wfs_sb* sb) {
+    return sb->i_bitmap_ptr >= SB_SIZE && sb->magic == WFS_MAGIC;
+}
+
+static inline uint32_t sb_groups(const struct wfs_sb* sb) {
+    return sb_is_extended(sb) ? sb->num_groups : 1;
+}
+
+static inline int sb_lazy_init(const struct wfs_sb* sb) {
+    return sb_is_extended(sb) && (sb->features & WFS_FEATURE_LAZY_INIT);
+}
+
+static inline int sb_long_names(const struct wfs_sb* sb) {
+    return sb_is_extended(sb) && (sb->features & WFS_FEATURE_LONG_NAMES);
+}
+
+// whether group g's bitmaps can be trusted
+static inline int group_initialized(const struct wfs_sb* sb, uint32_t g) {
+    return !sb_lazy_init(sb) || g < sb->init_groups;
+}
+
+// offset of group g relative to group 0
+static inline off_t group_offset(const struct wfs_sb* sb, uint32_t g) {
+    return sb_is_extended(sb) ? (off_t)g * sb->group_size : 0;
+}
+
+static inline int sb_has_refcounts(const struct wfs_sb* sb) {
+    return sb_is_extended(sb) && sb->refcount_ptr != 0;
+}
+
+/*
+  Block checksums. Every group has a table of CRC32C checksums, one for
+  each of:
+      entry 0                   the group's bitmaps and reference counts,
+                                [i_bitmap_ptr, csum_ptr) of the group
+      entries 1 .. ipg          the inode slots
+      entries ipg+1 .. ipg+dpg  the data blocks: file data, directory,
+                                indirect and snapshot blocks
+  Only entries for allocated inodes and data blocks mean anything. wfs
+  brings the checksums of what an operation touched up to date when it
+  finishes and verifies blocks as it reads them; wfs-fsck verifies them
+  all. The superblock carries its own checksum.
+*/
+static inline int sb_has_csums(const struct wfs_sb* sb) {
+    return sb_is_extended(sb) && sb->csum_ptr != 0;
+}
+
+static inline size_t csum_entries(const struct wfs_sb* sb) {
+    return 1 + (sb->num_inodes + sb->num_data_blocks) / sb_groups(sb);
+}
+
+/*
+  Copy-on-write snapshots. A data block normally has a single owner; the
+  reference count table holds the number of *extra* references to each
+  block, so a block is shared while its count is non-zero. An indirect
+  block's count covers the blocks it points to: those are only counted
+  once however many inodes share the indirect block.
+
+  Taking a snapshot only records the current epoch. Every inode carries
+  the epoch it was last preserved in; before an inode seen by a snapshot
+  (inode epoch <= snapshot epoch) is modified, a copy of it is put in a
+  data block and entered in the snapshot's inode map, and the blocks it
+  points to gain a reference. The snapshot sees the copy if there is one
+  and the live inode otherwise.
+
+  The inode map is a radix tree of blocks of MAP_FANOUT block offsets,
+  `height` levels deep, indexed by inode number. One preserved copy can be
+  shared by several snapshots and is reference counted like any block.
+*/
+#define SNAP_DIR "/.snapshots"
+#define MAP_FANOUT (BLOCK_SIZE / sizeof(off_t))
+
+struct wfs_snapshot {
+    char name[MAX_NAME]; /* empty for a free slot */
+    uint32_t epoch;      /* sb->snap_epoch when the snapshot was taken */
+    uint32_t height;     /* levels in the inode map */
+    off_t map;           /* root of the inode map, 0 while empty */
+};
+
+#define MAX_SNAPSHOTS (BLOCK_SIZE / sizeof(struct wfs_snapshot))
+
+/*
+  Volumes. mkfs can spread an image over several member files (given as
+  several -d, and to wfs and wfs-fsck as one comma-separated list). The
+  image itself is laid out as above; only where its bytes are stored
+  changes. Every member starts with a WFS_VOL_HDR-byte header, and the
+  image is cut into `stripe`-byte units dealt out to the members in turn:
+
+      unit k -> member k % n, at WFS_VOL_HDR + (k / n) * stripe
+
+  With a metadata member (mkfs -m), the first meta_size bytes of the image
+  (the superblock and group 0's bitmaps, checksums and inode table,
+  rounded up to a whole unit) live on that member alone, and the units
+  after them are dealt out to the other members. Groups added later keep
+  their metadata among their data. The stripe unit is a multiple of the
+  page size, so each unit can be mapped on its own.
+
+  A mirrored volume (mkfs -M) keeps a whole copy of the image on every
+  member, right after the header. Writes go to all members, reads to any.
+  The rest of the header is a write-intent bitmap with a bit for every
+  `region` bytes of the image: a region's bit is set, on every member,
+  before it is first written, and bits are only cleared once all members
+  have synced their data. So after a crash the members can only differ in
+  regions whose bits are set. A member left out of a mount (missing, or
+  failing during it) keeps a lower event count than the others, and they
+  keep their bits until it is back. Either way, opening the volume for
+  writing copies the regions with bits set from an up-to-date member to
+  the others instead of copying the whole image.
+
+  A file without a header is a plain image, as mkfs makes with one -d.
+*/
+#define WFS_VOL_MAGIC   "WFSVOL01"
+#define WFS_VOL_HDR     (4096)
+#define WFS_VOL_MAX     (16)
+#define WFS_VOL_STRIPED (UINT32_MAX) /* meta: no metadata member */
+
+#define WFS_VOL_STRIPE  (0)
+#define WFS_VOL_MIRROR  (1)
+
+#define WFS_VOL_BITMAP_OFF (512)                             /* of the bitmap in the header */
+#define WFS_VOL_BITMAP     (WFS_VOL_HDR - WFS_VOL_BITMAP_OFF) /* bytes */
+#define WFS_VOL_REGION     (64 * 1024)                       /* smallest region */
+
+struct wfs_vol_header {
+    char magic[8];      /* WFS_VOL_MAGIC */
+    uint64_t id;        /* the same on every member of a volume */
+    uint32_t members;
+    uint32_t index;     /* of this member */
+    uint32_t layout;    /* WFS_VOL_STRIPE or WFS_VOL_MIRROR */
+    uint32_t stripe;    /* bytes per unit */
+    uint32_t meta;      /* metadata member, or WFS_VOL_STRIPED */
+    uint32_t region;    /* mirror: bytes of image per bitmap bit */
+    uint64_t meta_size; /* bytes on the metadata member */
+    uint64_t size;      /* of the image */
+    uint64_t events;    /* mirror: mounts this member has been part of */
+    uint32_t csum;      /* CRC32C of the whole header, bitmap included,
+                           taken with csum = 0 */
 };
 
 // Inode
@@ -68,25 +263,534 @@ struct wfs_inode {
      *  - Other values correspond to a fixed palette (see wfs_color_t)
      */
     uint8_t color;
+    uint8_t flags;    /* WFS_INODE_* */
+    uint16_t zunits;  /* compression units stored compressed, one bit each */
 
     off_t blocks[N_BLOCKS];
+
+    uint32_t epoch;   /* snapshot epoch the inode was last preserved in */
+
+    uint32_t atim_ns; /* nanoseconds of atim, mtim and ctim */
+    uint32_t mtim_ns;
+    uint32_t ctim_ns;
+
+    off_t dtree;      /* root node of a WFS_INODE_DTREE directory */
+
+    off_t xattr;      /* block of extended attributes, 0 if none */
 };
 
-// Directory entry
+/* Transparent compression ("user.compress" xattr). Files are compressed
+ * in units of ZUNIT_BLOCKS logical blocks. A unit that compresses by at
+ * least a block is stored as a 4-byte length and the compressed bytes in
+ * the first blocks of the unit, leaving the unit's other block pointers
+ * empty; any other unit is stored as is. On a directory the flag is only
+ * inherited by what is created in it. */
+#define WFS_INODE_COMPRESS (0x1)
+#define ZUNIT_BLOCKS       (8)
+#define ZUNIT_SIZE         (ZUNIT_BLOCKS * BLOCK_SIZE)
+
+/*
+  Extended attributes. The user., trusted. and security. attributes of an
+  inode are kept in the part of its slot past the inode, WFS_XATTR_IBODY
+  bytes from WFS_XATTR_IBODY_OFF, and those that do not fit there in one
+  xattr block. Either area is all zero while empty; otherwise it is a
+  magic number followed by entries packed one after another, each the
+  header, the name without its prefix and the value, padded to 4 bytes.
+  An entry with name_len 0, or the end of the area, ends the list.
+
+  Inodes with the same attributes in their blocks share one block, counted
+  like any shared block, and a shared block is never written in place.
+  "user.color" and "user.compress" are the inode fields they control and
+  are not stored here.
+*/
+#define WFS_XATTR_MAGIC     (0x52545841) /* "AXTR" */
+#define WFS_XATTR_IBODY_OFF (256)
+#define WFS_XATTR_IBODY     (BLOCK_SIZE - WFS_XATTR_IBODY_OFF)
+
+#define WFS_XATTR_USER      (1)
+#define WFS_XATTR_TRUSTED   (2)
+#define WFS_XATTR_SECURITY  (3)
+
+struct wfs_xattr_entry {
+    uint8_t ns;        /* WFS_XATTR_USER, ... */
+    uint8_t name_len;
+    uint16_t value_len;
+    char name[];       /* then the value */
+};
+
+#define XATTR_ENTRY_SIZE(name_len, value_len) \
+    ((sizeof(struct wfs_xattr_entry) + (name_len) + (value_len) + 3) & ~3)
+
+_Static_assert(sizeof(struct wfs_inode) <= WFS_XATTR_IBODY_OFF, "inode runs into its xattr area");
+
+// Directory entry, on images made without WFS_FEATURE_LONG_NAMES
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
 
+/*
+  Variable-length directory entries, as in ext2. On images with
+  WFS_FEATURE_LONG_NAMES a directory block is a chain of records, each
+  rec_len bytes on to the next, the last one running to the end of the
+  block. An entry needs DIRENT_SIZE(name_len) bytes and the rest of its
+  rec_len is free: a new entry goes into the first record with room for
+  it, split off its end. A removed entry is merged into the record before
+  it, or just has its num cleared if it is the first one. Names are not
+  NUL-terminated.
+*/
+#define WFS_NAME_MAX (255)
+
+struct wfs_dirent {
+    int num;           /* inode, 0 for an unused record */
+    uint16_t rec_len;  /* bytes to the next record */
+    uint8_t name_len;
+    uint8_t file_type; /* DT_* type of the inode, what readdir reports */
+    char name[];
+};
+
+#define DIRENT_SIZE(len) ((sizeof(struct wfs_dirent) + (len) + 3) & ~3)
+
+/*
+  B+-tree directories. A directory starts out as a list of entries in its
+  direct blocks; once those are full it is turned into a B+-tree keyed by
+  name, rooted at the inode's `dtree`, and WFS_INODE_DTREE is set. Its
+  blocks[] are unused from then on and its size is the number of tree
+  nodes times BLOCK_SIZE.
+
+  Leaves hold wfs_dirent records like a directory block, in no particular
+  order, whatever the format of the image's list directories. Inner nodes
+  hold (key, child) records of the same kind, also unordered; a child
+  holds the names from its key up to the next larger key in the node. The
+  smallest key's child takes everything below as well, and that key is
+  kept empty.
+
+  A node only holds what lies inside its range as given by its parent:
+  records at or past the next key up are dead, whatever they contain.
+  That is what makes splits safe without a journal. The upper half of a
+  node is copied into a new one, the new node is linked into the parent,
+  which kills the originals at once, and they are cleared afterwards.
+  Empty nodes are unlinked from their parent the same way, after the dead
+  records of the neighbour whose range grows are cleared.
+
+  As with indirect blocks, a node's reference count covers the nodes it
+  points to, so a directory shares its whole tree with a snapshot until
+  the paths it changes are copied.
+*/
+#define WFS_INODE_DTREE    (0x2)
+#define DTREE_MAGIC        (0x45455254) /* "TREE" */
+#define DTREE_MAX_HEIGHT   (16)
+#define DTREE_AREA         (BLOCK_SIZE - 8)
+
+struct wfs_dtree_key {
+    off_t child;       /* 0 for an unused record */
+    uint16_t rec_len;
+    uint8_t key_len;
+    uint8_t pad;
+    char key[];
+};
+
+#define DTREE_KEY_SIZE(len) ((offsetof(struct wfs_dtree_key, key) + (len) + 7) & ~7)
+
+struct wfs_dtree_node {
+    uint32_t magic;
+    uint16_t level;   /* 0 for leaves */
+    uint16_t pad;
+    char recs[DTREE_AREA];
+};
+
+/*
+  Reading the records of a directory block or tree node, whichever kind
+  they are. struct wfs_dentry counts as a record of fixed size, with the
+  free slots records of their own.
+*/
+#define REC_FIXED  (0) /* struct wfs_dentry */
+#define REC_DIRENT (1) /* struct wfs_dirent */
+#define REC_KEY    (2) /* struct wfs_dtree_key */
+
+struct wfs_rec {
+    char* at;
+    int size;         /* bytes to the next record */
+    long id;          /* inode or child node, 0 for an unused record */
+    const char* name;
+    int len;
+    int type;         /* DT_* type of a REC_DIRENT, 0 if not known */
+};
+
+// bytes a record with a `len`-byte name takes up
+static inline int rec_need(int kind, int len) {
+    if (kind == REC_FIXED) {
+        return sizeof(struct wfs_dentry);
+    }
+    return kind == REC_DIRENT ? (int)DIRENT_SIZE(len) : (int)DTREE_KEY_SIZE(len);
+}
+
+// the record `off` bytes into an area of `alen` bytes: 1 if there is one,
+// 0 past the last, -1 if it is damaged
+static inline int rec_at(char* area, int alen, int kind, int off, struct wfs_rec* r) {
+    if (off >= alen) {
+        return 0;
+    }
+    r->at = area + off;
+    r->type = 0;
+    if (kind == REC_FIXED) {
+        struct wfs_dentry* d = (struct wfs_dentry*)r->at;
+        r->size = sizeof(*d);
+        r->id = d->num;
+        r->name = d->name;
+        r->len = strnlen(d->name, MAX_NAME);
+        return off + r->size <= alen ? 1 : -1;
+    }
+    if (alen - off < rec_need(kind, 0)) {
+        return -1;
+    }
+    if (kind == REC_DIRENT) {
+        struct wfs_dirent* d = (struct wfs_dirent*)r->at;
+        r->size = d->rec_len;
+        r->id = d->num;
+        r->name = d->name;
+        r->len = d->name_len;
+        r->type = d->file_type;
+    } else {
+        struct wfs_dtree_key* k = (struct wfs_dtree_key*)r->at;
+        r->size = k->rec_len;
+        r->id = k->child;
+        r->name = k->key;
+        r->len = k->key_len;
+    }
+    int align = kind == REC_KEY ? 8 : 4;
+    return r->size >= rec_need(kind, r->id ? r->len : 0) && r->size % align == 0 &&
+           r->size <= alen - off ? 1 : -1;
+}
+
+static inline int name_cmp(const char* a, int alen, const char* b, int blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : alen - blen;
+}
+
+// bounds are NUL-terminated names; an empty one is no bound at all
+static inline int dtree_below(const char* name, int len, const char* hi) {
+    return hi[0] == '\0' || name_cmp(name, len, hi, strlen(hi)) < 0;
+}
+
+static inline int rec_live(const struct wfs_rec* r, const char* hi) {
+    return r->id != 0 && dtree_below(r->name, r->len, hi);
+}
+
+// the bound of child `kid` of an inner node bounded by `hi`: the next
+// larger live key, or `hi` itself for the last child
+static inline void dtree_kid_bound(struct wfs_dtree_node* node, const char* hi,
+                                   const struct wfs_rec* kid, char* kid_hi) {
+    struct wfs_rec r, next = {0};
+    for (int off = 0; rec_at(node->recs, DTREE_AREA, REC_KEY, off, &r) > 0; off += r.size) {
+        if (rec_live(&r, hi) && name_cmp(r.name, r.len, kid->name, kid->len) > 0 &&
+            (next.at == NULL || name_cmp(r.name, r.len, next.name, next.len) < 0)) {
+            next = r;
+        }
+    }
+    if (next.at == NULL) {
+        strcpy(kid_hi, hi);
+    } else {
+        memcpy(kid_hi, next.name, next.len);
+        kid_hi[next.len] = '\0';
+    }
+}
+
+/*
+  ioctl interface. The commands can be issued on any file or directory in
+  the mount (e.g. the mountpoint itself) and act on the whole filesystem.
+*/
+
+// WFS_IOC_DEFRAG: one incremental defragmentation step. Inodes are visited
+// starting at `cursor`; the step stops once about `max_blocks` blocks have
+// been moved, and returns the cursor to resume from. The budget must be at
+// least 1 (EINVAL otherwise).
+struct wfs_defrag_args {
+    uint32_t cursor;      /* in: first inode to visit, out: next inode */
+    uint32_t max_blocks;  /* in: block budget for this step */
+    uint32_t moved;       /* out: blocks relocated or freed */
+    uint32_t done;        /* out: 1 once the last inode has been visited */
+};
+
+// WFS_IOC_FRAGSTAT: fragmentation report
+struct wfs_frag_stats {
+    uint32_t files;            /* regular files holding data blocks */
+    uint32_t fragmented_files; /* files whose blocks are not one contiguous run */
+    uint32_t file_blocks;      /* data + indirect blocks held by files */
+    uint32_t file_extents;     /* contiguous runs across all files */
+    uint32_t dirs;
+    uint32_t dir_blocks;
+    uint32_t dir_extents;
+    uint32_t dir_slots;        /* dentry slots in all directory blocks */
+    uint32_t dir_live;         /* slots holding a live dentry */
+    uint32_t free_blocks;
+    uint32_t free_extents;     /* contiguous runs of free data blocks */
+    uint32_t largest_free;     /* longest free run, in blocks */
+};
+
+#define WFS_IOC_DEFRAG   _IOWR('W', 1, struct wfs_defrag_args)
+#define WFS_IOC_FRAGSTAT _IOR('W', 2, struct wfs_frag_stats)
+
+// WFS_IOC_GROW: online resize. Appends block groups to the end of the
+// image, extending the image file if it is too short. Every new group has
+// as many inodes and data blocks as the existing ones. Images made by the
+// original mkfs (no block groups) cannot grow.
+struct wfs_grow_args {
+    uint32_t add_groups;  /* in: number of groups to append */
+    uint32_t num_groups;  /* out: number of groups after growing */
+};
+
+#define WFS_IOC_GROW _IOWR('W', 3, struct wfs_grow_args)
+
+// WFS_IOC_CLONE: copy_file_range() by sharing blocks, issued on the
+// destination file. Blocks that line up are shared with the source and
+// only copied once either file writes to them; unaligned bytes at the
+// ends of the range are copied right away. The destination grows as
+// needed. Needs an image with reference counts (see snapshots below).
+// The kernel keeps the destination's old size until its attribute cache
+// times out.
+struct wfs_clone_args {
+    char src[256];           /* in: source file, as a path from the root of the mount */
+    uint64_t src_offset;     /* in */
+    uint64_t dst_offset;     /* in */
+    uint64_t length;         /* in: bytes to clone, 0 for up to the end of the source */
+    uint64_t cloned;         /* out: bytes cloned */
+    uint32_t shared_blocks;  /* out: blocks shared rather than copied */
+    uint32_t pad;
+};
+
+#define WFS_IOC_CLONE _IOWR('W', 4, struct wfs_clone_args)
+
+// WFS_IOC_DEDUPSTAT: what inline deduplication (mount option -o dedup)
+// has done since the image was mounted. Whole-block writes are looked up
+// by content; those matching a block already in use share it instead of
+// taking a new one.
+struct wfs_dedup_stats {
+    uint64_t blocks_written;  /* whole-block writes looked up */
+    uint64_t blocks_deduped;  /* of those, ones that shared an existing block */
+    uint32_t indexed_blocks;  /* data blocks in the content index */
+    uint32_t enabled;         /* mounted with -o dedup */
+};
+
+#define WFS_IOC_DEDUPSTAT _IOR('W', 5, struct wfs_dedup_stats)
+
+// WFS_IOC_RENAME: renameat2(), for the flags fuse's rename() cannot pass
+// on (RENAME_NOREPLACE, RENAME_EXCHANGE). Issued on any file of the mount.
+// The kernel keeps its old view of both names until its entry cache
+// times out.
+struct wfs_rename_args {
+    char from[256];   /* in: paths from the root of the mount */
+    char to[256];     /* in */
+    uint32_t flags;   /* in: RENAME_* */
+    uint32_t pad;
+};
+
+#define WFS_IOC_RENAME _IOW('W', 6, struct wfs_rename_args)
+
+// WFS_IOC_DIRSCAN: a directory's entries in name order, a batch at a time.
+// Issued on the directory. Entries start after `after` (empty to start at
+// the beginning) and stop at the first name not starting with `prefix`.
+// On a B+-tree directory only the part of the tree in range is read.
+#define DIRSCAN_BATCH (32)
+
+struct wfs_dirscan_ent {
+    uint32_t num;
+    uint8_t file_type;                /* DT_*, DT_UNKNOWN on older images */
+    uint8_t pad[3];
+    char name[WFS_NAME_MAX + 1];      /* NUL-terminated */
+};
+
+struct wfs_dirscan_args {
+    char after[WFS_NAME_MAX + 1];     /* in: last name of the previous batch */
+    char prefix[WFS_NAME_MAX + 1];    /* in: empty for every name */
+    uint32_t count;                   /* out: entries returned */
+    uint32_t more;                    /* out: 1 if entries in range are left */
+    struct wfs_dirscan_ent ents[DIRSCAN_BATCH];
+};
+
+#define WFS_IOC_DIRSCAN _IOWR('W', 7, struct wfs_dirscan_args)
+
+// WFS_IOC_IOSTAT: the block I/O backend the image was mounted with
+// (-o io=mmap or io=pread) and, for io=pread, what its page cache has
+// done since. Pages are the system's, not BLOCK_SIZE.
+#define WFS_IO_MMAP  (0)
+#define WFS_IO_PREAD (1)
+
+struct wfs_io_stats {
+    uint32_t backend;      /* WFS_IO_* */
+    uint32_t direct;       /* image opened O_DIRECT */
+    uint64_t cache_pages;  /* pages the cache may hold */
+    uint64_t resident;     /* pages it holds now */
+    uint64_t dirty;        /* of those, ones not written back yet */
+    uint64_t reads;        /* pages read in */
+    uint64_t dirtied;      /* clean pages written to */
+    uint64_t evictions;    /* pages dropped to make room */
+    uint64_t writebacks;   /* pages written out */
+    uint64_t locked;       /* pages locked in memory (-o mlock) */
+    uint64_t prefetched;   /* pages read ahead of readers */
+};
+
+#define WFS_IOC_IOSTAT _IOR('W', 8, struct wfs_io_stats)
+
+// WFS_IOC_VOLSTAT: how the image is stored (see Volumes above), and which
+// members served the reads and writes of -o io=pread since it was mounted.
+// Mirrored volumes are always mounted with io=pread.
+struct wfs_vol_stats {
+    uint32_t layout;              /* WFS_VOL_* */
+    uint32_t members;             /* 1 for a plain image */
+    uint32_t present;             /* members in use: not missing or failed */
+    uint32_t stale;               /* mirror: members brought up to date at mount */
+    uint64_t resynced;            /* mirror: bytes copied to do that */
+    uint64_t reads[WFS_VOL_MAX];  /* per member */
+    uint64_t writes[WFS_VOL_MAX];
+};
+
+#define WFS_IOC_VOLSTAT _IOR('W', 9, struct wfs_vol_stats)
+
+// WFS_IOC_FREESTAT: free space as the allocator's extent index has it,
+// without the scan of the bitmaps WFS_IOC_FRAGSTAT does, and how the runs
+// handed out since the image was mounted fit the free extents
+struct wfs_free_stats {
+    uint64_t free_blocks;
+    uint32_t free_extents;     /* contiguous runs of free data blocks */
+    uint32_t largest_free;     /* longest free run, in blocks */
+    uint64_t runs_allocated;   /* runs allocated by writes and defragmentation */
+    uint64_t exact_fits;       /* of those, ones that took a free extent whole */
+};
+
+#define WFS_IOC_FREESTAT _IOR('W', 10, struct wfs_free_stats)
+
 int get_inode_from_path(char* path, struct wfs_inode** inode);
 char* data_offset(struct wfs_inode* inode, off_t offset, int alloc);
-int add_dentry(struct wfs_inode* parent, int num, char* name);
-int remove_dentry(struct wfs_inode* inode, int inum);
+int add_dentry(struct wfs_inode* parent, struct wfs_inode* inode, const char* name);
+int remove_dentry(struct wfs_inode* inode, int inum, const char* name);
+int wfs_rename2(const char* from, const char* to, unsigned int flags);
 int dentry_to_num(char* name, struct wfs_inode* inode);
 void free_block(off_t blk);
+int file_compressed(struct wfs_inode* inode);
+blkcnt_t inode_blocks(struct wfs_inode* inode);
+ssize_t read_compressed(struct wfs_inode* inode, char* buf, size_t length, off_t offset);
+ssize_t write_compressed(struct wfs_inode* inode, const char* buf, size_t length, off_t offset);
+int set_compression(struct wfs_inode* inode, int on);
+void csum_dirty(off_t off);
+int csum_verify(off_t off);
+void csum_flush();
+int csum_check_mount();
+uint16_t* block_refs(off_t blk);
+int block_shared(off_t blk);
+off_t copy_block(struct wfs_inode* inode, off_t blk);
+void put_block(off_t blk);
+#define WFS_ATIME (0x1)
+#define WFS_MTIME (0x2)
+#define WFS_CTIME (0x4)
+void touch_inode(struct wfs_inode* inode, int which);
+void touch_atime(struct wfs_inode* inode);
+void inode_times(struct wfs_inode* inode, struct timespec* atim, struct timespec* mtim,
+                 struct timespec* ctim);
+void lazy_flush();
+void lazy_forget(int num);
+void dedup_insert(off_t blk, uint32_t hash);
+void dedup_forget(off_t blk);
+int dedup_write(struct wfs_inode* inode, int blocknum, const char* data, uint32_t* hash);
+void dedup_load();
+void release_blocks(struct wfs_inode* inode);
+int cow_inode(struct wfs_inode* inode);
+int snapshot_sees(struct wfs_inode* inode);
+int in_snapshots(const char* path);
+int resolve_path(const char* path, struct wfs_inode** inode, struct wfs_snapshot** view);
+struct wfs_snapshot* find_snapshot(const char* name);
+struct wfs_inode* snapshot_inode(struct wfs_snapshot* snap, int num);
+struct wfs_inode* snapshot_dir();
+int snapshot_create(const char* name);
+int snapshot_delete(const char* name);
 void free_inode(struct wfs_inode* inode);
+struct wfs_inode* inode_slot(int num);
 struct wfs_inode* retrieve_inode(int num);
-off_t allocate_data_block(void);
-struct wfs_inode* allocate_inode(void);
+int inode_group(struct wfs_inode* inode);
+void init_group(uint32_t g);
+off_t allocate_data_block(int group);
+off_t allocate_data_run(int group, int count);
+struct wfs_inode* allocate_inode(struct wfs_inode* parent, mode_t mode);
+void load_alloc_summary();
+void free_stats(struct wfs_free_stats* st);
 void fillin_inode(struct wfs_inode* inode, mode_t mode);
 void create_root_dir(void);
+
+// Volumes (vol.c)
+struct wfs_volume {
+    int members;               /* 1 for a plain image */
+    int fd[WFS_VOL_MAX];       /* in member order, -1 if missing or failed */
+    struct wfs_vol_header hdr; /* the layout, unused for a plain image */
+    size_t size;               /* of the image */
+    int writable;
+
+    /* mirrors */
+    uint8_t bitmap[WFS_VOL_BITMAP]; /* regions the members may differ in */
+    int source;                     /* up-to-date member mapped and copied from */
+    int degraded;                   /* some member is missing or failed */
+    off_t last[WFS_VOL_MAX];        /* where each member's last read ended */
+    int busy[WFS_VOL_MAX];          /* reads in flight on each member */
+
+    struct wfs_vol_stats stats;
+    pthread_mutex_t lock;
+};
+
+int vol_open(const char* paths, int flags, struct wfs_volume* vol);
+void vol_plain(struct wfs_volume* vol, int fd, size_t size);
+int vol_create(char** paths, int members, uint32_t layout, uint32_t stripe, uint32_t meta,
+               size_t meta_size, size_t size, struct wfs_volume* vol);
+size_t vol_locate(const struct wfs_volume* vol, off_t off, int* member, off_t* moff);
+void* vol_map(struct wfs_volume* vol, int flags);
+ssize_t vol_pread(struct wfs_volume* vol, void* buf, size_t len, off_t off);
+ssize_t vol_pwrite(struct wfs_volume* vol, const void* buf, size_t len, off_t off);
+int vol_truncate(struct wfs_volume* vol, size_t size);
+int vol_sync(struct wfs_volume* vol);
+void vol_stats(struct wfs_volume* vol, struct wfs_vol_stats* st);
+void vol_close(struct wfs_volume* vol);
+
+// Block I/O (bio.c)
+struct bio_config {
+    int backend;            /* WFS_IO_* */
+    int direct;             /* io=pread: the image fd is O_DIRECT */
+    size_t cache_mb;        /* io=pread: cache size */
+    unsigned writeback_ms;  /* io=pread: writeback interval, 0 for none */
+};
+
+// bio_advise() hints
+#define BIO_PREFAULT (0x1)  /* read in and map now */
+#define BIO_HUGEPAGE (0x2)  /* back with transparent huge pages */
+#define BIO_LOCK     (0x4)  /* keep in memory */
+#define BIO_WILLNEED (0x8)  /* about to be read: start reading it in */
+#define BIO_RANDOM   (0x10) /* read at random: no readaround */
+#define BIO_NORMAL   (0x20) /* undoes BIO_RANDOM */
+
+void* bio_open(struct wfs_volume* vol, const struct bio_config* cfg);
+int bio_start();
+int bio_advise(off_t off, size_t len, int how);
+void* bio_resize(size_t size);
+int bio_sync();
+void bio_stats(struct wfs_io_stats* st);
+int bio_close();
+
+// Checksums (csum.c)
+uint32_t crc32c(const void* buf, size_t len);
+const char* crc32c_impl_name();
+uint32_t sb_checksum(const struct wfs_sb* sb);
+
+// LZ codec (lz.c)
+ssize_t lz_compress(const char* src, size_t len, char* dst, size_t cap);
+ssize_t lz_decompress(const char* src, size_t len, char* dst, size_t cap);
+
+// Consistency checking (fsck.c). Exit codes follow fsck(8).
+#define FSCK_OK          (0)
+#define FSCK_CORRECTED   (1)
+#define FSCK_UNCORRECTED (4)
+#define FSCK_ERROR       (8)
+
+struct fsck_result {
+    size_t problems;
+    size_t leaks;       /* problems that only lose space (orphans, leaked blocks) */
+    size_t bad_csums;   /* problems that are checksum mismatches */
+};
+
+int fsck_image(void* region, size_t size, int fix, int print, struct fsck_result* res);
@@ -5,7 +5,8 @@
 #include "common/test.h"
 
 const int expected_inode_count = 96;
-const int expected_data_block_count = 6;
+// 95 entries of 16 bytes take three directory blocks
+const int expected_data_block_count = 3;
 
 int main() {
   int ret;
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_defrag_args {
+  uint32_t cursor;
+  uint32_t max_blocks;
+  uint32_t moved;
+  uint32_t done;
+};
+
+struct wfs_frag_stats {
+  uint32_t files;
+  uint32_t fragmented_files;
+  uint32_t file_blocks;
+  uint32_t file_extents;
+  uint32_t dirs;
+  uint32_t dir_blocks;
+  uint32_t dir_extents;
+  uint32_t dir_slots;
+  uint32_t dir_live;
+  uint32_t free_blocks;
+  uint32_t free_extents;
+  uint32_t largest_free;
+};
+
+#define WFS_IOC_DEFRAG _IOWR('W', 1, struct wfs_defrag_args)
+#define WFS_IOC_FRAGSTAT _IOR('W', 2, struct wfs_frag_stats)
+
+const int file_block_num = D_BLOCK + 4;
+const int expected_inode_count = 8;
+// two files with an indirect block each, and the root directory which
+// compacts down to a single block
+const int expected_data_block_count = 2 * (file_block_num + 1) + 1;
+
+int main() {
+  int ret;
+  char* bufs[2];
+  const char* names[2] = {"mnt/a", "mnt/b"};
+  int fds[2];
+
+  for (int f = 0; f < 2; f++) {
+    bufs[f] = (char*)malloc(file_block_num * BLOCK_SIZE);
+    generate_random_data(bufs[f], file_block_num * BLOCK_SIZE);
+    CHECK(create_file(names[f]));
+    fds[f] = ret;
+  }
+
+  // grow both files one block at a time so their blocks interleave
+  for (int i = 0; i < file_block_num; i++) {
+    for (int f = 0; f < 2; f++) {
+      CHECK(write_file_check(fds[f], bufs[f] + i * BLOCK_SIZE, BLOCK_SIZE,
+                             names[f], i * BLOCK_SIZE));
+    }
+  }
+  for (int f = 0; f < 2; f++) {
+    CHECK(close_file(fds[f]));
+  }
+
+  // leave holes in the root directory; unlink compacts it back to one
+  // block on the way
+  char name[32];
+  for (int i = 0; i < 20; i++) {
+    sprintf(name, "mnt/tmp%d", i);
+    CHECK(create_file(name));
+    CHECK(close_file(ret));
+  }
+  for (int i = 0; i < 20; i++) {
+    if (i % 4 == 0) {
+      continue;
+    }
+    sprintf(name, "mnt/tmp%d", i);
+    CHECK(remove_file(name));
+  }
+
+  int dir = open("mnt", O_RDONLY);
+  if (dir < 0) {
+    perror("open mnt");
+    return FAIL;
+  }
+
+  struct wfs_frag_stats st;
+  if (ioctl(dir, WFS_IOC_FRAGSTAT, &st) < 0) {
+    perror("WFS_IOC_FRAGSTAT");
+    return FAIL;
+  }
+  if (st.fragmented_files != 2 || st.dir_live != 7 || st.dir_blocks != 1) {
+    printf("Unexpected fragmentation before defrag: %u fragmented files, %u live dentries in %u blocks\n",
+           st.fragmented_files, st.dir_live, st.dir_blocks);
+    return FAIL;
+  }
+  printf("SUCCESS: %u of %u files fragmented before defrag\n",
+         st.fragmented_files, st.files);
+
+  // a step that may not move anything would never finish
+  struct wfs_defrag_args args = {.cursor = 0, .max_blocks = 0};
+  if (ioctl(dir, WFS_IOC_DEFRAG, &args) != -1 || errno != EINVAL) {
+    printf("Defrag took a budget of 0 blocks\n");
+    return FAIL;
+  }
+  printf("SUCCESS: defrag rejects a budget of 0 blocks\n");
+
+  args.max_blocks = 8;
+  int steps = 0;
+  do {
+    if (ioctl(dir, WFS_IOC_DEFRAG, &args) < 0) {
+      perror("WFS_IOC_DEFRAG");
+      return FAIL;
+    }
+    steps++;
+  } while (!args.done);
+  if (steps < 2) {
+    printf("Defrag ignored the block budget\n");
+    return FAIL;
+  }
+  printf("SUCCESS: defrag finished in several steps\n");
+
+  if (ioctl(dir, WFS_IOC_FRAGSTAT, &st) < 0) {
+    perror("WFS_IOC_FRAGSTAT");
+    return FAIL;
+  }
+  if (st.fragmented_files != 0 || st.file_extents != 2 || st.dir_blocks != 1) {
+    printf("Still fragmented after defrag: %u fragmented files, %u extents, %u directory blocks\n",
+           st.fragmented_files, st.file_extents, st.dir_blocks);
+    return FAIL;
+  }
+  printf("SUCCESS: no fragmented files after defrag\n");
+  close(dir);
+
+  for (int f = 0; f < 2; f++) {
+    CHECK(open_file_read(names[f]));
+    int fd = ret;
+    CHECK(read_file_check(fd, bufs[f], file_block_num * BLOCK_SIZE, names[f], 0));
+    CHECK(close_file(fd));
+    free(bufs[f]);
+  }
+
+  char* expected[] = {"a", "b", "tmp0", "tmp4", "tmp8", "tmp12", "tmp16"};
+  CHECK(read_dir_check("mnt", expected, 7));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+  UNMAP_DISK();
+
+  return PASS;
+}
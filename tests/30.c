@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+// must match struct wfs_sb in solution/wfs.h, up to group_size
+struct disk_sb {
+  size_t num_inodes;
+  size_t num_data_blocks;
+  off_t i_bitmap_ptr;
+  off_t d_bitmap_ptr;
+  off_t i_blocks_ptr;
+  off_t d_blocks_ptr;
+  uint32_t magic;
+  uint32_t num_groups;
+  off_t group_size;
+};
+
+// must match struct wfs_inode in solution/wfs.h
+struct disk_inode {
+  int num;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  off_t size;
+  int nlinks;
+  time_t atim;
+  time_t mtim;
+  time_t ctim;
+  uint8_t color;
+  off_t blocks[N_BLOCKS];
+};
+
+// mkfs -i 128 -b 512 -g 4: 32 inodes and 128 data blocks per group. each
+// directory's group is filled up with empty files, so the next directory
+// has to go to another one, quietly since how many that takes depends on
+// where the directory went. the directories are told apart by their mode
+// and the files by their size, as getattr does not give out inode numbers
+const int num_groups = 4;
+const int num_dirs = 4;
+const int files_per_dir = 3;
+const char* dirs[4] = {"mnt/a", "mnt/b", "mnt/c", "mnt/d"};
+
+// file f of directory d: a distinct size, and past the direct blocks for
+// the last file of each directory so it has an indirect block too
+int file_id(int d, int f) { return 1 + d * files_per_dir + f; }
+int file_blocks(int f) { return f == files_per_dir - 1 ? D_BLOCK + 3 : 1 + f; }
+size_t file_size(int d, int f) { return (file_blocks(f) - 1) * BLOCK_SIZE + file_id(d, f); }
+
+int write_file(const char* path, size_t size) {
+  int ret;
+  char* buf = (char*)malloc(size);
+  generate_random_data(buf, size);
+  CHECK(create_file(path));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, size, path, 0));
+  CHECK(close_file(fd));
+  free(buf);
+  return PASS;
+}
+
+struct disk_inode* inode_at(char* disk_map, struct disk_sb* sb, int g, size_t i) {
+  return (struct disk_inode*)(disk_map + sb->i_blocks_ptr + g * sb->group_size + i * BLOCK_SIZE);
+}
+
+int is_used(char* disk_map, struct disk_sb* sb, int g, size_t i) {
+  uint32_t* bitmap = (uint32_t*)(disk_map + sb->i_bitmap_ptr + g * sb->group_size);
+  return (bitmap[i / 32] >> (i % 32)) & 0x1;
+}
+
+// the group of directory d, and how many inodes it has left
+int find_dir(char* disk_map, int d, int* free_inodes) {
+  struct disk_sb* sb = (struct disk_sb*)disk_map;
+  size_t per_group = sb->num_inodes / sb->num_groups;
+  for (int g = 0; g < sb->num_groups; g++) {
+    for (size_t i = 0; i < per_group; i++) {
+      struct disk_inode* inode = inode_at(disk_map, sb, g, i);
+      if (is_used(disk_map, sb, g, i) && inode->num != 0 && S_ISDIR(inode->mode) &&
+          (inode->mode & 07) == d) {
+        *free_inodes = 0;
+        for (i = 0; i < per_group; i++) {
+          *free_inodes += !is_used(disk_map, sb, g, i);
+        }
+        return g;
+      }
+    }
+  }
+  return -1;
+}
+
+int group_of_block(struct disk_sb* sb, off_t blk) {
+  return (blk - sb->d_blocks_ptr) / sb->group_size;
+}
+
+// every block of `inode`, indirect ones included, is in group `g`
+int check_blocks(char* disk_map, struct disk_sb* sb, struct disk_inode* inode, int g) {
+  for (int i = 0; i < N_BLOCKS; i++) {
+    off_t blk = inode->blocks[i];
+    if (blk != 0 && group_of_block(sb, blk) != g) {
+      printf("inode %d: block %d is in group %d, not %d\n", inode->num, i, group_of_block(sb, blk), g);
+      return FAIL;
+    }
+  }
+  if (inode->blocks[IND_BLOCK] != 0) {
+    off_t* ind = (off_t*)(disk_map + inode->blocks[IND_BLOCK]);
+    for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+      if (ind[i] != 0 && group_of_block(sb, ind[i]) != g) {
+        printf("inode %d: indirect block %d is in group %d, not %d\n", inode->num, i,
+               group_of_block(sb, ind[i]), g);
+        return FAIL;
+      }
+    }
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char path[64];
+  int dir_group[4], free_inodes;
+  int files_seen = 0, spread = 0;
+
+  umask(0);
+  for (int d = 0; d < num_dirs; d++) {
+    if (mkdir(dirs[d], 0700 | d) < 0) {
+      perror("mkdir");
+      return FAIL;
+    }
+    for (int f = 0; f < files_per_dir; f++) {
+      sprintf(path, "%s/f%d", dirs[d], f);
+      CHECK(write_file(path, file_size(d, f)));
+    }
+    MAP_DISK();
+    dir_group[d] = find_dir(disk_map, d, &free_inodes);
+    UNMAP_DISK();
+    if (dir_group[d] < 0) {
+      printf("%s is not in the inode table\n", dirs[d]);
+      return FAIL;
+    }
+    spread |= 1 << dir_group[d];
+    for (int i = 0; i < free_inodes; i++) {
+      sprintf(path, "%s/e%d", dirs[d], i);
+      int fd = open(path, O_CREAT | O_WRONLY, 0644);
+      if (fd < 0) {
+        printf("Failed to create %s: %s\n", path, strerror(errno));
+        return FAIL;
+      }
+      close(fd);
+    }
+  }
+  if (spread != (1 << num_groups) - 1) {
+    printf("The directories only use groups 0x%x\n", spread);
+    return FAIL;
+  }
+  printf("SUCCESS: the directories are spread across the groups\n");
+
+  MAP_DISK();
+  struct disk_sb* sb = (struct disk_sb*)disk_map;
+  size_t per_group = sb->num_inodes / sb->num_groups;
+  for (int g = 0; g < num_groups; g++) {
+    for (size_t i = 0; i < per_group; i++) {
+      struct disk_inode* inode = inode_at(disk_map, sb, g, i);
+      if (!is_used(disk_map, sb, g, i) || !S_ISREG(inode->mode) || inode->size == 0) {
+        continue;
+      }
+      int id = inode->size % BLOCK_SIZE;
+      int d = (id - 1) / files_per_dir;
+      if (id == 0 || d >= num_dirs) {
+        printf("inode %d has an unexpected size %ld\n", inode->num, (long)inode->size);
+        UNMAP_DISK();
+        return FAIL;
+      }
+      if (g != dir_group[d]) {
+        printf("inode %d is in group %d, its parent %s in group %d\n", inode->num, g, dirs[d],
+               dir_group[d]);
+        UNMAP_DISK();
+        return FAIL;
+      }
+      CHECK_MAPPED(check_blocks(disk_map, sb, inode, g));
+      files_seen++;
+    }
+  }
+  if (files_seen != num_dirs * files_per_dir) {
+    printf("Found %d files, expected %d\n", files_seen, num_dirs * files_per_dir);
+    UNMAP_DISK();
+    return FAIL;
+  }
+  printf("SUCCESS: files are in their parent's group\n");
+  printf("SUCCESS: file blocks are in their inode's group\n");
+
+  UNMAP_DISK();
+  return PASS;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int expected_inode_count = 10;
+const int expected_data_block_count = 3;
+
+// with 96 inodes the table is split into three slices of 32: the root
+// keeps slice 0, each top-level directory gets a slice of its own, and
+// files land right after their parent
+const uint32_t expected_bitmap[3] = {0x3, 0xF, 0xF};
+
+int main() {
+  int ret;
+  char name[32];
+  const char* dirs[2] = {"mnt/a", "mnt/b"};
+
+  for (int d = 0; d < 2; d++) {
+    CHECK(create_dir(dirs[d]));
+  }
+  // interleave the two subtrees so a lowest-free allocator would mix them
+  for (int i = 0; i < 3; i++) {
+    for (int d = 0; d < 2; d++) {
+      sprintf(name, "%s/f%d", dirs[d], i);
+      CHECK(create_file(name));
+      CHECK(close_file(ret));
+    }
+  }
+  CHECK(create_file("mnt/r"));
+  CHECK(close_file(ret));
+
+  MAP_DISK();
+
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  uint32_t* bitmap = (uint32_t*)(disk_map + sb->i_bitmap_ptr);
+  for (int i = 0; i < 3; i++) {
+    if (bitmap[i] != expected_bitmap[i]) {
+      printf("Wrong inode bitmap word %d: expected 0x%x, found 0x%x\n", i,
+             expected_bitmap[i], bitmap[i]);
+      UNMAP_DISK();
+      return FAIL;
+    }
+  }
+  printf("SUCCESS: inodes grouped by subtree\n");
+
+  CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_grow_args {
+  uint32_t add_groups;
+  uint32_t num_groups;
+};
+
+#define WFS_IOC_GROW _IOWR('W', 3, struct wfs_grow_args)
+
+// mkfs -i 32 -b 64 makes one group; growing by 20 groups still fits in the
+// 1 MB image, the next 19 groups need the image file to be extended
+const int grow_steps[2] = {20, 19};
+const int expected_groups = 40;
+const int num_files = 64;
+const int file_block_num = D_BLOCK + 40;
+
+int main() {
+  int ret;
+  char name[32];
+
+  int dir = open("mnt", O_RDONLY);
+  if (dir < 0) {
+    printf("Failed to open mnt\n");
+    return FAIL;
+  }
+  struct wfs_grow_args args;
+  for (int i = 0; i < 2; i++) {
+    args.add_groups = grow_steps[i];
+    if (ioctl(dir, WFS_IOC_GROW, &args) < 0) {
+      printf("WFS_IOC_GROW failed: %s\n", strerror(errno));
+      return FAIL;
+    }
+  }
+  close(dir);
+  if (args.num_groups != expected_groups) {
+    printf("Expected %d groups, found %u\n", expected_groups, args.num_groups);
+    return FAIL;
+  }
+
+  struct statvfs st;
+  if (statvfs("mnt", &st) < 0 || st.f_files != 32 * expected_groups ||
+      st.f_blocks != 64 * expected_groups) {
+    printf("Wrong size after growing: %lu inodes, %lu blocks\n", st.f_files,
+           st.f_blocks);
+    return FAIL;
+  }
+  struct stat disk;
+  if (stat("disk.img", &disk) < 0 || disk.st_size <= 1024 * 1024) {
+    printf("Expected the disk image to be extended\n");
+    return FAIL;
+  }
+  printf("SUCCESS: grew to %d groups\n", expected_groups);
+
+  // more files than the original inode table had room for
+  for (int i = 0; i < num_files; i++) {
+    sprintf(name, "mnt/file%d", i);
+    CHECK(create_file(name));
+    CHECK(close_file(ret));
+  }
+
+  // and a file larger than the original data area
+  char* buf = (char*)malloc(file_block_num * BLOCK_SIZE);
+  generate_random_data(buf, file_block_num * BLOCK_SIZE);
+  CHECK(open_file_write("mnt/file0"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, file_block_num * BLOCK_SIZE, "mnt/file0", 0));
+  CHECK(close_file(fd));
+
+  CHECK(open_file_read("mnt/file0"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, file_block_num * BLOCK_SIZE, "mnt/file0", 0));
+  CHECK(close_file(fd));
+
+  free(buf);
+  return PASS;
+}
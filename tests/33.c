@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+// the image is filled with random bytes before mkfs, which only writes
+// group 0; the other groups must be cleared as they are taken into use
+const int num_dirs = 4;
+const int expected_inodes_used = 1 + 2 * 4;
+// root directory, one block per subdirectory and one per file
+const int expected_blocks_used = 1 + 2 * 4;
+
+int main() {
+  int ret;
+  char path[32];
+  char* dirs[4] = {"a", "b", "c", "d"};
+  char* files[1] = {"file"};
+  char* bufs[4];
+
+  for (int d = 0; d < num_dirs; d++) {
+    sprintf(path, "mnt/%s", dirs[d]);
+    CHECK(create_dir(path));
+
+    bufs[d] = (char*)malloc(BLOCK_SIZE);
+    generate_random_data(bufs[d], BLOCK_SIZE);
+    sprintf(path, "mnt/%s/file", dirs[d]);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, bufs[d], BLOCK_SIZE, path, 0));
+    CHECK(close_file(fd));
+  }
+
+  CHECK(read_dir_check("mnt", dirs, num_dirs));
+  for (int d = 0; d < num_dirs; d++) {
+    sprintf(path, "mnt/%s", dirs[d]);
+    CHECK(read_dir_check(path, files, 1));
+
+    sprintf(path, "mnt/%s/file", dirs[d]);
+    CHECK(open_file_read(path));
+    int fd = ret;
+    CHECK(read_file_check(fd, bufs[d], BLOCK_SIZE, path, 0));
+    CHECK(close_file(fd));
+    free(bufs[d]);
+  }
+
+  struct statvfs st;
+  if (statvfs("mnt", &st) < 0) {
+    printf("statvfs failed\n");
+    return FAIL;
+  }
+  if (st.f_files - st.f_ffree != expected_inodes_used ||
+      st.f_blocks - st.f_bfree != expected_blocks_used) {
+    printf("Wrong usage: %lu inodes, %lu blocks\n", st.f_files - st.f_ffree,
+           st.f_blocks - st.f_bfree);
+    return FAIL;
+  }
+  printf("SUCCESS: %d inodes and %d data blocks in use\n", expected_inodes_used,
+         expected_blocks_used);
+
+  return PASS;
+}
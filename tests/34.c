@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+// must match struct wfs_inode in solution/wfs.h
+struct disk_inode {
+  int num;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  off_t size;
+  int nlinks;
+  time_t atim;
+  time_t mtim;
+  time_t ctim;
+  uint8_t color;
+  off_t blocks[N_BLOCKS];
+};
+
+// with 96 inodes: the root keeps slice 0 of the inode table, the top-level
+// directory gets slice 1 and each file lands right after its parent
+const int dir_num = 32;
+const int a_num = 33;
+const int b_num = 1;
+const int orphan_num = 50;
+const int file_block_num = 2;
+
+#define EXPECT_FSCK(flags, expected)                                     \
+  if ((ret = fsck(flags " disk.img")) != expected) {                      \
+    printf("wfs-fsck [%s]: expected exit status %d, got %d\n", flags,      \
+           expected, ret);                                               \
+    return FAIL;                                                         \
+  } else {                                                               \
+    printf("SUCCESS: wfs-fsck [%s] exited with %d\n", flags, expected);  \
+  }
+
+int main() {
+  int ret;
+  char* buf = (char*)malloc(file_block_num * BLOCK_SIZE);
+  generate_random_data(buf, file_block_num * BLOCK_SIZE);
+
+  CHECK(create_dir("mnt/d"));
+  CHECK(create_file("mnt/d/a"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, file_block_num * BLOCK_SIZE, "mnt/d/a", 0));
+  CHECK(close_file(fd));
+  CHECK(create_file("mnt/b"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf, BLOCK_SIZE, "mnt/b", 0));
+  CHECK(close_file(fd));
+
+  EXPECT_FSCK("", 0);
+
+  // corrupt the image: b shares a's first block (leaking its own), a's
+  // link count is wrong, and a free inode is marked allocated
+  int disk = open("disk.img", O_RDWR);
+  struct stat st;
+  fstat(disk, &st);
+  char* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk, 0);
+  close(disk);
+  struct wfs_sb* sb = (struct wfs_sb*)map;
+  struct disk_inode* a = (struct disk_inode*)(map + sb->i_blocks_ptr + a_num * BLOCK_SIZE);
+  struct disk_inode* b = (struct disk_inode*)(map + sb->i_blocks_ptr + b_num * BLOCK_SIZE);
+  uint32_t* i_bitmap = (uint32_t*)(map + sb->i_bitmap_ptr);
+  if (a->num != a_num || b->num != b_num || !(i_bitmap[dir_num / 32] & (1U << (dir_num % 32)))) {
+    printf("Inodes are not where they were expected\n");
+    return FAIL;
+  }
+  b->blocks[0] = a->blocks[0];
+  a->nlinks = 3;
+  i_bitmap[orphan_num / 32] |= 1U << (orphan_num % 32);
+  munmap(map, st.st_size);
+
+  EXPECT_FSCK("", 4);
+  EXPECT_FSCK("-r", 1);
+  EXPECT_FSCK("", 0);
+
+  CHECK(open_file_read("mnt/d/a"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, file_block_num * BLOCK_SIZE, "mnt/d/a", 0));
+  CHECK(close_file(fd));
+
+  free(buf);
+  return PASS;
+}
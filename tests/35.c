@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "common/test.h"
+
+// a subdirectory with a file big enough to need the indirect block, torn
+// down again while another file keeps growing
+const char* workload =
+    "mkdir /x\n"
+    "create /x/big\n"
+    "write /x/big 5000\n"
+    "create /y\n"
+    "write /y 100\n"
+    "unlink /x/big\n"
+    "rmdir /x\n"
+    "write /y 1000\n";
+
+int crash(const char* args) {
+  char cmd[128];
+  sprintf(cmd, "./solution/wfs-crash disk.img %s >/dev/null", args);
+  int status = system(cmd);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+  int ret;
+
+  if ((ret = crash("")) != 0) {
+    printf("Built-in workload left a corrupt prefix (exit status %d)\n", ret);
+    return FAIL;
+  }
+  printf("SUCCESS: no corrupt prefix in the built-in workload\n");
+
+  FILE* f = fopen("workload.txt", "w");
+  fputs(workload, f);
+  fclose(f);
+  ret = crash("workload.txt");
+  remove("workload.txt");
+  if (ret != 0) {
+    printf("Workload file left a corrupt prefix (exit status %d)\n", ret);
+    return FAIL;
+  }
+  printf("SUCCESS: no corrupt prefix in the workload file\n");
+
+  return PASS;
+}
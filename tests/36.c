@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+// a spans the indirect block: 7 direct blocks, the indirect one and 3 more
+const int a_blocks = 10;
+
+#define EXPECT_EROFS(call, what)                                         \
+  if ((call) != -1 || errno != EROFS) {                                  \
+    printf("%s: expected EROFS\n", what);                                \
+    return FAIL;                                                         \
+  } else {                                                               \
+    printf("SUCCESS: %s is read-only\n", what);                          \
+  }
+
+int main() {
+  int ret;
+  char* old = (char*)malloc(a_blocks * BLOCK_SIZE);
+  char* new = (char*)malloc(BLOCK_SIZE);
+  generate_random_data(old, a_blocks * BLOCK_SIZE);
+  generate_random_data(new, BLOCK_SIZE);
+
+  CHECK(create_dir("mnt/d"));
+  CHECK(create_file("mnt/d/a"));
+  int fd = ret;
+  CHECK(write_file_check(fd, old, a_blocks * BLOCK_SIZE, "mnt/d/a", 0));
+  CHECK(close_file(fd));
+  CHECK(create_file("mnt/b"));
+  fd = ret;
+  CHECK(write_file_check(fd, old, BLOCK_SIZE, "mnt/b", 0));
+  CHECK(close_file(fd));
+  long base = used_blocks();
+
+  // taking the snapshot only adds the snapshot table
+  CHECK(create_dir("mnt/.snapshots/s"));
+  EXPECT_USED(base + 1, "snapshot shares all blocks");
+
+  // change the live tree: overwrite a's first block, add a file, remove b
+  CHECK(open_file_write("mnt/d/a"));
+  fd = ret;
+  CHECK(write_file_check(fd, new, BLOCK_SIZE, "mnt/d/a", 0));
+  CHECK(close_file(fd));
+  CHECK(create_file("mnt/d/c"));
+  CHECK(close_file(ret));
+  CHECK(remove_file("mnt/b"));
+  if (fsck("disk.img") != 0) {
+    printf("image with a snapshot does not check clean\n");
+    return FAIL;
+  }
+
+  // the snapshot still shows the tree as it was
+  char* root[] = {"d"};
+  char* snaps[] = {"s"};
+  char* snap_root[] = {"d", "b"};
+  char* snap_d[] = {"a"};
+  CHECK(read_dir_check("mnt", root, 1));
+  CHECK(read_dir_check("mnt/.snapshots", snaps, 1));
+  CHECK(read_dir_check("mnt/.snapshots/s", snap_root, 2));
+  CHECK(read_dir_check("mnt/.snapshots/s/d", snap_d, 1));
+  CHECK(open_file_read("mnt/.snapshots/s/d/a"));
+  fd = ret;
+  CHECK(read_file_check(fd, old, a_blocks * BLOCK_SIZE, "mnt/.snapshots/s/d/a", 0));
+  CHECK(close_file(fd));
+  CHECK(open_file_read("mnt/.snapshots/s/b"));
+  fd = ret;
+  CHECK(read_file_check(fd, old, BLOCK_SIZE, "mnt/.snapshots/s/b", 0));
+  CHECK(close_file(fd));
+
+  // while the live file has the new first block and the old rest
+  memcpy(old, new, BLOCK_SIZE);
+  CHECK(open_file_read("mnt/d/a"));
+  fd = ret;
+  CHECK(read_file_check(fd, old, a_blocks * BLOCK_SIZE, "mnt/d/a", 0));
+  CHECK(close_file(fd));
+
+  EXPECT_EROFS(open("mnt/.snapshots/s/d/x", O_CREAT | O_WRONLY, 0666), "creating in a snapshot");
+  EXPECT_EROFS(unlink("mnt/.snapshots/s/d/a"), "unlinking in a snapshot");
+  EXPECT_EROFS(mkdir("mnt/.snapshots/s/e", 0777), "mkdir in a snapshot");
+
+  // deleting the snapshot gives back everything only it was using: b's
+  // block makes up for the snapshot table, which stays
+  CHECK(remove_dir("mnt/.snapshots/s"));
+  CHECK(read_dir_check("mnt/.snapshots", snaps, 0));
+  EXPECT_USED(base, "snapshot space reclaimed");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after deleting the snapshot\n");
+    return FAIL;
+  }
+
+  // removing a directory a snapshot can see copies its parent's block, for
+  // which a full disk has no room: rmdir says so and the directory stays
+  char* d_entries[] = {"a", "c", "e"};
+  CHECK(create_dir("mnt/d/e"));
+  CHECK(create_dir("mnt/.snapshots/t"));
+  CHECK(fill_disk());
+  if (rmdir("mnt/d/e") != -1 || errno != ENOSPC) {
+    printf("rmdir on a full disk: expected ENOSPC\n");
+    return FAIL;
+  }
+  CHECK(read_dir_check("mnt/d", d_entries, 3));
+  printf("SUCCESS: rmdir on a full disk fails and keeps the directory\n");
+  CHECK(remove_dir("mnt/.snapshots/t"));
+  CHECK(remove_dir("mnt/d/e"));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after a failed rmdir\n");
+    return FAIL;
+  }
+
+  // nor is there room for a new entry in it: the inode made for the entry
+  // is given back
+  struct statvfs st;
+  CHECK(create_dir("mnt/.snapshots/u"));
+  CHECK(fill_disk());
+  statvfs("mnt", &st);
+  fsfilcnt_t free_inodes = st.f_ffree;
+  if (mkdir("mnt/d/g", 0777) != -1 || errno != ENOSPC) {
+    printf("mkdir on a full disk: expected ENOSPC\n");
+    return FAIL;
+  }
+  if (open("mnt/d/h", O_CREAT | O_WRONLY, 0666) != -1 || errno != ENOSPC) {
+    printf("creating a file on a full disk: expected ENOSPC\n");
+    return FAIL;
+  }
+  statvfs("mnt", &st);
+  if (st.f_ffree != free_inodes) {
+    printf("failed mkdir and create leaked %ld inodes\n", (long)(free_inodes - st.f_ffree));
+    return FAIL;
+  }
+  printf("SUCCESS: mkdir and create on a full disk keep no inode\n");
+  CHECK(remove_dir("mnt/.snapshots/u"));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after a failed mkdir\n");
+    return FAIL;
+  }
+
+  free(old);
+  free(new);
+  return PASS;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_clone_args {
+  char src[256];
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  uint64_t cloned;
+  uint32_t shared_blocks;
+  uint32_t pad;
+};
+
+#define WFS_IOC_CLONE _IOWR('W', 4, struct wfs_clone_args)
+
+// a spans the indirect block
+const int file_block_num = D_BLOCK + 24;
+// blocks a holds: data blocks and the indirect block
+const int file_blocks_held = D_BLOCK + 24 + 1;
+
+int clone(const char* dst, const char* src, uint64_t src_off, uint64_t dst_off,
+          uint64_t len, struct wfs_clone_args* args) {
+  int fd = open(dst, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    printf("Unable to open %s\n", dst);
+    return FAIL;
+  }
+  memset(args, 0, sizeof(*args));
+  strcpy(args->src, src);
+  args->src_offset = src_off;
+  args->dst_offset = dst_off;
+  args->length = len;
+  if (ioctl(fd, WFS_IOC_CLONE, args) < 0) {
+    printf("WFS_IOC_CLONE %s -> %s failed: %s\n", src, dst, strerror(errno));
+    close(fd);
+    return FAIL;
+  }
+  close(fd);
+  printf("SUCCESS: cloned %s to %s\n", src, dst);
+  return PASS;
+}
+
+// the kernel caches the destination's old size for the attribute timeout
+// (1 s) since it cannot tell the ioctl changed it
+void wait_attr_timeout() {
+  usleep(1100 * 1000);
+}
+
+int main() {
+  int ret;
+  size_t size = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(size);
+  char* new = (char*)malloc(BLOCK_SIZE);
+  generate_random_data(buf, size);
+  generate_random_data(new, BLOCK_SIZE);
+
+  CHECK(create_file("mnt/a"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, size, "mnt/a", 0));
+  CHECK(close_file(fd));
+  long base = used_blocks();
+
+  // a whole-file clone takes no space at all
+  struct wfs_clone_args args;
+  CHECK(clone("mnt/b", "/a", 0, 0, 0, &args));
+  if (args.cloned != size || args.shared_blocks != file_blocks_held) {
+    printf("Cloned %lu bytes sharing %u blocks\n", (unsigned long)args.cloned, args.shared_blocks);
+    return FAIL;
+  }
+  EXPECT_USED(base, "clone shares every block");
+  wait_attr_timeout();
+  CHECK(open_file_read("mnt/b"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, size, "mnt/b", 0));
+  CHECK(close_file(fd));
+
+  // writing to a block of the clone copies just that block, and the
+  // indirect block above it
+  CHECK(open_file_write("mnt/b"));
+  fd = ret;
+  CHECK(write_file_check(fd, new, BLOCK_SIZE, "mnt/b", (D_BLOCK + 5) * BLOCK_SIZE));
+  CHECK(close_file(fd));
+  EXPECT_USED(base + 2, "write copies the shared block");
+  CHECK(open_file_read("mnt/a"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, size, "mnt/a", 0));
+  CHECK(close_file(fd));
+
+  // a range clone shares the blocks that line up and copies the rest
+  CHECK(clone("mnt/c", "/a", BLOCK_SIZE + 100, 200, 3 * BLOCK_SIZE, &args));
+  if (args.cloned != 3 * BLOCK_SIZE || args.shared_blocks != 0) {
+    printf("Cloned %lu bytes sharing %u blocks\n", (unsigned long)args.cloned, args.shared_blocks);
+    return FAIL;
+  }
+  CHECK(clone("mnt/d", "/a", 2 * BLOCK_SIZE, 0, 2 * BLOCK_SIZE + 10, &args));
+  if (args.shared_blocks != 2) {
+    printf("Range clone shared %u blocks\n", args.shared_blocks);
+    return FAIL;
+  }
+  wait_attr_timeout();
+  CHECK(open_file_read("mnt/c"));
+  fd = ret;
+  char* expected_c = (char*)calloc(1, 200 + 3 * BLOCK_SIZE);
+  memcpy(expected_c + 200, buf + BLOCK_SIZE + 100, 3 * BLOCK_SIZE);
+  CHECK(read_file_check(fd, expected_c, 200 + 3 * BLOCK_SIZE, "mnt/c", 0));
+  CHECK(close_file(fd));
+  CHECK(open_file_read("mnt/d"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf + 2 * BLOCK_SIZE, 2 * BLOCK_SIZE + 10, "mnt/d", 0));
+  CHECK(close_file(fd));
+  if (fsck("disk.img") != 0) {
+    printf("image with clones does not check clean\n");
+    return FAIL;
+  }
+
+  // removing the original only frees the two blocks b no longer shares,
+  // leaving b with as many blocks as a had
+  CHECK(remove_file("mnt/c"));
+  CHECK(remove_file("mnt/d"));
+  CHECK(remove_file("mnt/a"));
+  EXPECT_USED(base, "blocks of the clone survive");
+  memcpy(buf + (D_BLOCK + 5) * BLOCK_SIZE, new, BLOCK_SIZE);
+  CHECK(open_file_read("mnt/b"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, size, "mnt/b", 0));
+  CHECK(close_file(fd));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after removing the original\n");
+    return FAIL;
+  }
+
+  free(buf);
+  free(new);
+  free(expected_c);
+  return PASS;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "common/test.h"
+
+// a log spans the indirect block
+const int log_block_num = D_BLOCK + 20;
+
+// must match ZUNIT_SIZE in solution/wfs.h
+#define ZUNIT (8 * BLOCK_SIZE)
+
+// blocks the file holds on disk, in BLOCK_SIZE units
+long disk_blocks(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    return -1;
+  }
+  return st.st_blocks * 512 / BLOCK_SIZE;
+}
+
+int check_contents(const char* path, char* expected, size_t size) {
+  int ret;
+  CHECK(open_file_read(path));
+  int fd = ret;
+  CHECK(read_file_check(fd, expected, size, path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+int set_compress(const char* path, const char* value) {
+  if (setxattr(path, "user.compress", value, strlen(value), 0) < 0) {
+    printf("setxattr user.compress=%s on %s failed: %s\n", value, path, strerror(errno));
+    return FAIL;
+  }
+  return PASS;
+}
+
+// lines of a made up server log: compresses well
+void generate_log(char* buf, size_t size) {
+  size_t pos = 0;
+  for (int i = 0; pos < size; i++) {
+    char line[128];
+    int n = snprintf(line, sizeof(line), "2024-05-%02d 12:%02d:%02d INFO request %d served in %d ms\n",
+                     i % 28 + 1, i % 60, (i * 7) % 60, i, i % 13);
+    memcpy(buf + pos, line, pos + n > size ? size - pos : n);
+    pos += n;
+  }
+}
+
+int main() {
+  int ret;
+  size_t size = log_block_num * BLOCK_SIZE;
+  char* log = (char*)malloc(size);
+  char* noise = (char*)malloc(size);
+  char* patch = (char*)malloc(BLOCK_SIZE);
+  generate_log(log, size);
+  generate_random_data(noise, size);
+  generate_random_data(patch, BLOCK_SIZE);
+
+  // files made in the directory are compressed
+  CHECK(create_dir("mnt/z"));
+  CHECK(set_compress("mnt/z", "lz"));
+  CHECK(create_file("mnt/z/log"));
+  int fd = ret;
+  CHECK(write_file_check(fd, log, size, "mnt/z/log", 0));
+  CHECK(close_file(fd));
+  char value[16] = {0};
+  if (getxattr("mnt/z/log", "user.compress", value, sizeof(value)) < 0 || strcmp(value, "lz") != 0) {
+    printf("log did not inherit compression: \"%s\"\n", value);
+    return FAIL;
+  }
+  long held = disk_blocks("mnt/z/log");
+  if (held <= 0 || held * 2 > log_block_num) {
+    printf("log of %d blocks takes %ld on disk\n", log_block_num, held);
+    return FAIL;
+  }
+  printf("SUCCESS: log of %d blocks takes %ld on disk\n", log_block_num, held);
+  CHECK(check_contents("mnt/z/log", log, size));
+
+  // overwriting part of it
+  CHECK(open_file_write("mnt/z/log"));
+  fd = ret;
+  CHECK(write_file_check(fd, patch, BLOCK_SIZE, "mnt/z/log", 3 * BLOCK_SIZE + 100));
+  CHECK(close_file(fd));
+  memcpy(log + 3 * BLOCK_SIZE + 100, patch, BLOCK_SIZE);
+  CHECK(check_contents("mnt/z/log", log, size));
+
+  // data that does not compress is not stored any bigger
+  CHECK(create_file("mnt/z/noise"));
+  fd = ret;
+  CHECK(write_file_check(fd, noise, size, "mnt/z/noise", 0));
+  CHECK(close_file(fd));
+  if (disk_blocks("mnt/z/noise") != log_block_num + 1) {
+    printf("noise of %d blocks takes %ld on disk\n", log_block_num, disk_blocks("mnt/z/noise"));
+    return FAIL;
+  }
+  CHECK(check_contents("mnt/z/noise", noise, size));
+  if (fsck("disk.img") != 0) {
+    printf("image with compressed files does not check clean\n");
+    return FAIL;
+  }
+
+  // turning it off stores the log as is again
+  CHECK(set_compress("mnt/z/log", "none"));
+  if (disk_blocks("mnt/z/log") != log_block_num + 1) {
+    printf("uncompressed log takes %ld blocks on disk\n", disk_blocks("mnt/z/log"));
+    return FAIL;
+  }
+  CHECK(check_contents("mnt/z/log", log, size));
+  if (setxattr("mnt/z/log", "user.compress", "zip", 3, 0) == 0 || errno != EINVAL) {
+    printf("unknown codec accepted\n");
+    return FAIL;
+  }
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after uncompressing\n");
+    return FAIL;
+  }
+
+  // an overwrite that runs out of space keeps the units it could not
+  // store as they were, and says how much it did store
+  char* zeros = (char*)calloc(2, ZUNIT);
+  CHECK(create_file("mnt/z/zeros"));
+  fd = ret;
+  CHECK(write_file_check(fd, zeros, 2 * ZUNIT, "mnt/z/zeros", 0));
+  CHECK(close_file(fd));
+  CHECK(fill_disk());
+  if (remove_file("mnt/fill0") == FAIL || free_blocks() != D_BLOCK + 1) {
+    printf("expected %d blocks free, found %ld\n", D_BLOCK + 1, free_blocks());
+    return FAIL;
+  }
+  // the first unit takes them all, the second does not fit
+  CHECK(open_file_write("mnt/z/zeros"));
+  fd = ret;
+  ssize_t n = pwrite(fd, noise, 2 * ZUNIT, 0);
+  if (n != ZUNIT) {
+    printf("overwrite on a full disk wrote %zd bytes, expected %d\n", n, ZUNIT);
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  memcpy(zeros, noise, ZUNIT);
+  CHECK(check_contents("mnt/z/zeros", zeros, 2 * ZUNIT));
+  printf("SUCCESS: an overwrite on a full disk stops short and keeps the rest\n");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after running out of space\n");
+    return FAIL;
+  }
+
+  free(log);
+  free(noise);
+  free(patch);
+  free(zeros);
+  return PASS;
+}
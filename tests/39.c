@@ -0,0 +1,232 @@
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_defrag_args {
+  uint32_t cursor;
+  uint32_t max_blocks;
+  uint32_t moved;
+  uint32_t done;
+};
+
+struct wfs_clone_args {
+  char src[256];
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  uint64_t cloned;
+  uint32_t shared_blocks;
+  uint32_t pad;
+};
+
+#define WFS_IOC_DEFRAG _IOWR('W', 1, struct wfs_defrag_args)
+#define WFS_IOC_CLONE _IOWR('W', 4, struct wfs_clone_args)
+
+const int file_block_num = 3;
+const char* file_name = "checksummed";
+
+// image offset of the first occurrence of `what`, -1 if there is none
+off_t find_on_disk(const void* what, size_t len) {
+  MAP_DISK();
+  struct stat st;
+  stat(new_disk_path, &st);
+  char* at = memmem(disk_map, st.st_size, what, len);
+  off_t off = at ? at - disk_map : -1;
+  UNMAP_DISK();
+  return off;
+}
+
+// flips the bits of the byte at `off` behind the filesystem's back
+int flip_byte(off_t off) {
+  int fd = open(new_disk_path, O_RDWR);
+  unsigned char c;
+  if (fd < 0 || pread(fd, &c, 1, off) != 1) {
+    return FAIL;
+  }
+  c = ~c;
+  if (pwrite(fd, &c, 1, off) != 1) {
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+// one pass of the defragmenter over every inode
+int defrag() {
+  int dir = open("mnt", O_RDONLY);
+  struct wfs_defrag_args args = {.cursor = 0, .max_blocks = 64};
+  do {
+    if (dir < 0 || ioctl(dir, WFS_IOC_DEFRAG, &args) < 0) {
+      perror("WFS_IOC_DEFRAG");
+      return FAIL;
+    }
+  } while (!args.done);
+  close(dir);
+  return PASS;
+}
+
+// reading `path` fails with EIO
+int expect_eio(const char* path, char* got, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || pread(fd, got, size, 0) != -1 || errno != EIO) {
+    printf("reading %s did not fail with EIO\n", path);
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+// the kernel answers lookups from its own cache for the entry timeout (1 s)
+void wait_entry_timeout() {
+  usleep(1100 * 1000);
+}
+
+int main() {
+  int ret;
+  size_t size = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(size);
+  char* got = (char*)malloc(size);
+  generate_random_data(buf, size);
+
+  CHECK(create_dir("mnt/d"));
+  CHECK(create_file("mnt/d/checksummed"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, size, "mnt/d/checksummed", 0));
+  CHECK(close_file(fd));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean\n");
+    return FAIL;
+  }
+
+  // a damaged data block is not handed out
+  off_t data = find_on_disk(buf + BLOCK_SIZE, BLOCK_SIZE);
+  if (data < 0) {
+    printf("second block of the file not found on disk\n");
+    return FAIL;
+  }
+  CHECK(flip_byte(data + 100));
+  fd = open("mnt/d/checksummed", O_RDONLY);
+  if (fd < 0 || pread(fd, got, size, 0) != -1 || errno != EIO) {
+    printf("reading a damaged block did not fail with EIO\n");
+    return FAIL;
+  }
+  close(fd);
+  printf("SUCCESS: damaged data block gives EIO\n");
+  if (fsck("disk.img") != 4) {
+    printf("fsck did not find the damaged block\n");
+    return FAIL;
+  }
+  printf("SUCCESS: fsck finds the damaged block\n");
+  CHECK(flip_byte(data + 100));
+  CHECK(open_file_read("mnt/d/checksummed"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, size, "mnt/d/checksummed", 0));
+  CHECK(close_file(fd));
+
+  // so is a damaged directory block: the padding behind the name
+  char name[MAX_NAME] = {0};
+  strcpy(name, file_name);
+  off_t dent = find_on_disk(name, MAX_NAME);
+  if (dent < 0) {
+    printf("directory entry not found on disk\n");
+    return FAIL;
+  }
+  CHECK(flip_byte(dent + MAX_NAME - 1));
+  wait_entry_timeout();
+  struct stat st;
+  if (stat("mnt/d/checksummed", &st) != -1 || errno != EIO) {
+    printf("looking up in a damaged directory did not fail with EIO\n");
+    return FAIL;
+  }
+  printf("SUCCESS: damaged directory block gives EIO\n");
+  CHECK(flip_byte(dent + MAX_NAME - 1));
+  if (stat("mnt/d/checksummed", &st) != 0 || st.st_size != (off_t)size) {
+    printf("file not back after repairing the directory\n");
+    return FAIL;
+  }
+  printf("SUCCESS: directory readable again\n");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after undoing the damage\n");
+    return FAIL;
+  }
+
+  // a damaged block is not copied into a fresh, valid looking one: not
+  // by the defragmenter, which leaves such a file alone
+  char* frag = (char*)malloc(size);
+  char* other = (char*)malloc(size);
+  generate_random_data(frag, size);
+  generate_random_data(other, size);
+  int fa = open("mnt/frag", O_WRONLY | O_CREAT, 0644);
+  int fb = open("mnt/other", O_WRONLY | O_CREAT, 0644);
+  for (int b = 0; b < file_block_num; b++) {
+    if (write(fa, frag + b * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE ||
+        write(fb, other + b * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE) {
+      printf("interleaved writes failed: %s\n", strerror(errno));
+      return FAIL;
+    }
+  }
+  close(fa);
+  close(fb);
+  data = find_on_disk(frag + BLOCK_SIZE, BLOCK_SIZE);
+  CHECK(flip_byte(data + 100));
+  CHECK(defrag());
+  CHECK(expect_eio("mnt/frag", got, size));
+  CHECK(flip_byte(data + 100));
+  CHECK(open_file_read("mnt/frag"));
+  fd = ret;
+  CHECK(read_file_check(fd, frag, size, "mnt/frag", 0));
+  CHECK(close_file(fd));
+  printf("SUCCESS: defrag leaves a damaged file alone\n");
+
+  // nor when a block shared with a snapshot is copied before it changes:
+  // cloning into a file whose indirect block the snapshot shares
+  size_t big_size = (IND_BLOCK + 3) * BLOCK_SIZE;
+  char* big = (char*)malloc(big_size);
+  generate_random_data(big, big_size);
+  CHECK(create_file("mnt/big"));
+  fd = ret;
+  CHECK(write_file_check(fd, big, big_size, "mnt/big", 0));
+  CHECK(close_file(fd));
+  CHECK(create_dir("mnt/.snapshots/s"));
+  // the indirect block starts with the offsets of the blocks behind it
+  off_t behind[2] = {find_on_disk(big + IND_BLOCK * BLOCK_SIZE, BLOCK_SIZE),
+                     find_on_disk(big + (IND_BLOCK + 1) * BLOCK_SIZE, BLOCK_SIZE)};
+  off_t ind = find_on_disk(behind, sizeof(behind));
+  if (behind[0] < 0 || behind[1] < 0 || ind < 0) {
+    printf("indirect block not found on disk\n");
+    return FAIL;
+  }
+  CHECK(flip_byte(ind + BLOCK_SIZE - 1));
+  fd = open("mnt/big", O_RDWR);
+  struct wfs_clone_args args = {
+      .src = "/frag", .dst_offset = (IND_BLOCK + 1) * BLOCK_SIZE, .length = BLOCK_SIZE};
+  if (fd < 0 || ioctl(fd, WFS_IOC_CLONE, &args) != -1 || errno != EIO) {
+    printf("cloning into a file with a damaged shared indirect block did not fail with EIO\n");
+    return FAIL;
+  }
+  close(fd);
+  CHECK(flip_byte(ind + BLOCK_SIZE - 1));
+  CHECK(open_file_read("mnt/big"));
+  fd = ret;
+  CHECK(read_file_check(fd, big, big_size, "mnt/big", 0));
+  CHECK(close_file(fd));
+  printf("SUCCESS: a damaged shared block is not copied on write\n");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after undoing the damage\n");
+    return FAIL;
+  }
+
+  free(buf);
+  free(got);
+  free(frag);
+  free(other);
+  free(big);
+  return PASS;
+}
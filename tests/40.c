@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_dedup_stats {
+  uint64_t blocks_written;
+  uint64_t blocks_deduped;
+  uint32_t indexed_blocks;
+  uint32_t enabled;
+};
+
+#define WFS_IOC_DEDUPSTAT _IOR('W', 5, struct wfs_dedup_stats)
+
+// a spans the indirect block: 7 direct blocks, the indirect one and 3 more
+const int a_blocks = 10;
+// c is one block of bytes repeated
+const int c_blocks = 8;
+
+int write_new(const char* path, const char* buf, size_t size) {
+  int ret;
+  CHECK(create_file(path));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, size, path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+int check_content(const char* path, const char* buf, size_t size) {
+  int ret;
+  CHECK(open_file_read(path));
+  int fd = ret;
+  CHECK(read_file_check(fd, buf, size, path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+int dedup_stats(struct wfs_dedup_stats* st) {
+  int fd = open("mnt/b", O_RDONLY);
+  if (fd < 0 || ioctl(fd, WFS_IOC_DEDUPSTAT, st) < 0) {
+    printf("WFS_IOC_DEDUPSTAT failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+int main() {
+  int ret;
+  size_t size = a_blocks * BLOCK_SIZE;
+  char* buf = (char*)malloc(size);
+  char* new = (char*)malloc(BLOCK_SIZE);
+  char* same = (char*)malloc(c_blocks * BLOCK_SIZE);
+  generate_random_data(buf, size);
+  generate_random_data(new, BLOCK_SIZE);
+  for (int i = 0; i < c_blocks; i++) {
+    memcpy(same + i * BLOCK_SIZE, new, BLOCK_SIZE);
+  }
+  new[0] ^= 1; // not quite the block c repeats
+
+  CHECK(write_new("mnt/a", buf, size));
+  long base = used_blocks();
+
+  // a copy of a only needs an indirect block of its own
+  CHECK(write_new("mnt/b", buf, size));
+  EXPECT_USED(base + 1, "duplicate file takes no data blocks");
+  CHECK(check_content("mnt/b", buf, size));
+
+  // and a file repeating one block stores it once
+  CHECK(write_new("mnt/c", same, c_blocks * BLOCK_SIZE));
+  EXPECT_USED(base + 3, "repeated block stored once");
+  CHECK(check_content("mnt/c", same, c_blocks * BLOCK_SIZE));
+
+  // writing to a shared block copies it, the other users keep the old bytes
+  CHECK(open_file_write("mnt/b"));
+  int fd = ret;
+  CHECK(write_file_check(fd, new, BLOCK_SIZE, "mnt/b", 2 * BLOCK_SIZE));
+  CHECK(close_file(fd));
+  CHECK(open_file_write("mnt/c"));
+  fd = ret;
+  CHECK(write_file_check(fd, "patch", 5, "mnt/c", 3 * BLOCK_SIZE + 7));
+  CHECK(close_file(fd));
+  EXPECT_USED(base + 5, "writes copy shared blocks");
+  CHECK(check_content("mnt/a", buf, size));
+  memcpy(same + 3 * BLOCK_SIZE + 7, "patch", 5);
+  CHECK(check_content("mnt/c", same, c_blocks * BLOCK_SIZE));
+
+  struct wfs_dedup_stats st;
+  CHECK(dedup_stats(&st));
+  if (!st.enabled || st.blocks_written != 2 * a_blocks + c_blocks + 1 ||
+      st.blocks_deduped != a_blocks + c_blocks - 1) {
+    printf("dedup stats: enabled %u, %lu written, %lu deduped\n", st.enabled,
+           (unsigned long)st.blocks_written, (unsigned long)st.blocks_deduped);
+    return FAIL;
+  }
+  printf("SUCCESS: dedup stats\n");
+  if (fsck("disk.img") != 0) {
+    printf("deduplicated image does not check clean\n");
+    return FAIL;
+  }
+
+  // removing a frees only its indirect block and the block b rewrote
+  CHECK(remove_file("mnt/a"));
+  EXPECT_USED(base + 3, "blocks b still uses survive");
+  memcpy(buf + 2 * BLOCK_SIZE, new, BLOCK_SIZE);
+  CHECK(check_content("mnt/b", buf, size));
+
+  // new blocks of a freed file can be matched again
+  CHECK(write_new("mnt/d", new, BLOCK_SIZE));
+  EXPECT_USED(base + 3, "block shared with b");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after removing a\n");
+    return FAIL;
+  }
+
+  free(buf);
+  free(new);
+  free(same);
+  return PASS;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_rename_args {
+  char from[256];
+  char to[256];
+  uint32_t flags;
+  uint32_t pad;
+};
+
+#define WFS_IOC_RENAME _IOW('W', 6, struct wfs_rename_args)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+const int a_blocks = 10;
+
+int check_content(const char* path, const char* buf, size_t size) {
+  int ret;
+  CHECK(open_file_read(path));
+  int fd = ret;
+  CHECK(read_file_check(fd, buf, size, path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+int rename2(const char* from, const char* to, unsigned int flags) {
+  struct wfs_rename_args args;
+  memset(&args, 0, sizeof(args));
+  strcpy(args.from, from);
+  strcpy(args.to, to);
+  args.flags = flags;
+  int fd = open("mnt", O_RDONLY);
+  int ret = ioctl(fd, WFS_IOC_RENAME, &args);
+  close(fd);
+  return ret;
+}
+
+int nlink(const char* path) {
+  struct stat st;
+  return stat(path, &st) < 0 ? -1 : (int)st.st_nlink;
+}
+
+// the kernel caches names and attributes for 1 s, and cannot tell the
+// ioctl changed them
+void wait_entry_timeout() {
+  usleep(1100 * 1000);
+}
+
+#define EXPECT_ERRNO(call, err, what)                                    \
+  if ((call) != -1 || errno != (err)) {                                  \
+    printf("%s: expected %s, got %s\n", what, strerror(err),             \
+           strerror(errno));                                             \
+    return FAIL;                                                         \
+  } else {                                                               \
+    printf("SUCCESS: %s fails with %s\n", what, strerror(err));          \
+  }
+
+int main() {
+  int ret;
+  size_t size = a_blocks * BLOCK_SIZE;
+  char* a = (char*)malloc(size);
+  char* x = (char*)malloc(BLOCK_SIZE);
+  generate_random_data(a, size);
+  generate_random_data(x, BLOCK_SIZE);
+
+  CHECK(create_file("mnt/a"));
+  int fd = ret;
+  CHECK(write_file_check(fd, a, size, "mnt/a", 0));
+  CHECK(close_file(fd));
+  CHECK(create_dir("mnt/d"));
+  long base = used_blocks();
+
+  // renames only move entries, within a directory and across them
+  EXPECT(rename("mnt/a", "mnt/b") == 0, "rename in place");
+  EXPECT(rename("mnt/b", "mnt/d/b") == 0, "rename to another directory");
+  base++; // d's first entry needs a directory block
+  EXPECT(used_blocks() == base, "no data blocks moved");
+  char* root[] = {"d"};
+  char* d[] = {"b"};
+  CHECK(read_dir_check("mnt", root, 1));
+  CHECK(read_dir_check("mnt/d", d, 1));
+  CHECK(check_content("mnt/d/b", a, size));
+
+  // hard links share the inode, and it goes with the last of them
+  EXPECT(link("mnt/d/b", "mnt/c") == 0 && link("mnt/c", "mnt/c2") == 0, "link");
+  wait_entry_timeout(); // every name has attributes of its own cached
+  EXPECT(nlink("mnt/c") == 3, "link count 3");
+  EXPECT(unlink("mnt/c2") == 0 && unlink("mnt/d/b") == 0, "unlink two links");
+  wait_entry_timeout();
+  EXPECT(nlink("mnt/c") == 1, "link count back to 1");
+  base--; // d is empty again and gives its block back
+  EXPECT(used_blocks() == base, "data kept while linked");
+  CHECK(check_content("mnt/c", a, size));
+  EXPECT_ERRNO(link("mnt/d", "mnt/e"), EPERM, "linking a directory");
+  EXPECT_ERRNO(link("mnt/c", "mnt/d"), EEXIST, "linking over a name");
+
+  // rename over a file drops that file
+  CHECK(create_file("mnt/x"));
+  fd = ret;
+  CHECK(write_file_check(fd, x, BLOCK_SIZE, "mnt/x", 0));
+  CHECK(close_file(fd));
+  EXPECT(rename("mnt/c", "mnt/x") == 0, "rename over a file");
+  EXPECT(used_blocks() == base, "replaced file freed");
+  CHECK(check_content("mnt/x", a, size));
+
+  CHECK(create_dir("mnt/d/sub"));
+  CHECK(create_file("mnt/d/sub/f"));
+  CHECK(close_file(ret));
+  CHECK(create_dir("mnt/e"));
+  EXPECT_ERRNO(rename("mnt/d", "mnt/d/sub/d"), EINVAL, "moving a directory into itself");
+  EXPECT_ERRNO(rename("mnt/x", "mnt/e"), EISDIR, "rename of a file over a directory");
+  EXPECT_ERRNO(rename("mnt/e", "mnt/d/sub"), ENOTEMPTY, "rename over a full directory");
+  EXPECT(rename("mnt/d/sub", "mnt/e") == 0, "rename over an empty directory");
+  CHECK(check_content("mnt/e/f", "", 0));
+
+  // the flags rename() cannot pass on
+  CHECK(create_file("mnt/y"));
+  fd = ret;
+  CHECK(write_file_check(fd, x, BLOCK_SIZE, "mnt/y", 0));
+  CHECK(close_file(fd));
+  EXPECT_ERRNO(rename2("/x", "/y", RENAME_NOREPLACE), EEXIST, "RENAME_NOREPLACE");
+  EXPECT_ERRNO(rename2("/x", "/z", RENAME_EXCHANGE), ENOENT, "RENAME_EXCHANGE with one file");
+  EXPECT(rename2("/x", "/y", RENAME_EXCHANGE) == 0, "RENAME_EXCHANGE");
+  wait_entry_timeout();
+  CHECK(check_content("mnt/x", x, BLOCK_SIZE));
+  CHECK(check_content("mnt/y", a, size));
+  EXPECT(rename2("/e", "/d/e", RENAME_NOREPLACE) == 0, "RENAME_NOREPLACE to a new name");
+  wait_entry_timeout();
+  EXPECT_ERRNO(rmdir("mnt/d"), ENOTEMPTY, "rmdir of a full directory");
+  EXPECT_ERRNO(rmdir("mnt/x"), ENOTDIR, "rmdir of a file");
+  char* root2[] = {"d", "x", "y"};
+  char* d2[] = {"e"};
+  CHECK(read_dir_check("mnt", root2, 3));
+  CHECK(read_dir_check("mnt/d", d2, 1));
+
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after renames and links\n");
+    return FAIL;
+  }
+  free(a);
+  free(x);
+  return PASS;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "common/test.h"
+
+// the image as it is now: wfs maps it shared, so every store it makes
+// shows up here
+unsigned long image_hash() {
+  int fd = open("disk.img", O_RDONLY);
+  unsigned long h = 14695981039346656037UL;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      h = (h ^ (unsigned char)buf[i]) * 1099511628211UL;
+    }
+  }
+  close(fd);
+  return h;
+}
+
+int remount(const char* opts) {
+  char cmd[256];
+  system("./solution/umount.sh mnt");
+  sprintf(cmd, "./solution/wfs disk.img mnt -s %s >/dev/null &", opts);
+  system(cmd);
+  usleep(300 * 1000);
+  printf("SUCCESS: mounted with '%s'\n", opts);
+  return PASS;
+}
+
+int read_times(const char* path, int times) {
+  char buf[BLOCK_SIZE];
+  for (int i = 0; i < times; i++) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      printf("Unable to read %s\n", path);
+      return FAIL;
+    }
+    close(fd);
+  }
+  return PASS;
+}
+
+// cached attributes time out after 1 s
+struct stat stat_fresh(const char* path) {
+  struct stat st;
+  usleep(1100 * 1000);
+  stat(path, &st);
+  return st;
+}
+
+int same_time(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+int main() {
+  int ret;
+  char* buf = (char*)malloc(BLOCK_SIZE);
+  generate_random_data(buf, BLOCK_SIZE);
+
+  int nsec = 0;
+  const char* names[] = {"mnt/a", "mnt/b", "mnt/c"};
+  for (int i = 0; i < 3; i++) {
+    CHECK(create_file(names[i]));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, BLOCK_SIZE, names[i], 0));
+    CHECK(close_file(fd));
+    struct stat st;
+    stat(names[i], &st);
+    nsec |= st.st_mtim.tv_nsec != 0;
+  }
+  EXPECT(nsec, "timestamps have nanoseconds");
+
+  // relatime (the default): the first read after a write moves atime,
+  // later ones write nothing
+  struct stat before = stat_fresh("mnt/a");
+  CHECK(read_times("mnt/a", 1));
+  struct stat after = stat_fresh("mnt/a");
+  EXPECT(!same_time(before.st_atim, after.st_atim), "relatime: read after write updates atime");
+  unsigned long h = image_hash();
+  CHECK(read_times("mnt/a", 20));
+  EXPECT(image_hash() == h, "relatime: further reads leave the image alone");
+  EXPECT(same_time(stat_fresh("mnt/a").st_atim, after.st_atim), "relatime: atime kept");
+
+  // noatime: reads never write
+  CHECK(remount("-o noatime"));
+  before = stat_fresh("mnt/b");
+  h = image_hash();
+  CHECK(read_times("mnt/b", 20));
+  EXPECT(image_hash() == h, "noatime: reads leave the image alone");
+  EXPECT(same_time(stat_fresh("mnt/b").st_atim, before.st_atim), "noatime: atime kept");
+
+  // lazytime: every read moves atime, but only in memory until unmount
+  CHECK(remount("-o strictatime,lazytime"));
+  before = stat_fresh("mnt/c");
+  h = image_hash();
+  CHECK(read_times("mnt/c", 5));
+  after = stat_fresh("mnt/c");
+  EXPECT(!same_time(after.st_atim, before.st_atim), "lazytime: atime updated");
+  EXPECT(image_hash() == h, "lazytime: image unchanged while mounted");
+  CHECK(remount(""));
+  EXPECT(image_hash() != h, "lazytime: times written at unmount");
+  EXPECT(same_time(stat_fresh("mnt/c").st_atim, after.st_atim), "lazytime: atime persisted");
+
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean\n");
+    return FAIL;
+  }
+  free(buf);
+  return PASS;
+}
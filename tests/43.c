@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "common/test.h"
+
+long dir_size(const char* path) {
+  struct stat st;
+  usleep(1100 * 1000); // cached attributes time out after 1 s
+  return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+int main() {
+  int ret;
+  char path[64];
+
+  // 40 files, a subdirectory, 20 more files: 61 entries in 4 blocks, the
+  // files with names long enough for 32-byte entries, 16 to a block
+  CHECK(create_dir("mnt/d"));
+  long base = used_blocks();
+  for (int i = 0; i < 60; i++) {
+    if (i == 40) {
+      CHECK(create_dir("mnt/d/sub"));
+    }
+    sprintf(path, "mnt/d/file-with-long-name-%02d", i);
+    CHECK(create_file(path));
+    CHECK(close_file(ret));
+  }
+  EXPECT(dir_size("mnt/d") == 4 * BLOCK_SIZE, "directory has 4 blocks");
+  EXPECT(used_blocks() == base + 4, "4 directory blocks in use");
+
+  // the remaining files move into the room left in the first blocks, the
+  // subdirectory stays where it was, in the third block
+  for (int i = 0; i < 50; i++) {
+    sprintf(path, "mnt/d/file-with-long-name-%02d", i);
+    CHECK(remove_file(path));
+  }
+  EXPECT(dir_size("mnt/d") == 3 * BLOCK_SIZE, "compacted up to the subdirectory");
+  EXPECT(used_blocks() == base + 3, "blocks freed");
+
+  // with it gone, everything fits in the first block
+  CHECK(remove_dir("mnt/d/sub"));
+  EXPECT(dir_size("mnt/d") == BLOCK_SIZE, "compacted to one block");
+  EXPECT(used_blocks() == base + 1, "trailing blocks freed");
+
+  char* names[10];
+  for (int i = 0; i < 10; i++) {
+    names[i] = malloc(32);
+    sprintf(names[i], "file-with-long-name-%02d", 50 + i);
+  }
+  CHECK(read_dir_check("mnt/d", names, 10));
+  for (int i = 50; i < 60; i++) {
+    struct stat st;
+    sprintf(path, "mnt/d/file-with-long-name-%02d", i);
+    EXPECT(stat(path, &st) == 0 && st.st_nlink == 1, path);
+  }
+
+  // and emptying it gives back the last one
+  for (int i = 50; i < 60; i++) {
+    sprintf(path, "mnt/d/file-with-long-name-%02d", i);
+    CHECK(remove_file(path));
+  }
+  EXPECT(dir_size("mnt/d") == 0, "empty directory has no blocks");
+  EXPECT(used_blocks() == base, "all directory blocks freed");
+
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean\n");
+    return FAIL;
+  }
+  for (int i = 0; i < 10; i++) {
+    free(names[i]);
+  }
+  return PASS;
+}
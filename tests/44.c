@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+#define DIRSCAN_BATCH (32)
+#define WFS_NAME_MAX (255)
+
+struct wfs_dirscan_ent {
+  uint32_t num;
+  uint8_t file_type;
+  uint8_t pad[3];
+  char name[WFS_NAME_MAX + 1];
+};
+
+struct wfs_dirscan_args {
+  char after[WFS_NAME_MAX + 1];
+  char prefix[WFS_NAME_MAX + 1];
+  uint32_t count;
+  uint32_t more;
+  struct wfs_dirscan_ent ents[DIRSCAN_BATCH];
+};
+
+#define WFS_IOC_DIRSCAN _IOWR('W', 7, struct wfs_dirscan_args)
+
+// far more than the 7 direct blocks of a list directory hold (112)
+const int num_files = 600;
+
+// the names in a directory, besides . and .., checking they come sorted
+int list_sorted(const char* path) {
+  DIR* d = opendir(path);
+  if (d == NULL) {
+    printf("Unable to open directory %s\n", path);
+    return -1;
+  }
+  char prev[256] = "";
+  int n = 0;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+      continue;
+    }
+    if (n > 0 && strcmp(prev, e->d_name) >= 0) {
+      printf("%s lists '%s' after '%s'\n", path, e->d_name, prev);
+      closedir(d);
+      return -1;
+    }
+    strcpy(prev, e->d_name);
+    n++;
+  }
+  closedir(d);
+  return n;
+}
+
+int dirscan(const char* path, struct wfs_dirscan_args* args) {
+  int fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    printf("Unable to open %s\n", path);
+    return FAIL;
+  }
+  if (ioctl(fd, WFS_IOC_DIRSCAN, args) < 0) {
+    printf("WFS_IOC_DIRSCAN on %s failed: %s\n", path, strerror(errno));
+    close(fd);
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+int check_content(const char* path, const char* expected) {
+  int ret;
+  CHECK(open_file_read(path));
+  int fd = ret;
+  CHECK(read_file_check(fd, (char*)expected, strlen(expected), (char*)path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char path[64], name[16];
+  int order[num_files];
+  for (int i = 0; i < num_files; i++) {
+    order[i] = i;
+  }
+  srand(43);
+  for (int i = num_files - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    int t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  CHECK(create_dir("mnt/big"));
+  CHECK(create_dir("mnt/big/sub"));
+  CHECK(create_file("mnt/big/sub/inner"));
+  CHECK(close_file(ret));
+  long base = used_blocks();
+
+  // created in random order, each file holding its own name
+  for (int i = 0; i < num_files; i++) {
+    sprintf(name, "f%03d", order[i]);
+    sprintf(path, "mnt/big/%s", name);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, name, strlen(name), path, 0));
+    CHECK(close_file(fd));
+  }
+  if ((ret = list_sorted("mnt/big")) != num_files + 1) {
+    printf("Listed %d entries, expected %d\n", ret, num_files + 1);
+    return FAIL;
+  }
+  printf("SUCCESS: large directory lists every entry in order\n");
+  for (int i = 0; i < num_files; i += 7) {
+    sprintf(name, "f%03d", i);
+    sprintf(path, "mnt/big/%s", name);
+    CHECK(check_content(path, name));
+  }
+  printf("SUCCESS: entries are found by name\n");
+
+  // the 100 names starting with f1, a batch at a time
+  struct wfs_dirscan_args args;
+  memset(&args, 0, sizeof(args));
+  strcpy(args.prefix, "f1");
+  for (int first = 100; first < 200; first += DIRSCAN_BATCH) {
+    int n = 200 - first < DIRSCAN_BATCH ? 200 - first : DIRSCAN_BATCH;
+    char want[2][16];
+    sprintf(want[0], "f%03d", first);
+    sprintf(want[1], "f%03d", first + n - 1);
+    CHECK(dirscan("mnt/big", &args));
+    if (args.count != n || args.more != (first + n < 200) || strcmp(args.ents[0].name, want[0]) ||
+        strcmp(args.ents[n - 1].name, want[1]) || args.ents[0].file_type != DT_REG) {
+      printf("Batch from %s: %u entries, more %u, from %s\n", want[0], args.count, args.more,
+             args.ents[0].name);
+      return FAIL;
+    }
+    strcpy(args.after, args.ents[n - 1].name);
+  }
+  printf("SUCCESS: prefix scan returns the range in batches\n");
+  if (fsck("disk.img") != 0) {
+    printf("image with a large directory does not check clean\n");
+    return FAIL;
+  }
+
+  // a snapshot keeps the old listing while most entries go
+  CHECK(create_dir("mnt/.snapshots/s"));
+  for (int i = 0; i < num_files; i++) {
+    if (order[i] % 10 != 0) {
+      sprintf(path, "mnt/big/f%03d", order[i]);
+      CHECK(remove_file(path));
+    }
+  }
+  if ((ret = list_sorted("mnt/big")) != num_files / 10 + 1) {
+    printf("Listed %d entries after unlinking, expected %d\n", ret, num_files / 10 + 1);
+    return FAIL;
+  }
+  if ((ret = list_sorted("mnt/.snapshots/s/big")) != num_files + 1) {
+    printf("Snapshot lists %d entries, expected %d\n", ret, num_files + 1);
+    return FAIL;
+  }
+  CHECK(check_content("mnt/.snapshots/s/big/f123", "f123"));
+  CHECK(check_content("mnt/big/f120", "f120"));
+  printf("SUCCESS: snapshot keeps the directory as it was\n");
+
+  // and once it is gone, so are the blocks of the removed entries
+  CHECK(remove_dir("mnt/.snapshots/s"));
+  for (int i = 0; i < num_files; i += 10) {
+    sprintf(path, "mnt/big/f%03d", i);
+    CHECK(remove_file(path));
+  }
+  if ((ret = list_sorted("mnt/big")) != 1) {
+    printf("Listed %d entries in the emptied directory\n", ret);
+    return FAIL;
+  }
+  // the tree is down to one leaf, where the list had one block. the
+  // snapshot table stays
+  if (used_blocks() != base + 1) {
+    printf("Expected %ld data blocks in use, found %ld\n", base + 1, used_blocks());
+    return FAIL;
+  }
+  CHECK(open_file_read("mnt/big/sub/inner"));
+  CHECK(close_file(ret));
+  printf("SUCCESS: emptied directory gives its blocks back\n");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after the deletes\n");
+    return FAIL;
+  }
+  return PASS;
+}
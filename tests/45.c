@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+#define WFS_NAME_MAX (255)
+
+// enough 200-byte names, two to a block, to turn the directory into a tree
+const int num_long = 40;
+
+// a name of len bytes, unique per i
+void long_name(char* buf, int i, int len) {
+  memset(buf, 'a' + i % 26, len);
+  sprintf(buf, "%03d", i);
+  buf[3] = '-';
+  buf[len] = '\0';
+}
+
+// the d_type readdir reports for name in dir, or -1 when it is missing
+int listed_type(const char* dir, const char* name) {
+  DIR* d = opendir(dir);
+  if (d == NULL) {
+    return -1;
+  }
+  struct dirent* e;
+  int type = -1;
+  while ((e = readdir(d)) != NULL) {
+    if (!strcmp(e->d_name, name)) {
+      type = e->d_type;
+      break;
+    }
+  }
+  closedir(d);
+  return type;
+}
+
+int main() {
+  int ret;
+  char name[WFS_NAME_MAX + 2], other[WFS_NAME_MAX + 2];
+  char path[WFS_NAME_MAX + 64];
+
+  struct statvfs st;
+  if (statvfs("mnt", &st) < 0 || st.f_namemax != WFS_NAME_MAX) {
+    printf("statvfs reports a name limit of %lu\n", st.f_namemax);
+    return FAIL;
+  }
+
+  // the longest name there can be
+  long_name(name, 0, WFS_NAME_MAX);
+  sprintf(path, "mnt/%s", name);
+  CHECK(create_file(path));
+  int fd = ret;
+  CHECK(write_file_check(fd, "longest", 7, path, 0));
+  CHECK(close_file(fd));
+  CHECK(open_file_read(path));
+  fd = ret;
+  CHECK(read_file_check(fd, "longest", 7, path, 0));
+  CHECK(close_file(fd));
+  if (listed_type("mnt", name) != DT_REG) {
+    printf("%d-byte name is not listed as a file\n", WFS_NAME_MAX);
+    return FAIL;
+  }
+  printf("SUCCESS: %d-byte name works\n", WFS_NAME_MAX);
+
+  // one byte more is refused
+  long_name(other, 1, WFS_NAME_MAX + 1);
+  sprintf(path, "mnt/%s", other);
+  if (open(path, O_CREAT | O_RDWR, S_IRWXU) >= 0 || errno != ENAMETOOLONG) {
+    printf("%d-byte name was not refused with ENAMETOOLONG\n", WFS_NAME_MAX + 1);
+    return FAIL;
+  }
+  printf("SUCCESS: longer name is refused\n");
+
+  // renamed into a subdirectory under another long name
+  long_name(other, 2, 100);
+  sprintf(path, "mnt/%s", other);
+  CHECK(create_dir(path));
+  if (listed_type("mnt", other) != DT_DIR) {
+    printf("Directory is not listed as one\n");
+    return FAIL;
+  }
+  char from[WFS_NAME_MAX + 8], to[2 * WFS_NAME_MAX + 8];
+  sprintf(from, "mnt/%s", name);
+  long_name(name, 3, 200);
+  sprintf(to, "mnt/%s/%s", other, name);
+  if (rename(from, to) < 0) {
+    printf("Unable to rename to %s: %s\n", to, strerror(errno));
+    return FAIL;
+  }
+  CHECK(open_file_read(to));
+  fd = ret;
+  CHECK(read_file_check(fd, "longest", 7, to, 0));
+  CHECK(close_file(fd));
+  printf("SUCCESS: rename between long names works\n");
+
+  // short names pack far tighter than the old 32-byte entries
+  CHECK(create_dir("mnt/short"));
+  for (int i = 0; i < 40; i++) {
+    sprintf(path, "mnt/short/s%02d", i);
+    CHECK(create_file(path));
+    CHECK(close_file(ret));
+  }
+  struct stat sst;
+  if (stat("mnt/short", &sst) < 0 || sst.st_size != BLOCK_SIZE) {
+    printf("40 short names take %ld bytes, expected %d\n", (long)sst.st_size, BLOCK_SIZE);
+    return FAIL;
+  }
+  printf("SUCCESS: short names share a block\n");
+
+  // long names in a directory big enough to become a tree
+  CHECK(create_dir("mnt/tree"));
+  for (int i = 0; i < num_long; i++) {
+    long_name(name, i, 200);
+    sprintf(path, "mnt/tree/%s", name);
+    CHECK(create_file(path));
+    CHECK(close_file(ret));
+  }
+  for (int i = 0; i < num_long; i++) {
+    long_name(name, i, 200);
+    if (listed_type("mnt/tree", name) != DT_REG) {
+      printf("Entry %d is missing from the tree directory\n", i);
+      return FAIL;
+    }
+  }
+  if (fsck("disk.img") != 0) {
+    printf("image with long names does not check clean\n");
+    return FAIL;
+  }
+  for (int i = 0; i < num_long; i += 2) {
+    long_name(name, i, 200);
+    sprintf(path, "mnt/tree/%s", name);
+    CHECK(remove_file(path));
+  }
+  for (int i = 0; i < num_long; i++) {
+    long_name(name, i, 200);
+    sprintf(path, "mnt/tree/%s", name);
+    if ((access(path, F_OK) == 0) != (i % 2 == 1)) {
+      printf("Entry %d is %s after the deletes\n", i, i % 2 ? "missing" : "still there");
+      return FAIL;
+    }
+  }
+  printf("SUCCESS: long names work in a tree directory\n");
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after the deletes\n");
+    return FAIL;
+  }
+  return PASS;
+}
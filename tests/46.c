@@ -0,0 +1,180 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+#define WFS_IO_PREAD (1)
+
+struct wfs_io_stats {
+  uint32_t backend;
+  uint32_t direct;
+  uint64_t cache_pages;
+  uint64_t resident;
+  uint64_t dirty;
+  uint64_t reads;
+  uint64_t dirtied;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint64_t locked;
+  uint64_t prefetched;
+};
+
+struct wfs_grow_args {
+  uint32_t add_groups;
+  uint32_t num_groups;
+};
+
+#define WFS_IOC_GROW _IOWR('W', 3, struct wfs_grow_args)
+#define WFS_IOC_IOSTAT _IOR('W', 8, struct wfs_io_stats)
+
+// mounted with a 1MB cache; together the files are several times that
+const int num_files = 150;
+const int file_size = 20000;
+// O_DIRECT reads reach the filesystem one at a time, at this size
+const int chunk = 512;
+
+int io_stats(struct wfs_io_stats* st) {
+  int fd = open("mnt", O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || ioctl(fd, WFS_IOC_IOSTAT, st) < 0) {
+    printf("WFS_IOC_IOSTAT failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+void fill(char* buf, int i) {
+  for (int k = 0; k < file_size; k++) {
+    buf[k] = (char)(k * 31 + i * 7);
+  }
+}
+
+int main() {
+  int ret;
+  char path[64];
+  char* buf = malloc(file_size);
+  struct wfs_io_stats st;
+
+  CHECK(io_stats(&st));
+  if (st.backend != WFS_IO_PREAD || st.cache_pages == 0) {
+    printf("Mounted with backend %u and %lu cache pages\n", st.backend, (unsigned long)st.cache_pages);
+    return FAIL;
+  }
+
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%03d", i);
+    fill(buf, i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%03d", i);
+    fill(buf, i);
+    CHECK(open_file_read(path));
+    int fd = ret;
+    CHECK(read_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  CHECK(io_stats(&st));
+  if (st.evictions == 0 || st.writebacks == 0 || st.resident > st.cache_pages) {
+    printf("%lu of %lu pages resident, %lu evicted, %lu written back\n", (unsigned long)st.resident,
+           (unsigned long)st.cache_pages, (unsigned long)st.evictions, (unsigned long)st.writebacks);
+    return FAIL;
+  }
+  printf("SUCCESS: files larger than the cache read back through it\n");
+  // -o mlock keeps the metadata in the cache through all of that
+  if (st.locked == 0 || st.locked > st.resident) {
+    printf("%lu pages locked, %lu resident\n", (unsigned long)st.locked, (unsigned long)st.resident);
+    return FAIL;
+  }
+  printf("SUCCESS: metadata stays locked in the cache\n");
+
+  // reading files front to back in small pieces has the writeback
+  // thread read them in ahead of the reader
+  uint64_t prefetched = st.prefetched;
+  char* piece = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  for (int i = 0; i < 10; i++) {
+    sprintf(path, "mnt/f%03d", i);
+    fill(buf, i);
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+      printf("Unable to open %s with O_DIRECT: %s\n", path, strerror(errno));
+      return FAIL;
+    }
+    for (int off = 0; off < file_size; off += chunk) {
+      int want = file_size - off < chunk ? file_size - off : chunk;
+      if (pread(fd, piece, chunk, off) != want || memcmp(piece, buf + off, want) != 0) {
+        printf("%s reads back wrong at %d\n", path, off);
+        return FAIL;
+      }
+    }
+    CHECK(close_file(fd));
+  }
+  munmap(piece, 4096);
+  CHECK(io_stats(&st));
+  if (st.prefetched == prefetched) {
+    printf("Sequential reads prefetched nothing\n");
+    return FAIL;
+  }
+  printf("SUCCESS: sequential reads are read ahead\n");
+
+  // fsync writes back everything, so the image on disk is whole
+  CHECK(open_file_read("mnt/f000"));
+  int fd = ret;
+  if (fsync(fd) < 0) {
+    printf("fsync failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after fsync\n");
+    return FAIL;
+  }
+  printf("SUCCESS: fsync writes the cache back\n");
+
+  // growing past the end of the image file grows the cache's region too.
+  // a new top-level directory goes to the new, empty group
+  int dir = open("mnt", O_RDONLY | O_DIRECTORY);
+  struct wfs_grow_args args = {.add_groups = 1};
+  struct statvfs sv;
+  if (dir < 0 || ioctl(dir, WFS_IOC_GROW, &args) < 0 || args.num_groups != 2 ||
+      statvfs("mnt", &sv) < 0 || sv.f_files != 2 * 512) {
+    printf("WFS_IOC_GROW failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(dir);
+  CHECK(create_dir("mnt/grown"));
+  fill(buf, num_files);
+  CHECK(create_file("mnt/grown/f"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf, file_size, "mnt/grown/f", 0));
+  CHECK(close_file(fd));
+  for (int i = 0; i < num_files; i += 10) {
+    sprintf(path, "mnt/f%03d", i);
+    fill(buf, i);
+    CHECK(open_file_read(path));
+    fd = ret;
+    CHECK(read_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  CHECK(open_file_read("mnt/grown/f"));
+  fd = ret;
+  fill(buf, num_files);
+  CHECK(read_file_check(fd, buf, file_size, "mnt/grown/f", 0));
+  if (fsync(fd) < 0 || fsck("disk.img") != 0) {
+    printf("image does not check clean after growing\n");
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  printf("SUCCESS: the image grows through the cache\n");
+  free(buf);
+  return PASS;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_frag_stats {
+  uint32_t files;
+  uint32_t fragmented_files;
+  uint32_t file_blocks;
+  uint32_t file_extents;
+  uint32_t dirs;
+  uint32_t dir_blocks;
+  uint32_t dir_extents;
+  uint32_t dir_slots;
+  uint32_t dir_live;
+  uint32_t free_blocks;
+  uint32_t free_extents;
+  uint32_t largest_free;
+};
+
+struct wfs_clone_args {
+  char src[256];
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  uint64_t cloned;
+  uint32_t shared_blocks;
+  uint32_t pad;
+};
+
+#define WFS_IOC_FRAGSTAT _IOR('W', 2, struct wfs_frag_stats)
+#define WFS_IOC_CLONE _IOWR('W', 4, struct wfs_clone_args)
+
+// 7 direct blocks and 64 behind the indirect block
+#define MAX_FILE_SIZE (71 * BLOCK_SIZE)
+
+void fill(char* buf, int len, int seed) {
+  for (int k = 0; k < len; k++) {
+    buf[k] = (char)(k * 13 + seed);
+  }
+}
+
+int main() {
+  int ret;
+  char* buf = malloc(MAX_FILE_SIZE);
+  char* back = malloc(MAX_FILE_SIZE);
+
+  // the largest file there can be, in one write
+  fill(buf, MAX_FILE_SIZE, 1);
+  CHECK(create_file("mnt/big"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, MAX_FILE_SIZE, "mnt/big", 0));
+  CHECK(close_file(fd));
+  CHECK(open_file_read("mnt/big"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, MAX_FILE_SIZE, "mnt/big", 0));
+  CHECK(close_file(fd));
+
+  // its blocks, the indirect one included, are one run
+  struct wfs_frag_stats st;
+  fd = open("mnt", O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || ioctl(fd, WFS_IOC_FRAGSTAT, &st) < 0) {
+    printf("WFS_IOC_FRAGSTAT failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  if (st.files != 1 || st.fragmented_files != 0 || st.file_blocks != 72) {
+    printf("%u files, %u fragmented, %u blocks\n", st.files, st.fragmented_files, st.file_blocks);
+    return FAIL;
+  }
+  printf("SUCCESS: one write allocates one run\n");
+
+  // overwrite a stretch crossing into the indirect blocks, unaligned
+  fd = open("mnt/big", O_RDWR);
+  fill(buf + 3000, 2500, 7);
+  if (pwrite(fd, buf + 3000, 2500, 3000) != 2500) {
+    printf("Unaligned overwrite failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  if (pread(fd, back, MAX_FILE_SIZE, 0) != MAX_FILE_SIZE || memcmp(buf, back, MAX_FILE_SIZE) != 0) {
+    printf("File reads back wrong after the overwrite\n");
+    return FAIL;
+  }
+  printf("SUCCESS: unaligned overwrite reads back\n");
+
+  // nothing fits past the largest size, and a write running into it
+  // stops short there
+  if (pwrite(fd, buf, 10, MAX_FILE_SIZE) >= 0 || errno != EFBIG) {
+    printf("Write past the largest size was not refused with EFBIG\n");
+    return FAIL;
+  }
+  close(fd);
+  CHECK(create_file("mnt/short"));
+  fd = ret;
+  if (pwrite(fd, buf, 2000, MAX_FILE_SIZE - 1000) != 1000) {
+    printf("Write into the size limit did not stop short at it\n");
+    return FAIL;
+  }
+  struct stat sst;
+  if (fstat(fd, &sst) < 0 || sst.st_size != MAX_FILE_SIZE) {
+    printf("Size after the short write is %ld\n", (long)sst.st_size);
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean after writing up to the size limit\n");
+    return FAIL;
+  }
+  printf("SUCCESS: writes stop at the size limit\n");
+
+  // everything in front of the short write is a hole
+  CHECK(open_file_read("mnt/short"));
+  fd = ret;
+  if (pread(fd, back, MAX_FILE_SIZE, 0) != MAX_FILE_SIZE) {
+    printf("Short read of a sparse file\n");
+    return FAIL;
+  }
+  for (int k = 0; k < MAX_FILE_SIZE - 1000; k++) {
+    if (back[k] != 0) {
+      printf("Hole reads back %d at %d\n", back[k], k);
+      return FAIL;
+    }
+  }
+  if (memcmp(back + MAX_FILE_SIZE - 1000, buf, 1000) != 0) {
+    printf("Data behind the hole reads back wrong\n");
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  printf("SUCCESS: holes read as zeros\n");
+
+  // a write over hole, shared block and hole takes one run for both holes.
+  // when copying the shared block finds the disk full, what is left of
+  // the run goes back
+  fill(buf, BLOCK_SIZE, 3);
+  CHECK(create_file("mnt/one"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf, BLOCK_SIZE, "mnt/one", 0));
+  CHECK(close_file(fd));
+  fd = open("mnt/clone", O_RDWR | O_CREAT, 0644);
+  struct wfs_clone_args args = {.src = "/one", .dst_offset = BLOCK_SIZE, .length = BLOCK_SIZE};
+  if (fd < 0 || ioctl(fd, WFS_IOC_CLONE, &args) < 0 || args.shared_blocks != 1) {
+    printf("WFS_IOC_CLONE failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  // the fillers get their indirect blocks first, so each block after
+  // that takes exactly one
+  const char* fillers[] = {"mnt/fill0", "mnt/fill1", "mnt/fill2"};
+  int fds[3];
+  for (int f = 0; f < 3; f++) {
+    CHECK(create_file(fillers[f]));
+    fds[f] = ret;
+    if (pwrite(fds[f], buf, BLOCK_SIZE, IND_BLOCK * BLOCK_SIZE) != BLOCK_SIZE) {
+      printf("Unable to write %s: %s\n", fillers[f], strerror(errno));
+      return FAIL;
+    }
+  }
+  for (int f = 0, b = 0; free_blocks() > 2; b++) {
+    if (b == MAX_FILE_SIZE / BLOCK_SIZE) {
+      f++;
+      b = 0;
+    }
+    if (b != IND_BLOCK && pwrite(fds[f], buf, BLOCK_SIZE, b * BLOCK_SIZE) != BLOCK_SIZE) {
+      printf("Unable to fill the disk: %s\n", strerror(errno));
+      return FAIL;
+    }
+  }
+  for (int f = 0; f < 3; f++) {
+    CHECK(close_file(fds[f]));
+  }
+  fill(back, 3 * BLOCK_SIZE, 5);
+  if (pwrite(fd, back, 3 * BLOCK_SIZE, 0) != BLOCK_SIZE) {
+    printf("Write with the disk full did not stop after its first block\n");
+    return FAIL;
+  }
+  close(fd);
+  if (free_blocks() != 1 || fsck("disk.img") != 0) {
+    printf("%ld blocks free after a write stopped short, or the image does not check clean\n",
+           free_blocks());
+    return FAIL;
+  }
+  printf("SUCCESS: a write stopped by a full disk gives back the blocks it did not use\n");
+
+  free(buf);
+  free(back);
+  return PASS;
+}
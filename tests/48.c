@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_grow_args {
+  uint32_t add_groups;
+  uint32_t num_groups;
+};
+
+#define WFS_IOC_GROW _IOWR('W', 3, struct wfs_grow_args)
+
+#define VOL_HDR (4096)
+
+// mounted from a volume made with mkfs -m 2: members 0 and 1 hold the data
+// in 8K units, member 2 the metadata
+const char* members[3] = {"vol0.img", "vol1.img", "vol2.img"};
+const int num_files = 8;
+const int file_size = 30000;
+
+// every 512 bytes of file i start with a tag naming the file and block
+void fill(char* buf, int i) {
+  for (int k = 0; k < file_size; k++) {
+    buf[k] = (char)(k * 13 + i);
+  }
+  for (int b = 0; b * BLOCK_SIZE < file_size; b++) {
+    sprintf(buf + b * BLOCK_SIZE, "<file %d block %02d>", i, b);
+  }
+}
+
+// how many file tags a member holds, -1 if it cannot be read
+int count_tags(const char* path, off_t* size) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  char* data = malloc(*size + 1);
+  fseek(f, 0, SEEK_SET);
+  if (fread(data, 1, *size, f) != (size_t)*size || memcmp(data, "WFSVOL01", 8) != 0) {
+    fclose(f);
+    free(data);
+    return -1;
+  }
+  fclose(f);
+  int tags = 0;
+  for (off_t off = VOL_HDR; off + 6 < *size; off += BLOCK_SIZE) {
+    tags += memcmp(data + off, "<file ", 6) == 0;
+  }
+  free(data);
+  return tags;
+}
+
+int check_files(char* buf) {
+  int ret;
+  char path[32];
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%d", i);
+    fill(buf, i);
+    CHECK(open_file_read(path));
+    int fd = ret;
+    CHECK(read_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char path[32];
+  char* buf = malloc(file_size);
+
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%d", i);
+    fill(buf, i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  CHECK(check_files(buf));
+  printf("SUCCESS: files read back from the volume\n");
+
+  // the data is split between the data members. the metadata member only
+  // has what of group 0's data blocks shares its last unit with the inodes
+  int tags[3], total = 0;
+  off_t sizes[3];
+  for (int m = 0; m < 3; m++) {
+    if ((tags[m] = count_tags(members[m], &sizes[m])) < 0) {
+      printf("%s is not a volume member\n", members[m]);
+      return FAIL;
+    }
+    total += tags[m];
+  }
+  int blocks = num_files * ((file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  if (total != blocks || tags[0] == 0 || tags[1] == 0 || tags[2] >= tags[0]) {
+    printf("%d of %d blocks found on the members: %d, %d, %d\n", total, blocks, tags[0], tags[1], tags[2]);
+    return FAIL;
+  }
+  printf("SUCCESS: data is striped over the data members\n");
+
+  // growing past the end of the image extends the data members only
+  int dir = open("mnt", O_RDONLY);
+  struct wfs_grow_args args = {12, 0};
+  if (dir < 0 || ioctl(dir, WFS_IOC_GROW, &args) < 0) {
+    printf("WFS_IOC_GROW failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(dir);
+  off_t grown[3];
+  for (int m = 0; m < 3; m++) {
+    count_tags(members[m], &grown[m]);
+  }
+  if (grown[0] <= sizes[0] || grown[1] <= sizes[1] || grown[2] != sizes[2]) {
+    printf("Members went from %ld, %ld, %ld to %ld, %ld, %ld bytes\n", (long)sizes[0], (long)sizes[1],
+           (long)sizes[2], (long)grown[0], (long)grown[1], (long)grown[2]);
+    return FAIL;
+  }
+  for (int i = num_files; i < 2 * num_files; i++) {
+    sprintf(path, "mnt/f%d", i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  CHECK(check_files(buf));
+  printf("SUCCESS: volume grows\n");
+
+  // members can be given in any order, but all of them
+  if (fsck("vol2.img,vol0.img,vol1.img") != 0) {
+    printf("volume does not check clean\n");
+    return FAIL;
+  }
+  if (fsck("vol0.img,vol1.img") == 0 || fsck("vol0.img") == 0) {
+    printf("volume checks with members missing\n");
+    return FAIL;
+  }
+  printf("SUCCESS: volume checks clean\n");
+  free(buf);
+  return PASS;
+}
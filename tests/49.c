@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+#define WFS_VOL_MIRROR (1)
+#define WFS_VOL_MAX (16)
+#define VOL_HDR (4096)
+
+struct wfs_vol_stats {
+  uint32_t layout;
+  uint32_t members;
+  uint32_t present;
+  uint32_t stale;
+  uint64_t resynced;
+  uint64_t reads[WFS_VOL_MAX];
+  uint64_t writes[WFS_VOL_MAX];
+};
+
+#define WFS_IOC_VOLSTAT _IOR('W', 9, struct wfs_vol_stats)
+
+// mounted from a mirror of two members with a small cache, so reads go
+// out to the members
+const int num_files = 16;
+const int file_size = 30000;
+const long image_size = 2 * 1024 * 1024;
+
+int remount(const char* members) {
+  char cmd[256];
+  system("./solution/umount.sh mnt");
+  sprintf(cmd, "./solution/wfs %s mnt -s -o io=pread,cache=1 >/dev/null &", members);
+  system(cmd);
+  usleep(300 * 1000);
+  printf("SUCCESS: mounted %s\n", members);
+  return PASS;
+}
+
+int vol_stats(struct wfs_vol_stats* st) {
+  int fd = open("mnt", O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || ioctl(fd, WFS_IOC_VOLSTAT, st) < 0) {
+    printf("WFS_IOC_VOLSTAT failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+void fill(char* buf, int i) {
+  for (int k = 0; k < file_size; k++) {
+    buf[k] = (char)(k * 29 + i * 3);
+  }
+}
+
+int write_files(char* buf, int first, int last) {
+  int ret;
+  char path[32];
+  for (int i = first; i < last; i++) {
+    sprintf(path, "mnt/f%02d", i);
+    fill(buf, i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  return PASS;
+}
+
+int check_files(char* buf, int last) {
+  int ret;
+  char path[32];
+  for (int i = 0; i < last; i++) {
+    sprintf(path, "mnt/f%02d", i);
+    fill(buf, i);
+    CHECK(open_file_read(path));
+    int fd = ret;
+    CHECK(read_file_check(fd, buf, file_size, path, 0));
+    CHECK(close_file(fd));
+  }
+  return PASS;
+}
+
+// the members hold the same image behind their headers
+int same_members() {
+  char* a = malloc(image_size);
+  char* b = malloc(image_size);
+  int fa = open("mir0.img", O_RDONLY), fb = open("mir1.img", O_RDONLY);
+  int same = pread(fa, a, image_size, VOL_HDR) == image_size &&
+             pread(fb, b, image_size, VOL_HDR) == image_size && memcmp(a, b, image_size) == 0;
+  close(fa);
+  close(fb);
+  free(a);
+  free(b);
+  return same;
+}
+
+int main() {
+  int ret;
+  char* buf = malloc(file_size);
+  struct wfs_vol_stats st;
+
+  CHECK(vol_stats(&st));
+  if (st.layout != WFS_VOL_MIRROR || st.members != 2 || st.present != 2) {
+    printf("Mounted a volume of layout %u with %u of %u members\n", st.layout, st.present, st.members);
+    return FAIL;
+  }
+  CHECK(write_files(buf, 0, num_files));
+  // fsync has the cache write everything back
+  CHECK(open_file_read("mnt/f00"));
+  int fd = ret;
+  if (fsync(fd) < 0) {
+    printf("fsync failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  CHECK(vol_stats(&st));
+  if (st.writes[0] == 0 || st.writes[0] != st.writes[1]) {
+    printf("Members took %lu and %lu writes\n", (unsigned long)st.writes[0], (unsigned long)st.writes[1]);
+    return FAIL;
+  }
+  CHECK(remount("mir0.img,mir1.img"));
+  if (!same_members()) {
+    printf("Members differ after unmounting\n");
+    return FAIL;
+  }
+  printf("SUCCESS: writes reach both members\n");
+
+  // metadata near the start and file data further on are read from
+  // different members
+  CHECK(check_files(buf, num_files));
+  CHECK(vol_stats(&st));
+  if (st.reads[0] == 0 || st.reads[1] == 0) {
+    printf("Members served %lu and %lu reads\n", (unsigned long)st.reads[0], (unsigned long)st.reads[1]);
+    return FAIL;
+  }
+  printf("SUCCESS: reads are spread over the members\n");
+
+  // without its second member the mirror still works...
+  CHECK(remount("mir0.img"));
+  CHECK(vol_stats(&st));
+  if (st.present != 1) {
+    printf("%u members present, expected 1\n", st.present);
+    return FAIL;
+  }
+  CHECK(write_files(buf, num_files, num_files + 4));
+  CHECK(check_files(buf, num_files + 4));
+  printf("SUCCESS: mirror works with a member missing\n");
+
+  // ...and the member is brought up to date when it is back, by copying
+  // only the regions written meanwhile
+  CHECK(remount("mir1.img,mir0.img"));
+  CHECK(vol_stats(&st));
+  if (st.present != 2 || st.stale != 1 || st.resynced == 0 || st.resynced >= image_size / 2) {
+    printf("%u members present, %u stale, %lu bytes resynced\n", st.present, st.stale,
+           (unsigned long)st.resynced);
+    return FAIL;
+  }
+  CHECK(check_files(buf, num_files + 4));
+  CHECK(remount("mir0.img,mir1.img"));
+  if (!same_members()) {
+    printf("Members differ after the resync\n");
+    return FAIL;
+  }
+  printf("SUCCESS: stale member is resynced from the bitmap\n");
+  if (fsck("mir0.img,mir1.img") != 0) {
+    printf("mirror does not check clean\n");
+    return FAIL;
+  }
+  free(buf);
+  return PASS;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/xattr.h>
+#include "common/test.h"
+
+// values of this size put about 9 attributes in the inode, the rest in
+// its xattr block
+const int num_attrs = 20;
+const int value_len = 20;
+
+void value_of(char* buf, int i, char tag) {
+  memset(buf, 'a' + i % 26, value_len);
+  buf[0] = tag;
+}
+
+int set_all(const char* path, char tag) {
+  char name[32], value[64];
+  for (int i = 0; i < num_attrs; i++) {
+    sprintf(name, "user.a%02d", i);
+    value_of(value, i, tag);
+    if (setxattr(path, name, value, value_len, 0) < 0) {
+      printf("setxattr %s on %s failed: %s\n", name, path, strerror(errno));
+      return FAIL;
+    }
+  }
+  return PASS;
+}
+
+int check_all(const char* path, char tag) {
+  char name[32], value[64], got[64];
+  for (int i = 0; i < num_attrs; i++) {
+    sprintf(name, "user.a%02d", i);
+    value_of(value, i, tag);
+    ssize_t n = getxattr(path, name, got, sizeof(got));
+    if (n != value_len || memcmp(got, value, value_len) != 0) {
+      printf("getxattr %s on %s: got %zd bytes, %s\n", name, path, n, n < 0 ? strerror(errno) : "wrong");
+      return FAIL;
+    }
+  }
+  return PASS;
+}
+
+// the names listxattr gives, NUL-separated, as one string per name
+int count_names(const char* path, const char* want) {
+  char list[4096];
+  ssize_t len = listxattr(path, list, sizeof(list));
+  if (len < 0 || listxattr(path, NULL, 0) != len) {
+    return -1;
+  }
+  int count = 0, found = want == NULL;
+  for (char* p = list; p < list + len; p += strlen(p) + 1) {
+    count++;
+    found |= want != NULL && strcmp(p, want) == 0;
+  }
+  return found ? count : -1;
+}
+
+int expect_error(ssize_t ret, int err, const char* what) {
+  if (ret >= 0 || errno != err) {
+    printf("%s: expected %s, got %zd (%s)\n", what, strerror(err), ret, strerror(errno));
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char got[64];
+  CHECK(create_file("mnt/a"));
+  CHECK(close_file(ret));
+  CHECK(create_file("mnt/b"));
+  CHECK(close_file(ret));
+
+  // small attributes live in the inode
+  long before = free_blocks();
+  if (setxattr("mnt/a", "user.small", "hi", 2, 0) < 0 || getxattr("mnt/a", "user.small", got, sizeof(got)) != 2 ||
+      memcmp(got, "hi", 2) != 0 || free_blocks() != before || count_names("mnt/a", "user.small") != 1) {
+    printf("user.small did not go into the inode\n");
+    return FAIL;
+  }
+  printf("SUCCESS: a small attribute is kept in the inode\n");
+
+  CHECK(expect_error(setxattr("mnt/a", "user.small", "x", 1, XATTR_CREATE), EEXIST, "XATTR_CREATE"));
+  CHECK(expect_error(setxattr("mnt/a", "user.none", "x", 1, XATTR_REPLACE), ENODATA, "XATTR_REPLACE"));
+  CHECK(expect_error(getxattr("mnt/a", "user.none", got, sizeof(got)), ENODATA, "getxattr"));
+  CHECK(expect_error(removexattr("mnt/a", "user.none"), ENODATA, "removexattr"));
+  CHECK(expect_error(setxattr("mnt/a", "system.x", "x", 1, 0), EOPNOTSUPP, "system. namespace"));
+  CHECK(expect_error(getxattr("mnt/a", "user.small", got, 1), ERANGE, "short buffer"));
+  char big[600] = {0};
+  CHECK(expect_error(setxattr("mnt/a", "user.big", big, sizeof(big), 0), ENOSPC, "oversized value"));
+  printf("SUCCESS: flags and errors\n");
+
+  // the rest spill into one block
+  CHECK(set_all("mnt/a", 'A'));
+  CHECK(check_all("mnt/a", 'A'));
+  if (free_blocks() != before - 1 || count_names("mnt/a", "user.a19") != num_attrs + 1) {
+    printf("%d attributes took %ld blocks\n", num_attrs, before - free_blocks());
+    return FAIL;
+  }
+  printf("SUCCESS: attributes spill into one xattr block\n");
+
+  // the same attributes share that block
+  if (setxattr("mnt/b", "user.small", "hi", 2, 0) < 0) {
+    perror("setxattr");
+    return FAIL;
+  }
+  CHECK(set_all("mnt/b", 'A'));
+  CHECK(check_all("mnt/b", 'A'));
+  if (free_blocks() != before - 1) {
+    printf("identical attributes took %ld blocks\n", before - free_blocks());
+    return FAIL;
+  }
+  printf("SUCCESS: identical attribute blocks are shared\n");
+
+  // changing one copies it, changing back shares it again
+  CHECK(set_all("mnt/b", 'B'));
+  CHECK(check_all("mnt/a", 'A'));
+  CHECK(check_all("mnt/b", 'B'));
+  if (free_blocks() != before - 2) {
+    printf("changed attributes took %ld blocks\n", before - free_blocks());
+    return FAIL;
+  }
+  CHECK(set_all("mnt/b", 'A'));
+  if (free_blocks() != before - 1) {
+    printf("restored attributes took %ld blocks\n", before - free_blocks());
+    return FAIL;
+  }
+  printf("SUCCESS: a shared block is copied before it changes\n");
+
+  // trusted. attributes, and the color tag alongside the stored ones
+  if (setxattr("mnt/b", "trusted.t", "root", 4, 0) < 0 || setxattr("mnt/b", "user.color", "red", 3, 0) < 0 ||
+      count_names("mnt/b", "trusted.t") != num_attrs + 3 || count_names("mnt/b", "user.color") < 0) {
+    printf("trusted.t or user.color missing from the list\n");
+    return FAIL;
+  }
+  printf("SUCCESS: listxattr lists every namespace\n");
+
+  // a snapshot keeps the attributes as they were
+  CHECK(create_dir("mnt/.snapshots/s"));
+  if (removexattr("mnt/a", "user.a00") < 0 || removexattr("mnt/a", "user.small") < 0) {
+    perror("removexattr");
+    return FAIL;
+  }
+  CHECK(check_all("mnt/.snapshots/s/a", 'A'));
+  if (count_names("mnt/.snapshots/s/a", "user.small") != num_attrs + 1 ||
+      count_names("mnt/a", NULL) != num_attrs - 1) {
+    printf("the snapshot does not keep the old attributes\n");
+    return FAIL;
+  }
+  printf("SUCCESS: snapshots keep their attributes\n");
+
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean\n");
+    return FAIL;
+  }
+  printf("SUCCESS: fsck is clean\n");
+  return PASS;
+}
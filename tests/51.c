@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "common/test.h"
+
+// must match the ioctl interface in solution/wfs.h
+struct wfs_frag_stats {
+  uint32_t files;
+  uint32_t fragmented_files;
+  uint32_t file_blocks;
+  uint32_t file_extents;
+  uint32_t dirs;
+  uint32_t dir_blocks;
+  uint32_t dir_extents;
+  uint32_t dir_slots;
+  uint32_t dir_live;
+  uint32_t free_blocks;
+  uint32_t free_extents;
+  uint32_t largest_free;
+};
+
+struct wfs_free_stats {
+  uint64_t free_blocks;
+  uint32_t free_extents;
+  uint32_t largest_free;
+  uint64_t runs_allocated;
+  uint64_t exact_fits;
+};
+
+#define WFS_IOC_FRAGSTAT _IOR('W', 2, struct wfs_frag_stats)
+#define WFS_IOC_FREESTAT _IOR('W', 10, struct wfs_free_stats)
+
+const int num_files = 60;
+
+int stats(struct wfs_frag_stats* frag, struct wfs_free_stats* fs) {
+  int fd = open("mnt", O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || ioctl(fd, WFS_IOC_FRAGSTAT, frag) < 0 || ioctl(fd, WFS_IOC_FREESTAT, fs) < 0) {
+    printf("stats ioctl failed: %s\n", strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+// the index agrees with a scan of the bitmaps
+int check_index(struct wfs_free_stats* fs, const char* when) {
+  int ret;
+  struct wfs_frag_stats frag;
+  CHECK(stats(&frag, fs));
+  if (fs->free_blocks != frag.free_blocks || fs->free_extents != frag.free_extents ||
+      fs->largest_free != frag.largest_free) {
+    printf("%s: index has %lu free in %u extents, largest %u; bitmaps %u in %u, largest %u\n", when,
+           (unsigned long)fs->free_blocks, fs->free_extents, fs->largest_free, frag.free_blocks,
+           frag.free_extents, frag.largest_free);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int write_blocks(const char* path, int blocks) {
+  char buf[BLOCK_SIZE * 16];
+  memset(buf, 'x', sizeof(buf));
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0 || write(fd, buf, blocks * BLOCK_SIZE) != blocks * BLOCK_SIZE) {
+    printf("writing %d blocks to %s failed: %s\n", blocks, path, strerror(errno));
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char path[64];
+  struct wfs_free_stats fs, before;
+
+  // the names first, so the files' blocks end up next to each other
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%02d", i);
+    CHECK(write_blocks(path, 0));
+  }
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%02d", i);
+    CHECK(write_blocks(path, 1));
+  }
+  // holes of 3, 7 and 5 blocks, in that order
+  int holes[][2] = {{10, 13}, {20, 27}, {40, 45}};
+  for (int h = 0; h < 3; h++) {
+    for (int i = holes[h][0]; i < holes[h][1]; i++) {
+      sprintf(path, "mnt/f%02d", i);
+      if (unlink(path) < 0) {
+        perror("unlink");
+        return FAIL;
+      }
+    }
+  }
+  CHECK(check_index(&before, "after the holes"));
+  printf("SUCCESS: the free space index matches the bitmaps\n");
+
+  // 5 blocks go into the hole of 5, not the first one they fit in
+  CHECK(write_blocks("mnt/five", 5));
+  CHECK(check_index(&fs, "after 5 blocks"));
+  if (fs.exact_fits != before.exact_fits + 1 || fs.free_extents != before.free_extents - 1) {
+    printf("5 blocks: %lu exact fits, %u free extents, were %lu and %u\n", (unsigned long)fs.exact_fits,
+           fs.free_extents, (unsigned long)before.exact_fits, before.free_extents);
+    return FAIL;
+  }
+  // 2 blocks go into the hole of 3 rather than the one of 7, which takes
+  // a file of 7, all its direct blocks
+  CHECK(write_blocks("mnt/two", 2));
+  CHECK(write_blocks("mnt/seven", 7));
+  CHECK(check_index(&fs, "after 2 and 7 blocks"));
+  if (fs.exact_fits != before.exact_fits + 2 || fs.free_extents != before.free_extents - 2) {
+    printf("2 and 7 blocks: %lu exact fits, %u free extents, were %lu and %u\n",
+           (unsigned long)fs.exact_fits, fs.free_extents, (unsigned long)before.exact_fits,
+           before.free_extents);
+    return FAIL;
+  }
+  if (fs.largest_free != before.largest_free) {
+    printf("the largest free extent went from %u to %u\n", before.largest_free, fs.largest_free);
+    return FAIL;
+  }
+  printf("SUCCESS: runs take the best fitting free extent\n");
+
+  // freed blocks join their neighbours again
+  for (int i = 0; i < num_files; i++) {
+    sprintf(path, "mnt/f%02d", i);
+    unlink(path);
+  }
+  CHECK(remove_file("mnt/five"));
+  CHECK(remove_file("mnt/two"));
+  CHECK(remove_file("mnt/seven"));
+  CHECK(check_index(&fs, "after removing everything"));
+  if (fs.free_extents != 1 && fs.free_extents != 2) {
+    printf("%u free extents left on an empty image\n", fs.free_extents);
+    return FAIL;
+  }
+  printf("SUCCESS: freed blocks merge with their neighbours\n");
+
+  // churn keeps index and bitmaps in step
+  srand(50);
+  for (int round = 0; round < 300; round++) {
+    sprintf(path, "mnt/c%02d", rand() % 40);
+    unlink(path);
+    if (rand() % 3 != 0) {
+      CHECK(write_blocks(path, 1 + rand() % 16));
+    }
+    if (round % 20 == 0) {
+      CHECK(check_index(&fs, "during churn"));
+    }
+  }
+  CHECK(check_index(&fs, "after churn"));
+  printf("SUCCESS: the index follows allocations and frees\n");
+
+  if (fsck("disk.img") != 0) {
+    printf("image does not check clean\n");
+    return FAIL;
+  }
+  printf("SUCCESS: fsck is clean\n");
+  return PASS;
+}
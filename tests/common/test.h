@@ -71,6 +71,18 @@ struct wfs_dentry {
   int num;
 };
 
+// Variable-length directory entry, on images with long names (what mkfs
+// makes now)
+struct wfs_dirent {
+  int num;
+  uint16_t rec_len;
+  uint8_t name_len;
+  uint8_t file_type;
+  char name[];
+};
+
+#define DIRENT_SIZE(len) ((sizeof(struct wfs_dirent) + (len) + 3) & ~3)
+
 extern const char* new_disk_path;
 
 char* map_disk();
@@ -93,6 +105,10 @@ int read_dir_check(const char* path, char* const* expected_dentries,
 void generate_random_data(char* buf, size_t size);
 int ceil_div(int a, int b);
 int expected_datablock_num(int file_block_num, int cur_file_num);
+int fsck(const char* args);
+long used_blocks();
+long free_blocks();
+int fill_disk();
 
 #define MAP_DISK()                        \
   char* disk_map = map_disk();            \
@@ -141,4 +157,21 @@ int expected_datablock_num(int file_block_num, int cur_file_num);
     return FAIL;     \
   }
 
-#endif
\ No newline at end of file
+#define EXPECT_USED(expected, what)                                      \
+  if (used_blocks() != (expected)) {                                     \
+    printf("%s: expected %ld data blocks in use, found %ld\n", what,     \
+           (long)(expected), used_blocks());                             \
+    return FAIL;                                                         \
+  } else {                                                               \
+    printf("SUCCESS: %s\n", what);                                       \
+  }
+
+#define EXPECT(cond, what)                                               \
+  if (!(cond)) {                                                         \
+    printf("%s: failed\n", what);                                        \
+    return FAIL;                                                         \
+  } else {                                                               \
+    printf("SUCCESS: %s\n", what);                                       \
+  }
+
+#endif
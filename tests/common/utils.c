@@ -1,3 +1,5 @@
+#include <sys/statvfs.h>
+#include <sys/wait.h>
 #include "test.h"
 
 const char* new_disk_path = "disk.img";
@@ -238,10 +240,67 @@ void generate_random_data(char* buf, size_t size) {
 
 int ceil_div(int a, int b) { return (a + b - 1) / b; }
 
-// Suppose all files are located in the root directory and each file has the
-// same number of blocks.
+// Suppose all files are located in the root directory, are named file0,
+// file1, ... and each file has the same number of blocks.
 int expected_datablock_num(int file_block_num, int cur_file_num) {
   int indirect_block_num = (int)(file_block_num > IND_BLOCK);
-  return ceil_div(cur_file_num, BLOCK_SIZE / sizeof(struct wfs_dentry)) +
-         (file_block_num + indirect_block_num) * cur_file_num;
+  int dir_block_num = 0, used = BLOCK_SIZE;
+  char name[32];
+  for (int i = 0; i < cur_file_num; i++) {
+    int len = DIRENT_SIZE(sprintf(name, "file%d", i));
+    if (used + len > BLOCK_SIZE) {
+      dir_block_num++;
+      used = 0;
+    }
+    used += len;
+  }
+  return dir_block_num + (file_block_num + indirect_block_num) * cur_file_num;
+}
+
+// exit status of wfs-fsck run with `args`: flags and the image, or the
+// members of a volume. -1 if it did not exit normally
+int fsck(const char* args) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "./solution/wfs-fsck %s >/dev/null", args);
+  int status = system(cmd);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// data blocks in use on the filesystem mounted at mnt, as statvfs sees it
+long used_blocks() {
+  struct statvfs st;
+  if (statvfs("mnt", &st) < 0) {
+    return -1;
+  }
+  return st.f_blocks - st.f_bfree;
+}
+
+long free_blocks() {
+  struct statvfs st;
+  if (statvfs("mnt", &st) < 0) {
+    return -1;
+  }
+  return (long)st.f_bfree;
+}
+
+// fills the disk with files mnt/fill0, mnt/fill1, ... of D_BLOCK + 1
+// blocks each, none of which needs an indirect block
+int fill_disk() {
+  char path[32], block[BLOCK_SIZE];
+  memset(block, 'f', BLOCK_SIZE);
+  for (int i = 0;; i++) {
+    sprintf(path, "mnt/fill%d", i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      printf("Failed to create %s: %s\n", path, strerror(errno));
+      return FAIL;
+    }
+    for (int b = 0; b <= D_BLOCK; b++) {
+      if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+        close(fd);
+        return errno == ENOSPC ? PASS : FAIL;
+      }
+    }
+    close(fd);
+  }
 }